@@ -28,8 +28,35 @@
 #include <cups/dir.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <malloc.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <spawn.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <setjmp.h>
+#include <zlib.h>
+#include <jpeglib.h>
+#ifdef HAVE_LIBURING
+#  include <liburing.h>
+#endif // HAVE_LIBURING
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  include <immintrin.h>
+#  define PS_SIMD_X86 1
+#elif defined(__aarch64__)
+#  include <arm_neon.h>
+#  define PS_SIMD_NEON 1
+#endif // __GNUC__ && (__x86_64__ || __i386__)
 
 
 //
@@ -42,6 +69,132 @@ typedef struct ps_ppd_path_s		// Driver-name/PPD-path pair
   const char *ppd_path;	                // PPD path in collections
 } ps_ppd_path_t;
 
+typedef enum ps_transport_mode_e	// Transport of binary image data
+{
+  PS_TRANSPORT_ASCII85,                 // ASCII85-encoded, 7-bit clean
+  PS_TRANSPORT_BCP,                     // Binary, quoted according to the
+                                        // Binary Communications Protocol
+  PS_TRANSPORT_TBCP,                    // Binary, quoted according to the
+                                        // Tagged Binary Communications
+                                        // Protocol
+  PS_TRANSPORT_HEX,                     // Hex-encoded, read with
+                                        // readhexstring on PostScript
+                                        // level 1
+  PS_TRANSPORT_NULL                     // Nothing sent, only counted, for
+                                        // trial encodings
+} ps_transport_mode_t;
+
+typedef enum ps_codec_e			// Compression of image data
+{
+  PS_CODEC_NONE,                        // Uncompressed
+  PS_CODEC_RUNLENGTH,                   // RunLengthDecode
+  PS_CODEC_LZW,                         // LZWDecode
+  PS_CODEC_FLATE,                       // FlateDecode, with PNG predictors
+  PS_CODEC_CCITT,                       // CCITTFaxDecode, Group 4, only
+                                        // 1-bit gray
+  PS_CODEC_DCT,                         // DCTDecode, lossy, only photos
+  PS_CODEC_MAX
+} ps_codec_t;
+
+#define PS_CONSTRAINT_MAX 32		// Options per constraint rule
+
+typedef struct ps_constraint_option_s	// PPD option in the constraint index
+{
+  ppd_option_t *option;                 // PPD option
+  int        first_bit;                 // Bit of its first choice
+  int        marked;                    // Marked choice, -1 if none
+  bool       installable;               // In the "Installable Options"?
+} ps_constraint_option_t;
+
+typedef struct ps_constraint_rule_s	// "*UIConstraints" or
+					// "*cupsUIConstraints" rule
+{
+  bool       installable;               // Has an installable option?
+  int        num_options;               // Number of options of the rule
+  int        *options;                  // Options of the rule
+  uint64_t   *choices;                  // Choices which fulfill the rule,
+                                        // per option one or more
+} ps_constraint_rule_t;
+
+typedef struct ps_constraints_s		// Constraints of a PPD file as bit
+					// masks, one bit per choice
+{
+  int        num_options;               // Number of PPD options
+  ps_constraint_option_t *options;      // PPD options, sorted by keyword
+  int        num_words;                 // 64-bit words per mask
+  int        num_rules;                 // Number of rules
+  ps_constraint_rule_t *rules;          // Rules
+  uint64_t   *state,                    // Marked choices
+             *conflicts;                // Choices conflicting with the
+                                        // installable accessories
+} ps_constraints_t;
+
+#define PS_LOOKUP_SEEDS 65536		// Seeds tried per bucket of a
+					// perfect hash table
+
+typedef struct ps_lookup_s		// Perfect hash table mapping PWG
+					// names to PPD choices
+{
+  int        num_buckets;               // Buckets of the first hash, 0 if
+                                        // the table is empty
+  int        size;                      // Slots, a power of 2
+  uint32_t   *seeds;                    // Seed of the slot hash per bucket
+  const char **keys,                    // PWG name per slot, `NULL` if free
+             **values;                  // PPD choice per slot
+  int        *indices;                  // Index of the map per slot
+} ps_lookup_t;
+
+typedef struct ps_resolution_s		// Choice of the Resolution option
+{
+  pwg_map_t  map;                       // Key "XxY" and name of the choice,
+                                        // the key is `NULL` if the choice
+                                        // is not a resolution or has the
+                                        // resolution of an earlier one
+  int        x, y;                      // Resolution in dpi, 0 if the
+                                        // choice is not a resolution
+  char       key[32];                   // Key "XxY"
+} ps_resolution_t;
+
+typedef struct ps_vendor_option_s	// Vendor option compiled at driver
+					// setup for mapping job settings
+{
+  char       *default_name;             // Name of the "...-default" IPP
+                                        // attribute
+  ppd_option_t *option;                 // PPD option, `NULL` for options
+                                        // of the Printer Application
+  const char *param;                    // Custom parameter, `NULL` if this
+                                        // is the PPD option itself
+  ppd_coption_t *coption;               // Custom option, `NULL` if none
+  int        num_cparams;               // Parameters of the custom option
+  int        bool_choices[2];           // Choices for false and true, -1
+                                        // if none
+  int        num_maps;                  // Number of choices
+  pwg_map_t  *maps;                     // IPP keywords and PPD choices
+  ps_lookup_t choices;                  // PPD choices by IPP keyword
+  int        first_bit;                 // Bit of the first choice in the
+                                        // constraint index, -1 if none
+} ps_vendor_option_t;
+
+typedef struct ps_vendor_table_s	// Compiled vendor options of a driver
+{
+  int        refcount;                  // References by the driver and by
+                                        // jobs reading the table
+  int        num_options;               // Number of vendor options
+  ps_vendor_option_t *options;          // Vendor options
+} ps_vendor_table_t;
+
+#define PS_OPTION_MEMO_SIZE 64		// Option mappings remembered per
+					// printer
+
+typedef struct ps_option_memo_s		// Job options mapped to PPD options
+{
+  uint64_t   hash;                      // FNV-1a hash of the key
+  char       *key;                      // Job option settings, `NULL` if
+                                        // the slot is free
+  int        num_options;               // Number of PPD options
+  cups_option_t *options;               // PPD options
+} ps_option_memo_t;
+
 typedef struct ps_driver_extension_s	// Driver data extension
 {
   ppd_file_t *ppd;                      // PPD file loaded from collection
@@ -58,6 +211,34 @@ typedef struct ps_driver_extension_s	// Driver data extension
                                         // as defined by "*cupsFilter(s):" line
   char       *temp_ppd_name;            // File name of temporary copy of the
                                         // PPD file to be used by CUPS filters
+  ps_transport_mode_t binary_transport; // Binary protocol of the printer
+                                        // ("*Protocols:" in the PPD file)
+  char       ppd_hash[65];              // SHA-256 of the PPD file for the
+                                        // conversion cache key, empty if
+                                        // it could not be computed
+  bool       pdf_native;                // Does the printer accept PDF
+                                        // directly? ("PDF" in the device
+                                        // ID or "*cupsFilter2:" line)
+  ps_lookup_t media_lookup,             // PageSize choices by PWG name,
+                                        // only unambiguous ones
+             source_lookup,             // InputSlot choices by PWG name
+             type_lookup,               // MediaType choices by PWG name
+             bin_lookup,                // OutputBin choices by PWG name
+             resolution_lookup;         // Resolution choices by "XxY"
+  int        num_resolutions;           // Choices of the Resolution option
+  ps_resolution_t *resolutions;         // Resolutions of the choices, keys
+                                        // of resolution_lookup
+  ps_constraints_t constraints;         // Constraint index of the PPD file
+  pthread_mutex_t vendor_mutex;         // Mutex for the vendor table
+  ps_vendor_table_t *vendor_table;      // Vendor options compiled for
+                                        // mapping job settings, replaced
+                                        // as a whole on driver updates
+  pthread_mutex_t option_memo_mutex;    // Mutex for the memo
+  unsigned   option_memo_generation;    // Incremented when the memo gets
+                                        // cleared
+  ps_option_memo_t option_memo[PS_OPTION_MEMO_SIZE];
+                                        // Memo of the mapping of job
+                                        // options to PPD options, by hash
 } ps_driver_extension_t;
 
 typedef struct ps_filter_data_s		// Filter data
@@ -66,6 +247,301 @@ typedef struct ps_filter_data_s		// Filter data
   void		    *filter_parameters;	// Filter parameters
 } ps_filter_data_t;
 
+typedef struct ps_chain_stage_s	// Filter function run as a thread or
+					// process by ps_filter_chain()
+{
+  filter_filter_in_chain_t *filter;     // Filter function and parameters
+  filter_data_t         *data;          // Job and printer data
+  int                   inputfd,        // Input file descriptor
+                        outputfd,       // Output file descriptor
+                        inputseekable;  // Is input seekable?
+  bool                  pipe_in,        // Is input a pipe of the chain?
+                        pipe_out;       // Is output a pipe of the chain?
+  bool                  forked;         // Run in a sub-process?
+  pid_t                 pid;            // Process running the function,
+                                        // -1 if not forked or failed
+  pthread_t             thread;         // Thread running the function
+  bool                  started;        // Thread started?
+  int                   status;         // Exit status of the function
+} ps_chain_stage_t;
+
+typedef void (*ps_ascii85_kernel_t)(const unsigned char *data,
+				    size_t num_groups,
+				    unsigned char *tuples);
+					// ASCII85 kernel, converts groups of
+					// 4 bytes into 5 characters each
+
+typedef struct ps_ascii85_s		// ASCII85 encoder state
+{
+  int                   col;            // Current column
+  unsigned char         remaining[3];   // Remaining bytes which do not
+                                        // complete 4 to be encoded, kept
+                                        // for next call
+  unsigned              num_remaining;  // Number of remaining bytes
+  unsigned char         *buffer;        // Output buffer
+  size_t                bufsize;        // Size of output buffer
+  bool                  failed;         // Out of memory, data got lost
+} ps_ascii85_t;
+
+typedef struct ps_transport_s		// Image data transport
+{
+  ps_transport_mode_t   mode;           // Transport mode
+  FILE                  *outputfp;      // Output file
+  ps_ascii85_t          ascii85;        // ASCII85 encoder state
+  int                   col;            // Current column (hex)
+  unsigned long         bytes;          // Image data bytes sent (before
+                                        // encoding for the transport)
+  bool                  hold;           // Data held until the data source
+                                        // is chosen?
+  ps_transport_mode_t   held_mode;      // Transport of the job while
+                                        // holding
+  unsigned char         *held;          // Held data
+  size_t                num_held,       // Bytes of held data
+                        held_size;      // Size of held data buffer
+  bool                  failed;         // Out of memory, data got lost
+} ps_transport_t;
+
+typedef struct ps_ccitt_code_s		// CCITT code word
+{
+  unsigned char         length;         // Length in bits
+  unsigned short        code;           // Code bits
+} ps_ccitt_code_t;
+
+typedef struct ps_ccitt_s		// CCITT Group 4 encoder state
+{
+  int                   width;          // Width of the lines in pixels
+  unsigned char         invert;         // 0xff if 1 bits are white pixels
+  int                   *ref,           // Changing elements of reference line
+                        *cur;           // Changing elements of coding line
+  unsigned              bits;           // Bit accumulator
+  int                   num_bits;       // Number of bits in accumulator
+  unsigned char         buffer[4096];   // Output buffer
+  int                   bufused;        // Bytes used in output buffer
+  ps_transport_t        *transport;     // Transport for the output
+} ps_ccitt_t;
+
+#define PS_LZW_HSIZE 9001		// Size of LZW string table, a prime
+					// giving at most 45% load with the
+					// 4096 codes of LZWDecode
+
+typedef struct ps_lzw_s			// LZW encoder state
+{
+  int                   hash_key[PS_LZW_HSIZE];
+                                        // Strings in the table, as
+                                        // (byte << 12) | prefix code,
+                                        // -1 for free entries
+  unsigned short        hash_code[PS_LZW_HSIZE];
+                                        // Codes of the strings
+  int                   prefix,         // Code of the current string, -1
+                                        // at the beginning
+                        next_code,      // Next free code
+                        code_bits;      // Current code length
+  unsigned              bits;           // Bit accumulator
+  int                   num_bits;       // Number of bits in accumulator
+  unsigned char         buffer[4096];   // Output buffer
+  int                   bufused;        // Bytes used in output buffer
+  ps_transport_t        *transport;     // Transport for the output
+} ps_lzw_t;
+
+typedef struct ps_jpeg_error_s		// libjpeg error handler
+{
+  struct jpeg_error_mgr pub;            // libjpeg error manager
+  jmp_buf               env;            // Where to continue on error
+} ps_jpeg_error_t;
+
+typedef struct ps_jpeg_dest_s		// libjpeg destination
+{
+  struct jpeg_destination_mgr pub;      // libjpeg destination manager
+  ps_transport_t        *transport;     // Transport for the output
+  JOCTET                buffer[65536];  // Output buffer
+} ps_jpeg_dest_t;
+
+typedef struct ps_encoder_s		// Image encoder chain: Sample
+					// transform (PNG predictor) ->
+					// compressor -> transport
+{
+  ps_codec_t            codec;          // Compressor
+  int                   width,          // Width in pixels
+                        height,         // Height in pixels
+                        colors,         // Color components per pixel
+                        bpc;            // Bits per color component
+  size_t                bytes_per_line; // Bytes per raster line
+  bool                  black_is_1;     // Are 1 bits black (1-bit gray)?
+  int                   flate_level,    // Flate compression level
+                        jpeg_quality;   // JPEG quality
+  ps_transport_t        *transport;     // Transport for the output
+  unsigned long         bytes_in;       // Raster data bytes encoded
+  int                   pred_bpp;       // Bytes per pixel for PNG predictor
+  unsigned char         *prev_line,     // Previous raster line (predictor)
+                        *pred_line,     // Current line after prediction
+                        *buffer;        // Compressed data buffer
+  size_t                bufsize;        // Size of compressed data buffer
+  z_stream              zstream;        // Flate compression stream
+  bool                  zstream_init;   // Compression stream set up?
+  ps_lzw_t              *lzw;           // LZW encoder state
+  ps_ccitt_t            ccitt;          // CCITT Group 4 encoder state
+  bool                  jpeg_init,      // JPEG compressor created?
+                        jpeg_error;     // Error in JPEG compression?
+  struct jpeg_compress_struct jpeg;     // JPEG compressor
+  ps_jpeg_error_t       jpeg_err;       // JPEG error handler
+  ps_jpeg_dest_t        *jpeg_dest;     // JPEG output destination
+} ps_encoder_t;
+
+#define PS_WRITER_CHUNK  (256 * 1024)	// Size of the output chunks sent to
+					// the device
+#define PS_WRITER_CHUNKS 4		// Number of output chunks, one being
+					// filled while the others get sent
+
+typedef struct ps_writer_s		// In-process output to the device,
+					// a writer thread sends the chunks
+					// filled by the raster callbacks
+{
+  pappl_job_t           *job;           // Job
+  pappl_device_t        *device;        // Output device
+  pthread_t             thread;         // Writer thread
+  pthread_mutex_t       mutex;          // Mutex for the fields below
+  pthread_cond_t        cond;           // Signal for chunk state changes
+  unsigned char         *chunks[PS_WRITER_CHUNKS];
+                                        // Output chunks, page-aligned
+  size_t                used[PS_WRITER_CHUNKS];
+                                        // Bytes in the chunks
+  bool                  flush[PS_WRITER_CHUNKS];
+                                        // Flush device after the chunk?
+  int                   fill,           // Chunk being filled
+                        head,           // Next chunk to send
+                        num_pending;    // Chunks waiting to be sent
+  bool                  done,           // No more chunks to come?
+                        error;          // Error writing to the device?
+  unsigned long         bytes,          // Bytes sent to the device
+                        writes;         // Device writes for them
+} ps_writer_t;
+
+typedef struct ps_dsc_s			// DSC page index of a spooled
+					// PostScript file
+{
+  const char            *data;          // File mapped into memory, `NULL`
+                                        // if not mapped
+  size_t                size;           // Size of the file
+  size_t                end_prolog,     // Offset of "%%EndProlog" line
+                        setup,          // Offset where the PPD option code
+                                        // for the setup goes: "%%EndSetup"
+                                        // line, or after the "%%EndProlog"
+                                        // line if there is no setup
+                        trailer,        // Offset of the trailer, end of
+                                        // the last page
+                        header_pages,   // Offset of "%%Pages:" line with
+                                        // count in header, 0 if none
+                        trailer_pages;  // The same in the trailer
+  bool                  has_setup;      // Has the file a setup section?
+  int                   num_pages;      // Number of "%%Page:" comments
+  size_t                *pages;         // Offsets of the "%%Page:" lines
+} ps_dsc_t;
+
+typedef struct ps_dsc_out_s		// Output assembled from byte ranges
+					// of the file and generated text
+{
+  struct iovec          *iov;           // Segments of the output, bases
+                                        // are offsets into generated text
+                                        // until it is complete
+  bool                  *gen;           // Segment is generated text?
+  int                   num_iov,        // Number of segments
+                        alloc_iov;      // Allocated segments
+  FILE                  *fp;            // Generated text
+  char                  *text;          // Buffer of generated text
+  size_t                text_size;      // Size of generated text
+  long                  text_pos;       // End of last generated segment
+} ps_dsc_out_t;
+
+typedef enum ps_dsc_section_e		// Section of a DSC document
+{
+  PS_DSC_HEADER,                        // Header comments
+  PS_DSC_PROLOG,                        // Prolog
+  PS_DSC_SETUP,                         // Document setup
+  PS_DSC_PAGES,                         // Pages
+  PS_DSC_TRAILER                        // Trailer
+} ps_dsc_section_t;
+
+typedef struct ps_pdf_chunk_s		// Chunk of pages of a PDF job,
+					// converted by a worker thread in a
+					// sub-process
+{
+  int                   first,          // First page
+                        last,           // Last page
+                        status;         // -1 while converting, 0 when
+                                        // converted, 1 on error
+  char                  filename[1024]; // PostScript output
+} ps_pdf_chunk_t;
+
+typedef struct ps_pdf_parallel_s	// Parallel conversion of a PDF job
+{
+  const char            *filename;      // Spooled PDF file
+  filter_data_t         data;           // Job data for converting the
+                                        // chunks, single copy
+  void                  *parameters;    // Parameters for pdftops()
+  ps_pdf_chunk_t        *chunks;        // Chunks of pages
+  int                   num_chunks,     // Number of chunks
+                        next_chunk,     // Next chunk to convert
+                        num_pages,      // Pages of the PDF file
+                        page;           // Pages stitched together
+  bool                  canceled;       // Stop converting?
+  pthread_mutex_t       mutex;          // Mutex for the chunks
+  pthread_cond_t        cond;           // Signals converted chunks
+  char                  *prolog;        // Prolog of the first chunk
+  size_t                prolog_size;    // Size of prolog
+  char                  *trailer;       // Trailer code of the chunk before,
+                                        // sent with the setup code of the
+                                        // next one
+  size_t                trailer_size;   // Size of trailer code
+} ps_pdf_parallel_t;
+
+typedef struct ps_page_scan_s		// Search for the end of the first
+					// page in PostScript output
+{
+  char                  line[16];       // Start of the current line
+  size_t                len,            // Length of it
+                        bytes;          // Bytes scanned
+  bool                  postscript;     // "%!" line seen?
+  int                   pages,          // "%%Page:" comments seen
+                        depth;          // Depth of embedded documents
+} ps_page_scan_t;
+
+typedef struct ps_cache_header_s	// Header of a conversion cache file,
+					// followed by the printer-ready data
+{
+  char                  magic[8];       // PS_CACHE_MAGIC
+  int                   impressions;    // Impressions of the job
+  off_t                 size;           // Size of the data
+} ps_cache_header_t;
+
+typedef enum ps_cache_fanout_state_e	// State of a shared conversion
+{
+  PS_CACHE_FANOUT_PENDING,              // Registered, cache file not yet
+                                        // created
+  PS_CACHE_FANOUT_RUNNING,              // Data going into the cache file
+  PS_CACHE_FANOUT_DONE,                 // Data complete
+  PS_CACHE_FANOUT_FAILED                // Conversion failed
+} ps_cache_fanout_state_t;
+
+typedef struct ps_cache_fanout_s	// Conversion of a job shared with the
+					// jobs with the same cache key which
+					// arrive while it is running
+{
+  struct ps_cache_fanout_s *next;       // Next conversion in flight
+  char                  key[65];        // Conversion cache key
+  char                  filename[1024]; // Cache file being written
+  int                   job_id;         // ID of the converting job
+  ps_cache_fanout_state_t state;        // State of the conversion
+  off_t                 bytes;          // Bytes in the cache file so far
+  int                   impressions;    // Impressions, when done
+  int                   users;          // Jobs converting, following, or
+                                        // waiting, freed when 0
+  int                   readers;        // Jobs reading the cache file, the
+                                        // conversion stops when none is
+                                        // left
+  pthread_cond_t        cond;           // Signals new data and changes of
+                                        // the state
+} ps_cache_fanout_t;
+
 typedef struct ps_job_data_s		// Job data
 {
   ppd_file_t            *ppd;           // PPD file loaded from collection
@@ -86,8 +562,75 @@ typedef struct ps_job_data_s		// Job data
                                         // sub-process
   FILE                  *device_file;   // File pointer for output to
                                         // device
+  ps_dsc_t              dsc;            // DSC structure of PostScript
+                                        // input passed through without
+                                        // pstops()
+  bool                  pdf_native;     // Send PDF input as PDF, without
+                                        // converting it to PostScript?
+  ps_pdf_parallel_t     *pdf_parallel;  // Parallel conversion of PDF
+                                        // input in chunks, `NULL` if
+                                        // converted as a whole
+  filter_filter_in_chain_t *page_filter;// pstops() after the parallel
+                                        // conversion of PDF input
+  struct timespec       start;          // Start of processing the job
+  double                first_page;     // Time to first page: Seconds until
+                                        // the first page was sent to the
+                                        // device, < 0 if not yet sent
+  char                  *cache_jcl;     // JCL job header of the job, not
+                                        // in the cache file
+  size_t                cache_jcl_size; // Size of it
+  char                  cache_key[65];  // Conversion cache key, empty if
+                                        // the job does not use the cache
+  char                  cache_temp[1024];// Cache file being written
+  int                   cache_fd;       // File descriptor of it, -1 if none
+  off_t                 cache_bytes;    // Bytes written into it, -1 on error
+  filter_filter_in_chain_t *cache_filter;// Copies the output into the cache
+  ps_cache_fanout_t     *fanout;        // Conversion this job shares with
+                                        // others, `NULL` if none
+  cups_array_t          *cache_chain;   // Filter functions converting into
+                                        // the cache file on their own
+                                        // thread, `NULL` if not shared
+  filter_data_t         cache_data;     // Filter data for them, canceled
+                                        // when no job reads the data
+  pthread_t             cache_thread;   // Thread running them
+  int                   cache_input;    // Input file descriptor for them
+  int                   cache_status;   // Exit status of them
+  filter_filter_in_chain_t *follow_filter;// Sends the data of the shared
+                                        // conversion to the device
+  bool                  cache_fallback; // Shared conversion failed before
+                                        // any data got sent, convert on
+                                        // our own?
+  ps_writer_t           *writer;        // In-process output to the device
+                                        // if there is no CUPS filter in
+                                        // the PPD file, `NULL` otherwise
   int                   line_count;     // Raster lines actually received for
                                         // this page
+  ps_transport_t        transport;      // Transport (and ASCII85 encoder
+                                        // state) for raster output, per
+                                        // job so that jobs on different
+                                        // printers can run in parallel
+  ps_encoder_t          encoder;        // Encoder chain for raster output
+  unsigned              codecs,         // Compressors usable for the job,
+                                        // bit mask of 1 << ps_codec_t
+                        page_codecs;    // Compressors usable for the
+                                        // current page
+  unsigned              page;           // Current page number
+  bool                  codec_chosen;   // Compressor for the page chosen?
+  ps_codec_t            page_codec;     // Compressor for the page
+  unsigned char         blank;          // Value of the bytes of blank lines
+  unsigned char         *band;          // Buffered lines of current band
+  int                   band_y,         // First line of current band
+                        band_lines,     // Number of buffered lines
+                        band_blank,     // Blank lines at the end of them
+                        band_max_lines, // Size of buffer in lines
+                        num_bands,      // Bands sent for the page
+                        num_gray_bands, // Bands of them sent as gray
+                        space_colors;   // Colors of the current color space
+  unsigned long         page_bytes_in,  // Raster bytes encoded for the page
+                        page_bytes_out, // Bytes sent for them
+                        page_gray_saved,// Raster bytes saved by sending
+                                        // bands without color as gray
+                        job_gray_saved; // The same for the whole job
 } ps_job_data_t;
 
 
@@ -111,6 +654,7 @@ typedef struct ps_job_data_s		// Job data
 #define SYSTEM_SPOOL_DIR "/var/spool/" SYSTEM_PACKAGE_NAME
 #define SYSTEM_DATA_DIR "/usr/share/" SYSTEM_PACKAGE_NAME
 #define SYSTEM_EXEC_DIR "/usr/lib/" SYSTEM_PACKAGE_NAME
+#define SYSTEM_CACHE_DIR "/var/cache/" SYSTEM_PACKAGE_NAME
 
 // State file
 
@@ -134,6 +678,81 @@ static const char * const col_paths[] =   // PPD collection dirs
 
 #define FILTERDIR SYSTEM_EXEC_DIR "/filter"
 
+// ASCII85 encoding
+
+#define PS_ASCII85_CHUNK 256              // Groups encoded per kernel call
+#define PS_ASCII85_BUFSIZE(groups) (6 * (groups) + 16)
+                                          // Buffer size needed for encoding
+                                          // the given number of groups
+
+// Raster compression
+
+#define PS_ZBUF_SIZE 65536                // Size of compressed data buffer
+#define PS_DEFAULT_COMPRESSION_LEVEL 6    // Default Flate compression level
+#define PS_DEFAULT_JPEG_QUALITY 90        // Default JPEG quality for photos
+#define PS_SAMPLE_LINES 32                // Lines sampled per page to choose
+                                          // the compressor
+#define PS_BAND_GAP 16                    // Blank lines which end a band,
+                                          // shorter gaps cost less than
+                                          // starting a new image
+#define PS_BAND_MAX_BYTES (4 * 1024 * 1024)
+                                          // Maximum size of a band
+#define PS_LINK_RATE 1000000.0            // Assumed throughput to the
+                                          // printer in bytes/sec, weighs
+                                          // output size against CPU time
+
+// Filter chain
+
+#define PS_CHAIN_PIPE_SIZE (1024 * 1024)  // Buffer size of the pipes between
+                                          // the filter functions
+
+// Parallel conversion of PDF
+
+#define PS_PDF_MAX_THREADS 16             // Maximum threads converting the
+                                          // chunks of a PDF job
+#define PS_PDF_MIN_CHUNK 8                // Minimum pages per chunk
+#define PS_PDF_FIRST_CHUNK 1              // Pages of the first chunk, the
+                                          // following ones double in size
+#define PS_PDF_MIN_PAGES 4                // Minimum pages for converting in
+                                          // chunks
+#define PS_PDF_CHUNKS_PER_THREAD 4        // Chunks per thread, for balancing
+                                          // pages of different complexity
+
+// Page ranges of PDF
+
+#define PS_PDF_SLICE_FRACTION 4           // Pages of a range get cut out of
+                                          // the PDF if it has at least this
+                                          // many times more pages
+
+// Conversion cache
+
+#define PS_CACHE_MAGIC "PSCACHE2"         // Magic of the cache files
+#define PS_CACHE_EXT ".ps"                // Extension of the cache files
+#define PS_CACHE_SIZE 0                   // Default size limit of the cache
+                                          // in MB, 0: off
+#define PS_CACHE_FANOUT_WAIT 1            // Seconds between checks whether
+                                          // a job waiting for data of a
+                                          // shared conversion got canceled
+
+// Output to the device
+
+#define PS_SPLICE_SIZE (1024 * 1024)      // Bytes per splice()/sendfile()
+                                          // call for zero-copy output
+#define PS_PAGE_SCAN_HEADER 65536         // Bytes of output searched for the
+                                          // "%!" of PostScript, after JCL
+#define PS_URING_DEPTH 8                  // Writes kept in flight with
+                                          // io_uring
+#define PS_URING_BUFSIZE 65536            // Bytes per io_uring write
+
+// Vendor option slots reserved for the Printer Application's own options
+
+#define PS_NUM_APP_VENDOR 5
+
+// End of binary image data, for /SubFileDecode
+
+#define PS_BINARY_EOD "%-EOD-\n"
+#define PS_BINARY_EOD_PS "(%-EOD-\\n)"
+
 
 static  int               num_drivers = 0; // Number of drivers (from the PPDs)
 static  pappl_pr_driver_t *drivers = NULL; // Driver index (for menu and
@@ -152,6 +771,113 @@ static  char              spool_dir[1024]; // Spool directory, customizable via
 static  char              filter_dir[1024]; // Filter directory, customizable
                                            // via FILTER_DIR environment
                                            // variable
+static  int               pdf_threads = 1; // Threads converting a PDF job in
+                                           // parallel, customizable via
+                                           // PDF_CONVERSION_THREADS
+                                           // environment variable
+static  char              cache_dir[1024]; // Conversion cache directory,
+                                           // customizable via CACHE_DIR
+                                           // environment variable
+static  off_t             cache_size = 0;  // Size limit of the conversion
+                                           // cache, 0 if off, customizable
+                                           // via CONVERSION_CACHE_SIZE
+                                           // environment variable (MB)
+static  pthread_mutex_t   cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+                                           // Mutex for the cache directory
+                                           // and the counters
+static  unsigned long     cache_hits = 0,  // Jobs printed from the cache
+                          cache_misses = 0,// Jobs not found in the cache
+                          cache_shared = 0;// Jobs following the conversion
+                                           // of another job
+static  ps_cache_fanout_t *cache_fanouts = NULL;
+                                           // Conversions in flight, shared
+                                           // by jobs with the same key
+static  ps_ascii85_kernel_t ps_ascii85_kernel = NULL; // ASCII85 kernel
+                                           // selected for the CPU
+static  pthread_once_t    ps_ascii85_once = PTHREAD_ONCE_INIT;
+                                           // Kernel selection done?
+
+// Compressors for image data, names (also used as values of the
+// "raster-compression" option) and the PostScript level they need
+
+static const char * const ps_codec_names[PS_CODEC_MAX] =
+{
+  "none", "runlength", "lzw", "flate", "ccitt", "dct"
+};
+static const int ps_codec_levels[PS_CODEC_MAX] =
+{
+  1, 2, 2, 3, 2, 2
+};
+
+// CCITT T.4/T.6 code tables
+
+static const ps_ccitt_code_t ps_ccitt_white_term[64] =
+{					// White terminating codes, runs 0-63
+  {  8, 0x035 }, {  6, 0x007 }, {  4, 0x007 }, {  4, 0x008 },
+  {  4, 0x00b }, {  4, 0x00c }, {  4, 0x00e }, {  4, 0x00f },
+  {  5, 0x013 }, {  5, 0x014 }, {  5, 0x007 }, {  5, 0x008 },
+  {  6, 0x008 }, {  6, 0x003 }, {  6, 0x034 }, {  6, 0x035 },
+  {  6, 0x02a }, {  6, 0x02b }, {  7, 0x027 }, {  7, 0x00c },
+  {  7, 0x008 }, {  7, 0x017 }, {  7, 0x003 }, {  7, 0x004 },
+  {  7, 0x028 }, {  7, 0x02b }, {  7, 0x013 }, {  7, 0x024 },
+  {  7, 0x018 }, {  8, 0x002 }, {  8, 0x003 }, {  8, 0x01a },
+  {  8, 0x01b }, {  8, 0x012 }, {  8, 0x013 }, {  8, 0x014 },
+  {  8, 0x015 }, {  8, 0x016 }, {  8, 0x017 }, {  8, 0x028 },
+  {  8, 0x029 }, {  8, 0x02a }, {  8, 0x02b }, {  8, 0x02c },
+  {  8, 0x02d }, {  8, 0x004 }, {  8, 0x005 }, {  8, 0x00a },
+  {  8, 0x00b }, {  8, 0x052 }, {  8, 0x053 }, {  8, 0x054 },
+  {  8, 0x055 }, {  8, 0x024 }, {  8, 0x025 }, {  8, 0x058 },
+  {  8, 0x059 }, {  8, 0x05a }, {  8, 0x05b }, {  8, 0x04a },
+  {  8, 0x04b }, {  8, 0x032 }, {  8, 0x033 }, {  8, 0x034 }
+};
+
+static const ps_ccitt_code_t ps_ccitt_white_makeup[40] =
+{					// White make-up codes, runs 64-2560
+  {  5, 0x01b }, {  5, 0x012 }, {  6, 0x017 }, {  7, 0x037 },
+  {  8, 0x036 }, {  8, 0x037 }, {  8, 0x064 }, {  8, 0x065 },
+  {  8, 0x068 }, {  8, 0x067 }, {  9, 0x0cc }, {  9, 0x0cd },
+  {  9, 0x0d2 }, {  9, 0x0d3 }, {  9, 0x0d4 }, {  9, 0x0d5 },
+  {  9, 0x0d6 }, {  9, 0x0d7 }, {  9, 0x0d8 }, {  9, 0x0d9 },
+  {  9, 0x0da }, {  9, 0x0db }, {  9, 0x098 }, {  9, 0x099 },
+  {  9, 0x09a }, {  6, 0x018 }, {  9, 0x09b }, { 11, 0x008 },
+  { 11, 0x00c }, { 11, 0x00d }, { 12, 0x012 }, { 12, 0x013 },
+  { 12, 0x014 }, { 12, 0x015 }, { 12, 0x016 }, { 12, 0x017 },
+  { 12, 0x01c }, { 12, 0x01d }, { 12, 0x01e }, { 12, 0x01f }
+};
+
+static const ps_ccitt_code_t ps_ccitt_black_term[64] =
+{					// Black terminating codes, runs 0-63
+  { 10, 0x037 }, {  3, 0x002 }, {  2, 0x003 }, {  2, 0x002 },
+  {  3, 0x003 }, {  4, 0x003 }, {  4, 0x002 }, {  5, 0x003 },
+  {  6, 0x005 }, {  6, 0x004 }, {  7, 0x004 }, {  7, 0x005 },
+  {  7, 0x007 }, {  8, 0x004 }, {  8, 0x007 }, {  9, 0x018 },
+  { 10, 0x017 }, { 10, 0x018 }, { 10, 0x008 }, { 11, 0x067 },
+  { 11, 0x068 }, { 11, 0x06c }, { 11, 0x037 }, { 11, 0x028 },
+  { 11, 0x017 }, { 11, 0x018 }, { 12, 0x0ca }, { 12, 0x0cb },
+  { 12, 0x0cc }, { 12, 0x0cd }, { 12, 0x068 }, { 12, 0x069 },
+  { 12, 0x06a }, { 12, 0x06b }, { 12, 0x0d2 }, { 12, 0x0d3 },
+  { 12, 0x0d4 }, { 12, 0x0d5 }, { 12, 0x0d6 }, { 12, 0x0d7 },
+  { 12, 0x06c }, { 12, 0x06d }, { 12, 0x0da }, { 12, 0x0db },
+  { 12, 0x054 }, { 12, 0x055 }, { 12, 0x056 }, { 12, 0x057 },
+  { 12, 0x064 }, { 12, 0x065 }, { 12, 0x052 }, { 12, 0x053 },
+  { 12, 0x024 }, { 12, 0x037 }, { 12, 0x038 }, { 12, 0x027 },
+  { 12, 0x028 }, { 12, 0x058 }, { 12, 0x059 }, { 12, 0x02b },
+  { 12, 0x02c }, { 12, 0x05a }, { 12, 0x066 }, { 12, 0x067 }
+};
+
+static const ps_ccitt_code_t ps_ccitt_black_makeup[40] =
+{					// Black make-up codes, runs 64-2560
+  { 10, 0x00f }, { 12, 0x0c8 }, { 12, 0x0c9 }, { 12, 0x05b },
+  { 12, 0x033 }, { 12, 0x034 }, { 12, 0x035 }, { 13, 0x06c },
+  { 13, 0x06d }, { 13, 0x04a }, { 13, 0x04b }, { 13, 0x04c },
+  { 13, 0x04d }, { 13, 0x072 }, { 13, 0x073 }, { 13, 0x074 },
+  { 13, 0x075 }, { 13, 0x076 }, { 13, 0x077 }, { 13, 0x052 },
+  { 13, 0x053 }, { 13, 0x054 }, { 13, 0x055 }, { 13, 0x05a },
+  { 13, 0x05b }, { 13, 0x064 }, { 13, 0x065 }, { 11, 0x008 },
+  { 11, 0x00c }, { 11, 0x00d }, { 12, 0x012 }, { 12, 0x013 },
+  { 12, 0x014 }, { 12, 0x015 }, { 12, 0x016 }, { 12, 0x017 },
+  { 12, 0x01c }, { 12, 0x01d }, { 12, 0x01e }, { 12, 0x01f }
+};
 
 
 //
@@ -160,43 +886,217 @@ static  char              filter_dir[1024]; // Filter directory, customizable
 
 static const char *ps_autoadd(const char *device_info, const char *device_uri,
 			      const char *device_id, void *data);
-static void   ps_ascii85(FILE *outputfp, const unsigned char *data, int length,
-			 int last_data);
+static bool   ps_ascii85(ps_ascii85_t *a85, FILE *outputfp,
+			 const unsigned char *data, int length, int last_data);
+static size_t ps_ascii85_encode(const unsigned char *data, size_t num_groups,
+				unsigned char *out, int *col);
+static void   ps_ascii85_select_kernel(void);
+static void   ps_ascii85_tuples_scalar(const unsigned char *data,
+				       size_t num_groups,
+				       unsigned char *tuples);
+#ifdef PS_SIMD_X86
+static void   ps_ascii85_tuples_sse41(const unsigned char *data,
+				      size_t num_groups,
+				      unsigned char *tuples);
+static void   ps_ascii85_tuples_avx2(const unsigned char *data,
+				     size_t num_groups,
+				     unsigned char *tuples);
+#endif // PS_SIMD_X86
+#ifdef PS_SIMD_NEON
+static void   ps_ascii85_tuples_neon(const unsigned char *data,
+				     size_t num_groups,
+				     unsigned char *tuples);
+#endif // PS_SIMD_NEON
+static int    ps_cache_canceled(void *data);
+static void   *ps_cache_convert(void *data);
+static int    ps_cache_filter_function(int inputfd, int outputfd,
+				       int inputseekable, filter_data_t *data,
+				       void *parameters);
+static void   ps_cache_finish(pappl_job_t *job, ps_job_data_t *job_data,
+			      bool success);
+static int    ps_cache_follow_filter_function(int inputfd, int outputfd,
+					      int inputseekable,
+					      filter_data_t *data,
+					      void *parameters);
+static bool   ps_cache_key(pappl_job_t *job, ps_job_data_t *job_data,
+			   int fd);
+static int    ps_cache_open(pappl_job_t *job, ps_job_data_t *job_data,
+			    int *impressions);
+static void   ps_cache_progress(ps_job_data_t *job_data);
+static int    ps_cache_share(pappl_job_t *job, ps_job_data_t *job_data,
+			     int inputfd);
+static bool   ps_cache_start(pappl_job_t *job, ps_job_data_t *job_data);
+static int    ps_cache_trim(off_t limit, int *num_files, off_t *bytes);
+static void   ps_ccitt_end(ps_ccitt_t *g4);
+static void   ps_ccitt_encode_line(ps_ccitt_t *g4,
+				   const unsigned char *line);
+static void   ps_ccitt_put_bits(ps_ccitt_t *g4, unsigned code, int length);
+static void   ps_ccitt_put_run(ps_ccitt_t *g4, int run, int black);
+static bool   ps_ccitt_start(ps_ccitt_t *g4, int width, bool black_is_1,
+			     ps_transport_t *transport);
+static int    ps_compare_cache_files(void *a, void *b, void *data);
 static int    ps_compare_ppd_paths(void *a, void *b, void *data); 
+static void   ps_constraints_add(ps_constraints_t *c, int num_entries,
+				 const char **options, const char **choices);
+static int    ps_constraints_bit(ps_constraints_t *c, const char *option,
+				 const char *choice);
+static void   ps_constraints_build(ps_constraints_t *c, ppd_file_t *ppd);
+static bool   ps_constraints_conflict(ps_constraints_t *c, const char *option,
+				      const char *choice);
+static void   ps_constraints_free(ps_constraints_t *c);
+static int    ps_constraints_option(ps_constraints_t *c, const char *option);
+static void   ps_constraints_resolve(ps_constraints_t *c, int bit, char *buf,
+				     size_t bufsize);
+static bool   ps_constraints_test(ps_constraints_t *c, int bit);
+static void   ps_constraints_update(ps_constraints_t *c);
 static ps_job_data_t *ps_create_job_data(pappl_job_t *job,
 					 pappl_pr_options_t *job_options);
+static bool   ps_dsc_add(ps_dsc_out_t *out, const char *data, size_t offset,
+			 size_t length);
+static int    ps_dsc_filter_function(int inputfd, int outputfd,
+				     int inputseekable, filter_data_t *data,
+				     void *parameters);
+static bool   ps_dsc_keyword(const char *line, size_t len,
+			     const char *keyword);
+static bool   ps_dsc_map(pappl_job_t *job, ps_dsc_t *dsc, int fd);
+static bool   ps_dsc_page_selected(const char *ranges, const char *page_set,
+				   int page);
+static bool   ps_driver_accepts_pdf(ppd_file_t *ppd, const char *device_id);
 static void   ps_driver_delete(pappl_printer_t *printer,
 			       pappl_pr_driver_data_t *driver_data);
 static char   *ps_cups_filter_path(const char *filter);
 static char   *ps_ppd_find_cups_filter(const char *input_format,
 				       int num_filters, char **filters);
+static bool   ps_ppd_hash(pappl_system_t *system, const char *ppd_path,
+			  char *hashstr, size_t hashsize);
 bool          ps_str_has_code(const char *str);
 bool          ps_option_has_code(pappl_system_t *system, ppd_file_t *ppd,
 				 ppd_option_t *option);
 static const char *ps_default_paper_size();
+static int    ps_device_fd(pappl_device_t *device, pappl_job_t *job);
 static bool   ps_driver_setup(pappl_system_t *system, const char *driver_name,
 			      const char *device_uri, const char *device_id,
 			      pappl_pr_driver_data_t *driver_data,
 			      ipp_t **driver_attrs, void *data);
 bool          ps_filter(pappl_job_t *job, pappl_device_t *device, void *data);
+static int    ps_filter_chain(int inputfd, int outputfd, int inputseekable,
+			      filter_data_t *data, cups_array_t *chain);
+static void   *ps_filter_chain_stage(void *data);
+static void   ps_emit_band(pappl_job_t *job, pappl_pr_options_t *options,
+			   ps_job_data_t *job_data);
+static void   ps_emit_job_header(FILE *fp, ppd_file_t *ppd, int job_id,
+				 const char *user, const char *title,
+				 int copies, int width, int length,
+				 int num_pages, ps_transport_mode_t transport);
+static void   ps_emit_job_trailer(FILE *fp, ppd_file_t *ppd, int num_pages);
+static ps_codec_t ps_encoder_choose(pappl_job_t *job, ps_encoder_t *enc,
+				    unsigned codecs,
+				    const unsigned char *lines,
+				    int num_lines, unsigned page);
+static void   ps_encoder_end(ps_encoder_t *enc);
+static void   ps_encoder_free(ps_encoder_t *enc);
+static void   ps_encoder_source(ps_encoder_t *enc, FILE *fp);
+static bool   ps_encoder_start(ps_encoder_t *enc, ps_codec_t codec,
+			       ps_transport_t *transport);
+static void   ps_encoder_write_line(ps_encoder_t *enc,
+				    const unsigned char *line);
+static void   ps_flate_write(ps_encoder_t *enc, const unsigned char *data,
+			     size_t bytes, int flush);
 static void   ps_free_job_data(ps_job_data_t *job_data);
 static bool   ps_have_force_gray(ppd_file_t *ppd,
 				 const char **optstr, const char **choicestr);
 static void   ps_identify(pappl_printer_t *printer,
 			  pappl_identify_actions_t actions,
 			  const char *message);
+static void   ps_job_first_page(pappl_job_t *job);
 static int    ps_job_is_canceled(void *data);
 static void   ps_job_log(void *data, filter_loglevel_t level,
 			 const char *message, ...);
+static bool   ps_job_needs_pdftops(pappl_job_t *job,
+				   ps_job_data_t *job_data);
+static bool   ps_job_needs_pstops(pappl_job_t *job,
+				  ps_job_data_t *job_data);
+static bool   ps_job_output_reversed(ps_job_data_t *job_data);
+static const char *ps_job_page_processing(ps_job_data_t *job_data);
+static ipp_attribute_t *ps_job_vendor_attribute(pappl_job_t *job,
+					       ipp_t *driver_attrs,
+					       const char *name);
+static boolean ps_jpeg_dest_empty(j_compress_ptr cinfo);
+static void   ps_jpeg_dest_init(j_compress_ptr cinfo);
+static void   ps_jpeg_dest_term(j_compress_ptr cinfo);
+static void   ps_jpeg_end(ps_encoder_t *enc);
+static void   ps_jpeg_error_exit(j_common_ptr cinfo);
+static int    ps_jpeg_filter_function(int inputfd, int outputfd,
+				      int inputseekable, filter_data_t *data,
+				      void *parameters);
+static bool   ps_jpeg_start(ps_encoder_t *enc);
+static void   ps_jpeg_write_line(ps_encoder_t *enc,
+				 const unsigned char *line);
+static bool   ps_line_is_blank(const unsigned char *line, size_t bytes,
+			       unsigned char blank);
+static void   ps_lookup_build(ps_lookup_t *lookup, const pwg_map_t *maps,
+			      size_t stride, int num_maps);
+static const char *ps_lookup_find(const ps_lookup_t *lookup,
+				  const char *key);
+static void   ps_lookup_free(ps_lookup_t *lookup);
+static uint32_t ps_lookup_hash(uint32_t seed, const char *key);
+static int    ps_lookup_index(const ps_lookup_t *lookup, const char *key);
+static void   ps_lzw_end(ps_lzw_t *lzw);
+static void   ps_lzw_put_code(ps_lzw_t *lzw, int code);
+static void   ps_lzw_reset(ps_lzw_t *lzw);
+static void   ps_lzw_start(ps_lzw_t *lzw, ps_transport_t *transport);
+static void   ps_lzw_write(ps_lzw_t *lzw, const unsigned char *data,
+			   size_t bytes);
 static void   ps_media_col(pwg_size_t *pwg_size, const char *def_source,
 			   const char *def_type, int left_offset,
 			   int top_offset, pappl_media_tracking_t tracking,
 			   pappl_media_col_t *col);
 static void   ps_one_bit_dither_on_draft(pappl_job_t *job,
 					 pappl_pr_options_t *options);
+static void   ps_option_memo_clear(ps_driver_extension_t *extension);
+static bool   ps_option_memo_get(ps_driver_extension_t *extension,
+				 const char *key, uint64_t hash,
+				 ps_job_data_t *job_data,
+				 unsigned *generation);
+static char   *ps_option_memo_key(pappl_job_t *job,
+				  pappl_pr_options_t *job_options,
+				  pappl_pr_driver_data_t *driver_data,
+				  ps_vendor_table_t *vendor,
+				  ipp_t *driver_attrs, uint64_t *hash);
+static void   ps_option_memo_put(ps_driver_extension_t *extension,
+				 const char *key, uint64_t hash,
+				 ps_job_data_t *job_data,
+				 unsigned generation);
+static bool   ps_page_scan(ps_page_scan_t *scan, const char *buffer,
+			   size_t bytes);
 int           ps_print_filter_function(int inputfd, int outputfd,
 				       int inputseekable, filter_data_t *data,
 				       void *parameters);
+static int    ps_pdf_filter_function(int inputfd, int outputfd,
+				     int inputseekable, filter_data_t *data,
+				     void *parameters);
+static void   ps_pdf_chunk_log(void *data, filter_loglevel_t level,
+			       const char *message, ...);
+static int    ps_pdf_parallel_filter_function(int inputfd, int outputfd,
+					      int inputseekable,
+					      filter_data_t *data,
+					      void *parameters);
+static int    ps_pdf_parallel_pages(pappl_job_t *job,
+				    ps_job_data_t *job_data,
+				    const char *filename);
+static int    ps_pdf_slice(pappl_job_t *job, ps_job_data_t *job_data,
+			   const char *filename, char *slicename,
+			   size_t slicesize);
+static bool   ps_pdf_stitch(ps_pdf_parallel_t *par, FILE *fp,
+			    FILE *outputfp, bool first, bool last);
+static void   *ps_pdf_worker(void *data);
+static bool   ps_pixels_are_neutral(const unsigned char *data,
+				    size_t num_pixels, int colors);
+static void   ps_pixels_to_gray(unsigned char *data, size_t num_pixels,
+				int colors);
+static void   ps_png_predict_line(const unsigned char *line,
+				  const unsigned char *prev, size_t bytes,
+				  int bpp, unsigned char *out);
 static int    ps_poll_device_option_defaults(pappl_printer_t *printer,
 					     bool installable,
 					     cups_option_t **defaults);
@@ -215,15 +1115,50 @@ static bool   ps_rstartjob(pappl_job_t *job, pappl_pr_options_t *options,
 			   pappl_device_t *device);
 static bool   ps_rstartpage(pappl_job_t *job, pappl_pr_options_t *options,
 			    pappl_device_t *device, unsigned page);
+static int    ps_run_qpdf(pappl_job_t *job, const char * const *args,
+			  char *buffer, size_t bufsize);
+static void   ps_runlength_encode_line(ps_encoder_t *enc,
+				       const unsigned char *line);
 static bool   ps_rwriteline(pappl_job_t *job, pappl_pr_options_t *options,
 			    pappl_device_t *device, unsigned y,
 			    const unsigned char *pixels);
 static void   ps_setup(pappl_system_t *system);
 static void   ps_system_web_add_ppd(pappl_client_t *client,
 				    pappl_system_t *system);
+static void   ps_system_web_cache(pappl_client_t *client,
+				  pappl_system_t *system);
 static bool   ps_status(pappl_printer_t *printer);
 static const char *ps_testpage(pappl_printer_t *printer, char *buffer,
 			       size_t bufsize);
+static void   ps_transport_end(ps_transport_t *transport);
+static void   ps_transport_hold(ps_transport_t *transport);
+static void   ps_transport_release(ps_transport_t *transport);
+static const char *ps_transport_source(ps_transport_t *transport);
+static void   ps_transport_write(ps_transport_t *transport,
+				 const unsigned char *data, size_t bytes);
+#ifdef HAVE_LIBURING
+static int    ps_uring_read(int inputfd, unsigned char *buffer, size_t *size,
+			    size_t *done, bool *eof, filter_data_t *data);
+static int    ps_uring_send(int inputfd, int devfd, bool flush,
+			    filter_data_t *data, unsigned long *bytes);
+#endif // HAVE_LIBURING
+static void   ps_vendor_compile(pappl_system_t *system, ppd_file_t *ppd,
+				pappl_pr_driver_data_t *driver_data);
+static void   ps_vendor_free(ps_vendor_table_t *table);
+static ps_vendor_table_t *ps_vendor_get(ps_driver_extension_t *extension);
+static void   ps_vendor_release(ps_driver_extension_t *extension,
+				ps_vendor_table_t *table);
+static void   ps_write_image_line(pappl_job_t *job,
+				  pappl_pr_options_t *options,
+				  ps_job_data_t *job_data,
+				  const unsigned char *line);
+static int    ps_writer_close(void *cookie);
+static bool   ps_writer_flush(ps_writer_t *writer);
+static FILE   *ps_writer_open(pappl_job_t *job, pappl_device_t *device,
+			      ps_writer_t **writer);
+static void   *ps_writer_run(void *data);
+static bool   ps_writer_submit(ps_writer_t *writer, bool flush);
+static ssize_t ps_writer_write(void *cookie, const char *buf, size_t size);
 static pappl_system_t   *system_cb(int num_options, cups_option_t *options,
 				   void *data);
 
@@ -265,92 +1200,450 @@ main(int  argc,				// I - Number of command-line arguments
 //                  out without needing to supply further data by calling
 //                  with data set to NULL, length to 0 and last_data to 1.
 //
+//                  The supplied data is encoded as a whole block into
+//                  an output buffer (see ps_ascii85_encode()) which is
+//                  written with a single call.
+//
+//                  All state (column, held bytes, output buffer) is
+//                  kept in the supplied encoder state, so that
+//                  several jobs can encode at the same time. The
+//                  state must be zero-initialized before the first
+//                  call and its buffer freed when done.
+//
+//                  If the output buffer cannot be allocated, the data
+//                  is lost and the encoder stays failed, further calls
+//                  do not output anything, so that the caller can let
+//                  the job fail instead of printing corrupt output.
+//
 
-static void
-ps_ascii85(FILE                *outputfp,
+static bool				// O - `true` on success, `false` on error
+ps_ascii85(ps_ascii85_t        *a85,		// I - Encoder state
+	   FILE                *outputfp,	// I - Output file
 	   const unsigned char *data,		// I - Data to encode
 	   int                 length,		// I - Number of bytes to encode
 	   int                 last_data)	// I - Last portion of data?
 {
-  unsigned              i;
-  unsigned	        b;			// Binary data word */
-  unsigned char	        c[5];			// ASCII85 encoded chars */
-  static int	        col = 0;		// Current column */
-  static unsigned char  remaining[3];           // Remaining bytes which do
-                                                // not complete 4 to be encoded
-                                                // Keep them for next call
-  static unsigned int   num_remaining = 0;
+  unsigned char         group[4],               // One group of 4 bytes
+                        tuple[5],               // Encoded group
+                        *ptr;                   // Pointer into output buffer
+  size_t                num_groups,             // Number of complete groups
+                        needed;                 // Needed buffer size
 
 
-  while (num_remaining + length > 0)
+  if (a85->failed)
+    return (false);
+
+  if (!data || length < 0)
+    length = 0;
+
+  // Make sure that the output buffer can take the encoded data
+  needed = PS_ASCII85_BUFSIZE((a85->num_remaining + length) / 4 + 1);
+  if (needed > a85->bufsize)
   {
-    if (num_remaining > 0 || length < 4)
+    if ((ptr = (unsigned char *)realloc(a85->buffer, needed)) == NULL)
     {
-      for (b = 0, i = 0; i < 4; i ++)
-      {
-	b << 8;
-	if (i < num_remaining)
-	  b |= remaining[i];
-	else if (i - num_remaining < length) 
-	  b |= data[i - num_remaining];
-	else if (!last_data)
-	{
-	  if (length)
-	    memcpy(remaining + num_remaining, data, length);
-	  num_remaining = i;
-	  return;
-	}
-      }
-      i = 4 - num_remaining;
-      if (length < i)
-	i = length;
-      num_remaining = 0;
+      a85->failed = true;
+      return (false);
     }
-    else
+    a85->buffer  = ptr;
+    a85->bufsize = needed;
+  }
+  ptr = a85->buffer;
+
+  // Complete a group with the bytes held from the previous call
+  if (a85->num_remaining > 0 && a85->num_remaining + length >= 4)
+  {
+    memcpy(group, a85->remaining, a85->num_remaining);
+    memcpy(group + a85->num_remaining, data, 4 - a85->num_remaining);
+    ptr += ps_ascii85_encode(group, 1, ptr, &a85->col);
+    data += 4 - a85->num_remaining;
+    length -= 4 - a85->num_remaining;
+    a85->num_remaining = 0;
+  }
+
+  // Encode all complete groups of the supplied data in one block
+  if (a85->num_remaining == 0 && length >= 4)
+  {
+    num_groups = (size_t)length / 4;
+    ptr += ps_ascii85_encode(data, num_groups, ptr, &a85->col);
+    data += 4 * num_groups;
+    length -= 4 * num_groups;
+  }
+
+  // Keep the rest for the next call
+  if (length > 0)
+  {
+    memcpy(a85->remaining + a85->num_remaining, data, length);
+    a85->num_remaining += length;
+  }
+
+  if (last_data)
+  {
+    // A final partial group is padded with zeros and only the first
+    // num_remaining + 1 characters get output, never as 'z'
+    if (a85->num_remaining > 0)
     {
-      b = (((((data[0] << 8) | data[1]) << 8) | data[2]) << 8) | data[3];
-      i = 4;
+      memset(group, 0, sizeof(group));
+      memcpy(group, a85->remaining, a85->num_remaining);
+      ps_ascii85_tuples_scalar(group, 1, tuple);
+      memcpy(ptr, tuple, a85->num_remaining + 1);
+      ptr += a85->num_remaining + 1;
     }
+    memcpy(ptr, "~>\n", 3);
+    ptr += 3;
+    a85->col = 0;
+    a85->num_remaining = 0;
+  }
+
+  if (ptr > a85->buffer)
+    fwrite(a85->buffer, 1, ptr - a85->buffer, outputfp);
 
-    if (b == 0)
+  return (true);
+}
+
+
+//
+// 'ps_ascii85_encode()' - Encode complete groups of 4 bytes into an
+//                         output buffer, using 'z' for all-zero groups
+//                         and wrapping lines after 75 columns. The
+//                         buffer must hold at least
+//                         PS_ASCII85_BUFSIZE(num_groups) bytes.
+//                         Returns the number of bytes written.
+//
+
+static size_t				// O  - Bytes written to out
+ps_ascii85_encode(
+    const unsigned char *data,		// I  - Data to encode
+    size_t              num_groups,	// I  - Number of 4-byte groups
+    unsigned char       *out,		// I  - Output buffer
+    int                 *col)		// IO - Current column
+{
+  unsigned char *ptr = out;		// Pointer into output buffer
+  unsigned char tuples[5 * PS_ASCII85_CHUNK + 8];
+					// Encoded groups of current chunk
+  const unsigned char *tuple;		// Current encoded group
+  size_t        i, count;
+  unsigned      word;			// Current group as word
+  int           c = *col,		// Current column
+                zero,			// Is the group all-zero?
+                nl;			// Line feed needed?
+
+
+  pthread_once(&ps_ascii85_once, ps_ascii85_select_kernel);
+
+  while (num_groups > 0)
+  {
+    count = (num_groups > PS_ASCII85_CHUNK ? PS_ASCII85_CHUNK : num_groups);
+
+    (ps_ascii85_kernel)(data, count, tuples);
+
+    // Compact all-zero groups to 'z' and insert line feeds, without
+    // branching on the data: Each group gets copied as 5 characters
+    // and a line feed is always stored after it, but the output
+    // pointer only advances over what is actually needed
+    for (i = 0, tuple = tuples; i < count; i ++, data += 4, tuple += 5)
     {
-      fputc('z', outputfp);
-      col ++;
+      memcpy(&word, data, 4);
+      zero = (word == 0);
+      memcpy(ptr, tuple, 5);
+      ptr[0] = (zero ? 'z' : ptr[0]);
+      ptr += 5 - 4 * zero;
+      c += 5 - 4 * zero;
+      nl = (c >= 75);
+      *ptr = '\n';
+      ptr += nl;
+      c *= !nl;
     }
-    else
-    {
-      c[4] = (b % 85) + '!';
-      b /= 85;
-      c[3] = (b % 85) + '!';
-      b /= 85;
-      c[2] = (b % 85) + '!';
-      b /= 85;
-      c[1] = (b % 85) + '!';
-      b /= 85;
-      c[0] = b + '!';
 
-      fwrite(c, 5, 1, outputfp);
-      col += 5;
+    num_groups -= count;
+  }
+
+  *col = c;
+
+  return (ptr - out);
+}
+
+
+//
+// 'ps_ascii85_select_kernel()' - Select the fastest kernel for converting
+//                                groups of 4 bytes into 5 ASCII85
+//                                characters which the CPU supports.
+//                                Called once via pthread_once().
+//
+
+static void
+ps_ascii85_select_kernel(void)
+{
+  ps_ascii85_kernel = ps_ascii85_tuples_scalar;
+
+#ifdef PS_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    ps_ascii85_kernel = ps_ascii85_tuples_avx2;
+  else if (__builtin_cpu_supports("sse4.1"))
+    ps_ascii85_kernel = ps_ascii85_tuples_sse41;
+#elif defined(PS_SIMD_NEON)
+  ps_ascii85_kernel = ps_ascii85_tuples_neon;
+#endif // PS_SIMD_X86
+}
+
+
+//
+// 'ps_ascii85_tuples_scalar()' - Convert groups of 4 bytes into 5 ASCII85
+//                                characters each (portable version).
+//
+
+static void
+ps_ascii85_tuples_scalar(
+    const unsigned char *data,		// I - Data to encode
+    size_t              num_groups,	// I - Number of 4-byte groups
+    unsigned char       *tuples)	// O - 5 characters per group
+{
+  unsigned b, q;			// Binary data word, quotient
+
+
+  for (; num_groups > 0; num_groups --, data += 4, tuples += 5)
+  {
+    b = ((unsigned)data[0] << 24) | ((unsigned)data[1] << 16) |
+        ((unsigned)data[2] << 8) | (unsigned)data[3];
+
+    q = b / 85;
+    tuples[4] = (unsigned char)(b - q * 85 + '!');
+    b = q / 85;
+    tuples[3] = (unsigned char)(q - b * 85 + '!');
+    q = b / 85;
+    tuples[2] = (unsigned char)(b - q * 85 + '!');
+    b = q / 85;
+    tuples[1] = (unsigned char)(q - b * 85 + '!');
+    tuples[0] = (unsigned char)(b + '!');
+  }
+}
+
+
+#ifdef PS_SIMD_X86
+//
+// 'ps_ascii85_tuples_sse41()' - Convert groups of 4 bytes into 5 ASCII85
+//                               characters each (SSE4.1, 4 groups at a
+//                               time).
+//
+// The division by 85 is done as a multiplication with 0xC0C0C0C1 and a
+// shift by 38 bits, which is exact for all 32-bit values.
+//
+
+__attribute__((target("sse4.1")))
+static void
+ps_ascii85_tuples_sse41(
+    const unsigned char *data,		// I - Data to encode
+    size_t              num_groups,	// I - Number of 4-byte groups
+    unsigned char       *tuples)	// O - 5 characters per group
+{
+  int     i;
+  __m128i b, q, d[5], w, out;
+  unsigned tail;
+  const __m128i bswap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+				      11, 10, 9, 8, 15, 14, 13, 12);
+  const __m128i magic = _mm_set1_epi32((int)0xC0C0C0C1);
+  const __m128i c85   = _mm_set1_epi32(85);
+  const __m128i excl  = _mm_set1_epi8('!');
+  // Interleave the first 4 characters (w) and the fifth (d[4]) of each
+  // group to 5-byte tuples, first 16 bytes, then the last 4 bytes
+  const __m128i wmask1 = _mm_setr_epi8(0, 1, 2, 3, -128, 4, 5, 6,
+				       7, -128, 8, 9, 10, 11, -128, 12);
+  const __m128i lmask1 = _mm_setr_epi8(-128, -128, -128, -128, 0, -128,
+				       -128, -128, -128, 4, -128, -128,
+				       -128, -128, 8, -128);
+  const __m128i wmask2 = _mm_setr_epi8(13, 14, 15, -128, -128, -128, -128,
+				       -128, -128, -128, -128, -128, -128,
+				       -128, -128, -128);
+  const __m128i lmask2 = _mm_setr_epi8(-128, -128, -128, 12, -128, -128,
+				       -128, -128, -128, -128, -128, -128,
+				       -128, -128, -128, -128);
+
+
+  for (; num_groups >= 4; num_groups -= 4, data += 16, tuples += 20)
+  {
+    b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), bswap);
+
+    for (i = 4; i > 0; i --)
+    {
+      q = _mm_or_si128(
+	    _mm_srli_epi64(_mm_mul_epu32(b, magic), 38),
+	    _mm_slli_epi64(_mm_srli_epi64(
+	      _mm_mul_epu32(_mm_srli_epi64(b, 32), magic), 38), 32));
+      d[i] = _mm_sub_epi32(b, _mm_mullo_epi32(q, c85));
+      b    = q;
     }
+    d[0] = b;
+
+    w = _mm_or_si128(_mm_or_si128(d[0], _mm_slli_epi32(d[1], 8)),
+		     _mm_or_si128(_mm_slli_epi32(d[2], 16),
+				  _mm_slli_epi32(d[3], 24)));
+    w    = _mm_add_epi8(w, excl);
+    d[4] = _mm_add_epi8(d[4], excl);
+
+    out = _mm_or_si128(_mm_shuffle_epi8(w, wmask1),
+		       _mm_shuffle_epi8(d[4], lmask1));
+    _mm_storeu_si128((__m128i *)tuples, out);
+    out  = _mm_or_si128(_mm_shuffle_epi8(w, wmask2),
+			_mm_shuffle_epi8(d[4], lmask2));
+    tail = (unsigned)_mm_cvtsi128_si32(out);
+    memcpy(tuples + 16, &tail, 4);
+  }
+
+  ps_ascii85_tuples_scalar(data, num_groups, tuples);
+}
+
+
+//
+// 'ps_ascii85_tuples_avx2()' - Convert groups of 4 bytes into 5 ASCII85
+//                              characters each (AVX2, 8 groups at a
+//                              time).
+//
 
-    if (data)
-      data += i;
-    length -= i;
+__attribute__((target("avx2")))
+static void
+ps_ascii85_tuples_avx2(
+    const unsigned char *data,		// I - Data to encode
+    size_t              num_groups,	// I - Number of 4-byte groups
+    unsigned char       *tuples)	// O - 5 characters per group
+{
+  int     i;
+  __m256i b, q, d[5], w, out1, out2;
+  unsigned tail;
+  const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+					 11, 10, 9, 8, 15, 14, 13, 12,
+					 3, 2, 1, 0, 7, 6, 5, 4,
+					 11, 10, 9, 8, 15, 14, 13, 12);
+  const __m256i magic = _mm256_set1_epi32((int)0xC0C0C0C1);
+  const __m256i c85   = _mm256_set1_epi32(85);
+  const __m256i excl  = _mm256_set1_epi8('!');
+  // Same interleaving as in the SSE4.1 kernel, in each 128-bit lane
+  const __m256i wmask1 = _mm256_setr_epi8(0, 1, 2, 3, -128, 4, 5, 6,
+					  7, -128, 8, 9, 10, 11, -128, 12,
+					  0, 1, 2, 3, -128, 4, 5, 6,
+					  7, -128, 8, 9, 10, 11, -128, 12);
+  const __m256i lmask1 = _mm256_setr_epi8(-128, -128, -128, -128, 0, -128,
+					  -128, -128, -128, 4, -128, -128,
+					  -128, -128, 8, -128,
+					  -128, -128, -128, -128, 0, -128,
+					  -128, -128, -128, 4, -128, -128,
+					  -128, -128, 8, -128);
+  const __m256i wmask2 = _mm256_setr_epi8(13, 14, 15, -128, -128, -128,
+					  -128, -128, -128, -128, -128, -128,
+					  -128, -128, -128, -128,
+					  13, 14, 15, -128, -128, -128,
+					  -128, -128, -128, -128, -128, -128,
+					  -128, -128, -128, -128);
+  const __m256i lmask2 = _mm256_setr_epi8(-128, -128, -128, 12, -128, -128,
+					  -128, -128, -128, -128, -128, -128,
+					  -128, -128, -128, -128,
+					  -128, -128, -128, 12, -128, -128,
+					  -128, -128, -128, -128, -128, -128,
+					  -128, -128, -128, -128);
+
+
+  for (; num_groups >= 8; num_groups -= 8, data += 32, tuples += 40)
+  {
+    b = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)data), bswap);
 
-    if (col >= 75)
+    for (i = 4; i > 0; i --)
     {
-      fputc('\n', outputfp);
-      col = 0;
+      q = _mm256_or_si256(
+	    _mm256_srli_epi64(_mm256_mul_epu32(b, magic), 38),
+	    _mm256_slli_epi64(_mm256_srli_epi64(
+	      _mm256_mul_epu32(_mm256_srli_epi64(b, 32), magic), 38), 32));
+      d[i] = _mm256_sub_epi32(b, _mm256_mullo_epi32(q, c85));
+      b    = q;
     }
+    d[0] = b;
+
+    w = _mm256_or_si256(_mm256_or_si256(d[0], _mm256_slli_epi32(d[1], 8)),
+			_mm256_or_si256(_mm256_slli_epi32(d[2], 16),
+					_mm256_slli_epi32(d[3], 24)));
+    w    = _mm256_add_epi8(w, excl);
+    d[4] = _mm256_add_epi8(d[4], excl);
+
+    out1 = _mm256_or_si256(_mm256_shuffle_epi8(w, wmask1),
+			   _mm256_shuffle_epi8(d[4], lmask1));
+    out2 = _mm256_or_si256(_mm256_shuffle_epi8(w, wmask2),
+			   _mm256_shuffle_epi8(d[4], lmask2));
+
+    _mm_storeu_si128((__m128i *)tuples, _mm256_castsi256_si128(out1));
+    tail = (unsigned)_mm_cvtsi128_si32(_mm256_castsi256_si128(out2));
+    memcpy(tuples + 16, &tail, 4);
+    _mm_storeu_si128((__m128i *)(tuples + 20),
+		     _mm256_extracti128_si256(out1, 1));
+    tail = (unsigned)_mm_cvtsi128_si32(_mm256_extracti128_si256(out2, 1));
+    memcpy(tuples + 36, &tail, 4);
   }
 
-  if (last_data)
+  ps_ascii85_tuples_sse41(data, num_groups, tuples);
+}
+#endif // PS_SIMD_X86
+
+
+#ifdef PS_SIMD_NEON
+//
+// 'ps_ascii85_tuples_neon()' - Convert groups of 4 bytes into 5 ASCII85
+//                              characters each (NEON, 4 groups at a
+//                              time).
+//
+
+static void
+ps_ascii85_tuples_neon(
+    const unsigned char *data,		// I - Data to encode
+    size_t              num_groups,	// I - Number of 4-byte groups
+    unsigned char       *tuples)	// O - 5 characters per group
+{
+  int        i;
+  uint32x4_t b, q, d[5];
+  uint8x16_t w, l, out;
+  uint32_t   tail;
+  static const unsigned char wmask1[16] =
+  { 0, 1, 2, 3, 255, 4, 5, 6, 7, 255, 8, 9, 10, 11, 255, 12 };
+  static const unsigned char lmask1[16] =
+  { 255, 255, 255, 255, 0, 255, 255, 255, 255, 4, 255, 255, 255, 255, 8, 255 };
+  static const unsigned char wmask2[16] =
+  { 13, 14, 15, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255 };
+  static const unsigned char lmask2[16] =
+  { 255, 255, 255, 12, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255 };
+
+
+  for (; num_groups >= 4; num_groups -= 4, data += 16, tuples += 20)
   {
-    fputs("~>\n", outputfp);
-    col = 0;
-    num_remaining = 0;
+    b = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data)));
+
+    for (i = 4; i > 0; i --)
+    {
+      q = vcombine_u32(
+	    vshrn_n_u64(vmull_n_u32(vget_low_u32(b), 0xC0C0C0C1), 32),
+	    vshrn_n_u64(vmull_n_u32(vget_high_u32(b), 0xC0C0C0C1), 32));
+      q    = vshrq_n_u32(q, 6);
+      d[i] = vmlsq_n_u32(b, q, 85);
+      b    = q;
+    }
+    d[0] = b;
+
+    w = vreinterpretq_u8_u32(vorrq_u32(vorrq_u32(d[0], vshlq_n_u32(d[1], 8)),
+				       vorrq_u32(vshlq_n_u32(d[2], 16),
+						 vshlq_n_u32(d[3], 24))));
+    w = vaddq_u8(w, vdupq_n_u8('!'));
+    l = vaddq_u8(vreinterpretq_u8_u32(d[4]), vdupq_n_u8('!'));
+
+    out = vorrq_u8(vqtbl1q_u8(w, vld1q_u8(wmask1)),
+		   vqtbl1q_u8(l, vld1q_u8(lmask1)));
+    vst1q_u8(tuples, out);
+    out = vorrq_u8(vqtbl1q_u8(w, vld1q_u8(wmask2)),
+		   vqtbl1q_u8(l, vld1q_u8(lmask2)));
+    tail = vgetq_lane_u32(vreinterpretq_u32_u8(out), 0);
+    memcpy(tuples + 16, &tail, 4);
   }
+
+  ps_ascii85_tuples_scalar(data, num_groups, tuples);
 }
+#endif // PS_SIMD_NEON
 
 
 //
@@ -504,4715 +1797,11486 @@ ps_autoadd(const char *device_info,	// I - Device name (unused)
 
 
 //
-// 'ps_compare_ppd_paths()' - Compare function for sorting PPD path array
+// 'ps_cache_canceled()' - Check whether a conversion shared by several
+//                         jobs is not needed anymore, as no job reads its
+//                         data. Only the filter functions running as
+//                         threads see this, forked filter processes have
+//                         a copy of the counter from the time of the fork.
+//                         The Caching stage polls it and the filter chain
+//                         then terminates the filter processes. It reads
+//                         without locking the mutex, which could be held
+//                         in a forked process by a thread not existing
+//                         there.
 //
 
-static int
-ps_compare_ppd_paths(void *a,
-		     void *b,
-		     void *data)
+static int				// O - 1 if not needed anymore, 0 if
+					//     still needed
+ps_cache_canceled(void *data)		// I - Shared conversion
 {
-  ps_ppd_path_t *aa = (ps_ppd_path_t *)a;
-  ps_ppd_path_t *bb = (ps_ppd_path_t *)b;
+  ps_cache_fanout_t *fanout = (ps_cache_fanout_t *)data;
+					// Shared conversion
 
-  (void)data;
-  return (strcmp(aa->driver_name, bb->driver_name));
+
+  return (*(volatile int *)&(fanout->readers) == 0);
 }
 
 
 //
-// 'ps_create_job_data()' - Load the printer's PPD file and set the PPD options
-//                          according to the job options
+// 'ps_cache_convert()' - Run the conversion of a job shared with other
+//                        jobs into the cache file, on its own thread. It
+//                        does not depend on the printer of the job or on
+//                        the job not getting canceled, only on some job
+//                        still reading its data. When it ends the jobs
+//                        reading the data get told whether it is
+//                        complete.
 //
 
-static ps_job_data_t *ps_create_job_data(pappl_job_t *job,
-					 pappl_pr_options_t *job_options)
+static void *				// O - Thread exit status (unused)
+ps_cache_convert(void *data)		// I - Job data
 {
-  int                   i, j, k, count, intval;
-  ps_driver_extension_t *extension;
-  ps_job_data_t         *job_data;      // PPD data for job
-  ppd_cache_t           *pc;
-  pappl_pr_driver_data_t driver_data;   // Printer driver data
-  const char            *ppd_path;
-  cups_option_t         *opt;
-  ipp_t                 *driver_attrs;  // Printer (driver) IPP attributes
-  char                  buf[1024];      // Buffer for building strings
-  const char            *optstr,        // Option name from PPD option
-                        *choicestr,     // Choice name from PPD option
-                        *val;           // Value string from IPP option
-  ipp_t                 *attrs;         // IPP Attributes structure
-  ipp_t		        *media_col,	// media-col IPP structure
-                        *media_size;	// media-size IPP structure
-  int                   xres, yres;
-  ipp_attribute_t       *attr;
-  int                   pcm;            // Print color mode: 0: mono,
-                                        // 1: color (for presets)
-  int                   pq;             // IPP Print quality value (for presets)
-  int		        num_presets;	// Number of presets
-  cups_option_t	        *presets;       // Presets of PPD options
-  ppd_option_t          *option;        // PPD option
-  ppd_choice_t          *choice;        // Choice in PPD option
-  ppd_attr_t            *ppd_attr;
-  pwg_map_t             *pwg_map;
-  ppd_coption_t         *coption = NULL;
-  char                  *param;
-  int                   num_cparams = 0;
-  char                  paramstr[1024];
-  time_t t;
-  filter_data_t         *filter_data;
-  const char * const extra_attributes[] =
+  ps_job_data_t	*job_data = (ps_job_data_t *)data;
+					// Job data
+  pappl_job_t	*job = (pappl_job_t *)job_data->cache_data.logdata;
+					// Job
+  ps_cache_fanout_t *fanout = job_data->fanout;
+					// Shared conversion
+  int		nullfd;			// File descriptor for /dev/null
+
+
+  // The filter chain has no output, the data goes into the cache file
+  if ((nullfd = open("/dev/null", O_RDWR | O_CLOEXEC)) < 0)
+    job_data->cache_status = 1;
+  else
   {
-   "job-uuid",
-   "job-originating-user-name",
-   "job-originating-host-name",
-   NULL
-  };
-  pappl_printer_t       *printer = papplJobGetPrinter(job);
+    job_data->cache_status =
+      ps_filter_chain(job_data->cache_input, nullfd, 1,
+		      &(job_data->cache_data), job_data->cache_chain);
+    close(nullfd);
+  }
 
-  //
-  // Load the printer's assigned PPD file, mark the defaults, and create the
-  // cache
-  //
+  pthread_mutex_lock(&cache_mutex);
+  fanout->impressions = papplJobGetImpressionsCompleted(job);
+  fanout->state       = job_data->cache_status == 0 &&
+			job_data->cache_bytes > 0 ? PS_CACHE_FANOUT_DONE :
+						    PS_CACHE_FANOUT_FAILED;
+  pthread_cond_broadcast(&(fanout->cond));
+  pthread_mutex_unlock(&cache_mutex);
 
-  job_data = (ps_job_data_t *)calloc(1, sizeof(ps_job_data_t));
+  return (NULL);
+}
 
-  papplPrinterGetDriverData(printer, &driver_data);
-  extension = (ps_driver_extension_t *)driver_data.extension;
-  job_data->ppd = extension->ppd;
-  pc = job_data->ppd->cache;
-  job_data->cups_filter_ps = extension->cups_filter_ps;
-  job_data->temp_ppd_name = extension->temp_ppd_name;
-  if (job_data->cups_filter_ps)
-    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
-		"Using CUPS filter for post-processing PostScript: %s",
-		job_data->cups_filter_ps);
-  else
-    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
-		"Not using any CUPS filter for post-processing the PostScript");
 
-  driver_attrs = papplPrinterGetDriverAttributes(printer);
+//
+// 'ps_cache_filter_function()' - Pass the printer-ready data of a job on
+//                                to the output to the device and copy it
+//                                into the conversion cache file. Between
+//                                pipes tee() duplicates the data without
+//                                copying it and splice() moves it into
+//                                the file. Errors on the cache file only
+//                                stop the caching. Jobs sharing the
+//                                conversion get told about each piece.
+//                                The JCL job header with the job ID does
+//                                not go into the file. It stops when the
+//                                job is canceled or nobody needs the data
+//                                of a shared conversion anymore.
+//
 
-  //
-  // Find the PPD (or filter) options corresponding to the job options
-  //
+static int				// O - Error status
+ps_cache_filter_function(
+    int           inputfd,		// I - File descriptor input stream
+    int           outputfd,		// I - File descriptor output stream
+    int           inputseekable,	// I - Is input stream seekable?
+					//     (unused)
+    filter_data_t *data,		// I - Job and printer data
+    void          *parameters)		// I - Job data
+{
+  ps_job_data_t	*job_data = (ps_job_data_t *)parameters;
+					// Job data
+  filter_logfunc_t log = data->logfunc;	// Log function
+  void		*ld = data->logdata;	// Log function data
+  char		buffer[65536];		// Read/write buffer
+  ssize_t	bytes,			// Bytes read or duplicated
+		moved = 0;		// Bytes moved or written
+  size_t	pos,			// Position in data
+		wpos;			// Position in data written
+  struct pollfd	pfd;			// Poll for input
+  bool		use_tee = true;		// Use tee() and splice()?
+  int		status = 0,		// Exit status
+		err = 0;		// Error on reading or writing
 
-  // Job options without PPD equivalent
-  //  - print-content-optimize
-  //  - print-darkness
-  //  - darkness-configured
-  //  - print-speed
 
-  // page-ranges (filter option)
-  if (job_options->first_page == 0)
-    job_options->first_page = 1;
-  if (job_options->last_page == 0)
-    job_options->last_page = INT_MAX;
-  if (job_options->first_page > 1 || job_options->last_page < INT_MAX)
-  {
-    snprintf(buf, sizeof(buf), "%d-%d",
-	     job_options->first_page, job_options->last_page);
-    job_data->num_options = cupsAddOption("page-ranges", buf,
-					  job_data->num_options,
-					  &(job_data->options));
-  }
-
-  // Finishings
-  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding options for finishings");
-  if (job_options->finishings & PAPPL_FINISHINGS_PUNCH)
-    job_data->num_options = ppdCacheGetFinishingOptions(pc, NULL,
-							IPP_FINISHINGS_PUNCH,
-							job_data->num_options,
-							&(job_data->options));
-  if (job_options->finishings & PAPPL_FINISHINGS_STAPLE)
-    job_data->num_options = ppdCacheGetFinishingOptions(pc, NULL,
-							IPP_FINISHINGS_STAPLE,
-							job_data->num_options,
-							&(job_data->options));
-  if (job_options->finishings & PAPPL_FINISHINGS_TRIM)
-    job_data->num_options = ppdCacheGetFinishingOptions(pc, NULL,
-							IPP_FINISHINGS_TRIM,
-							job_data->num_options,
-							&(job_data->options));
-
-  // PageSize/media/media-size/media-size-name
-  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding option: PageSize");
-  attrs = ippNew();
-  media_col = ippNew();
-  media_size = ippNew();
-  ippAddInteger(media_size, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
-		"x-dimension", job_options->media.size_width);
-  ippAddInteger(media_size, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
-		"y-dimension", job_options->media.size_length);
-  ippAddCollection(media_col, IPP_TAG_PRINTER, "media-size", media_size);
-  ippDelete(media_size);
-  ippAddString(media_col, IPP_TAG_PRINTER, IPP_TAG_KEYWORD, "media-size-name",
-	       NULL, job_options->media.size_name);
-  ippAddInteger(media_col, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
-		"media-left-margin", job_options->media.left_margin);
-  ippAddInteger(media_col, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
-		"media-right-margin", job_options->media.right_margin);
-  ippAddInteger(media_col, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
-		"media-top-margin", job_options->media.top_margin);
-  ippAddInteger(media_col, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
-		"media-bottom-margin", job_options->media.bottom_margin);
-  ippAddCollection(attrs, IPP_TAG_PRINTER, "media-col", media_col);
-  ippDelete(media_col);
-  if ((choicestr = ppdCacheGetPageSize(pc, attrs, NULL, NULL)) != NULL)
-    job_data->num_options = cupsAddOption("PageSize", choicestr,
-					  job_data->num_options,
-					  &(job_data->options));
-  ippDelete(attrs);
-
-  // InputSlot/media-source
-  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding option: %s",
-	      pc->source_option ? pc->source_option : "InputSlot");
-  if ((choicestr = ppdCacheGetInputSlot(pc, NULL,
-					job_options->media.source)) !=
-      NULL)
-    job_data->num_options = cupsAddOption(pc->source_option, choicestr,
-					  job_data->num_options,
-					  &(job_data->options));
-
-  // MediaType/media-type
-  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding option: MediaType");
-  if ((choicestr = ppdCacheGetMediaType(pc, NULL,
-					job_options->media.type)) != NULL)
-    job_data->num_options = cupsAddOption("MediaType", choicestr,
-					  job_data->num_options,
-					  &(job_data->options));
-
-  // orientation-requested (filter option)
-  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
-	      "Adding option: orientation-requested");
-  if (job_options->orientation_requested >= IPP_ORIENT_PORTRAIT &&
-      job_options->orientation_requested <  IPP_ORIENT_NONE)
-  {
-    snprintf(buf, sizeof(buf), "%d", job_options->orientation_requested);
-    job_data->num_options = cupsAddOption("orientation-requested", buf,
-					  job_data->num_options,
-					  &(job_data->options));
-  }
-
-  // OutputBin/output-bin
-  if ((count = pc->num_bins) > 0)
-  {
-    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding option: OutputBin");
-    val = job_options->output_bin;
-    for (i = 0, pwg_map = pc->bins; i < count; i ++, pwg_map ++)
-      if (!strcmp(pwg_map->pwg, val))
-	choicestr = pwg_map->ppd;
-    if (choicestr != NULL)
-      job_data->num_options = cupsAddOption("OutputBin", choicestr,
-					    job_data->num_options,
-					    &(job_data->options));
-  }
-
-  // Presets, selected by color/bw and print quality
-  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
-	      "Adding option presets depending on requested print quality");
-  if (job_data->ppd->color_device &&
-      (job_options->print_color_mode &
-       (PAPPL_COLOR_MODE_AUTO | PAPPL_COLOR_MODE_COLOR)) != 0)
-    pcm = 1;
-  else
-    pcm = 0;
-  if (job_options->print_quality == IPP_QUALITY_DRAFT)
-    pq = 0;
-  else if (job_options->print_quality == IPP_QUALITY_HIGH)
-    pq = 2;
-  else
-    pq = 1;
-  num_presets = pc->num_presets[pcm][pq];
-  presets     = pc->presets[pcm][pq];
-  for (i = 0; i < num_presets; i ++)
-    job_data->num_options = cupsAddOption(presets[i].name, presets[i].value,
-					  job_data->num_options,
-					  &(job_data->options));
-
-  // Do we have a way to force grayscale printing?
-  if (pcm == 0)
-  {
-    // Find suitable option in the PPD file and set it if available
-    if (ps_have_force_gray(job_data->ppd, &optstr, &choicestr) &&
-	cupsGetOption(optstr, job_data->num_options,
-		      job_data->options) == NULL)
-      job_data->num_options = cupsAddOption(optstr, choicestr,
-					    job_data->num_options,
-					    &(job_data->options));
-    // Add "ColorModel=Gray" to make filters converting color
-    // input to grayscale
-    if (cupsGetOption("ColorModel", job_data->num_options,
-		      job_data->options) == NULL)
-      job_data->num_options = cupsAddOption("ColorModel", "Gray",
-					    job_data->num_options,
-					    &(job_data->options));
-  }
-
-  // print-scaling (filter option)
-  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding option: print-scaling");
-  if (job_options->print_scaling)
-  {
-    if (job_options->print_scaling & PAPPL_SCALING_AUTO)
-      job_data->num_options = cupsAddOption("print-scaling", "auto",
-					    job_data->num_options,
-					    &(job_data->options));
-    if (job_options->print_scaling & PAPPL_SCALING_AUTO_FIT)
-      job_data->num_options = cupsAddOption("print-scaling", "auto-fit",
-					    job_data->num_options,
-					    &(job_data->options));
-    if (job_options->print_scaling & PAPPL_SCALING_FILL)
-      job_data->num_options = cupsAddOption("print-scaling", "fill",
-					    job_data->num_options,
-					    &(job_data->options));
-    if (job_options->print_scaling & PAPPL_SCALING_FIT)
-      job_data->num_options = cupsAddOption("print-scaling", "fit",
-					    job_data->num_options,
-					    &(job_data->options));
-    if (job_options->print_scaling & PAPPL_SCALING_NONE)
-      job_data->num_options = cupsAddOption("print-scaling", "none",
-					    job_data->num_options,
-					    &(job_data->options));
-  }
+  (void)inputseekable;
 
-  // Resolution/printer-resolution
-  // Only add a "Resolution" option if there is none yet (from presets)
-  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding option: Resolution");
-  if (cupsGetOption("Resolution", job_data->num_options,
-		    job_data->options) == NULL)
+  // Each job printing the data emits its own JCL job header. Data which
+  // does not start with the one of this job, for example from a CUPS
+  // filter putting the job ID somewhere else, does not get cached.
+  for (pos = 0; pos < job_data->cache_jcl_size; pos += bytes)
   {
-    if ((job_options->printer_resolution[0] &&
-	 ((attr = papplJobGetAttribute(job, "printer-resolution")) != NULL ||
-	  (attr = papplJobGetAttribute(job, "Resolution")) != NULL) &&
-	 (option = ppdFindOption(job_data->ppd, "Resolution")) != NULL &&
-	 (count = option->num_choices) > 0))
+    if ((bytes = read(inputfd, buffer,
+		      job_data->cache_jcl_size - pos < sizeof(buffer) ?
+		      job_data->cache_jcl_size - pos : sizeof(buffer))) < 0)
     {
-      for (i = 0, choice = option->choices; i < count; i ++, choice ++)
+      if (errno != EINTR)
       {
-	if ((j = sscanf(choice->choice, "%dx%d", &xres, &yres)) == 1)
-	  yres = xres;
-	else if (j <= 0)
-	  continue;
-	if (job_options->printer_resolution[0] == xres &&
-	    (job_options->printer_resolution[1] == yres ||
-	     (job_options->printer_resolution[1] == 0 && xres == yres)))
-	  break;
+	err    = errno;
+	status = 1;
+	goto done;
       }
-      if (i < count)
-	job_data->num_options = cupsAddOption("Resolution", choice->choice,
-					      job_data->num_options,
-					      &(job_data->options));
+      bytes = 0;
+      continue;
     }
-    else if (job_options->printer_resolution[0])
+    else if (bytes == 0)
+      break;
+
+    if (job_data->cache_bytes >= 0 &&
+	memcmp(buffer, job_data->cache_jcl + pos, bytes))
     {
-      if (job_options->printer_resolution[1] &&
-	  job_options->printer_resolution[0] !=
-	  job_options->printer_resolution[1])
-	snprintf(buf, sizeof(buf) - 1, "%dx%ddpi",
-		 job_options->printer_resolution[0],
-		 job_options->printer_resolution[1]);
-      else
-	snprintf(buf, sizeof(buf) - 1, "%ddpi",
-		 job_options->printer_resolution[0]);
-      job_data->num_options = cupsAddOption("Resolution", buf,
-					    job_data->num_options,
-					    &(job_data->options));
+      if (log)
+	log(ld, FILTER_LOGLEVEL_DEBUG,
+	    "Caching: Output does not start with the JCL job header, not "
+	    "caching it");
+      job_data->cache_bytes = -1;
+      ps_cache_progress(job_data);
     }
-    else if ((ppd_attr = ppdFindAttr(job_data->ppd, "DefaultResolution",
-				     NULL)) != NULL)
-      job_data->num_options = cupsAddOption("Resolution", ppd_attr->value,
-					    job_data->num_options,
-					    &(job_data->options));
-  }
 
-  // Duplex/sides
-  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding option: Duplex");
-  if (job_options->sides && pc->sides_option)
-  {
-    if (job_options->sides & PAPPL_SIDES_ONE_SIDED &&
-	pc->sides_1sided)
-      job_data->num_options = cupsAddOption(pc->sides_option,
-					    pc->sides_1sided,
-					    job_data->num_options,
-					    &(job_data->options));
-    else if (job_options->sides & PAPPL_SIDES_TWO_SIDED_LONG_EDGE &&
-	     pc->sides_2sided_long)
-      job_data->num_options = cupsAddOption(pc->sides_option,
-					    pc->sides_2sided_long,
-					    job_data->num_options,
-					    &(job_data->options));
-    else if (job_options->sides & PAPPL_SIDES_TWO_SIDED_SHORT_EDGE &&
-	     pc->sides_2sided_short)
-      job_data->num_options = cupsAddOption(pc->sides_option,
-					    pc->sides_2sided_short,
-					    job_data->num_options,
-					    &(job_data->options));
+    for (wpos = 0; wpos < (size_t)bytes; wpos += moved)
+      if ((moved = write(outputfd, buffer + wpos, bytes - wpos)) < 0)
+      {
+	if (errno != EINTR)
+	{
+	  err    = errno;
+	  status = 1;
+	  goto done;
+	}
+	moved = 0;
+      }
   }
 
-  //
-  // Add vendor-specific PPD options
-  //
+  pfd.fd     = inputfd;
+  pfd.events = POLLIN;
 
-  for (i = 0;
-       i < (extension->installable_options ?
-	    driver_data.num_vendor - 1 :
-	    driver_data.num_vendor);
-       i ++)
+  for (;;)
   {
-    if ((param = strchr(extension->vendor_ppd_options[i], ':')) == NULL) {
-      papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding option: %s",
-		  extension->vendor_ppd_options[i]);
-      coption = NULL;
-      num_cparams = 0;
-      k = 0;
-    }
-    else
+    // Check for cancellation at least every second, also while the
+    // filters before are busy
+    if (data->iscanceledfunc &&
+	(data->iscanceledfunc)(data->iscanceleddata))
     {
-      param ++;
-      papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "  Custom parameter: %s", param);
-    }
-    if ((attr = papplJobGetAttribute(job, driver_data.vendor[i])) == NULL ||
-	ippGetString(attr, 0, NULL) == NULL)
-    {
-      snprintf(buf, sizeof(buf), "%s-default", driver_data.vendor[i]);
-      attr = ippFindAttribute(driver_attrs, buf, IPP_TAG_ZERO);
+      if (log)
+	log(ld, FILTER_LOGLEVEL_DEBUG, "Caching: Canceled");
+      status = 1;
+      break;
     }
+    if ((bytes = poll(&pfd, 1, 1000)) == 0 || (bytes < 0 && errno == EINTR))
+      continue;
 
-    choicestr = NULL;
-    if (attr)
+    if (use_tee && job_data->cache_bytes >= 0)
     {
-      val = NULL;
-      if (ippGetValueTag(attr) == IPP_TAG_BOOLEAN)
-	val = ippGetBoolean(attr, 0) ? "True" : "False";
-      else if (ippGetValueTag(attr) == IPP_TAG_INTEGER)
-	intval = ippGetInteger(attr, 0);
-      else
-	val = ippGetString(attr, 0, NULL);
-      if (param)
+      if ((bytes = tee(inputfd, outputfd, PS_SPLICE_SIZE, 0)) < 0)
       {
-	if (!option || !coption || num_cparams <= 0 || k >= num_cparams)
+	if (errno == EINTR)
 	  continue;
-	if (num_cparams == 1)
+	else if (errno == EINVAL)
 	{
-	  if (ippGetValueTag(attr) == IPP_TAG_INTEGER)
-	    snprintf(paramstr, sizeof(paramstr) - 1, "Custom.%d", intval);
-	  else
-	    snprintf(paramstr, sizeof(paramstr) - 1, "Custom.%s", val);
+	  // Not both pipes
+	  use_tee = false;
+	  continue;
 	}
+	err    = errno;
+	status = 1;
+	break;
+      }
+      else if (bytes == 0)
+	break;
+
+      // Move the duplicated data from the input into the file, after an
+      // error on the file read and drop it
+      for (pos = 0; pos < (size_t)bytes; pos += moved)
+      {
+	if (job_data->cache_bytes >= 0 &&
+	    (moved = splice(inputfd, NULL, job_data->cache_fd, NULL,
+			    bytes - pos, SPLICE_F_MOVE)) > 0)
+	  job_data->cache_bytes += moved;
+	else if (job_data->cache_bytes >= 0 && moved < 0 && errno == EINTR)
+	  moved = 0;
 	else
 	{
-	  if (k == 0)
+	  if (job_data->cache_bytes >= 0)
 	  {
-	    paramstr[0] = '{';
-	    paramstr[1] = '\0';
+	    if (log)
+	      log(ld, FILTER_LOGLEVEL_WARN,
+		  "Caching: Unable to write conversion cache file: %s",
+		  strerror(errno));
+	    job_data->cache_bytes = -1;
+	  }
+	  if ((moved = read(inputfd, buffer,
+			    bytes - pos < sizeof(buffer) ?
+			    bytes - pos : sizeof(buffer))) < 0 &&
+	      errno == EINTR)
+	    moved = 0;
+	  else if (moved <= 0)
+	  {
+	    err    = moved < 0 ? errno : EIO;
+	    status = 1;
+	    goto done;
 	  }
-	  if (ippGetValueTag(attr) == IPP_TAG_INTEGER)
-	    snprintf(paramstr + strlen(paramstr),
-		     sizeof(paramstr) - strlen(paramstr) - 1,
-		     "%s=%d ", param, intval);
-	  else
-	    snprintf(paramstr + strlen(paramstr),
-		     sizeof(paramstr) - strlen(paramstr) - 1,
-		     "%s=%s ", param, val);
-	  if (k == num_cparams - 1)
-	    paramstr[strlen(paramstr) - 1] = '}';
 	}
-	if (k == num_cparams - 1)
-	  job_data->num_options =
-	    cupsAddOption(option->keyword, paramstr, job_data->num_options,
-			  &(job_data->options));
-	k ++;
       }
-      else
+      ps_cache_progress(job_data);
+    }
+    else
+    {
+      if ((bytes = read(inputfd, buffer, sizeof(buffer))) < 0)
       {
-	option = ppdFindOption(job_data->ppd, extension->vendor_ppd_options[i]);
-	if (option == NULL)
-        {
-	  // Should never happen
-	  papplLogJob(job, PAPPL_LOGLEVEL_ERROR,
-		      "  PPD Option not correctly registered (bug), "
-		      "skipping ...");
-	  continue;
-	}
-	if (val == NULL)
-        {
-	  // Should never happen
-	  papplLogJob(job, PAPPL_LOGLEVEL_ERROR,
-		      "  PPD option not enumerated choice or boolean, "
-		      "skipping ...");
+	if (errno == EINTR)
 	  continue;
+	err    = errno;
+	status = 1;
+	break;
+      }
+      else if (bytes == 0)
+	break;
+
+      for (pos = 0; pos < (size_t)bytes; pos += moved)
+	if ((moved = write(outputfd, buffer + pos, bytes - pos)) < 0)
+	{
+	  if (errno != EINTR)
+	  {
+	    err    = errno;
+	    status = 1;
+	    goto done;
+	  }
+	  moved = 0;
 	}
-	for (j = 0;
-	     j < (ippGetValueTag(attr) == IPP_TAG_BOOLEAN ?
-		  2 : option->num_choices);
-	     j ++)
-        {
-	  ppdPwgUnppdizeName(option->choices[j].text, buf, sizeof(buf), NULL);
-	  if (!strcasecmp(buf, val))
+
+      for (pos = 0; job_data->cache_bytes >= 0 && pos < (size_t)bytes;
+	   pos += moved)
+	if ((moved = write(job_data->cache_fd, buffer + pos,
+			   bytes - pos)) < 0)
+	{
+	  if (errno != EINTR)
 	  {
-	    choicestr = option->choices[j].choice;
-	    break;
+	    if (log)
+	      log(ld, FILTER_LOGLEVEL_WARN,
+		  "Caching: Unable to write conversion cache file: %s",
+		  strerror(errno));
+	    job_data->cache_bytes = -1;
 	  }
+	  moved = 0;
 	}
-	if (choicestr != NULL &&
-	    !ppdInstallableConflict(job_data->ppd,
-				    extension->vendor_ppd_options[i],
-				    choicestr) &&
-	    (strcasecmp(choicestr, "Custom") ||
-	     (coption =
-	      ppdFindCustomOption(job_data->ppd, option->keyword)) == NULL ||
-	     (num_cparams = cupsArrayCount(coption->params)) <= 0))
-	    job_data->num_options =
-	      cupsAddOption(option->keyword, choicestr, job_data->num_options,
-			    &(job_data->options));
-      }
+      if (job_data->cache_bytes >= 0)
+	job_data->cache_bytes += bytes;
+      ps_cache_progress(job_data);
     }
   }
 
-  // Collate (will only be used with PDF or PostScript input)
-  if ((attr =
-       papplJobGetAttribute(job,
-			    "multiple-document-handling")) != NULL)
+ done:
+  if (err && log)
+    log(ld, FILTER_LOGLEVEL_ERROR, "Caching: Unable to pass on data: %s",
+	strerror(err));
+
+  close(inputfd);
+  close(outputfd);
+
+  return (status);
+}
+
+
+//
+// 'ps_cache_finish()' - Complete the conversion cache file of a job with
+//                       its header and put it in place under its key if
+//                       the data got written completely, otherwise remove
+//                       it. Then shrink the cache to its size limit. The
+//                       jobs following a shared conversion get told about
+//                       its end, a job following one gets the impressions
+//                       of it.
+//
+
+static void
+ps_cache_finish(pappl_job_t   *job,	// I - Job
+		ps_job_data_t *job_data,// I - Job data
+		bool          success)	// I - Data converted completely?
+{
+  ps_cache_header_t header;		// Header of the cache file
+  ps_cache_fanout_t *fanout = job_data->fanout,
+					// Shared conversion
+		**prev;			// Pointer to it in the list
+  char		filename[1024];		// Cache file
+  bool		complete,		// Data complete?
+		stored = false;		// Cache file in place?
+  int		impressions = -1,	// Impressions of the shared conversion
+		removed;		// Files removed from the cache
+
+
+  if (job_data->cache_fd < 0 && !fanout)
+    return;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, PS_CACHE_MAGIC, sizeof(header.magic));
+  header.impressions = papplJobGetImpressionsCompleted(job);
+  header.size        = job_data->cache_bytes;
+
+  complete = success && job_data->cache_fd >= 0 &&
+	     job_data->cache_bytes > 0;
+  if (job_data->cache_fd >= 0)
   {
-    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding option: Collate");
-    val = ippGetString(attr, 0, NULL);
-    if (strstr(val, "uncollate"))
-      choicestr = "False";
-    else if (strstr(val, "collate"))
-      choicestr = "True";
-    job_data->num_options = cupsAddOption("Collate", choicestr,
-					  job_data->num_options,
-					  &(job_data->options));
+    // With the cache off the file only served the jobs sharing the
+    // conversion
+    stored = complete && cache_size > 0 &&
+	     pwrite(job_data->cache_fd, &header, sizeof(header), 0) ==
+	     sizeof(header);
+    if (close(job_data->cache_fd))
+      stored = false;
+    job_data->cache_fd = -1;
   }
 
-  // Mark options in the PPD file
-  ppdMarkOptions(job_data->ppd, job_data->num_options, job_data->options);
-
-  // Job attributes not handled by the PPD options which could be used by
-  // some CUPS filters or filter functions
-  for (i = 0; extra_attributes[i]; i ++)
-    if ((attr = papplJobGetAttribute(job, extra_attributes[i])) != NULL &&
-	(val = ippGetString(attr, 0, NULL)) != NULL)
-      job_data->num_options = cupsAddOption(extra_attributes[i], val,
-					    job_data->num_options,
-					    &(job_data->options));
+  snprintf(filename, sizeof(filename), "%s/%s" PS_CACHE_EXT, cache_dir,
+	   job_data->cache_key);
 
-  // Add options with time of creation and time of processing of the job
-  if ((t = papplJobGetTimeCreated(job)) > 0)
+  // Put the file in place and drop the shared conversion from the list in
+  // one go, so that jobs coming later find either of them
+  pthread_mutex_lock(&cache_mutex);
+  if (job_data->cache_temp[0] &&
+      (!stored || rename(job_data->cache_temp, filename)))
   {
-    snprintf(buf, sizeof(buf) - 1, "%ld", t);
-    job_data->num_options = cupsAddOption("time-at-creation", buf,
-					  job_data->num_options,
-					  &(job_data->options));
+    unlink(job_data->cache_temp);
+    stored = false;
   }
-  if ((t = papplJobGetTimeProcessed(job)) > 0)
+  job_data->cache_temp[0] = '\0';
+  if (fanout)
   {
-    snprintf(buf, sizeof(buf) - 1, "%ld", t);
-    job_data->num_options = cupsAddOption("time-at-processing", buf,
-					  job_data->num_options,
-					  &(job_data->options));
+    if (fanout->job_id == papplJobGetID(job))
+    {
+      fanout->impressions = header.impressions;
+      fanout->state       = complete ? PS_CACHE_FANOUT_DONE :
+					 PS_CACHE_FANOUT_FAILED;
+      for (prev = &cache_fanouts; *prev; prev = &((*prev)->next))
+	if (*prev == fanout)
+	{
+	  *prev = fanout->next;
+	  break;
+	}
+      pthread_cond_broadcast(&(fanout->cond));
+    }
+    else if (success && fanout->state == PS_CACHE_FANOUT_DONE)
+      impressions = fanout->impressions;
+    if (-- fanout->users == 0)
+    {
+      pthread_cond_destroy(&(fanout->cond));
+      free(fanout);
+    }
+    job_data->fanout = NULL;
   }
+  pthread_mutex_unlock(&cache_mutex);
 
-  // Log the option settings which will get used
-  snprintf(buf, sizeof(buf) - 1, "PPD options to be used:");
-  for (i = job_data->num_options, opt = job_data->options; i > 0; i --, opt ++)
-    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf) - 1,
-	     " %s=%s", opt->name, opt->value);
-  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "%s", buf);
-
-  // Clean up
-  ippDelete(driver_attrs);
-
-  // Prepare job data to be supplied to filter functions/CUPS filters
-  // called during job execution
-  filter_data = (filter_data_t *)calloc(1, sizeof(filter_data_t));
-  job_data->filter_data = filter_data;
-  filter_data->printer = strdup(papplPrinterGetName(printer));
-  filter_data->job_id = papplJobGetID(job);
-  filter_data->job_user = strdup(papplJobGetUsername(job));
-  filter_data->job_title = strdup(papplJobGetName(job));
-  filter_data->copies = job_options->copies;
-  filter_data->job_attrs = NULL;     // We use PPD/filter options
-  filter_data->printer_attrs = NULL; // We use the printer's PPD file
-  filter_data->num_options = job_data->num_options;
-  filter_data->options = job_data->options; // PPD/filter options
-  filter_data->ppdfile = job_data->temp_ppd_name;
-  filter_data->ppd = job_data->ppd;
-  filter_data->logfunc = ps_job_log; // Job log function catching page counts
-                                    // ("PAGE: XX YY" messages)
-  filter_data->logdata = job;
-  filter_data->iscanceledfunc = ps_job_is_canceled; // Function to indicate
-                                                   // whether the job got
-                                                   // canceled
-  filter_data->iscanceleddata = job;
+  if (impressions >= 0)
+    papplJobSetImpressionsCompleted(job, impressions);
+  if (!stored)
+    return;
 
-  return (job_data);
+  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+	      "Stored %ld bytes of printer-ready data in the conversion cache",
+	      (long)header.size);
+  if ((removed = ps_cache_trim(cache_size, NULL, NULL)) > 0)
+    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+		"Removed %d least recently used files from the conversion "
+		"cache", removed);
 }
 
 
 //
-// 'ps_driver_delete()' - Free dynamic data structures of the driver when
-//                        removing a printer.
+// 'ps_cache_follow_filter_function()' - Pass on the printer-ready data of
+//                                       a conversion cache file, preceded
+//                                       by the JCL job header of the job.
+//                                       The file of a conversion shared
+//                                       with other jobs gets read while
+//                                       the conversion writes it. Each job
+//                                       reads at the pace of its own
+//                                       printer, the data not yet sent
+//                                       stays in the file. If the
+//                                       conversion fails before anything
+//                                       got sent, the job gets converted
+//                                       on its own.
 //
 
-static void
-ps_driver_delete(
-    pappl_printer_t *printer,              // I - Printer to be removed
-    pappl_pr_driver_data_t *driver_data)   // I - Printer's driver data
+static int				// O - Error status
+ps_cache_follow_filter_function(
+    int           inputfd,		// I - File descriptor of the cache file
+    int           outputfd,		// I - File descriptor output stream
+    int           inputseekable,	// I - Is input stream seekable?
+					//     (unused)
+    filter_data_t *data,		// I - Job and printer data
+    void          *parameters)		// I - Job data
 {
-  int               i;
-  ps_driver_extension_t *extension;
-
+  ps_job_data_t	*job_data = (ps_job_data_t *)parameters;
+					// Job data
+  ps_cache_fanout_t *fanout = job_data->fanout;
+					// Shared conversion, `NULL` if the
+					// file is complete
+  ps_cache_fanout_state_t state;	// State of it
+  filter_logfunc_t log = data->logfunc;	// Log function
+  void		*ld = data->logdata;	// Log function data
+  const char	*name = fanout ? "Sharing" : "Cache";
+					// Name in log messages
+  char		buffer[65536];		// Read/write buffer
+  off_t		sent = 0,		// Bytes passed on
+		avail,			// Bytes available in the file
+		total = 0;		// Bytes in a complete file
+  ssize_t	bytes,			// Bytes moved or read
+		written;		// Bytes written
+  size_t	pos;			// Position in buffer
+  struct stat	st;			// Cache file information
+  struct timespec timeout;		// Timeout for waiting
+  bool		use_splice = true;	// Use splice()?
+  int		status = 0,		// Exit status
+		err = 0;		// Error on reading or writing
 
-  if (printer)
-    papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-		    "Freeing memory from driver data");
 
-  extension = (ps_driver_extension_t *)driver_data->extension;
+  (void)inputseekable;
 
-  // PPD file
-  ppdClose(extension->ppd);
+  if (!fanout && !fstat(inputfd, &st))
+    total = st.st_size - (off_t)sizeof(ps_cache_header_t);
 
-  // Media source
-  for (i = 0; i < driver_data->num_source; i ++)
-    if (driver_data->source[i])
-      free((char *)(driver_data->source[i]));
+  for (;;)
+  {
+    // Wait for more data
+    if (fanout)
+    {
+      pthread_mutex_lock(&cache_mutex);
+      if (fanout->bytes == sent && fanout->state == PS_CACHE_FANOUT_RUNNING)
+      {
+	clock_gettime(CLOCK_REALTIME, &timeout);
+	timeout.tv_sec += PS_CACHE_FANOUT_WAIT;
+	pthread_cond_timedwait(&(fanout->cond), &cache_mutex, &timeout);
+      }
+      avail = fanout->bytes - sent;
+      state = fanout->state;
+      pthread_mutex_unlock(&cache_mutex);
+    }
+    else
+    {
+      avail = total - sent;
+      state = PS_CACHE_FANOUT_DONE;
+    }
 
-  // Media type
-  for (i = 0; i < driver_data->num_type; i ++)
-    if (driver_data->type[i])
-      free((char *)(driver_data->type[i]));
+    if (state == PS_CACHE_FANOUT_FAILED)
+    {
+      if (sent == 0)
+      {
+	job_data->cache_fallback = true;
+	if (log)
+	  log(ld, FILTER_LOGLEVEL_INFO,
+	      "Sharing: Conversion started by job %d failed, converting on "
+	      "our own", fanout->job_id);
+      }
+      else if (log)
+	log(ld, FILTER_LOGLEVEL_ERROR,
+	    "Sharing: Conversion started by job %d failed after %ld bytes",
+	    fanout->job_id, (long)sent);
+      status = 1;
+      break;
+    }
+    else if (data->iscanceledfunc &&
+	     (data->iscanceledfunc)(data->iscanceleddata))
+    {
+      status = 1;
+      break;
+    }
+    else if (avail <= 0)
+    {
+      if (state == PS_CACHE_FANOUT_DONE)
+	break;
+      continue;
+    }
 
-  // Media size
-  for (i = 0; i < driver_data->num_media; i ++)
-    if (driver_data->media[i])
-      free((char *)(driver_data->media[i]));
+    // The JCL job header of this job goes first, only when there is data,
+    // so that nothing got sent if this job has to convert on its own
+    if (sent == 0)
+    {
+      for (pos = 0; pos < job_data->cache_jcl_size; pos += written)
+	if ((written = write(outputfd, job_data->cache_jcl + pos,
+			     job_data->cache_jcl_size - pos)) < 0)
+	{
+	  if (errno != EINTR)
+	  {
+	    err    = errno;
+	    status = 1;
+	    goto done;
+	  }
+	  written = 0;
+	}
+    }
 
-  // Output bins
-  for (i = 0; i < driver_data->num_bin; i ++)
-    if (driver_data->bin[i])
-      free((char *)(driver_data->bin[i]));
+    // Pass on what is there, splice() moves it from the page cache into
+    // the pipe without copying it
+    while (avail > 0)
+    {
+      if (use_splice)
+      {
+	if ((bytes = splice(inputfd, NULL, outputfd, NULL,
+			    avail < PS_SPLICE_SIZE ? avail : PS_SPLICE_SIZE,
+			    SPLICE_F_MOVE)) < 0 && errno == EINVAL)
+	{
+	  // Output is not a pipe
+	  use_splice = false;
+	  continue;
+	}
+      }
+      else if ((bytes = read(inputfd, buffer,
+			     avail < (off_t)sizeof(buffer) ?
+			     (size_t)avail : sizeof(buffer))) > 0)
+      {
+	for (pos = 0; pos < (size_t)bytes; pos += written)
+	  if ((written = write(outputfd, buffer + pos, bytes - pos)) < 0)
+	  {
+	    if (errno != EINTR)
+	    {
+	      err    = errno;
+	      status = 1;
+	      goto done;
+	    }
+	    written = 0;
+	  }
+      }
 
-  // Vendor options
-  for (i = 0; i < driver_data->num_vendor; i ++)
-  {
-    if (driver_data->vendor[i])
-      free((char *)(driver_data->vendor[i]));
-    if (extension->vendor_ppd_options[i])
-      free((char *)(extension->vendor_ppd_options[i]));
+      if (bytes < 0 && errno == EINTR)
+	continue;
+      else if (bytes <= 0)
+      {
+	// Error or cache file shorter than announced
+	err    = bytes < 0 ? errno : EIO;
+	status = 1;
+	goto done;
+      }
+      sent  += bytes;
+      avail -= bytes;
+    }
   }
 
-  // Extension
-  if (extension->cups_filter_ps)
+ done:
+  if (err && log)
+    log(ld, FILTER_LOGLEVEL_ERROR, "%s: Unable to pass on data: %s", name,
+	strerror(err));
+
+  // The conversion goes on only while some job reads its data
+  if (fanout)
   {
-    free(extension->cups_filter_ps);
-    if (extension->temp_ppd_name)
-    {
-      unlink(extension->temp_ppd_name);
-      free(extension->temp_ppd_name);
-    }
+    pthread_mutex_lock(&cache_mutex);
+    fanout->readers --;
+    pthread_mutex_unlock(&cache_mutex);
   }
-  free(extension);
+
+  close(inputfd);
+  close(outputfd);
+
+  return (status);
 }
 
 
 //
-// 'ps_cups_filter_path()' - Check whether a CUPS filter is present
-//                           and if so return its absolute path,
-//                           otherwise NULL
+// 'ps_cache_key()' - Compute the conversion cache key of a job, SHA-256
+//                    of: SHA-256 of the input file, driver name,
+//                    SHA-256 of the PPD file, user, title, copies, PDF
+//                    sent natively, the raster output settings of the
+//                    Printer Application (transport, compressors, Flate
+//                    level, JPEG quality), the job's options in
+//                    alphabetical order, and the marked choices of all
+//                    PPD options, which include the defaults and the
+//                    installable accessories. User and title are part of
+//                    the key as DSC comments contain them. The JCL job
+//                    header, which also contains the job ID, does not go
+//                    into the cache, it gets created here for each job.
 //
 
-static char *                           // O - Executable path of filter,
-                                        //     NULL if filter not found or
-                                        //     not executable
-ps_cups_filter_path(const char *filter) // I - CUPS filter name 
+static bool				// O - `true` if the job has a key
+ps_cache_key(pappl_job_t   *job,	// I - Job
+	     ps_job_data_t *job_data,	// I - Job data
+	     int           fd)		// I - Input file
 {
-  char		*filter_path;      /* Path to filter executable */
+  ppd_file_t	*ppd = job_data->ppd;	// PPD file with marked options
+  pappl_pr_driver_data_t driver_data;	// Printer driver data
+  ps_driver_extension_t *extension;	// Driver data extension
+  ppd_option_t	*option;		// Current PPD option
+  ppd_choice_t	*choice;		// Marked choice
+  cups_option_t	*opt;			// Current job option
+  cups_array_t	*options;		// Job options, sorted
+  struct stat	st;			// Input file information
+  void		*data;			// Input file mapped into memory
+  unsigned char	hash[64];		// SHA-256 hash
+  ssize_t	hashlen;		// Length of hash
+  char		hashstr[129],		// Hash as hexadecimal string
+		buf[2048],		// Option as "name=value"
+		*text = NULL,		// Text of the key
+		*ptr;			// Current option text
+  size_t	textsize = 0;		// Size of it
+  FILE		*fp;			// Stream for text
+  int		i, j;			// Looping vars
+  static const char * const job_specific[] =
+  {					// Options which differ for each job
+    "job-uuid",
+    "time-at-creation",
+    "time-at-processing",
+    NULL
+  };
 
-  if (!filter || !filter[0] || !filter_dir[0])
-    return (NULL);
 
-  if (filter[0] == '/')
+  job_data->cache_key[0] = '\0';
+
+  papplPrinterGetDriverData(papplJobGetPrinter(job), &driver_data);
+  extension = (ps_driver_extension_t *)driver_data.extension;
+  if (!extension->ppd_hash[0])
+    return (false);
+
+  // Hash of the input file
+  if (fstat(fd, &st) || st.st_size == 0 ||
+      (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+      MAP_FAILED)
+    return (false);
+  hashlen = cupsHashData("sha2-256", data, st.st_size, hash, sizeof(hash));
+  munmap(data, st.st_size);
+  if (hashlen < 0 || (fp = open_memstream(&text, &textsize)) == NULL)
+    return (false);
+
+  fprintf(fp, "%s\n%s\n%s\n%s\n%s\n%d\n%d\n%d\n%u\n%d\n%d\n",
+	  cupsHashString(hash, hashlen, hashstr, sizeof(hashstr)),
+	  papplPrinterGetDriverName(papplJobGetPrinter(job)),
+	  extension->ppd_hash,
+	  job_data->filter_data->job_user, job_data->filter_data->job_title,
+	  job_data->filter_data->copies, job_data->pdf_native ? 1 : 0,
+	  (int)job_data->transport.mode, job_data->codecs,
+	  job_data->encoder.flate_level, job_data->encoder.jpeg_quality);
+
+  // Options of the job in alphabetical order
+  options = cupsArrayNew3((cups_array_func_t)strcmp, NULL, NULL, 0, NULL,
+			  (cups_afree_func_t)free);
+  for (i = job_data->num_options, opt = job_data->options; i > 0;
+       i --, opt ++)
   {
-    if ((filter_path = (char *)calloc(strlen(filter) + 1,
-				      sizeof(char))) == NULL)
-      return (NULL);
-    snprintf(filter_path, (strlen(filter) + 1) * sizeof(char), "%s", filter);
-  }
-  else
-  {
-    if ((filter_path = (char *)calloc(strlen(filter_dir) + strlen(filter) + 2,
-				    sizeof(char))) == NULL)
-      return (NULL);
-    snprintf(filter_path, (strlen(filter_dir) + strlen(filter) + 2) *
-	     sizeof(filter_path), "%s/%s", filter_dir, filter);
+    for (j = 0; job_specific[j] && strcmp(opt->name, job_specific[j]); j ++);
+    if (!job_specific[j])
+    {
+      snprintf(buf, sizeof(buf), "%s=%s", opt->name, opt->value);
+      cupsArrayAdd(options, strdup(buf));
+    }
   }
+  for (ptr = (char *)cupsArrayFirst(options); ptr;
+       ptr = (char *)cupsArrayNext(options))
+    fprintf(fp, "%s\n", ptr);
+  cupsArrayDelete(options);
+
+  // Marked choices of all PPD options
+  for (option = ppdFirstOption(ppd); option; option = ppdNextOption(ppd))
+    if ((choice = ppdFindMarkedChoice(ppd, option->keyword)) != NULL)
+      fprintf(fp, "*%s=%s\n", option->keyword, choice->choice);
+
+  fclose(fp);
+  hashlen = cupsHashData("sha2-256", text, textsize, hash, sizeof(hash));
+  free(text);
+  if (hashlen < 0)
+    return (false);
 
-  if (access(filter_path, X_OK) == 0)
-    return (filter_path);
+  // JCL job header of the job, the same as the filter functions emit
+  free(job_data->cache_jcl);
+  job_data->cache_jcl      = NULL;
+  job_data->cache_jcl_size = 0;
+  if ((fp = open_memstream(&job_data->cache_jcl,
+			   &job_data->cache_jcl_size)) == NULL)
+    return (false);
+  ppdEmitJCL(ppd, fp, job_data->filter_data->job_id,
+	     job_data->filter_data->job_user,
+	     job_data->filter_data->job_title ?
+	     job_data->filter_data->job_title : "Unknown");
+  fclose(fp);
 
-  free(filter_path);
-  return (NULL);
+  cupsHashString(hash, hashlen, job_data->cache_key,
+		 sizeof(job_data->cache_key));
+
+  return (true);
 }
 
 
 //
-// 'ps_ppd_find_cups_filter()' - Check the strings of the
-//                               "*cupsFilter(2):" lines in a PPD file
-//                               whether there is a suitable filter
-//                               applying to a given input
-//                               format. Return the path to call the
-//                               filter or NULL if there is no
-//                               suitable one.
+// 'ps_cache_open()' - Look up the printer-ready data of a job in the
+//                     conversion cache. A hit marks the file as recently
+//                     used, for the LRU eviction. If another job does the
+//                     same conversion right now, this job follows it and
+//                     gets its cache file while it is written, otherwise
+//                     jobs with the same key arriving during the
+//                     conversion of this job will follow this one.
 //
 
-static char *                           // O - Executable path of filter,
-                                        //     NULL if filter not found or
-                                        //     not executable
-ps_ppd_find_cups_filter(const char *input_format, // I - Input data format
-			int num_filters,          // I - Number of filter
-			                          //     entries in PPD
-			char **filters)           // I - Pointer to PPD's
-                                                  //     filter list entries
+static int				// O - File descriptor, positioned at
+					//     the data, or -1 if not cached
+ps_cache_open(pappl_job_t   *job,	// I - Job
+	      ps_job_data_t *job_data,	// I - Job data with cache key
+	      int           *impressions)
+					// O - Impressions of the job
 {
-  int i,
-      cost,
-      lowest_cost = 9999999;
-  char *filter_str,
-       *filter_name,
-       *filter_cost,
-       *filter_path = NULL,
-       *filter_selected = NULL;
-
-  for (i = 0, filter_str = *filters; i < num_filters; i++, filter_str ++)
+  ps_cache_header_t header;		// Header of the cache file
+  ps_cache_fanout_t *fanout;		// Shared conversion
+  char		filename[1024];		// Cache file
+  struct stat	st;			// Cache file information
+  struct timespec timeout;		// Timeout for waiting
+  int		fd;			// File descriptor
+  unsigned long	hits,			// Jobs printed from the cache
+		misses,			// Jobs not found in the cache
+		shared;			// Jobs following another job
+
+
+  snprintf(filename, sizeof(filename), "%s/%s" PS_CACHE_EXT, cache_dir,
+	   job_data->cache_key);
+
+  pthread_mutex_lock(&cache_mutex);
+  for (;;)
   {
-    // First word of the filter entry string is the input format of the filter
-    if (strncmp(filter_str, input_format, strlen(input_format)) == 0 &&
-	isspace(filter_str[strlen(input_format)]))
+    // With the cache off only conversions running right now get shared
+    if (cache_size == 0)
+      fd = -1;
+    else if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) >= 0 &&
+	     (fstat(fd, &st) ||
+	      read(fd, &header, sizeof(header)) != sizeof(header) ||
+	      memcmp(header.magic, PS_CACHE_MAGIC, sizeof(header.magic)) ||
+	      header.size != st.st_size - (off_t)sizeof(header)))
     {
-      // This filter takes the desired input data format
-
-      // The name of the filter executable is the last word
-      filter_name = filter_str + strlen(filter_str) - 1;
-      while (!isspace(*filter_name) && filter_name > filter_str)
-	filter_name --;
-      if (filter_name == filter_str)
-	continue;
-
-      // The cost value of the filter is the second last word
-      filter_cost = filter_name;
-      filter_name ++;
-      while (isspace(*filter_cost) && filter_cost > filter_str)
-	filter_cost --;
-      while (!isspace(*filter_cost) && filter_cost > filter_str)
-	filter_cost --;
-      if (filter_cost == filter_str)
-	continue;
-      filter_cost ++;
-      if (!isdigit(*filter_cost))
-	continue;
-      cost = atoi(filter_cost);
+      // Broken file
+      close(fd);
+      unlink(filename);
+      fd = -1;
+    }
+    if (fd >= 0)
+    {
+      futimens(fd, NULL);
+      cache_hits ++;
+      break;
+    }
 
-      // Is the filter installed?
-      if (strcmp(filter_name, "-") == 0 ||
-	  (filter_path = ps_cups_filter_path(filter_name)) == NULL)
-	continue;
+    // Not in the cache, is the same conversion running?
+    for (fanout = cache_fanouts;
+	 fanout && strcmp(fanout->key, job_data->cache_key);
+	 fanout = fanout->next);
 
-      // If there is more than one suitable filter entry, take the one with
-      // the lowest cost value
-      if (cost < lowest_cost)
+    if (!fanout)
+    {
+      // No, this job converts and others can follow
+      if ((fanout = (ps_cache_fanout_t *)calloc(1, sizeof(ps_cache_fanout_t)))
+	  != NULL)
       {
-	if (filter_selected)
-	  free(filter_selected);
-	filter_selected = filter_path;
-	lowest_cost = cost;
-	if (cost == 0)
-	  break;
+	memcpy(fanout->key, job_data->cache_key, sizeof(fanout->key));
+	fanout->job_id = papplJobGetID(job);
+	fanout->state  = PS_CACHE_FANOUT_PENDING;
+	fanout->users  = 1;
+	pthread_cond_init(&(fanout->cond), NULL);
+	fanout->next   = cache_fanouts;
+	cache_fanouts  = fanout;
+	job_data->fanout = fanout;
       }
-      else
-	free(filter_path);
+      cache_misses ++;
+      break;
+    }
+    else if (fanout->state == PS_CACHE_FANOUT_PENDING)
+    {
+      // Wait until the other job creates its cache file, or gives up, in
+      // which case this job looks again
+      fanout->users ++;
+      clock_gettime(CLOCK_REALTIME, &timeout);
+      timeout.tv_sec += PS_CACHE_FANOUT_WAIT;
+      pthread_cond_timedwait(&(fanout->cond), &cache_mutex, &timeout);
+      if (-- fanout->users == 0)
+      {
+	pthread_cond_destroy(&(fanout->cond));
+	free(fanout);
+      }
+      if (papplJobIsCanceled(job))
+      {
+	cache_misses ++;
+	break;
+      }
+    }
+    else if ((fd = open(fanout->filename, O_RDONLY | O_CLOEXEC)) >= 0 &&
+	     lseek(fd, sizeof(header), SEEK_SET) >= 0)
+    {
+      fanout->users ++;
+      fanout->readers ++;
+      job_data->fanout = fanout;
+      cache_shared ++;
+      break;
+    }
+    else
+    {
+      if (fd >= 0)
+	close(fd);
+      fd = -1;
+      cache_misses ++;
+      break;
     }
   }
+  hits   = cache_hits;
+  misses = cache_misses;
+  shared = cache_shared;
+  pthread_mutex_unlock(&cache_mutex);
 
-  return (filter_selected);
+  if (fd < 0)
+  {
+    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+		"Not in the conversion cache (%lu hits, %lu misses, %lu "
+		"shared)", hits, misses, shared);
+    return (-1);
+  }
+  else if (job_data->fanout)
+  {
+    papplLogJob(job, PAPPL_LOGLEVEL_INFO,
+		"Sending the printer-ready data of job %d, which converts the "
+		"same document with the same settings (%lu hits, %lu misses, "
+		"%lu shared)", job_data->fanout->job_id, hits, misses, shared);
+    return (fd);
+  }
+
+  papplLogJob(job, PAPPL_LOGLEVEL_INFO,
+	      "Printing %ld bytes of printer-ready data from the conversion "
+	      "cache (%lu hits, %lu misses, %lu shared)", (long)header.size,
+	      hits, misses, shared);
+  *impressions = header.impressions;
+
+  return (fd);
 }
 
 
 //
-// 'ps_str_has_code()' - Check a string whether it contains active PostScript
-//                       or PJL code and not only whitespace and comments
+// 'ps_cache_progress()' - Tell the jobs following the conversion of a job
+//                         how much data is in its cache file, or that
+//                         writing it failed.
 //
 
-bool
-ps_str_has_code(
-    const char *str)   // I - String to check
+static void
+ps_cache_progress(ps_job_data_t *job_data)	// I - Job data
 {
-  const char *ptr;
-  bool       incomment = false;
+  ps_cache_fanout_t *fanout = job_data->fanout;
+					// Shared conversion
 
 
-  for (ptr = str; *ptr; ptr ++)
-  {
-    if (*ptr == '%' && *(ptr + 1) == '%')  // PostScript comment up to end of
-                                           // line
-      incomment = true;
-    else if (*ptr == '\n' || *ptr == '\r') // New line
-      incomment = false;
-    else if (!incomment && !isspace(*ptr)) // Active code character
-      return (true);
-  }
-  return (false);
+  if (!fanout)
+    return;
+
+  pthread_mutex_lock(&cache_mutex);
+  if (job_data->cache_bytes < 0)
+    fanout->state = PS_CACHE_FANOUT_FAILED;
+  else
+    fanout->bytes = job_data->cache_bytes;
+  pthread_cond_broadcast(&(fanout->cond));
+  pthread_mutex_unlock(&cache_mutex);
 }
 
 
-// 'ps_option_has_code()' - Check a PPD option whether it has active
-//                          PostScript or PJL code in enough choices
-//                          for the option and all its choices making
-//                          sense.
-//                          This means that at maximum one choice can
-//                          be without code.
+//
+// 'ps_cache_share()' - Move the conversion of a job which other jobs can
+//                      share, with the copying into the cache file, onto
+//                      its own thread, and let the job send the data
+//                      from the cache file, as the jobs following it do.
+//                      So neither the printer of the job nor canceling
+//                      it holds up or fails the others. Without a thread
+//                      the job passes the data on while caching it.
 //
 
-bool
-ps_option_has_code(
-    pappl_system_t *system, // I - System (for logging)
-    ppd_file_t     *ppd,    // I - PPD file
-    ppd_option_t   *option) // I - Option to check
+static int				// O - File descriptor of the cache
+					//     file, -1 if not shared
+ps_cache_share(pappl_job_t   *job,	// I - Job
+	       ps_job_data_t *job_data,	// I - Job data, cache file started
+	       int           inputfd)	// I - Input file descriptor
 {
-  int i;
-  int codeless_choices = 0;
+  int		fd,			// File descriptor of the cache file
+		err;			// Error from pthread_create()
 
 
-  if (option->ui == PPD_UI_PICKONE || option->ui == PPD_UI_BOOLEAN)
+  if (!job_data->fanout || job_data->cache_fd < 0)
+    return (-1);
+
+  if ((fd = open(job_data->cache_temp, O_RDONLY | O_CLOEXEC)) < 0 ||
+      lseek(fd, sizeof(ps_cache_header_t), SEEK_SET) < 0)
   {
-    for (i = 0; i < option->num_choices; i ++)
-      if (!ps_str_has_code(option->choices[i].code))
-	codeless_choices ++;
-    if (codeless_choices > 1)
+    papplLogJob(job, PAPPL_LOGLEVEL_WARN,
+		"Unable to open conversion cache file '%s': %s",
+		job_data->cache_temp, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return (-1);
+  }
+
+  job_data->follow_filter =
+    (filter_filter_in_chain_t *)calloc(1, sizeof(filter_filter_in_chain_t));
+  job_data->follow_filter->function = ps_cache_follow_filter_function;
+  job_data->follow_filter->parameters = job_data;
+  job_data->follow_filter->name = "Sharing";
+
+  job_data->cache_data                = *(job_data->filter_data);
+  job_data->cache_data.iscanceledfunc = ps_cache_canceled;
+  job_data->cache_data.iscanceleddata = job_data->fanout;
+  job_data->cache_input               = inputfd;
+  job_data->cache_chain               = job_data->chain;
+  job_data->chain                     = cupsArrayNew(NULL, NULL);
+  cupsArrayAdd(job_data->chain, job_data->follow_filter);
+
+  // This job reads the data, too
+  pthread_mutex_lock(&cache_mutex);
+  job_data->fanout->readers ++;
+  pthread_mutex_unlock(&cache_mutex);
+
+  if ((err = pthread_create(&job_data->cache_thread, NULL, ps_cache_convert,
+			    job_data)) != 0)
+  {
+    papplLogJob(job, PAPPL_LOGLEVEL_WARN,
+		"Unable to create conversion thread: %s", strerror(err));
+    pthread_mutex_lock(&cache_mutex);
+    job_data->fanout->readers --;
+    pthread_mutex_unlock(&cache_mutex);
+    cupsArrayDelete(job_data->chain);
+    job_data->chain       = job_data->cache_chain;
+    job_data->cache_chain = NULL;
+    close(fd);
+    return (-1);
+  }
+
+  return (fd);
+}
+
+
+//
+// 'ps_cache_start()' - Start writing the printer-ready data of a job into
+//                      a temporary file in the cache directory, or in the
+//                      spool directory if the cache is off, after room
+//                      for the header, by adding a filter function
+//                      copying it there to the filter chain. Jobs waiting
+//                      to share the conversion can follow it from then on.
+//
+
+static bool				// O - `true` on success
+ps_cache_start(pappl_job_t   *job,	// I - Job
+	       ps_job_data_t *job_data)	// I - Job data with cache key
+{
+  snprintf(job_data->cache_temp, sizeof(job_data->cache_temp),
+	   "%s/%s.%d.tmp", cache_size > 0 ? cache_dir : spool_dir,
+	   job_data->cache_key, papplJobGetID(job));
+  if ((job_data->cache_fd = open(job_data->cache_temp,
+				 O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+				 0600)) < 0 ||
+      lseek(job_data->cache_fd, sizeof(ps_cache_header_t), SEEK_SET) < 0)
+  {
+    papplLogJob(job, PAPPL_LOGLEVEL_WARN,
+		"Unable to create conversion cache file '%s': %s",
+		job_data->cache_temp, strerror(errno));
+    if (job_data->cache_fd >= 0)
     {
-      papplLog(system, PAPPL_LOGLEVEL_WARN,
-	       "Skipping option \"%s\", the PPD file does not provide PostScript/PJL code for all its choices.",
-	       option->keyword);
-      if (ppd->num_filters)
-	papplLog(system, PAPPL_LOGLEVEL_WARN,
-		 "This option most probably needs a CUPS filter to work. Is this a PostScript PPD?");
-      else
-	papplLog(system, PAPPL_LOGLEVEL_WARN,
-		 "The PPD file is probably broken.");
-      return (false);
+      close(job_data->cache_fd);
+      job_data->cache_fd = -1;
     }
+    // Lets the jobs waiting for this conversion do their own
+    ps_cache_finish(job, job_data, false);
+    return (false);
+  }
+
+  job_data->cache_bytes = 0;
+  if (job_data->fanout)
+  {
+    pthread_mutex_lock(&cache_mutex);
+    snprintf(job_data->fanout->filename, sizeof(job_data->fanout->filename),
+	     "%s", job_data->cache_temp);
+    job_data->fanout->state = PS_CACHE_FANOUT_RUNNING;
+    pthread_cond_broadcast(&(job_data->fanout->cond));
+    pthread_mutex_unlock(&cache_mutex);
   }
+  job_data->cache_filter =
+    (filter_filter_in_chain_t *)calloc(1, sizeof(filter_filter_in_chain_t));
+  job_data->cache_filter->function = ps_cache_filter_function;
+  job_data->cache_filter->parameters = job_data;
+  job_data->cache_filter->name = "Caching";
+  cupsArrayAdd(job_data->chain, job_data->cache_filter);
+
   return (true);
 }
 
 
 //
-// 'ps_default_paper_size()' - Determine default paper size
-//                             (A4/Letter) based on the location,
-//                             Letter for US and Canada, A4 for the
-//                             rest of the world. Use the locale
-//                             environment variables ("LC_...") for
-//                             that.
+// 'ps_cache_trim()' - Remove the least recently used files from the
+//                     conversion cache until it is not bigger than the
+//                     limit, and count what remains.
 //
 
-static const char *ps_default_paper_size()
+static int				// O - Number of files removed
+ps_cache_trim(off_t limit,		// I - Size limit, -1 for only
+					//     counting
+	      int   *num_files,		// O - Files in the cache or `NULL`
+	      off_t *bytes)		// O - Bytes in the cache or `NULL`
 {
-  static char result[128];            // Resulting default paper size
-  char        *val;                   // Paper size/locale value
-  int         i;
-  const char  * const lc_env_vars[] = // Environment variables with suitable
-  {                                   // locale information
-    "LC_PAPER",
-    "LC_CTYPE",
-    "LC_ALL",
-    "LANG",
-  };
-
+  cups_dir_t	*dir;			// Cache directory
+  cups_dentry_t	*dent,			// Directory entry
+		*copy;			// Copy of it for sorting
+  cups_array_t	*files;			// Cache files, least recently used
+					// first
+  char		filename[1024];		// Cache file to remove
+  size_t	len,			// Length of file name
+		extlen = strlen(PS_CACHE_EXT);
+					// Length of extension
+  off_t		total = 0;		// Bytes in the cache
+  int		removed = 0;		// Files removed
+
+
+  pthread_mutex_lock(&cache_mutex);
+
+  files = cupsArrayNew3(ps_compare_cache_files, NULL, NULL, 0, NULL,
+			(cups_afree_func_t)free);
+  if ((dir = cupsDirOpen(cache_dir)) != NULL)
+  {
+    while ((dent = cupsDirRead(dir)) != NULL)
+      if (S_ISREG(dent->fileinfo.st_mode) &&
+	  (len = strlen(dent->filename)) > extlen &&
+	  !strcmp(dent->filename + len - extlen, PS_CACHE_EXT) &&
+	  (copy = (cups_dentry_t *)malloc(sizeof(cups_dentry_t))) != NULL)
+      {
+	*copy = *dent;
+	cupsArrayAdd(files, copy);
+	total += dent->fileinfo.st_size;
+      }
+    cupsDirClose(dir);
+  }
 
-  memset(result, 0, sizeof(result));
-  for (i = 0; i < sizeof(lc_env_vars) / sizeof(lc_env_vars[0]); i ++)
+  for (dent = (cups_dentry_t *)cupsArrayFirst(files);
+       dent && limit >= 0 && total > limit;
+       dent = (cups_dentry_t *)cupsArrayNext(files))
   {
-    if ((val = getenv(lc_env_vars[i])) == NULL)
-      continue;
-    if (!strcmp(val, "C") ||
-	!strcmp(val, "POSIX"))
-      continue;
-    if (!strcmp(val, "en") ||
-	!strncmp(val, "en.", 3) ||
-	!strncmp(val, "en_US", 5) ||
-	!strncmp(val, "en_CA", 5) ||
-	!strncmp(val, "fr_CA", 5))
-      // These are the only locales that will default to "Letter" size...
-      strcpy(result, "Letter");
-    else
-      // Rest of the world is A4
-      strcpy(result, "A4");
-    if (result[0])
-      break;
+    snprintf(filename, sizeof(filename), "%s/%s", cache_dir, dent->filename);
+    if (!unlink(filename))
+    {
+      total -= dent->fileinfo.st_size;
+      removed ++;
+    }
   }
-  return (result[0] ? result : NULL);
+
+  if (num_files)
+    *num_files = cupsArrayCount(files) - removed;
+  if (bytes)
+    *bytes = total;
+
+  cupsArrayDelete(files);
+  pthread_mutex_unlock(&cache_mutex);
+
+  return (removed);
 }
 
 
 //
-// 'ps_driver_setup()' - PostScript driver setup callback.
+// 'ps_ccitt_end()' - Finish a CCITT Group 4 encoded image with the
+//                    EOFB code, pad to a full byte and flush the output
 //
-//                       Runs in two modes: Init and Update
+
+static void
+ps_ccitt_end(ps_ccitt_t *g4)		// I - Encoder state
+{
+  // EOFB, two EOL codes
+  ps_ccitt_put_bits(g4, 0x001, 12);
+  ps_ccitt_put_bits(g4, 0x001, 12);
+
+  // Pad to full byte
+  if (g4->num_bits > 0)
+    ps_ccitt_put_bits(g4, 0, 8 - g4->num_bits);
+
+  ps_transport_write(g4->transport, g4->buffer, g4->bufused);
+  g4->bufused = 0;
+}
+
+
 //
-//                       It runs in Init mode when the
-//                       driver_data->extension is still NULL, meaning
-//                       that the extension structure is not yet
-//                       defined. This is the case when the printer
-//                       data structure is created on startup or on
-//                       adding a printer. Then we load and read the
-//                       PPD and enter the properties into the driver
-//                       data structure, not taking into account any
-//                       user defaults or accessory settings.
+// 'ps_ccitt_encode_line()' - Encode a raster line with 1 bit per pixel
+//                            in CCITT Group 4 (T.6) two-dimensional
+//                            coding, using the previous line as reference
+//                            line.
 //
-//                       When called again with the data structure
-//                       already present, it runs in Update mode,
-//                       applying user defaults and modifying the data
-//                       structure if the user changed the
-//                       configuration of installable accessories.
-//                       This mode is triggered when called by the
-//                       ps_status() callback which in turn is called
-//                       after completely loading the printer's state
-//                       file entry or when doing changes on the
-//                       "Device Settings" web interface page.
+//                            The lines are converted into lists of
+//                            changing elements (positions where the
+//                            color changes), with the line width as
+//                            terminator, the coding modes are then
+//                            determined from these lists.
 //
 
-static bool				   // O - `true` on success, `false`
-                                           //     on failure
-ps_driver_setup(
-    pappl_system_t       *system,	   // I - System
-    const char           *driver_name,     // I - Driver name
-    const char           *device_uri,	   // I - Device URI
-    const char           *device_id,	   // I - Device ID
-    pappl_pr_driver_data_t *driver_data,   // O - Driver data
-    ipp_t                **driver_attrs,   // O - Driver attributes
-    void                 *data)	           // I - Callback data
+static void
+ps_ccitt_encode_line(
+    ps_ccitt_t          *g4,		// I - Encoder state
+    const unsigned char *line)		// I - Raster line
 {
-  int          i, j, k, l, m;              // Looping variables
-  bool         update;                     // Are we updating the data
-                                           // structure and not freshly
-                                           // creating it?
-  ps_driver_extension_t *extension;
-  cups_array_t *ppd_paths = (cups_array_t *)data;
-  ps_ppd_path_t *ppd_path,
-               search_ppd_path;
-  ppd_file_t   *ppd = NULL;		   // PPD file loaded from collection
-  ppd_cache_t  *pc;
-  cups_file_t  *tempfp;
-  int          tempfd,
-               bytes;
-  char         tempfile[1024];
-  ipp_attribute_t *attr;
-  int          num_options;
-  cups_option_t *options,
-               *opt;
-  char         *keyword;
-  ipp_res_t    units;			   // Resolution units
-  const char   *def_source,
-               *def_type;
-  char         *def_bin;
-  pwg_size_t   *def_media;
-  int          def_res_x, def_res_y,
-               def_left, def_right, def_top, def_bottom;
-  ppd_group_t  *group;
-  ppd_option_t *option;
-  ppd_choice_t *choice, *def_choice;
-  ppd_attr_t   *ppd_attr;
-  pwg_map_t    *pwg_map;
-  pwg_size_t   *pwg_size;
-  ppd_pwg_finishings_t *finishings;
-  ppd_coption_t *coption;
-  ppd_cparam_t *cparam;
-  int          num_cparams;
-  pappl_media_col_t tmp_col;
-  int          count;
-  bool         pollable;
-  char         buf[1024],
-               ipp_opt[80],
-               ipp_supported[256],
-               ipp_default[256],
-               ipp_choice[80],
-               ipp_custom_opt[192],
-               ipp_param[80];
-  char         **choice_list;
-  int          default_choice,
-               first_choice;
-  const char * const pappl_handled_options[] =
-  {
-   "PageSize",
-   "PageRegion",
-   "InputSlot",
-   "MediaType",
-   "Resolution",
-   "ColorModel",
-   "OutputBin",
-   "Duplex",
-   NULL
-  };
-
-
-  if (!driver_data || !driver_attrs)
+  int           width = g4->width;      // Width of line
+  int           *ref = g4->ref,         // Changing elements of reference
+                *cur = g4->cur,         // Changing elements of coding line
+                *tmp;
+  int           x,                      // Current pixel
+                n,                      // Number of changing elements
+                color,                  // Current color (1 = black)
+                a0, a1, a2, b1, b2,     // Changing elements as in T.4/T.6
+                ai, bi, bidx;           // Indexes into the element lists
+  unsigned char byte,                   // Bits differing from current color
+                bit;                    // Current bit
+
+
+  // Find the changing elements of the coding line, whole bytes of the
+  // current color are skipped
+  for (x = 0, n = 0, color = 0; x < width;)
   {
-    papplLog(system, PAPPL_LOGLEVEL_ERROR,
-	     "Driver callback called without required information.");
-    return (false);
+    byte = (line[x >> 3] ^ g4->invert ^ (color ? 0xff : 0x00)) &
+	   (0xff >> (x & 7));
+    while (!byte)
+    {
+      x = (x | 7) + 1;
+      if (x >= width)
+	break;
+      byte = line[x >> 3] ^ g4->invert ^ (color ? 0xff : 0x00);
+    }
+    if (x >= width)
+      break;
+    for (bit = 0x80 >> (x & 7); !(byte & bit); bit >>= 1)
+      x ++;
+    if (x >= width)
+      break;
+    cur[n ++] = x;
+    color = !color;
   }
+  cur[n] = cur[n + 1] = cur[n + 2] = cur[n + 3] = width;
 
-  if (driver_data->extension == NULL)
+  // Encode the line. Element i of a list changes to black for even i
+  // and to white for odd i, as each line starts with an imaginary white
+  // pixel.
+  for (a0 = -1, color = 0, ai = 0, bi = 0; a0 < width;)
   {
-    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-	     "Initializing driver data for driver \"%s\"", driver_name);
-
-    if (!ppd_paths || cupsArrayCount(ppd_paths) == 0)
+    // a1: First changing element on the coding line right to a0
+    while (cur[ai] <= a0)
+      ai ++;
+    a1 = cur[ai];
+
+    // b1: First changing element on the reference line right to a0
+    // and of opposite color to a0, b2: the next one after b1
+    while (ref[bi] <= a0)
+      bi ++;
+    bidx = bi + ((bi & 1) != color);
+    b1 = ref[bidx];
+    b2 = ref[bidx + 1];
+
+    if (b2 < a1)
     {
-      papplLog(system, PAPPL_LOGLEVEL_ERROR,
-	       "Driver callback did not find PPD indices.");
-      return (false);
+      // Pass mode
+      ps_ccitt_put_bits(g4, 0x1, 4);
+      a0 = b2;
     }
-
-    //
-    // Load assigned PPD file from the PPD collection, mark defaults, create
-    // cache
-    //
-
-  retry:
-    if (strcasecmp(driver_name, "auto") == 0)
+    else if (a1 - b1 >= -3 && a1 - b1 <= 3)
     {
-      // Auto-select driver
-      papplLog(system, PAPPL_LOGLEVEL_INFO,
-	       "Automatic printer driver selection for device with URI \"%s\" "
-	       "and device ID \"%s\" ...", device_uri, device_id);
-      search_ppd_path.driver_name = ps_autoadd(NULL, device_uri, device_id,
-					       NULL);
-      if (search_ppd_path.driver_name)
-	papplLog(system, PAPPL_LOGLEVEL_INFO,
-		 "Automatically selected driver \"%s\".",
-		 search_ppd_path.driver_name);
-      else
+      // Vertical mode
+      switch (a1 - b1)
       {
-	papplLog(system, PAPPL_LOGLEVEL_ERROR,
-		 "Automatic printer driver selection for printer "
-		 "\"%s\" with device ID \"%s\" failed.",
-		 device_uri, device_id);
-	return (false);
+      case 0 :
+	  ps_ccitt_put_bits(g4, 0x1, 1);
+	  break;
+      case 1 :
+	  ps_ccitt_put_bits(g4, 0x3, 3);
+	  break;
+      case 2 :
+	  ps_ccitt_put_bits(g4, 0x03, 6);
+	  break;
+      case 3 :
+	  ps_ccitt_put_bits(g4, 0x03, 7);
+	  break;
+      case -1 :
+	  ps_ccitt_put_bits(g4, 0x2, 3);
+	  break;
+      case -2 :
+	  ps_ccitt_put_bits(g4, 0x02, 6);
+	  break;
+      case -3 :
+	  ps_ccitt_put_bits(g4, 0x02, 7);
+	  break;
       }
+      a0 = a1;
+      color = !color;
     }
     else
-      search_ppd_path.driver_name = driver_name;
+    {
+      // Horizontal mode
+      a2 = cur[ai + 1];
+      ps_ccitt_put_bits(g4, 0x1, 3);
+      ps_ccitt_put_run(g4, a1 - (a0 < 0 ? 0 : a0), color);
+      ps_ccitt_put_run(g4, a2 - a1, !color);
+      a0 = a2;
+    }
+  }
 
-    ppd_path = (ps_ppd_path_t *)cupsArrayFind(ppd_paths, &search_ppd_path);
+  // The coding line is the reference line for the next line
+  tmp     = g4->ref;
+  g4->ref = g4->cur;
+  g4->cur = tmp;
+}
 
-    if (ppd_path == NULL)
+
+//
+// 'ps_ccitt_put_bits()' - Add a code word to the CCITT output
+//
+
+static void
+ps_ccitt_put_bits(ps_ccitt_t *g4,	// I - Encoder state
+		  unsigned   code,	// I - Code bits
+		  int        length)	// I - Number of bits
+{
+  g4->bits = (g4->bits << length) | code;
+  g4->num_bits += length;
+
+  while (g4->num_bits >= 8)
+  {
+    g4->num_bits -= 8;
+    g4->buffer[g4->bufused ++] = (unsigned char)(g4->bits >> g4->num_bits);
+    if (g4->bufused >= (int)sizeof(g4->buffer))
     {
-      if (strcasecmp(driver_name, "auto") == 0)
-      {
-	papplLog(system, PAPPL_LOGLEVEL_ERROR,
-		 "For the printer driver \"%s\" got auto-selected which does "
-		 "not exist in this Printer Application.",
-		 search_ppd_path.driver_name);
-	return (false);
-      }
-      else
-      {
-	papplLog(system, PAPPL_LOGLEVEL_WARN,
-		 "Printer uses driver \"%s\" which does not exist in this "
-		 "Printer Application, switching to \"auto\".", driver_name);
-	driver_name = "auto";
-	goto retry;
-      }
+      ps_transport_write(g4->transport, g4->buffer, g4->bufused);
+      g4->bufused = 0;
     }
+  }
 
-    if ((ppd = ppdOpen2(ppdCollectionGetPPD(ppd_path->ppd_path, NULL,
-					    (filter_logfunc_t)papplLog,
-					    system))) == NULL)
-    {
-      ppd_status_t	err;		// Last error in file
-      int		line;		// Line number in file
+  g4->bits &= (1 << g4->num_bits) - 1;
+}
 
-      err = ppdLastError(&line);
-      papplLog(system, PAPPL_LOGLEVEL_ERROR,
-	       "PPD %s: %s on line %d", ppd_path->ppd_path,
-	       ppdErrorString(err), line);
+
+//
+// 'ps_ccitt_put_run()' - Add the codes for a run of pixels of one color
+//                        to the CCITT output
+//
+
+static void
+ps_ccitt_put_run(ps_ccitt_t *g4,	// I - Encoder state
+		 int        run,	// I - Run length
+		 int        black)	// I - Black run?
+{
+  const ps_ccitt_code_t *term = black ? ps_ccitt_black_term :
+					ps_ccitt_white_term,
+			*makeup = black ? ps_ccitt_black_makeup :
+					  ps_ccitt_white_makeup;
+					// Code tables for the color
+
+
+  while (run >= 2624)
+  {
+    ps_ccitt_put_bits(g4, makeup[39].code, makeup[39].length);
+    run -= 2560;
+  }
+  if (run >= 64)
+  {
+    ps_ccitt_put_bits(g4, makeup[run / 64 - 1].code,
+		      makeup[run / 64 - 1].length);
+    run &= 63;
+  }
+  ps_ccitt_put_bits(g4, term[run].code, term[run].length);
+}
+
+
+//
+// 'ps_ccitt_start()' - Start a CCITT Group 4 encoded image, the reference
+//                      line of the first line is all white
+//
+
+static bool				// O - `true` on success, `false` on error
+ps_ccitt_start(ps_ccitt_t     *g4,	// I - Encoder state
+	       int            width,	// I - Width of the lines in pixels
+	       bool           black_is_1,// I - Are 1 bits black pixels?
+	       ps_transport_t *transport)// I - Transport for the output
+{
+  int *ptr;				// Reallocated list
+
+
+  if (width != g4->width || !g4->ref || !g4->cur)
+  {
+    // Changing elements plus terminators
+    if ((ptr = (int *)realloc(g4->ref, (width + 4) * sizeof(int))) == NULL)
       return (false);
-    }
+    g4->ref = ptr;
+    if ((ptr = (int *)realloc(g4->cur, (width + 4) * sizeof(int))) == NULL)
+      return (false);
+    g4->cur = ptr;
+    g4->width = width;
+  }
 
-    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-	     "Using PPD %s: %s", ppd_path->ppd_path, ppd->nickname);
+  g4->ref[0] = g4->ref[1] = g4->ref[2] = g4->ref[3] = width;
+  g4->invert    = black_is_1 ? 0x00 : 0xff;
+  g4->bits      = 0;
+  g4->num_bits  = 0;
+  g4->bufused   = 0;
+  g4->transport = transport;
 
-    ppdMarkDefaults(ppd);
+  return (true);
+}
 
-    if ((pc = ppdCacheCreateWithPPD(ppd)) != NULL)
-      ppd->cache = pc;
 
-    //
-    // Populate driver data record
-    //
+//
+// 'ps_compare_cache_files()' - Compare function for sorting the files of
+//                              the conversion cache, least recently used
+//                              first
+//
 
-    // Callback functions end general properties
-    driver_data->extension =
-      (ps_driver_extension_t *)calloc(1, sizeof(ps_driver_extension_t));
-    extension = (ps_driver_extension_t *)driver_data->extension;
-    extension->ppd                  = ppd;
-    extension->defaults_pollable    = false;
-    extension->installable_options  = false;
-    extension->installable_pollable = false;
-    extension->updated              = false;
-    extension->cups_filter_ps       = NULL;
-    extension->temp_ppd_name        = NULL;
-    driver_data->delete_cb          = ps_driver_delete;
-    driver_data->identify_cb        = ps_identify;
-    driver_data->identify_default   = PAPPL_IDENTIFY_ACTIONS_SOUND;
-    driver_data->identify_supported = PAPPL_IDENTIFY_ACTIONS_DISPLAY |
-                                      PAPPL_IDENTIFY_ACTIONS_SOUND;
-    driver_data->printfile_cb       = NULL;
-    driver_data->rendjob_cb         = ps_rendjob;
-    driver_data->rendpage_cb        = ps_rendpage;
-    driver_data->rstartjob_cb       = ps_rstartjob;
-    driver_data->rstartpage_cb      = ps_rstartpage;
-    driver_data->rwriteline_cb      = ps_rwriteline;
-    driver_data->status_cb          = ps_status;
-    driver_data->testpage_cb        = ps_testpage;
-    driver_data->format             = "application/vnd.printer-specific";
-    driver_data->orient_default     = IPP_ORIENT_NONE;
+static int
+ps_compare_cache_files(void *a,
+		       void *b,
+		       void *data)
+{
+  cups_dentry_t *aa = (cups_dentry_t *)a;
+  cups_dentry_t *bb = (cups_dentry_t *)b;
 
-    // Make and model
-    strncpy(driver_data->make_and_model,
-	    ppd->nickname,
-	    sizeof(driver_data->make_and_model));
+  (void)data;
+  if (aa->fileinfo.st_mtime != bb->fileinfo.st_mtime)
+    return (aa->fileinfo.st_mtime < bb->fileinfo.st_mtime ? -1 : 1);
+  return (strcmp(aa->filename, bb->filename));
+}
 
-    // Does the PPD file have "*cupsFilter(2): ..." lines? If so, there
-    // could some enhanced functionality working with a filter.
-    //
-    // Check whether the filter is installed and note its execution path.
-    // If we have a filter we will also accept options and choices without
-    // PostScript or JCL code as these are most probably handled by the
-    // filter.
-    extension->cups_filter_ps =
-      ps_ppd_find_cups_filter("application/vnd.cups-postscript",
-			      ppd->num_filters, ppd->filters);
-    if (extension->cups_filter_ps)
+
+//
+// 'ps_compare_ppd_paths()' - Compare function for sorting PPD path array
+//
+
+static int
+ps_compare_ppd_paths(void *a,
+		     void *b,
+		     void *data)
+{
+  ps_ppd_path_t *aa = (ps_ppd_path_t *)a;
+  ps_ppd_path_t *bb = (ps_ppd_path_t *)b;
+
+  (void)data;
+  return (strcmp(aa->driver_name, bb->driver_name));
+}
+
+
+//
+// 'ps_constraints_add()' - Add a rule to the constraint index. Options
+//                          without choice match all their choices except
+//                          "None", "Off", and "False". Rules with options
+//                          not in the PPD file are left out.
+//
+
+static void
+ps_constraints_add(ps_constraints_t *c,	// I - Constraint index
+		   int              num_entries,
+					// I - Number of options of the rule
+		   const char       **options,
+					// I - Options of the rule
+		   const char       **choices)
+					// I - Their choices, `NULL` for any
+{
+  ps_constraint_rule_t	*rule;		// New rule
+  ps_constraint_option_t *copt;		// Option in the index
+  const char		*name;		// Name of a choice
+  uint64_t		*mask = NULL;	// Choices of the current option
+  int			i, j, k, o;	// Looping vars
+
+
+  rule = c->rules + c->num_rules;
+  memset(rule, 0, sizeof(ps_constraint_rule_t));
+  if (num_entries <= 0 ||
+      (rule->options = (int *)calloc(num_entries, sizeof(int))) == NULL ||
+      (rule->choices = (uint64_t *)calloc(c->num_words,
+					  sizeof(uint64_t))) == NULL ||
+      (mask = (uint64_t *)calloc(c->num_words, sizeof(uint64_t))) == NULL)
+    goto error;
+
+  for (i = 0; i < num_entries; i ++)
+  {
+    if ((o = ps_constraints_option(c, options[i])) < 0)
+      goto error;
+    copt = c->options + o;
+
+    memset(mask, 0, c->num_words * sizeof(uint64_t));
+    for (j = 0; j < copt->option->num_choices; j ++)
     {
-      papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-	       "CUPS filter to be applied to the PostScript output: %s",
-	       extension->cups_filter_ps);
-      // Create a physical copy of the PPD file in a temporary file so that
-      // the CUPS filter can read it.
-      tempfp = ppdCollectionGetPPD(ppd_path->ppd_path, NULL,
-				   (filter_logfunc_t)papplLog,
-				   system);
-      if ((tempfd = cupsTempFd(tempfile, sizeof(tempfile))) >= 0)
-      {
-	papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-		 "Creating physical PPD file for the CUPS filter: %s",
-		 tempfile);
-	while ((bytes = cupsFileRead(tempfp, buf, sizeof(buf))) > 0)
-	  bytes = write(tempfd, buf, bytes);
-	cupsFileClose(tempfp);
-	close(tempfd);
-	extension->temp_ppd_name = strdup(tempfile);
-      }
-      else
-	papplLog(system, PAPPL_LOGLEVEL_WARN,
-		 "Unable to create physical PPD file for the CUPS filter, filter may not work correctly.");
+      name = copt->option->choices[j].choice;
+      if (choices[i] && choices[i][0] ? !strcasecmp(name, choices[i]) :
+	  (strcasecmp(name, "None") && strcasecmp(name, "Off") &&
+	   strcasecmp(name, "False")))
+	mask[(copt->first_bit + j) / 64] |=
+	  1ULL << ((copt->first_bit + j) % 64);
     }
-    else
-      papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-	       "No CUPS filter to be applied to the PostScript output");
 
-    // We are in Init mode
-    update = false;
+    for (k = 0; k < rule->num_options && rule->options[k] != o; k ++);
+    if (k < rule->num_options)
+    {
+      // Option named twice, the choice has to match both
+      for (j = copt->first_bit;
+	   j < copt->first_bit + copt->option->num_choices; j ++)
+	if (!(mask[j / 64] & (1ULL << (j % 64))))
+	  rule->choices[j / 64] &= ~(1ULL << (j % 64));
+    }
+    else
+    {
+      rule->options[rule->num_options ++] = o;
+      for (j = 0; j < c->num_words; j ++)
+	rule->choices[j] |= mask[j];
+      if (copt->installable)
+	rule->installable = true;
+    }
   }
-  else
-  {
-    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-	     "Updating driver data for %s", driver_data->make_and_model);
-    extension = (ps_driver_extension_t *)driver_data->extension;
-    ppd = extension->ppd;
-    pc = ppd->cache;
-    extension->updated = true;
 
-    // We are in Update mode
-    update = true;
-  }
+  c->num_rules ++;
+  free(mask);
+  return;
 
-  // Note that we take into account option choice conflicts with the
-  // configuration of installable accessories only in Update mode,
-  // this way all options and choices are available after first
-  // initialization (Init mode) so that all user defaults loaded from
-  // the state file get accepted.
-  //
-  // Only at the end of the printer entry in the state file the
-  // accessory configuration gets read. After that we re-run in Update
-  // mode to correct the options and choices for the actual accessory
-  // configuration.
+ error:
+  free(rule->options);
+  free(rule->choices);
+  free(mask);
+}
 
-  // Get settings of the "Installable Options" from the previous session
-  if (*driver_attrs &&
-      (attr = ippFindAttribute(*driver_attrs, "installable-options-default",
-			       IPP_TAG_ZERO)) != NULL &&
-      ippAttributeString(attr, buf, sizeof(buf)) > 0)
-  {
-    options = NULL;
-    num_options = cupsParseOptions(buf, 0, &options);
-    ppdMarkOptions(ppd, num_options, options);
-  }
 
-  // Print speed in pages per minute (PPDs do not show different values for
-  // Grayscale and Color)
-  driver_data->ppm = ppd->throughput;
-  if (driver_data->ppm <= 1)
-    driver_data->ppm = 1;
-  if (ppd->color_device)
-    driver_data->ppm_color = driver_data->ppm;
-  else
-    driver_data->ppm_color = 0;
+//
+// 'ps_constraints_bit()' - Find the bit of a choice in the constraint
+//                          index, with `choice` being `NULL` the bit of
+//                          the first choice of the option.
+//
 
-  // Properties not supported by the PPD
-  driver_data->has_supplies = false;
-  driver_data->input_face_up = false;
+static int				// O - Bit or -1 if not found
+ps_constraints_bit(ps_constraints_t *c,	// I - Constraint index
+		   const char       *option,
+					// I - Option
+		   const char       *choice)
+					// I - Choice or `NULL`
+{
+  ps_constraint_option_t *copt;		// Option in the index
+  int			o, j;		// Looping vars
 
-  // Pages face-up or face-down in output bin?
-  if (pc->num_bins > 0)
-    driver_data->output_face_up =
-      (strstr(pc->bins->pwg, "face-up") != NULL);
-  else
-    driver_data->output_face_up = false;
 
-  // No orientation requested by default
-  if (!update) driver_data->orient_default = IPP_ORIENT_NONE;
+  if ((o = ps_constraints_option(c, option)) < 0)
+    return (-1);
+  copt = c->options + o;
+  if (!choice)
+    return (copt->first_bit);
+  for (j = 0; j < copt->option->num_choices; j ++)
+    if (!strcasecmp(copt->option->choices[j].choice, choice))
+      return (copt->first_bit + j);
 
-  // Supported color modes
-  if (ppd->color_device)
+  return (-1);
+}
+
+
+//
+// 'ps_constraints_build()' - Build the constraint index of a PPD file:
+//                            Every choice gets a bit, every
+//                            "*UIConstraints" and "*cupsUIConstraints"
+//                            rule a mask of the choices which fulfill it.
+//                            The options are the ones of ppdFirstOption(),
+//                            sorted by keyword.
+//
+
+static void
+ps_constraints_build(ps_constraints_t *c,// O - Constraint index
+		     ppd_file_t       *ppd)
+					// I - PPD file
+{
+  ppd_option_t	*option;		// PPD option
+  ppd_group_t	*group;			// Option group
+  ppd_const_t	*cst;			// "*UIConstraints" rule
+  ppd_attr_t	*attr;			// "*cupsUIConstraints" rule
+  const char	*options[PS_CONSTRAINT_MAX],
+					// Options of a rule
+		*choices[PS_CONSTRAINT_MAX];
+					// Choices of a rule
+  char		*value,			// Copy of the rule
+		*ptr,			// Pointer into it
+		*start;			// Start of an option or choice
+  int		i, j, n,		// Looping vars
+		num_bits = 0,		// Number of choices
+		num_rules;		// Number of rules
+
+
+  memset(c, 0, sizeof(ps_constraints_t));
+
+  for (option = ppdFirstOption(ppd); option; option = ppdNextOption(ppd))
+    c->num_options ++;
+  if (c->num_options == 0 ||
+      (c->options =
+       (ps_constraint_option_t *)calloc(c->num_options,
+					sizeof(ps_constraint_option_t))) ==
+      NULL)
   {
-    driver_data->color_supported =
-      PAPPL_COLOR_MODE_AUTO | PAPPL_COLOR_MODE_COLOR |
-      PAPPL_COLOR_MODE_MONOCHROME;
-    if (!update) driver_data->color_default = PAPPL_COLOR_MODE_AUTO;
+    c->num_options = 0;
+    return;
   }
-  else
+  for (i = 0, option = ppdFirstOption(ppd); option && i < c->num_options;
+       i ++, option = ppdNextOption(ppd))
   {
-    driver_data->color_supported = PAPPL_COLOR_MODE_MONOCHROME;
-    driver_data->color_default = PAPPL_COLOR_MODE_MONOCHROME;
+    c->options[i].option    = option;
+    c->options[i].first_bit = num_bits;
+    c->options[i].marked    = -1;
+    num_bits += option->num_choices;
   }
-
-  // These parameters are usually not defined in PPDs but standard IPP
-  // options settable in the web interface
-  if (!update)
+  c->num_words = num_bits / 64 + 1;
+
+  for (i = ppd->num_groups, group = ppd->groups; i > 0; i --, group ++)
+    if (!strncasecmp(group->name, "Installable", 11))
+      for (j = 0; j < group->num_options; j ++)
+	if ((n = ps_constraints_option(c, group->options[j].keyword)) >= 0)
+	  c->options[n].installable = true;
+
+  num_rules = ppd->num_consts;
+  for (attr = ppdFindAttr(ppd, "cupsUIConstraints", NULL); attr;
+       attr = ppdFindNextAttr(ppd, "cupsUIConstraints", NULL))
+    num_rules ++;
+  if ((c->state = (uint64_t *)calloc(c->num_words,
+				     sizeof(uint64_t))) == NULL ||
+      (c->conflicts = (uint64_t *)calloc(c->num_words,
+					 sizeof(uint64_t))) == NULL ||
+      (c->rules =
+       (ps_constraint_rule_t *)calloc(num_rules + 1,
+				      sizeof(ps_constraint_rule_t))) == NULL)
   {
-    driver_data->content_default = PAPPL_CONTENT_AUTO;
-    driver_data->quality_default = IPP_QUALITY_NORMAL;
-    driver_data->scaling_default = PAPPL_SCALING_AUTO;
+    ps_constraints_free(c);
+    return;
   }
 
-  // Raster graphics modes fo PWG Raster input
-  if (ppd->color_device)
-    driver_data->raster_types =
-      PAPPL_PWG_RASTER_TYPE_BLACK_1 | PAPPL_PWG_RASTER_TYPE_SGRAY_8 |
-      PAPPL_PWG_RASTER_TYPE_SRGB_8;
-  else
-    driver_data->raster_types =
-      PAPPL_PWG_RASTER_TYPE_BLACK_1 | PAPPL_PWG_RASTER_TYPE_SGRAY_8;
-  driver_data->force_raster_type = 0;
+  // "*UIConstraints: *Option1 Choice1 *Option2 Choice2", the PPD parser
+  // has already removed the '*'s
+  for (i = ppd->num_consts, cst = ppd->consts; i > 0; i --, cst ++)
+  {
+    options[0] = cst->option1;
+    choices[0] = cst->choice1;
+    options[1] = cst->option2;
+    choices[1] = cst->choice2;
+    ps_constraints_add(c, 2, options, choices);
+  }
 
-  // Duplex
-  driver_data->sides_supported = PAPPL_SIDES_ONE_SIDED;
-  driver_data->duplex = PAPPL_DUPLEX_NONE;
-  if (!update) driver_data->sides_default = PAPPL_SIDES_ONE_SIDED;
-  if (pc->sides_option &&
-      (option = ppdFindOption(ppd, pc->sides_option)) != NULL &&
-      (extension->cups_filter_ps ||
-       ps_option_has_code(system, ppd, option)))
+  // "*cupsUIConstraints Name: "*Option1 Choice1 *Option2 *Option3 ...""
+  for (attr = ppdFindAttr(ppd, "cupsUIConstraints", NULL);
+       attr && c->num_rules < num_rules;
+       attr = ppdFindNextAttr(ppd, "cupsUIConstraints", NULL))
   {
-    if (pc->sides_2sided_long &&
-	!(update && ppdInstallableConflict(ppd, pc->sides_option,
-					   pc->sides_2sided_long)))
-    {
-      driver_data->sides_supported |= PAPPL_SIDES_TWO_SIDED_LONG_EDGE;
-      driver_data->duplex = PAPPL_DUPLEX_NORMAL;
-      if (!update &&
-	  (choice = ppdFindMarkedChoice(ppd, pc->sides_option)) != NULL &&
-	  strcmp(choice->choice, pc->sides_2sided_long) == 0)
-	driver_data->sides_default = PAPPL_SIDES_TWO_SIDED_LONG_EDGE;
-    }
-    if (pc->sides_2sided_short &&
-	!(update && ppdInstallableConflict(ppd, pc->sides_option,
-					   pc->sides_2sided_short)))
+    if (!attr->value || (value = strdup(attr->value)) == NULL)
+      continue;
+    for (n = 0, ptr = value; n >= 0;)
     {
-      driver_data->sides_supported |= PAPPL_SIDES_TWO_SIDED_SHORT_EDGE;
-      driver_data->duplex = PAPPL_DUPLEX_NORMAL;
-      if (!update &&
-	  (choice = ppdFindMarkedChoice(ppd, pc->sides_option)) != NULL &&
-	  strcmp(choice->choice, pc->sides_2sided_short) == 0)
-	driver_data->sides_default = PAPPL_SIDES_TWO_SIDED_SHORT_EDGE;
+      while (isspace(*ptr & 255))
+	ptr ++;
+      if (!*ptr)
+	break;
+      for (start = ptr; *ptr && !isspace(*ptr & 255); ptr ++);
+      if (*ptr)
+	*ptr++ = '\0';
+      if (*start == '*')
+      {
+	if (n >= PS_CONSTRAINT_MAX)
+	  n = -1;
+	else
+	{
+	  options[n]   = start + 1;
+	  choices[n ++] = NULL;
+	}
+      }
+      else if (n > 0 && !choices[n - 1])
+	choices[n - 1] = start;
     }
+    if (n > 0)
+      ps_constraints_add(c, n, options, choices);
+    free(value);
   }
-  if ((driver_data->sides_default & driver_data->sides_supported) == 0)
+}
+
+
+//
+// 'ps_constraints_conflict()' - Does a choice conflict with the
+//                               installable accessories? This is
+//                               ppdInstallableConflict() on the state of
+//                               the last ps_constraints_update().
+//
+
+static bool				// O - `true` if there is a conflict
+ps_constraints_conflict(ps_constraints_t *c,
+					// I - Constraint index
+			const char       *option,
+					// I - Option
+			const char       *choice)
+					// I - Choice
+{
+  return (ps_constraints_test(c, ps_constraints_bit(c, option, choice)));
+}
+
+
+//
+// 'ps_constraints_free()' - Free a constraint index.
+//
+
+static void
+ps_constraints_free(ps_constraints_t *c)// I - Constraint index
+{
+  int		i;			// Looping var
+
+
+  for (i = 0; i < c->num_rules; i ++)
   {
-    driver_data->sides_default = PAPPL_SIDES_ONE_SIDED;
-    if (pc->sides_option)
-      ppdMarkOption(ppd, pc->sides_option, pc->sides_1sided);
+    free(c->rules[i].options);
+    free(c->rules[i].choices);
   }
+  free(c->rules);
+  free(c->options);
+  free(c->state);
+  free(c->conflicts);
+  memset(c, 0, sizeof(ps_constraints_t));
+}
 
-  // Finishings
-  driver_data->finishings = PAPPL_FINISHINGS_NONE;
-  for (finishings = (ppd_pwg_finishings_t *)cupsArrayFirst(pc->finishings);
-       finishings;
-       finishings = (ppd_pwg_finishings_t *)cupsArrayNext(pc->finishings))
+
+//
+// 'ps_constraints_option()' - Find an option in the constraint index.
+//
+
+static int				// O - Index or -1 if not found
+ps_constraints_option(ps_constraints_t *c,
+					// I - Constraint index
+		      const char       *option)
+					// I - Option
+{
+  int		lo = 0,			// Lowest candidate
+		hi = c->num_options - 1,// Highest candidate
+		mid,			// Candidate to compare
+		diff;			// Result of comparison
+
+
+  while (option && lo <= hi)
   {
-    for (i = finishings->num_options, opt = finishings->options; i > 0;
-	 i --, opt ++)
-    {
-      if (update && ppdInstallableConflict(ppd, opt->name, opt->value))
-	break;
-      if ((option = ppdFindOption(ppd, opt->name)) == NULL ||
-	  (!extension->cups_filter_ps &&
-	   !ps_option_has_code(system, ppd, option)))
-	break;
-    }
-    if (i > 0)
-      continue;
-    if (finishings->value == IPP_FINISHINGS_STAPLE)
-      driver_data->finishings |= PAPPL_FINISHINGS_STAPLE;
-    else  if (finishings->value == IPP_FINISHINGS_PUNCH)
-      driver_data->finishings |= PAPPL_FINISHINGS_PUNCH;
-    else if (finishings->value == IPP_FINISHINGS_TRIM)
-      driver_data->finishings |= PAPPL_FINISHINGS_TRIM;
+    mid = (lo + hi) / 2;
+    if ((diff = strcasecmp(option, c->options[mid].option->keyword)) == 0)
+      return (mid);
+    else if (diff < 0)
+      hi = mid - 1;
+    else
+      lo = mid + 1;
   }
 
-  // Resolution
-  driver_data->num_resolution = 0;
-  if ((option = ppdFindOption(ppd, "Resolution")) != NULL &&
-      (count = option->num_choices) > 0 &&
-      (extension->cups_filter_ps ||
-       ps_option_has_code(system, ppd, option)))
+  return (-1);
+}
+
+
+//
+// 'ps_constraints_resolve()' - List the installable accessory settings
+//                              which would need to change to allow a
+//                              conflicting choice: The rules the choice
+//                              would fulfill, and for them, greedily,
+//                              the marked options which are in most of
+//                              the rules not covered yet.
+//
+
+static void
+ps_constraints_resolve(ps_constraints_t *c,
+					// I - Constraint index
+		       int              bit,
+					// I - Bit of the conflicting choice
+		       char             *buf,
+					// O - "Option=Choice ..." list
+		       size_t           bufsize)
+					// I - Size of buffer
+{
+  ps_constraint_option_t *copt;		// Option in the index
+  ps_constraint_rule_t	*rule;		// Current rule
+  char			*pending = NULL;// Rules not covered yet
+  int			*count = NULL,	// Pending rules per option
+			o, best,	// Option of the choice, best option
+			matched,	// Options of a rule fulfilled
+			i, j;		// Looping vars
+
+
+  buf[0] = '\0';
+  if (bit < 0 || c->num_rules == 0 ||
+      (pending = (char *)calloc(c->num_rules, 1)) == NULL ||
+      (count = (int *)calloc(c->num_options, sizeof(int))) == NULL)
+    goto done;
+
+  for (o = c->num_options - 1; o > 0 && c->options[o].first_bit > bit;
+       o --);
+
+  // Rules which are fulfilled with the choice
+  for (i = 0, rule = c->rules; i < c->num_rules; i ++, rule ++)
   {
-    // Valid "Resolution" option, make a sorted list of resolutions.
-    if (update)
+    if (!rule->installable ||
+	!(rule->choices[bit / 64] & (1ULL << (bit % 64))))
+      continue;
+    for (j = 0, matched = 1; j < rule->num_options; j ++)
     {
-      def_res_x = driver_data->x_default;
-      def_res_y = driver_data->y_default;
+      copt = c->options + rule->options[j];
+      if (rule->options[j] != o && copt->marked >= 0 &&
+	  (rule->choices[(copt->first_bit + copt->marked) / 64] &
+	   (1ULL << ((copt->first_bit + copt->marked) % 64))))
+	matched ++;
     }
-    driver_data->x_default = 0;
-    driver_data->y_default = 0;
-    for (i = 0, j = 0, choice = option->choices;
-	 i < count && j < PAPPL_MAX_SOURCE;
-	 i ++, choice ++)
-      if (!(update &&
-	    ppdInstallableConflict(ppd, "Resolution", choice->choice)))
-      {
-	if ((k = sscanf(choice->choice, "%dx%d",
-			&(driver_data->x_resolution[j]),
-			&(driver_data->y_resolution[j]))) == 1)
-	  driver_data->y_resolution[j] = driver_data->x_resolution[j];
-	else if (k <= 0)
-	{
-	  papplLog(system, PAPPL_LOGLEVEL_ERROR,
-		   "Invalid resolution: %s", choice->choice);
-	  continue;
-	}
-	// Default resolution
-	if (j == 0 ||
-	    (!update && choice->marked) ||
-	    (update &&
-	     def_res_x == driver_data->x_resolution[j] &&
-	     def_res_y == driver_data->y_resolution[j]))
-        {
-	  def_choice = choice;
-	  driver_data->x_default = driver_data->x_resolution[j];
-	  driver_data->y_default = driver_data->y_resolution[j];
-	}
-	for (k = j - 1; k >= 0; k --)
-	{
-	  int       x1, y1,               // First X and Y resolution
-	            x2, y2,               // Second X and Y resolution
-	            temp;                 // Swap variable
-	  x1 = driver_data->x_resolution[k];
-	  y1 = driver_data->y_resolution[k];
-	  x2 = driver_data->x_resolution[k + 1];
-	  y2 = driver_data->y_resolution[k + 1];
-	  if (x2 < x1 || (x2 == x1 && y2 < y1))
-	  {
-	    temp                             = driver_data->x_resolution[k];
-	    driver_data->x_resolution[k]     = driver_data->x_resolution[k + 1];
-	    driver_data->x_resolution[k + 1] = temp;
-	    temp                             = driver_data->y_resolution[k];
-	    driver_data->y_resolution[k]     = driver_data->y_resolution[k + 1];
-	    driver_data->y_resolution[k + 1] = temp;
-	  }
-	}
-	j ++;
-      }
-    if (j > 0)
-    {
-      driver_data->num_resolution = j;
-      ppdMarkOption(ppd, "Resolution", def_choice->choice);
-    }
-    else
-      papplLog(system, PAPPL_LOGLEVEL_WARN,
-	       "No valid resolution choice found, using 300 dpi");
-  }
-  else if ((ppd_attr = ppdFindAttr(ppd, "DefaultResolution", NULL)) != NULL)
-  {
-    // Use the PPD-defined default resolution...
-    if ((j = sscanf(ppd_attr->value, "%dx%d",
-		    &(driver_data->x_resolution[0]),
-		    &(driver_data->y_resolution[0]))) == 1)
-      driver_data->y_resolution[0] = driver_data->x_resolution[0];
-    else if (j <= 0)
-      papplLog(system, PAPPL_LOGLEVEL_ERROR,
-	       "Invalid default resolution: %s, using 300 dpi",
-	       ppd_attr->value);
-    driver_data->num_resolution = (j > 0 ? 1 : 0);
-  }
-  else
-    papplLog(system, PAPPL_LOGLEVEL_WARN,
-	     "No resolution information in PPD, using 300 dpi");
-  if (driver_data->num_resolution == 0)
-  {
-    driver_data->x_resolution[0] = 300;
-    driver_data->y_resolution[0] = 300;
-    driver_data->num_resolution = 1;
+    pending[i] = (matched == rule->num_options);
   }
-  if (driver_data->x_default == 0 || driver_data->y_default == 0)
+
+  for (;;)
   {
-    driver_data->x_default = driver_data->x_resolution[0];
-    driver_data->y_default = driver_data->y_resolution[0];
+    memset(count, 0, c->num_options * sizeof(int));
+    for (i = 0, best = -1, rule = c->rules; i < c->num_rules; i ++, rule ++)
+      for (j = 0; pending[i] && j < rule->num_options; j ++)
+	if (rule->options[j] != o &&
+	    (++ count[rule->options[j]] > (best < 0 ? 0 : count[best])))
+	  best = rule->options[j];
+    if (best < 0)
+      break;
+
+    copt = c->options + best;
+    snprintf(buf + strlen(buf), bufsize - strlen(buf), "%s%s=%s",
+	     buf[0] ? " " : "", copt->option->keyword,
+	     copt->option->choices[copt->marked].choice);
+    for (i = 0, rule = c->rules; i < c->num_rules; i ++, rule ++)
+      for (j = 0; pending[i] && j < rule->num_options; j ++)
+	if (rule->options[j] == best)
+	  pending[i] = 0;
   }
 
-  // For the options Media Source and Media Type we do not need to
-  // assure that both have PostScript/PJL code to tell the printer
-  // which choices are selected, as they depend on each other, by
-  // which media is loaded in which tray.
-  //
-  // If Media Source has PostScript/PJL code and Media Type not, the
-  // code of Media Source selects the tray with whatever is loaded in
-  // it. The Media Type selection in this Printer Application only
-  // serves as a reminder what we have loaded then.
-  //
-  // If Media Type has PostScript/PJL code and Media Source not, the
-  // printer, guided by the code of Media Size and Media Type searches
-  // for the tray which carries this combo, so our codeless Media
-  // Source option only serves for easy selection in this Printer
-  // Application.
-  //
-  // Note that Media Size is required to have PostScript/PJL code
+ done:
+  free(pending);
+  free(count);
+}
 
-  // Media source
-  if ((count = pc->num_sources) > 0)
+
+//
+// 'ps_constraints_test()' - Test the bit of a choice in the mask of choices
+//                           conflicting with the installable accessories.
+//
+
+static bool				// O - `true` if there is a conflict
+ps_constraints_test(ps_constraints_t *c,// I - Constraint index
+		    int              bit)
+					// I - Bit of the choice, -1 if none
+{
+  return (bit >= 0 && c->conflicts &&
+	  (c->conflicts[bit / 64] & (1ULL << (bit % 64))) != 0);
+}
+
+
+//
+// 'ps_constraints_update()' - Take the marked choices of the PPD file as
+//                             state and find the choices which conflict
+//                             with the installable accessories: With all
+//                             options of an installable rule fulfilled,
+//                             all its choices conflict; with one option
+//                             not fulfilled, the choices of that option
+//                             which fulfill the rule.
+//
+
+static void
+ps_constraints_update(ps_constraints_t *c)
+					// I - Constraint index
+{
+  ps_constraint_option_t *copt;		// Option in the index
+  ps_constraint_rule_t	*rule;		// Current rule
+  int			matched,	// Options of a rule fulfilled
+			bit,		// Bit of a choice
+			i, j;		// Looping vars
+
+
+  if (!c->state)
+    return;
+
+  memset(c->state, 0, c->num_words * sizeof(uint64_t));
+  memset(c->conflicts, 0, c->num_words * sizeof(uint64_t));
+  for (i = 0, copt = c->options; i < c->num_options; i ++, copt ++)
   {
-    if (!update)
-      choice = ppdFindMarkedChoice(ppd, pc->source_option);
-    else
-      for (i = 0; i < driver_data->num_source; i ++)
-	free((char *)(driver_data->source[i]));
-    def_source = NULL;
-    for (i = 0, j = 0, pwg_map = pc->sources;
-	 i < count && j < PAPPL_MAX_SOURCE;
-	 i ++, pwg_map ++)
-      if (!(update &&
-	    ppdInstallableConflict(ppd, pc->source_option, pwg_map->ppd)))
+    for (j = 0, copt->marked = -1; j < copt->option->num_choices; j ++)
+      if (copt->option->choices[j].marked)
       {
-	driver_data->source[j] = strdup(pwg_map->pwg);
-	if (j == 0 ||
-	    (!update && choice && !strcmp(pwg_map->ppd, choice->choice)) ||
-	    (update &&
-	     !strcmp(pwg_map->pwg, driver_data->media_default.source)))
-	{
-	  def_source = driver_data->source[j];
-	  ppdMarkOption(ppd, pc->source_option, pwg_map->ppd);
-	}
-	j ++;
+	copt->marked = j;
+	bit          = copt->first_bit + j;
+	c->state[bit / 64] |= 1ULL << (bit % 64);
+	break;
       }
-    driver_data->num_source = j;
-  }
-  if (count == 0 || driver_data->num_source == 0)
-  {
-    driver_data->num_source = 1;
-    driver_data->source[0] = strdup("default");
-    def_source = driver_data->source[0];
   }
 
-  // Media type
-  if ((count = pc->num_types) > 0)
+  for (i = 0, rule = c->rules; i < c->num_rules; i ++, rule ++)
   {
-    if (!update)
-      choice = ppdFindMarkedChoice(ppd, "MediaType");
-    else
-      for (i = 0; i < driver_data->num_type; i ++)
-	free((char *)(driver_data->type[i]));
-    def_type = NULL;
-    for (i = 0, j = 0, pwg_map = pc->types;
-	 i < count && j < PAPPL_MAX_TYPE;
-	 i ++, pwg_map ++)
-      if (!(update && ppdInstallableConflict(ppd, "MediaType", pwg_map->ppd)))
+    if (!rule->installable)
+      continue;
+
+    // The state has at most one bit per option, so the bits in common
+    // with the rule are its fulfilled options
+    for (j = 0, matched = 0; j < c->num_words; j ++)
+      matched += __builtin_popcountll(c->state[j] & rule->choices[j]);
+
+    if (matched == rule->num_options)
+    {
+      for (j = 0; j < c->num_words; j ++)
+	c->conflicts[j] |= rule->choices[j];
+    }
+    else if (matched == rule->num_options - 1)
+    {
+      for (j = 0; j < rule->num_options; j ++)
       {
-	driver_data->type[j] = strdup(pwg_map->pwg);
-	if (j == 0 ||
-	    (!update && choice && !strcmp(pwg_map->ppd, choice->choice)) ||
-	    (update &&
-	     !strcmp(pwg_map->pwg, driver_data->media_default.type)))
-	{
-	  def_type = driver_data->type[j];
-	  ppdMarkOption(ppd, "MediaType", pwg_map->ppd);
-	}
-	j ++;
+	copt = c->options + rule->options[j];
+	if (copt->marked < 0 ||
+	    !(rule->choices[(copt->first_bit + copt->marked) / 64] &
+	      (1ULL << ((copt->first_bit + copt->marked) % 64))))
+	  break;
       }
-    driver_data->num_type = j;
-  }
-  if (count == 0 || driver_data->num_type == 0)
-  {
-    driver_data->num_type = 1;
-    driver_data->type[0] = strdup("auto");
-    def_type = driver_data->type[0];
-  }
-
-  // Media size, margins
-  if ((option = ppdFindOption(ppd, "PageSize")) == NULL ||
-      (!extension->cups_filter_ps &&
-       !ps_option_has_code(system, ppd, option)))
-  {
-    papplLog(system, PAPPL_LOGLEVEL_ERROR,
-	     "PPD does not have a \"PageSize\" option or the option is "
-	     "missing PostScript/PJL code for selecting the page size.");
-    ps_driver_delete(NULL, driver_data);
-    return (false);
-  }
-  def_left = def_right = def_top = def_bottom = 9999999;
-  driver_data->borderless = false;
-  count = pc->num_sizes;
-  if (!update)
-  {
-    // If we can determine a default page size (Letter/A4) depending
-    // on the user's location via ps_default_paper_size() and there is
-    // either no default page size set or the default page size is A4
-    // or Letter, we correct the default to the page size of the
-    // user's location, but only if it is actually available in the
-    // PPD. Otherwise we take the default page size from the PPD file.
-    // Most PPDs have Letter as default but most places on the world
-    // use A4, so this switches the deafult to A4 in most cases.  This
-    // affects only new print queues or newly added media sources.
-    const char *val;
-    if ((val = ps_default_paper_size()) == NULL ||
-	(option = ppdFindOption(ppd, "PageSize")) == NULL ||
-	((choice = ppdFindMarkedChoice(ppd, "PageSize")) != NULL &&
-	 strcasecmp(choice->choice, "Letter") &&
-	 strcasecmp(choice->choice, "A4")) ||
-	(choice = ppdFindChoice(option, val)) == NULL)
-      choice = ppdFindMarkedChoice(ppd, "PageSize");
+      for (bit = copt->first_bit;
+	   bit < copt->first_bit + copt->option->num_choices; bit ++)
+	c->conflicts[bit / 64] |=
+	  rule->choices[bit / 64] & (1ULL << (bit % 64));
+    }
   }
-  else
-    for (i = 0; i < driver_data->num_media; i ++)
-      free((char *)(driver_data->media[i]));
-  def_media = NULL;
-  j = 0;
+}
 
-  // Custom page size (if defined in PPD)
-  if (pc->custom_min_keyword && pc->custom_max_keyword &&
-      pc->custom_max_width > pc->custom_min_width &&
-      pc->custom_max_length > pc->custom_min_length)
-  {
-    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-	     "Adding custom page size:");
-    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-	     "  PWG keyword min dimensions: \"%s\"", pc->custom_min_keyword);
-    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-	     "  PWG keyword max dimensions: \"%s\"", pc->custom_max_keyword);
-    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-	     "  Minimum dimensions (width, length): %dx%d",
-	     pc->custom_min_width, pc->custom_min_length);
-    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-	     "  Maximum dimensions (width, length): %dx%d",
-	     pc->custom_max_width, pc->custom_max_length);
-    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-	     "  Margins (left, bottom, right, top): %d, %d, %d, %d",
-	     pc->custom_size.left, pc->custom_size.bottom,
-	     pc->custom_size.right, pc->custom_size.top);
-    driver_data->media[j] = strdup(pc->custom_max_keyword);
-    j ++;
-    driver_data->media[j] = strdup(pc->custom_min_keyword);
-    j ++;
-  }
 
-  // Standard page sizes
-  for (i = 0, pwg_size = pc->sizes;
-       i < count && j < PAPPL_MAX_MEDIA;
-       i ++, pwg_size ++)
-    if (!(update && ppdInstallableConflict(ppd, "PageSize", pwg_size->map.ppd)))
-    {
-      driver_data->media[j] =
-	strdup(pwg_size->map.pwg);
-      if (j == 0 ||
-	  (!update && choice && !strcmp(pwg_size->map.ppd, choice->choice)) ||
-	  (update &&
-	   !strcmp(pwg_size->map.pwg, driver_data->media_default.size_name)))
-      {
-	def_media = pwg_size;
-	ppdMarkOption(ppd, "PageSize", pwg_size->map.ppd);
-      }
-      if (pwg_size->left == 0 && pwg_size->right == 0 &&
-	  pwg_size->top == 0 && pwg_size->bottom == 0)
-	driver_data->borderless = true;
-      else
-      {
-	if (pwg_size->left < def_left)
-	  def_left = pwg_size->left;
-	if (pwg_size->right < def_right)
-	  def_right = pwg_size->right;
-	if (pwg_size->top < def_top)
-	  def_top = pwg_size->top;
-	if (pwg_size->bottom < def_bottom)
-	  def_bottom = pwg_size->bottom;
-      }
-      j ++;
-    }
+//
+// 'ps_create_job_data()' - Load the printer's PPD file and set the PPD options
+//                          according to the job options
+//
 
-  // Number of media entries (Note that custom page size uses 2 entries,
-  // one holding the minimum, one the maximum dimensions)
-  driver_data->num_media = j;
+static ps_job_data_t *ps_create_job_data(pappl_job_t *job,
+					 pappl_pr_options_t *job_options)
+{
+  int                   i, j, k, count, intval;
+  ps_driver_extension_t *extension;
+  ps_job_data_t         *job_data;      // PPD data for job
+  ppd_cache_t           *pc;
+  pappl_pr_driver_data_t driver_data;   // Printer driver data
+  const char            *ppd_path;
+  cups_option_t         *opt;
+  ipp_t                 *driver_attrs;  // Printer (driver) IPP attributes
+  char                  buf[1024];      // Buffer for building strings
+  const char            *optstr,        // Option name from PPD option
+                        *choicestr,     // Choice name from PPD option
+                        *val;           // Value string from IPP option
+  ipp_t                 *attrs;         // IPP Attributes structure
+  ipp_t		        *media_col,	// media-col IPP structure
+                        *media_size;	// media-size IPP structure
+  ipp_attribute_t       *attr;
+  int                   pcm;            // Print color mode: 0: mono,
+                                        // 1: color (for presets)
+  int                   pq;             // IPP Print quality value (for presets)
+  int		        num_presets;	// Number of presets
+  cups_option_t	        *presets;       // Presets of PPD options
+  ppd_option_t          *option;        // PPD option
+  ppd_attr_t            *ppd_attr;
+  pwg_map_t             *pwg_map;
+  ppd_coption_t         *coption = NULL;
+  const char            *param;         // Custom parameter name
+  ps_vendor_table_t     *vendor;        // Compiled vendor options
+  ps_vendor_option_t    *vopt;          // Compiled vendor option
+  int                   num_cparams = 0;
+  int                   bit;            // Bit of a choice in the constraint
+                                        // index
+  char                  paramstr[1024];
+  char                  *memokey;       // Key for the printer's memo
+  uint64_t              memohash;       // Hash of the key
+  unsigned              memogeneration = 0;
+                                        // Generation of the memo
+  time_t t;
+  filter_data_t         *filter_data;
+  const char * const extra_attributes[] =
+  {
+   "job-uuid",
+   "job-originating-user-name",
+   "job-originating-host-name",
+   NULL
+  };
+  pappl_printer_t       *printer = papplJobGetPrinter(job);
 
-  // If margin info missing in the page size entries, use "HWMargins"
-  // line of the PPD file, otherwise zero
-  if (def_left >= 9999999)
-    def_left = (ppd->custom_margins[0] ?
-		(int)(ppd->custom_margins[0] / 72.0 * 2540.0) : 0);
-  if (def_bottom >= 9999999)
-    def_bottom = (ppd->custom_margins[1] ?
-		  (int)(ppd->custom_margins[1] / 72.0 * 2540.0) : 0);
-  if (def_right >= 9999999)
-    def_right = (ppd->custom_margins[2] ?
-		 (int)(ppd->custom_margins[2] / 72.0 * 2540.0) : 0);
-  if (def_top >= 9999999)
-    def_top = (ppd->custom_margins[3] ?
-	       (int)(ppd->custom_margins[3] / 72.0 * 2540.0) : 0);
+  //
+  // Load the printer's assigned PPD file, mark the defaults, and create the
+  // cache
+  //
 
-  // Set margin info
-  driver_data->left_right = (def_left < def_right ? def_left : def_right);
-  driver_data->bottom_top = (def_bottom < def_top ? def_bottom : def_top);
-  papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-	   "Margins: Left/Right: %d, Bottom/Top: %d",
-	   driver_data->left_right, driver_data->bottom_top);
+  job_data = (ps_job_data_t *)calloc(1, sizeof(ps_job_data_t));
+  clock_gettime(CLOCK_MONOTONIC, &job_data->start);
+  job_data->first_page = -1.0;
+  job_data->cache_fd   = -1;
 
-  // Set default for media
-  if (def_media)
-    ps_media_col(def_media, def_source, def_type, 0, 0, 0,
-		 &(driver_data->media_default));
+  papplPrinterGetDriverData(printer, &driver_data);
+  extension = (ps_driver_extension_t *)driver_data.extension;
+  job_data->ppd = extension->ppd;
+  pc = job_data->ppd->cache;
+  // Keep the vendor options while we read them, a driver update can
+  // replace them meanwhile
+  vendor = ps_vendor_get(extension);
+  job_data->cups_filter_ps = extension->cups_filter_ps;
+  job_data->temp_ppd_name = extension->temp_ppd_name;
+  if (job_data->cups_filter_ps)
+    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+		"Using CUPS filter for post-processing PostScript: %s",
+		job_data->cups_filter_ps);
+  else
+    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+		"Not using any CUPS filter for post-processing the PostScript");
+
+  driver_attrs = papplPrinterGetDriverAttributes(printer);
 
-  // "media-ready" not defined in PPDs, also cannot be polled from printer
-  // The user configures in the web interface what is loaded.
   //
-  // The web interface shows only the input trays which are actually
-  // installed on the printer, according to the configuration of
-  // installable accessories on the "Device Settings" page.
+  // Find the PPD (or filter) options corresponding to the job options
   //
-  // If the user accidentally removes a tray on the "Device Settings" page
-  // and re-adds it while the Printer Application is still running, the
-  // loaded media configuration gets restored.
-  if (update)
+
+  // Jobs with the same settings as an earlier job of the printer get the
+  // PPD options from the printer's memo
+  if ((memokey = ps_option_memo_key(job, job_options, &driver_data, vendor,
+				    driver_attrs, &memohash)) != NULL &&
+      ps_option_memo_get(extension, memokey, memohash, job_data,
+			 &memogeneration))
   {
-    for (i = 0, j = 0, pwg_map = pc->sources;
-	 i < pc->num_sources && j < PAPPL_MAX_SOURCE;
-	 i ++, pwg_map ++)
-    {
-      tmp_col.source[0] = '\0';
-      // Go through all media sources of the PPD file, to keep the order
-      if (!strcasecmp(pwg_map->pwg, driver_data->source[j]))
-      {
-	// Current PPD media source is available (installed)
-	if (strcasecmp(pwg_map->pwg, driver_data->media_ready[j].source))
-	{
-	  // There is no media-col-ready item for the current media source,
-	  // so first check whether we have it in the hidden "Undo" space
-	  // beyond the actually used media items (it should be there when
-	  // we had already set the source as installed earlier during this
-	  // session of the Printer Application
-	  for (k = j;
-	       k < PAPPL_MAX_SOURCE && driver_data->media_ready[k].source[0] &&
-		 strcasecmp(pwg_map->pwg, driver_data->media_ready[k].source);
-	       k ++);
-	  if (!strcasecmp(pwg_map->pwg, driver_data->media_ready[k].source))
-	    // Found desired item in hidden "Undo" space beyond the actually
-	    // used media-col-ready items
-	    memcpy(&tmp_col, &(driver_data->media_ready[k]),
-		   sizeof(pappl_media_col_t));
-	  else if (k == PAPPL_MAX_SOURCE)
-	    k --; // Do not push beyond the memory
-	  else if (k < PAPPL_MAX_SOURCE - 1)
-	    k ++; // Push up also the terminating zero item
-	  // Move up the other items to make space for the new item
-	  memmove(&(driver_data->media_ready[j + 1]),
-		  &(driver_data->media_ready[j]),
-		  (k - j) * sizeof(pappl_media_col_t));
-	  if (tmp_col.source[0])
-	    // Insert item from "Undo" space
-	    memcpy(&(driver_data->media_ready[j]), &tmp_col,
-		   sizeof(pappl_media_col_t));
-	  else
-	  {
-	    // Create new item, as this was not in "Undo" space
-	    memcpy(&(driver_data->media_ready[j]),
-		   &(driver_data->media_default),
-		   sizeof(pappl_media_col_t));
-	    strncpy(driver_data->media_ready[j].source, driver_data->source[j],
-		    sizeof(driver_data->media_ready[j].source));
-	  }
-	}
-	// Go on with next media source
-	j ++;
-      }
-      else
-      {
-	// Current PPD media source is unavailable (accessory not installed)
-	if (!strcasecmp(pwg_map->pwg, driver_data->media_ready[j].source))
-	{
-	  // Current media-col-ready item is the unavailable media source,
-	  // so move current media-col-ready away into the "Undo" space beyond
-	  // the actually used media-col-ready items, so its configuration
-	  // stays saved case we have removed the tray in the installable
-	  // accessories by accident
-	  memcpy(&tmp_col, &(driver_data->media_ready[j]),
-		 sizeof(pappl_media_col_t));
-	  // Pull down the rest
-	  for (k = j + 1;
-	       k < PAPPL_MAX_SOURCE && driver_data->media_ready[k].source[0];
-	       k ++);
-	  memmove(&(driver_data->media_ready[j]),
-		  &(driver_data->media_ready[j + 1]),
-		  (k - j - 1) * sizeof(pappl_media_col_t));
-	  // Drop the saved item into the freed slot in the "Undo" space
-	  memcpy(&(driver_data->media_ready[k - 1]), &tmp_col,
-		 sizeof(pappl_media_col_t));
-	}
-      }
-    }
-    // If there is no InputSlot (media source) option in the PPD file,
-    // set a single entry for the default media size and type
-    if (j == 0)
-    {
-      memcpy(&(driver_data->media_ready[0]), &(driver_data->media_default),
-	     sizeof(pappl_media_col_t));
-      j = 1;
-    }
-    // During initial loading of the state file add a terminating zero
-    // item to manage the "Undo" space when configuring available
-    // media trays on the printer
-    if (!papplSystemIsRunning(system) && j < PAPPL_MAX_SOURCE)
-      driver_data->media_ready[j].source[0] = '\0';
+    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+		"Adding options of earlier job with the same settings");
+    goto mapped;
   }
+
+  // Job options without PPD equivalent
+  //  - print-content-optimize
+  //  - print-darkness
+  //  - darkness-configured
+  //  - print-speed
+
+  // Finishings
+  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding options for finishings");
+  if (job_options->finishings & PAPPL_FINISHINGS_PUNCH)
+    job_data->num_options = ppdCacheGetFinishingOptions(pc, NULL,
+							IPP_FINISHINGS_PUNCH,
+							job_data->num_options,
+							&(job_data->options));
+  if (job_options->finishings & PAPPL_FINISHINGS_STAPLE)
+    job_data->num_options = ppdCacheGetFinishingOptions(pc, NULL,
+							IPP_FINISHINGS_STAPLE,
+							job_data->num_options,
+							&(job_data->options));
+  if (job_options->finishings & PAPPL_FINISHINGS_TRIM)
+    job_data->num_options = ppdCacheGetFinishingOptions(pc, NULL,
+							IPP_FINISHINGS_TRIM,
+							job_data->num_options,
+							&(job_data->options));
+
+  // PageSize/media/media-size/media-size-name, from the driver's lookup
+  // table, sizes not in it (custom or ambiguous) by the PPD cache
+  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding option: PageSize");
+  if ((choicestr = ps_lookup_find(&(extension->media_lookup),
+				  job_options->media.size_name)) != NULL)
+    job_data->num_options = cupsAddOption("PageSize", choicestr,
+					  job_data->num_options,
+					  &(job_data->options));
   else
   {
-    // Create media-col-ready items for each media source
-    for (i = 0; i < driver_data->num_source; i ++)
-    {
-      memcpy(&(driver_data->media_ready[i]), &(driver_data->media_default),
-	     sizeof(pappl_media_col_t));
-      strncpy(driver_data->media_ready[i].source, driver_data->source[i],
-	      sizeof(driver_data->media_ready[i].source));
-    }
-    // Add a terminating zero item to manage the "Undo" space when configuring
-    // available media trays on the printer
-    if (i < PAPPL_MAX_SOURCE)
-      driver_data->media_ready[i].source[0] = '\0';
+    attrs = ippNew();
+    media_col = ippNew();
+    media_size = ippNew();
+    ippAddInteger(media_size, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
+		  "x-dimension", job_options->media.size_width);
+    ippAddInteger(media_size, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
+		  "y-dimension", job_options->media.size_length);
+    ippAddCollection(media_col, IPP_TAG_PRINTER, "media-size", media_size);
+    ippDelete(media_size);
+    ippAddString(media_col, IPP_TAG_PRINTER, IPP_TAG_KEYWORD,
+		 "media-size-name", NULL, job_options->media.size_name);
+    ippAddInteger(media_col, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
+		  "media-left-margin", job_options->media.left_margin);
+    ippAddInteger(media_col, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
+		  "media-right-margin", job_options->media.right_margin);
+    ippAddInteger(media_col, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
+		  "media-top-margin", job_options->media.top_margin);
+    ippAddInteger(media_col, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
+		  "media-bottom-margin", job_options->media.bottom_margin);
+    ippAddCollection(attrs, IPP_TAG_PRINTER, "media-col", media_col);
+    ippDelete(media_col);
+    if ((choicestr = ppdCacheGetPageSize(pc, attrs, NULL, NULL)) != NULL)
+      job_data->num_options = cupsAddOption("PageSize", choicestr,
+					    job_data->num_options,
+					    &(job_data->options));
+    ippDelete(attrs);
   }
 
-  // Log "media-ready" entries
-  papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-	   "Entries for \"media-ready\":");
-  for (i = 0;
-       i < PAPPL_MAX_SOURCE && driver_data->media_ready[i].source[0];
-       i ++)
-  {
-    if (i == driver_data->num_source)
-      papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-	       "Undo buffer for \"media-ready\":");
-    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-	     "  %s: %s, %s%s, L=%d, B=%d, R=%d, T=%d",
-	     driver_data->media_ready[i].source,
-	     driver_data->media_ready[i].size_name,
-	     driver_data->media_ready[i].type,
-	     (driver_data->media_ready[i].bottom_margin ||
-	      driver_data->media_ready[i].left_margin ||
-	      driver_data->media_ready[i].right_margin ||
-	      driver_data->media_ready[i].top_margin ? "" : ", Borderless"),
-	     driver_data->media_ready[i].left_margin,
-	     driver_data->media_ready[i].bottom_margin,
-	     driver_data->media_ready[i].right_margin,
-	     driver_data->media_ready[i].top_margin);
-  }
+  // InputSlot/media-source
+  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding option: %s",
+	      pc->source_option ? pc->source_option : "InputSlot");
+  if ((choicestr = ps_lookup_find(&(extension->source_lookup),
+				  job_options->media.source)) != NULL ||
+      (choicestr = ppdCacheGetInputSlot(pc, NULL,
+					job_options->media.source)) != NULL)
+    job_data->num_options = cupsAddOption(pc->source_option, choicestr,
+					  job_data->num_options,
+					  &(job_data->options));
 
-  // Offsets not defined in PPDs
-  driver_data->left_offset_supported[0] = 0;
-  driver_data->left_offset_supported[1] = 0;
-  driver_data->top_offset_supported[0] = 0;
-  driver_data->top_offset_supported[1] = 0;
+  // MediaType/media-type
+  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding option: MediaType");
+  if ((choicestr = ps_lookup_find(&(extension->type_lookup),
+				  job_options->media.type)) != NULL ||
+      (choicestr = ppdCacheGetMediaType(pc, NULL,
+					job_options->media.type)) != NULL)
+    job_data->num_options = cupsAddOption("MediaType", choicestr,
+					  job_data->num_options,
+					  &(job_data->options));
 
-  // Media tracking not defined in PPDs
-  driver_data->tracking_supported = 0;
+  // orientation-requested (filter option)
+  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+	      "Adding option: orientation-requested");
+  if (job_options->orientation_requested >= IPP_ORIENT_PORTRAIT &&
+      job_options->orientation_requested <  IPP_ORIENT_NONE)
+  {
+    snprintf(buf, sizeof(buf), "%d", job_options->orientation_requested);
+    job_data->num_options = cupsAddOption("orientation-requested", buf,
+					  job_data->num_options,
+					  &(job_data->options));
+  }
 
-  // Output bins
-  if ((count = pc->num_bins) > 0 &&
-      (option = ppdFindOption(ppd, "OutputBin")) != NULL &&
-      (extension->cups_filter_ps ||
-       ps_option_has_code(system, ppd, option)))
+  // OutputBin/output-bin
+  if ((count = pc->num_bins) > 0)
   {
-    if (!update)
-      choice = ppdFindMarkedChoice(ppd, "OutputBin");
-    else
-    {
-      def_bin = strdup(driver_data->bin[driver_data->bin_default]);
-      for (i = 0; i < driver_data->num_bin; i ++)
-	free((char *)(driver_data->bin[i]));
-    }
-    driver_data->bin_default = 0;
-    for (i = 0, j = 0, pwg_map = pc->bins;
-	 i < count && j < PAPPL_MAX_BIN;
-	 i ++, pwg_map ++)
-      if (!(update && ppdInstallableConflict(ppd, "OutputBin", pwg_map->ppd)))
-      {
-	driver_data->bin[j] = strdup(pwg_map->pwg);
-	if ((!update && choice && !strcmp(pwg_map->ppd, choice->choice)) ||
-	    (update && !strcmp(pwg_map->pwg, def_bin)))
-	{
-	  driver_data->bin_default = j;
-	  ppdMarkOption(ppd, "OutputBin", pwg_map->ppd);
-	}
-	j ++;
-      }
-    driver_data->num_bin = j;
-    if (update)
-      free(def_bin);
+    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding option: OutputBin");
+    val = job_options->output_bin;
+    if ((choicestr = ps_lookup_find(&(extension->bin_lookup), val)) == NULL)
+      for (i = 0, pwg_map = pc->bins; i < count; i ++, pwg_map ++)
+	if (!strcmp(pwg_map->pwg, val))
+	  choicestr = pwg_map->ppd;
+    if (choicestr != NULL)
+      job_data->num_options = cupsAddOption("OutputBin", choicestr,
+					    job_data->num_options,
+					    &(job_data->options));
   }
+
+  // Presets, selected by color/bw and print quality
+  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+	      "Adding option presets depending on requested print quality");
+  if (job_data->ppd->color_device &&
+      (job_options->print_color_mode &
+       (PAPPL_COLOR_MODE_AUTO | PAPPL_COLOR_MODE_COLOR)) != 0)
+    pcm = 1;
+  else
+    pcm = 0;
+  if (job_options->print_quality == IPP_QUALITY_DRAFT)
+    pq = 0;
+  else if (job_options->print_quality == IPP_QUALITY_HIGH)
+    pq = 2;
   else
+    pq = 1;
+  num_presets = pc->num_presets[pcm][pq];
+  presets     = pc->presets[pcm][pq];
+  for (i = 0; i < num_presets; i ++)
+    job_data->num_options = cupsAddOption(presets[i].name, presets[i].value,
+					  job_data->num_options,
+					  &(job_data->options));
+
+  // Do we have a way to force grayscale printing?
+  if (pcm == 0)
   {
-    driver_data->num_bin = 0;
-    driver_data->bin_default = 0;
+    // Find suitable option in the PPD file and set it if available
+    if (ps_have_force_gray(job_data->ppd, &optstr, &choicestr) &&
+	cupsGetOption(optstr, job_data->num_options,
+		      job_data->options) == NULL)
+      job_data->num_options = cupsAddOption(optstr, choicestr,
+					    job_data->num_options,
+					    &(job_data->options));
+    // Add "ColorModel=Gray" to make filters converting color
+    // input to grayscale
+    if (cupsGetOption("ColorModel", job_data->num_options,
+		      job_data->options) == NULL)
+      job_data->num_options = cupsAddOption("ColorModel", "Gray",
+					    job_data->num_options,
+					    &(job_data->options));
   }
 
-  // Properties not defined in PPDs
-  driver_data->mode_configured = 0;
-  driver_data->mode_supported = 0;
-  driver_data->tear_offset_configured = 0;
-  driver_data->tear_offset_supported[0] = 0;
-  driver_data->tear_offset_supported[1] = 0;
-  driver_data->speed_supported[0] = 0;
-  driver_data->speed_supported[1] = 0;
-  driver_data->speed_default = 0;
-  driver_data->darkness_default = 0;
-  driver_data->darkness_configured = 0;
-  driver_data->darkness_supported = 0;
-  driver_data->num_features = 0;
-
-  // For each PPD option which is not supported by PAPPL/IPP add a
-  // vendor option, so that the default for the options can get set in
-  // the web interface or settings of these options can be supplied on
-  // the command line.
+  // print-scaling (filter option)
+  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding option: print-scaling");
+  if (job_options->print_scaling)
+  {
+    if (job_options->print_scaling & PAPPL_SCALING_AUTO)
+      job_data->num_options = cupsAddOption("print-scaling", "auto",
+					    job_data->num_options,
+					    &(job_data->options));
+    if (job_options->print_scaling & PAPPL_SCALING_AUTO_FIT)
+      job_data->num_options = cupsAddOption("print-scaling", "auto-fit",
+					    job_data->num_options,
+					    &(job_data->options));
+    if (job_options->print_scaling & PAPPL_SCALING_FILL)
+      job_data->num_options = cupsAddOption("print-scaling", "fill",
+					    job_data->num_options,
+					    &(job_data->options));
+    if (job_options->print_scaling & PAPPL_SCALING_FIT)
+      job_data->num_options = cupsAddOption("print-scaling", "fit",
+					    job_data->num_options,
+					    &(job_data->options));
+    if (job_options->print_scaling & PAPPL_SCALING_NONE)
+      job_data->num_options = cupsAddOption("print-scaling", "none",
+					    job_data->num_options,
+					    &(job_data->options));
+  }
 
-  // Clean up old option lists on update
-  if (update)
-    for (i = 0; i < driver_data->num_vendor; i ++)
+  // Resolution/printer-resolution
+  // Only add a "Resolution" option if there is none yet (from presets)
+  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding option: Resolution");
+  if (cupsGetOption("Resolution", job_data->num_options,
+		    job_data->options) == NULL)
+  {
+    if ((job_options->printer_resolution[0] &&
+	 ((attr = papplJobGetAttribute(job, "printer-resolution")) != NULL ||
+	  (attr = papplJobGetAttribute(job, "Resolution")) != NULL) &&
+	 extension->num_resolutions > 0))
     {
-      free((char *)(driver_data->vendor[i]));
-      if (extension->vendor_ppd_options[i])
-	free((char *)(extension->vendor_ppd_options[i]));
+      // Choices of the Resolution option by resolution, parsed at driver
+      // setup, a resolution without vertical part is square
+      snprintf(buf, sizeof(buf), "%dx%d", job_options->printer_resolution[0],
+	       job_options->printer_resolution[1] ?
+	       job_options->printer_resolution[1] :
+	       job_options->printer_resolution[0]);
+      if ((choicestr = ps_lookup_find(&(extension->resolution_lookup),
+				      buf)) != NULL)
+	job_data->num_options = cupsAddOption("Resolution", choicestr,
+					      job_data->num_options,
+					      &(job_data->options));
     }
-
-  // Go through all the options of the PPD file
-  driver_data->num_vendor = 0;
-  for (i = ppd->num_groups, group = ppd->groups;
-       i > 0;
-       i --, group ++)
-  {
-    for (j = group->num_options, option = group->options;
-         j > 0;
-         j --, option ++)
+    else if (job_options->printer_resolution[0])
     {
-      // Does the option allow custom values?
-      num_cparams = 0;
-      if ((coption = ppdFindCustomOption(ppd, option->keyword)) != NULL)
-	num_cparams = cupsArrayCount(coption->params);
-
-      // Does the option have less than 2 choices and also does not
-      // allow custom values? Then it does not make sense to let it
-      // show in the web interface
-      if (option->num_choices < 2 && num_cparams == 0)
-	continue;
-
-      // Can printer's default setting of this option be polled from the
-      // printer?
-      snprintf(buf, sizeof(buf), "?%s", option->keyword);
-      if ((ppd_attr = ppdFindAttr(ppd, buf, NULL)) != NULL &&
-	  ppd_attr->value)
-      {
-	pollable = true;
-	papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-		 "Default of option \"%s\" (\"%s\") can get queried from "
-		 "printer.", option->keyword, option->text);
-      }
+      if (job_options->printer_resolution[1] &&
+	  job_options->printer_resolution[0] !=
+	  job_options->printer_resolution[1])
+	snprintf(buf, sizeof(buf) - 1, "%dx%ddpi",
+		 job_options->printer_resolution[0],
+		 job_options->printer_resolution[1]);
       else
-	pollable = false;
+	snprintf(buf, sizeof(buf) - 1, "%ddpi",
+		 job_options->printer_resolution[0]);
+      job_data->num_options = cupsAddOption("Resolution", buf,
+					    job_data->num_options,
+					    &(job_data->options));
+    }
+    else if ((ppd_attr = ppdFindAttr(job_data->ppd, "DefaultResolution",
+				     NULL)) != NULL)
+      job_data->num_options = cupsAddOption("Resolution", ppd_attr->value,
+					    job_data->num_options,
+					    &(job_data->options));
+  }
 
-      // Skip the group for installable options here, as they should not
-      // show on the "Printing Defaults" page nor be listed in the response
-      // to a get-printer-atrributes IPP request from a client.
-      // Only note the fact that we have such options in the PPD file
-      if (strncasecmp(group->name, "Installable", 11) == 0)
-      {
-	papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-		 "Installable accessory option: \"%s\" (\"%s\")",
-		 option->keyword, option->text);
-	extension->installable_options = true;
-	if (pollable)
-	  extension->installable_pollable = true;
-	continue;
-      }
-
-      // Do we have a pollable option? Mark that we have one so that
-      // we can show an appropriate poll button in the web interface
-      if (pollable)
-	extension->defaults_pollable = true;
+  // Duplex/sides
+  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding option: Duplex");
+  if (job_options->sides && pc->sides_option)
+  {
+    if (job_options->sides & PAPPL_SIDES_ONE_SIDED &&
+	pc->sides_1sided)
+      job_data->num_options = cupsAddOption(pc->sides_option,
+					    pc->sides_1sided,
+					    job_data->num_options,
+					    &(job_data->options));
+    else if (job_options->sides & PAPPL_SIDES_TWO_SIDED_LONG_EDGE &&
+	     pc->sides_2sided_long)
+      job_data->num_options = cupsAddOption(pc->sides_option,
+					    pc->sides_2sided_long,
+					    job_data->num_options,
+					    &(job_data->options));
+    else if (job_options->sides & PAPPL_SIDES_TWO_SIDED_SHORT_EDGE &&
+	     pc->sides_2sided_short)
+      job_data->num_options = cupsAddOption(pc->sides_option,
+					    pc->sides_2sided_short,
+					    job_data->num_options,
+					    &(job_data->options));
+  }
 
-      // Is this option already handled by PAPPL/IPP
-      for (k = 0; pappl_handled_options[k]; k ++)
-	if (!strcasecmp(option->keyword, pappl_handled_options[k]))
-	  break;
-      if (pappl_handled_options[k] ||
-	  (pc->source_option &&
-	   !strcasecmp(option->keyword, pc->source_option)) ||
-	  (pc->sides_option &&
-	   !strcasecmp(option->keyword, pc->sides_option)))
-	continue;
+  //
+  // Add vendor-specific PPD options
+  //
 
-      // Check whether there is not more than one at least all but one choice
-      // without active PostScript or PJL code to inject into the job stream
-      if (!extension->cups_filter_ps &&
-	  !ps_option_has_code(system, ppd, option))
-	continue;
+  for (i = 0, vopt = vendor ? vendor->options : NULL;
+       vendor && i < vendor->num_options; i ++, vopt ++)
+  {
+    // Skip the options of the Printer Application itself and the
+    // placeholder for the "Installable Options", they do not correspond
+    // to a PPD option
+    if (extension->vendor_ppd_options[i] == NULL)
+      continue;
+    if ((param = vopt->param) == NULL) {
+      papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding option: %s",
+		  extension->vendor_ppd_options[i]);
+      coption = NULL;
+      num_cparams = 0;
+      k = 0;
+    }
+    else
+      papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "  Custom parameter: %s", param);
+    if ((attr = papplJobGetAttribute(job, driver_data.vendor[i])) == NULL ||
+	ippGetString(attr, 0, NULL) == NULL)
+      attr = ippFindAttribute(driver_attrs, vopt->default_name, IPP_TAG_ZERO);
 
-      // Stop and warn if we have no slots for vendor attributes any more
-      // Note that we reserve one slot for saving the "Installable Options"
-      // in the state file
-      // We also take into account here that each custom parameter for this
-      // option requires one additional vendor option
-      if (driver_data->num_vendor >= PAPPL_MAX_VENDOR - 1 - num_cparams)
+    choicestr = NULL;
+    if (attr)
+    {
+      val = NULL;
+      if (ippGetValueTag(attr) == IPP_TAG_BOOLEAN)
+	val = ippGetBoolean(attr, 0) ? "True" : "False";
+      else if (ippGetValueTag(attr) == IPP_TAG_INTEGER)
+	intval = ippGetInteger(attr, 0);
+      else
+	val = ippGetString(attr, 0, NULL);
+      if (param)
       {
-	papplLog(system, PAPPL_LOGLEVEL_WARN,
-		 "Too many options in PPD file, \"%s\" (\"%s\") will not be controllable!",
-		 option->keyword, option->text);
-	continue;
-      }
-
-      // IPP-style option name
-      ppdPwgUnppdizeName(option->text, ipp_opt, sizeof(ipp_opt), NULL);
-
-      // Check whether we have a duplicate (PPD bug: 2 Options have same
-      // Human-readable string)
-      for (k = 0; k < driver_data->num_vendor; k ++)
-	if (strcmp(ipp_opt, driver_data->vendor[k]) == 0)
+	if (!option || !coption || num_cparams <= 0 || k >= num_cparams)
+	  continue;
+	if (num_cparams == 1)
 	{
-	  papplLog(system, PAPPL_LOGLEVEL_WARN,
-		   "Two options with the same human-readable name in the PPD file (PPD file bug): \"%s\" and \"%s\" both have \"%s\", giving the IPP attribute name \"%s\"",
-		   extension->vendor_ppd_options[k],
-		   option->keyword, option->text, ipp_opt);
-	  break;
+	  if (ippGetValueTag(attr) == IPP_TAG_INTEGER)
+	    snprintf(paramstr, sizeof(paramstr) - 1, "Custom.%d", intval);
+	  else
+	    snprintf(paramstr, sizeof(paramstr) - 1, "Custom.%s", val);
 	}
-      if (k < driver_data->num_vendor)
-	continue;
-
-      // IPP attribute names for available values and default value
-      snprintf(ipp_supported, sizeof(ipp_supported), "%s-supported", ipp_opt);
-      snprintf(ipp_default, sizeof(ipp_default), "%s-default", ipp_opt);
-
-      // Add vendor option and its choices to driver IPP attributes
-      if (option->ui == PPD_UI_PICKONE || option->ui == PPD_UI_BOOLEAN)
-      {
-	papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-		 "Adding vendor-specific option \"%s\" (\"%s\") as IPP option "
-		 "\"%s\"", option->keyword, option->text, ipp_opt);
-	if (*driver_attrs == NULL)
-	  *driver_attrs = ippNew();
-	if (option->num_choices == 2 &&
-	    ((!strcasecmp(option->choices[0].text, "true") &&
-	      !strcasecmp(option->choices[1].text, "false")) ||
-	     (!strcasecmp(option->choices[0].text, "false") &&
-	      !strcasecmp(option->choices[1].text, "true"))))
+	else
 	{
-	  // Create a boolean IPP option, as human-readable choices "true"
-	  // and "false" are not very user-friendly
-
-	  // On update, remove IPP attributes, keep default
-	  default_choice = 0;
-	  if (update)
-          {
-	    ippDeleteAttribute(*driver_attrs,
-			       ippFindAttribute(*driver_attrs, ipp_supported,
-						IPP_TAG_ZERO));
-	    attr = ippFindAttribute(*driver_attrs, ipp_default, IPP_TAG_ZERO);
-	    if (attr)
-	    {
-	      default_choice = ippGetBoolean(attr, 0);
-	      ippDeleteAttribute(*driver_attrs, attr);
-	    }
-	    else
-	      default_choice = 0;
-	    if (ppdInstallableConflict(ppd, option->keyword,
-				       option->choices[0].choice))
-	      default_choice = -1;
-	    if (ppdInstallableConflict(ppd, option->keyword,
-				       option->choices[1].choice))
-	    {
-	      if (default_choice >= 0)
-		ppdMarkOption(ppd, option->keyword, option->choices[0].choice);
-	      default_choice = -1;
-	    }
-	    else if (default_choice < 0)
-	      ppdMarkOption(ppd, option->keyword, option->choices[1].choice);
-	    if (default_choice < 0)
-	    {
-	      papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-		       "  -> Skipping - Boolean option does not make sense with current accessory configuration");
-	      continue;
-	    }
-	  }
-	  else
+	  if (k == 0)
 	  {
-	    default_choice = 0;
-	    for (k = 0; k < 2; k ++)
-	      if (option->choices[k].marked &&
-		  !strcasecmp(option->choices[k].text, "true"))
-		default_choice = 1;
+	    paramstr[0] = '{';
+	    paramstr[1] = '\0';
 	  }
-	  papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-		   "  Default: %s", (default_choice ? "true" : "false"));
-	  ippAddBoolean(*driver_attrs, IPP_TAG_PRINTER, ipp_supported, 1);
-	  ippAddBoolean(*driver_attrs, IPP_TAG_PRINTER, ipp_default,
-			default_choice);
+	  if (ippGetValueTag(attr) == IPP_TAG_INTEGER)
+	    snprintf(paramstr + strlen(paramstr),
+		     sizeof(paramstr) - strlen(paramstr) - 1,
+		     "%s=%d ", param, intval);
+	  else
+	    snprintf(paramstr + strlen(paramstr),
+		     sizeof(paramstr) - strlen(paramstr) - 1,
+		     "%s=%s ", param, val);
+	  if (k == num_cparams - 1)
+	    paramstr[strlen(paramstr) - 1] = '}';
 	}
-	else
+	if (k == num_cparams - 1)
+	  job_data->num_options =
+	    cupsAddOption(option->keyword, paramstr, job_data->num_options,
+			  &(job_data->options));
+	k ++;
+      }
+      else
+      {
+	if ((option = vopt->option) == NULL)
+        {
+	  // Should never happen
+	  papplLogJob(job, PAPPL_LOGLEVEL_ERROR,
+		      "  PPD Option not correctly registered (bug), "
+		      "skipping ...");
+	  continue;
+	}
+	if (val == NULL)
+        {
+	  // Should never happen
+	  papplLogJob(job, PAPPL_LOGLEVEL_ERROR,
+		      "  PPD option not enumerated choice or boolean, "
+		      "skipping ...");
+	  continue;
+	}
+	// The IPP keywords of the choices got compiled at driver setup,
+	// only keywords not matching exactly (different case, ambiguous)
+	// need a scan through the choices. The index of the choice is the
+	// one in the PPD option.
+	if (ippGetValueTag(attr) == IPP_TAG_BOOLEAN)
+	  j = vopt->bool_choices[ippGetBoolean(attr, 0) ? 1 : 0];
+	else if ((j = ps_lookup_index(&(vopt->choices), val)) < 0)
 	{
-	  // Create an enumerated-choice IPP option
+	  for (j = 0; j < vopt->num_maps && strcasecmp(vopt->maps[j].pwg, val);
+	       j ++);
+	  if (j == vopt->num_maps)
+	    j = -1;
+	}
+	if (j < 0)
+	  continue;
+	choicestr = vopt->maps[j].ppd;
 
-	  // On update, remove IPP attributes, keep default
-	  if (update)
-          {
-	    ippDeleteAttribute(*driver_attrs,
-			       ippFindAttribute(*driver_attrs, ipp_supported,
-						IPP_TAG_ZERO));
-	    attr = ippFindAttribute(*driver_attrs, ipp_default, IPP_TAG_ZERO);
-	    if (attr)
-	    {
-	      ippAttributeString(attr, buf, sizeof(buf));
-	      ippDeleteAttribute(*driver_attrs, attr);
-	    }
-	    else
-	      buf[0] = '\0';
-	  }
-	  choice_list = (char **)calloc(option->num_choices, sizeof(char *));
-	  first_choice = -1;
-	  default_choice = -1;
-	  for (k = 0, l = 0; k < option->num_choices; k ++)
-	    if (!(update && ppdInstallableConflict(ppd, option->keyword,
-						   option->choices[k].choice)))
-	    {
-	      // If we have custom parameters (we accept a custom value)
-	      // the last choice of this option is "Custom". Only accept
-	      // this choice if PAPPL supports all the parameters (only
-	      // strings and integer numbers are supported)
-	      if (k == option->num_choices - 1 && num_cparams > 0)
-	      {
-		for (m = 0; m < num_cparams; m++)
-		{
-		  cparam = (ppd_cparam_t *)cupsArrayIndex(coption->params, m);
-		  if (cparam->type != PPD_CUSTOM_INT &&
-		      cparam->type != PPD_CUSTOM_STRING &&
-		      cparam->type != PPD_CUSTOM_PASSWORD &&
-		      cparam->type != PPD_CUSTOM_PASSCODE)
-		    break;
-		}
-		if (m < num_cparams)
-		{
-		  papplLog(system, PAPPL_LOGLEVEL_WARN,
-			   "  Custom setting for this option not possible, as the parameter \"%s\" (\"%s\") is of a format not supported by PAPPL",
-			   cparam->name, cparam->text);
-		  num_cparams = 0;
-		  continue;
-		}
-	      }
-	      ppdPwgUnppdizeName(option->choices[k].text,
-				 ipp_choice, sizeof(ipp_choice), NULL);
-	      // Check whether we have a duplicate (PPD bug: 2 Choices have same
-	      // Human-readable string)
-	      for (m = 0; m < l; m ++)
-		if (strcmp(ipp_choice, choice_list[m]) == 0)
-		{
-		  papplLog(system, PAPPL_LOGLEVEL_WARN,
-			   "  Two choices with the same human-readable name in the PPD file (PPD file bug): Choice \"%s\" (\"%s\") giving the IPP choice name \"%s\"",
-			   option->choices[k].choice,
-			   option->choices[k].text, ipp_choice);
-		  if (k == option->num_choices - 1 && num_cparams > 0)
-		    num_cparams = 0;
-		  break;
-		}
-	      if (m < l)
-		continue;
-	      // Choice is valid, add it
-	      choice_list[l] = strdup(ipp_choice);
-	      if (first_choice < 0)
-		first_choice = k;
-	      if ((!update && option->choices[k].marked) ||
-		  (update && buf[0] && !strcasecmp(ipp_choice, buf)))
-	      {
-		default_choice = l;
-		ppdMarkOption(ppd, option->keyword, option->choices[k].choice);
-	      }
-	      papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-		       "  Adding choice \"%s\" (\"%s\") as \"%s\"%s",
-		       option->choices[k].choice, option->choices[k].text,
-		       ipp_choice,
-		       default_choice == l ? " (default)" : "");
-	      l ++;
-	    }
-	    else if (k == option->num_choices - 1 && num_cparams > 0)
-	      // Last choice is the "custom" choice if an option allows custom
-	      // values, if it is dropped, this option does not allow custom
-	      // values any more
-	      num_cparams = 0;
-	  if (l > 0 && default_choice < 0)
-	  {
-	    default_choice = 0;
-	    ppdMarkOption(ppd, option->keyword,
-			  option->choices[first_choice].choice);
-	  }
-	  if (l >= 2)
-	  {
-	    ippAddStrings(*driver_attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD,
-			  ipp_supported, l, NULL,
-			  (const char * const *)choice_list);
-	    ippAddString(*driver_attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD,
-			 ipp_default, NULL, choice_list[default_choice]);
-	  }
-	  for (k = 0; k < l; k ++)
-	    free(choice_list[k]);
-	  free(choice_list);
-	  if (l == 0 || (l == 1 && num_cparams == 0))
-	  {
-	    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-		     "   -> Skipping - Option does not make sense with current accessory configuration");
-	    continue;
-	  }
-	}
-      }
-      else
-	continue;
-
-      // Add vendor option to lookup lists
-      driver_data->vendor[driver_data->num_vendor] = strdup(ipp_opt);
-      extension->vendor_ppd_options[driver_data->num_vendor] =
-	strdup(option->keyword);
-
-      // Next entry ...
-      driver_data->num_vendor ++;
-
-      // Does the option allow a custom value?
-      if (num_cparams == 0)
-	continue;
-
-      // Go through all custom parameters of the option
-      for (k = 0; k < num_cparams; k++)
-      {
-	cparam = (ppd_cparam_t *)cupsArrayIndex(coption->params, k);
-	// Name for extra vendor option to set this parameter
-	if (num_cparams == 1)
-	  snprintf(ipp_custom_opt, sizeof(ipp_custom_opt), "custom-%s", ipp_opt);
-	else
-	{
-	  ppdPwgUnppdizeName(cparam->text, ipp_param, sizeof(ipp_param), NULL);
-	  snprintf(ipp_custom_opt, sizeof(ipp_custom_opt), "custom-%s-for-%s",
-		   ipp_param, ipp_opt);
-	}
-	snprintf(ipp_supported, sizeof(ipp_supported), "%s-supported",
-		 ipp_custom_opt);
-	snprintf(ipp_default, sizeof(ipp_default), "%s-default",
-		 ipp_custom_opt);
-	// Create extra vendor option for each custom parameter, according to
-	// the data type
-	switch (cparam->type)
+	bit = vopt->first_bit < 0 ? -1 : vopt->first_bit + j;
+	if (ps_constraints_test(&(extension->constraints), bit))
 	{
-	case PPD_CUSTOM_INT:
-	  if (!ippFindAttribute(*driver_attrs, ipp_default, IPP_TAG_ZERO))
-	    ippAddInteger(*driver_attrs, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
-			  ipp_default,
-			  (cparam->minimum.custom_int <= 0 &&
-			   cparam->maximum.custom_int >= 0 ? 0 :
-			   (cparam->maximum.custom_int < 0 ?
-			    cparam->maximum.custom_int :
-			    cparam->minimum.custom_int)));
-	  if (!ippFindAttribute(*driver_attrs, ipp_supported, IPP_TAG_ZERO))
-	    ippAddRange(*driver_attrs, IPP_TAG_PRINTER, ipp_supported,
-			cparam->minimum.custom_int, cparam->maximum.custom_int);
-	  break;
-	case PPD_CUSTOM_STRING:
-	case PPD_CUSTOM_PASSCODE:
-	case PPD_CUSTOM_PASSWORD:
-	  if (!ippFindAttribute(*driver_attrs, ipp_default, IPP_TAG_ZERO))
-	    ippAddString(*driver_attrs, IPP_TAG_PRINTER, IPP_TAG_TEXT,
-			 ipp_default, NULL, "");
-	  break;
-	case PPD_CUSTOM_CURVE:
-	case PPD_CUSTOM_INVCURVE:
-	case PPD_CUSTOM_POINTS:
-	case PPD_CUSTOM_REAL:
-	case PPD_CUSTOM_UNKNOWN:
-	default:
-	  papplLog(system, PAPPL_LOGLEVEL_ERROR,
-		   "  Unsupported parameter \"%s\" (\"%s\") as IPP attribute \"%s\" -> This should never happen, \"Custom\" choice should have been rejected",
-		   cparam->name, cparam->text, ipp_custom_opt);
-	  break;
+	  ps_constraints_resolve(&(extension->constraints), bit, buf,
+				 sizeof(buf));
+	  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+		      "  Choice %s conflicts with the installable accessories "
+		      "(%s), skipping ...", choicestr, buf);
+	  continue;
 	}
-	papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-		 "  Adding custom parameter \"%s\" (\"%s\") as IPP attribute \"%s\"",
-		 cparam->name, cparam->text, ipp_custom_opt);
-	// Add parameter vendor option to lookup lists
-	driver_data->vendor[driver_data->num_vendor] = strdup(ipp_custom_opt);
-	snprintf(buf, sizeof(buf), "%s:%s", option->keyword, cparam->name);
-	extension->vendor_ppd_options[driver_data->num_vendor] = strdup(buf);
-	// Next entry ...
-	driver_data->num_vendor ++;
+	if (strcasecmp(choicestr, "Custom") ||
+	    (coption = vopt->coption) == NULL ||
+	    (num_cparams = vopt->num_cparams) <= 0)
+	  job_data->num_options =
+	    cupsAddOption(option->keyword, choicestr, job_data->num_options,
+			  &(job_data->options));
       }
     }
   }
 
-  // Add a vendor option as placeholder for saving the settings for the
-  // "Installable Options" in the state file. With no "...-supported" IPP
-  // attribute and IPP_TAG_TEXT format it will not appear on the "Printing
-  // Defaults" web interface page.
-  if (extension->installable_options)
+  // Collate (will only be used with PDF or PostScript input)
+  if ((attr =
+       papplJobGetAttribute(job,
+			    "multiple-document-handling")) != NULL)
   {
-    driver_data->vendor[driver_data->num_vendor] =
-      strdup("installable-options");
-    extension->vendor_ppd_options[driver_data->num_vendor] = NULL;
-    driver_data->num_vendor ++;
-    if (!update)
-      ippAddString(*driver_attrs, IPP_TAG_PRINTER, IPP_TAG_TEXT,
-		   "installable-options-default", NULL, "");
+    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Adding option: Collate");
+    val = ippGetString(attr, 0, NULL);
+    if (strstr(val, "uncollate"))
+      choicestr = "False";
+    else if (strstr(val, "collate"))
+      choicestr = "True";
+    job_data->num_options = cupsAddOption("Collate", choicestr,
+					  job_data->num_options,
+					  &(job_data->options));
   }
 
-  return (true);
-}
+  if (memokey)
+    ps_option_memo_put(extension, memokey, memohash, job_data,
+		       memogeneration);
 
+ mapped:
+  free(memokey);
+  ps_vendor_release(extension, vendor);
 
-//
-// 'ps_filter()' - PAPPL generic filter function wrapper
-//
+  // page-ranges (filter option)
+  if (job_options->first_page == 0)
+    job_options->first_page = 1;
+  if (job_options->last_page == 0)
+    job_options->last_page = INT_MAX;
+  if (job_options->first_page > 1 || job_options->last_page < INT_MAX)
+  {
+    snprintf(buf, sizeof(buf), "%d-%d",
+	     job_options->first_page, job_options->last_page);
+    job_data->num_options = cupsAddOption("page-ranges", buf,
+					  job_data->num_options,
+					  &(job_data->options));
+  }
 
-bool
-ps_filter(
-    pappl_job_t    *job,		// I - Job
-    pappl_device_t *device,		// I - Device
-    void           *data)		// I - Filter data
-{
-  int                   i, j, count;
-  ps_job_data_t         *job_data;      // PPD data for job
-  ps_filter_data_t	*psfd = (ps_filter_data_t *)data;
-  const char		*filename;	// Input filename
-  int			fd;		// Input file descriptor
-  int                   nullfd;         // File descriptor for /dev/null
-  pappl_pr_options_t	*job_options;	// Job options
-  bool			ret = false;	// Return value
-  char                  buf[1024];      // Buffer for building strings
-  filter_external_cups_t* ppd_filter_params = NULL; // Parameters for CUPS
-                                        // filter defined in the PPD
-  pappl_printer_t       *printer = papplJobGetPrinter(job);
+  // Mark options in the PPD file
+  ppdMarkOptions(job_data->ppd, job_data->num_options, job_data->options);
 
-  //
-  // Load the printer's assigned PPD file, and find out which PPD option
-  // seetings correspond to our job options
-  //
+  // Job attributes not handled by the PPD options which could be used by
+  // some CUPS filters or filter functions
+  for (i = 0; extra_attributes[i]; i ++)
+    if ((attr = papplJobGetAttribute(job, extra_attributes[i])) != NULL &&
+	(val = ippGetString(attr, 0, NULL)) != NULL)
+      job_data->num_options = cupsAddOption(extra_attributes[i], val,
+					    job_data->num_options,
+					    &(job_data->options));
 
-  job_options = papplJobCreatePrintOptions(job, INT_MAX, 1);
-  job_data = ps_create_job_data(job, job_options);
+  // Add options with time of creation and time of processing of the job
+  if ((t = papplJobGetTimeCreated(job)) > 0)
+  {
+    snprintf(buf, sizeof(buf) - 1, "%ld", t);
+    job_data->num_options = cupsAddOption("time-at-creation", buf,
+					  job_data->num_options,
+					  &(job_data->options));
+  }
+  if ((t = papplJobGetTimeProcessed(job)) > 0)
+  {
+    snprintf(buf, sizeof(buf) - 1, "%ld", t);
+    job_data->num_options = cupsAddOption("time-at-processing", buf,
+					  job_data->num_options,
+					  &(job_data->options));
+  }
+
+  // Log the option settings which will get used
+  snprintf(buf, sizeof(buf) - 1, "PPD options to be used:");
+  for (i = job_data->num_options, opt = job_data->options; i > 0; i --, opt ++)
+    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf) - 1,
+	     " %s=%s", opt->name, opt->value);
+  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "%s", buf);
 
   //
-  // Open the input file...
+  // Options of the Printer Application itself, for the raster output
   //
 
-  filename = papplJobGetFilename(job);
-  if ((fd = open(filename, O_RDONLY)) < 0)
+  // Compression of raster data (PostScript level 2 or later): "auto"
+  // chooses per page among all compressors the printer's PostScript
+  // level supports, otherwise only the selected one is used. Printers
+  // with broken decoders get a fixed setting.
+  job_data->codecs = 1 << PS_CODEC_NONE;
+  if (job_data->ppd->language_level >= 2)
   {
-    papplLogJob(job, PAPPL_LOGLEVEL_ERROR, "Unable to open input file '%s': %s",
-		filename, strerror(errno));
-    return (false);
+    if ((attr = ps_job_vendor_attribute(job, driver_attrs,
+					"raster-compression")) == NULL ||
+	(val = ippGetString(attr, 0, NULL)) == NULL)
+      val = "auto";
+    for (i = 0; i < PS_CODEC_MAX; i ++)
+      if (ps_codec_levels[i] <= job_data->ppd->language_level &&
+	  (!strcmp(val, "auto") || !strcmp(val, ps_codec_names[i])))
+	job_data->codecs |= 1 << i;
+    if (strcmp(val, "auto"))
+      job_data->codecs &= ~((1 << PS_CODEC_NONE) | (1 << PS_CODEC_CCITT) |
+			    (1 << PS_CODEC_DCT));
+    if (!job_data->codecs)
+      job_data->codecs = 1 << PS_CODEC_NONE;
+
+    job_data->encoder.flate_level = PS_DEFAULT_COMPRESSION_LEVEL;
+    if ((attr = ps_job_vendor_attribute(job, driver_attrs,
+					"raster-compression-level")) != NULL &&
+	ippGetValueTag(attr) == IPP_TAG_INTEGER &&
+	(intval = ippGetInteger(attr, 0)) >= 1 && intval <= 9)
+      job_data->encoder.flate_level = intval;
+
+    job_data->encoder.jpeg_quality = PS_DEFAULT_JPEG_QUALITY;
+    if ((attr = ps_job_vendor_attribute(job, driver_attrs,
+					"jpeg-quality")) != NULL &&
+	ippGetValueTag(attr) == IPP_TAG_INTEGER &&
+	(intval = ippGetInteger(attr, 0)) >= 1 && intval <= 100)
+      job_data->encoder.jpeg_quality = intval;
+
+    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+		"Raster data compression: %s (Flate level %d, JPEG quality "
+		"%d)", val, job_data->encoder.flate_level,
+		job_data->encoder.jpeg_quality);
   }
 
-  //
-  // Set up filter function chain
-  //
+  // Binary image data if the printer supports it, unless switched off.
+  // Not with a CUPS filter from the PPD, as it could choke on the binary
+  // data or not pass it through correctly. PostScript level 1 printers
+  // get hex data.
+  job_data->transport.mode = job_data->ppd->language_level >= 2 ?
+			     PS_TRANSPORT_ASCII85 : PS_TRANSPORT_HEX;
+  if (job_data->ppd->language_level >= 2 &&
+      extension->binary_transport != PS_TRANSPORT_ASCII85 &&
+      !job_data->cups_filter_ps &&
+      (attr = ps_job_vendor_attribute(job, driver_attrs,
+				      "image-data-transport")) != NULL &&
+      (val = ippGetString(attr, 0, NULL)) != NULL &&
+      !strcmp(val, "binary"))
+    job_data->transport.mode = extension->binary_transport;
+
+  // PDF input sent to the printer as PDF?
+  job_data->pdf_native =
+    (attr = ps_job_vendor_attribute(job, driver_attrs,
+				    "pdf-job-format")) != NULL &&
+    (val = ippGetString(attr, 0, NULL)) != NULL && !strcmp(val, "pdf");
 
-  job_data->chain = cupsArrayNew(NULL, NULL);
-  job_data->filter =
-    (filter_filter_in_chain_t *)calloc(1, sizeof(filter_filter_in_chain_t));
-  job_data->filter->function = psfd->filter_function;
-  job_data->filter->parameters = psfd->filter_parameters;
-  job_data->filter->name = "Filtering";
-  cupsArrayAdd(job_data->chain, job_data->filter);
-  if (job_data->cups_filter_ps)
-  {
-    ppd_filter_params =
-      (filter_external_cups_t *)calloc(1, sizeof(filter_external_cups_t));
-    ppd_filter_params->filter = job_data->cups_filter_ps;
-    job_data->ppd_filter =
-      (filter_filter_in_chain_t *)calloc(1, sizeof(filter_filter_in_chain_t));
-    job_data->ppd_filter->function = filterExternalCUPS;
-    job_data->ppd_filter->parameters = ppd_filter_params;
-    job_data->ppd_filter->name = "Post-filtering";
-    cupsArrayAdd(job_data->chain, job_data->ppd_filter);
-  }
-  job_data->print =
-    (filter_filter_in_chain_t *)calloc(1, sizeof(filter_filter_in_chain_t));
-  job_data->print->function = ps_print_filter_function;
-  job_data->print->parameters = device;
-  job_data->print->name = "Printing";
-  cupsArrayAdd(job_data->chain, job_data->print);
-
-  //
-  // Fire up the filter functions
-  //
-
-  papplJobSetImpressions(job, 1);
-
-  // The filter chain has no output, data is going to the device
-  nullfd = open("/dev/null", O_RDWR);
-
-  if (filterChain(fd, nullfd, 1, job_data->filter_data, job_data->chain) == 0)
-    ret = true;
-
-  //
   // Clean up
-  //
-
-  if (ppd_filter_params)
-    free(ppd_filter_params);
-  papplJobDeletePrintOptions(job_options);
-  ps_free_job_data(job_data);
-  close(fd);
-  close(nullfd);
-
-  return (ret);
-}
-
+  ippDelete(driver_attrs);
 
-//
-// 'ps_free_job_data()' - Clean up job data with PPD options.
-//
+  // Prepare job data to be supplied to filter functions/CUPS filters
+  // called during job execution
+  filter_data = (filter_data_t *)calloc(1, sizeof(filter_data_t));
+  job_data->filter_data = filter_data;
+  filter_data->printer = strdup(papplPrinterGetName(printer));
+  filter_data->job_id = papplJobGetID(job);
+  filter_data->job_user = strdup(papplJobGetUsername(job));
+  filter_data->job_title = strdup(papplJobGetName(job));
+  filter_data->copies = job_options->copies;
+  filter_data->job_attrs = NULL;     // We use PPD/filter options
+  filter_data->printer_attrs = NULL; // We use the printer's PPD file
+  filter_data->num_options = job_data->num_options;
+  filter_data->options = job_data->options; // PPD/filter options
+  filter_data->ppdfile = job_data->temp_ppd_name;
+  filter_data->ppd = job_data->ppd;
+  filter_data->logfunc = ps_job_log; // Job log function catching page counts
+                                    // ("PAGE: XX YY" messages)
+  filter_data->logdata = job;
+  filter_data->iscanceledfunc = ps_job_is_canceled; // Function to indicate
+                                                   // whether the job got
+                                                   // canceled
+  filter_data->iscanceleddata = job;
 
-static void   ps_free_job_data(ps_job_data_t *job_data)
-{
-  free(job_data->filter_data->printer);
-  free(job_data->filter_data->job_user);
-  free(job_data->filter_data->job_title);
-  free(job_data->filter_data);
-  if (job_data->filter)
-    free(job_data->filter);
-  if (job_data->ppd_filter)
-    free(job_data->ppd_filter);
-  if (job_data->print)
-    free(job_data->print);
-  if (job_data->chain)
-    cupsArrayDelete(job_data->chain);
-  cupsFreeOptions(job_data->num_options, job_data->options);
-  free(job_data);
+  return (job_data);
 }
 
 
 //
-// 'ps_have_force_gray()' - Check PPD file whether there is an option setting
-//                          which forces grayscale output. Return the first
-//                          suitable one as pair of option name and value.
+// 'ps_driver_accepts_pdf()' - Check whether a printer accepts PDF directly,
+//                             by "PDF" in the command set of its device ID,
+//                             or a "*cupsFilter(2):" line of its PPD file
+//                             taking PDF with no filter ("-").
 //
 
-static bool                                // O - True if suitable setting found
-ps_have_force_gray(ppd_file_t *ppd,        // I - PPD file to check
-		   const char **optstr,    // I - Option name of found option
-		   const char **choicestr) // I - Choice name to force grayscale
+static bool				// O - `true` if printer accepts PDF
+ps_driver_accepts_pdf(ppd_file_t *ppd,	// I - PPD file
+		      const char *device_id)
+					// I - IEEE-1284 device ID or `NULL`
 {
-  ppd_option_t *option;
+  int		i;			// Looping var
+  const char	*filter,		// "*cupsFilter(2):" entry
+		*cmd,			// Command set
+		*ptr;			// Pointer into string
+  size_t	len;			// Length of string
+  int		num_did;		// Number of device ID key/value pairs
+  cups_option_t	*did = NULL;		// Device ID key/value pairs
+  ppd_attr_t	*attr;			// "*1284DeviceID:" of PPD
+  bool		ret = false;		// Return value
 
 
-  if ((option = ppdFindOption(ppd, "ColorModel")) != NULL &&
-      ppdFindChoice(option, "Gray"))
-  {
-    if (optstr)
-      *optstr = "ColorModel";
-    if (choicestr)
-      *choicestr = "Gray";
-    return (true);
-  }
-  else if ((option = ppdFindOption(ppd, "ColorModel")) != NULL &&
-	   ppdFindChoice(option, "Grayscale"))
-  {
-    if (optstr)
-      *optstr = "ColorModel";
-    if (choicestr)
-      *choicestr = "Grayscale";
-    return (true);
-  }
-  else if ((option = ppdFindOption(ppd, "HPColorMode")) != NULL &&
-	   ppdFindChoice(option, "grayscale"))
-  {
-    if (optstr)
-      *optstr = "HPColorMode";
-    if (choicestr)
-      *choicestr = "grayscale";
-    return (true);
-  }
-  else if ((option = ppdFindOption(ppd, "BRMonoColor")) != NULL &&
-	   ppdFindChoice(option, "Mono"))
-  {
-    if (optstr)
-      *optstr = "BRMonoColor";
-    if (choicestr)
-      *choicestr = "Mono";
-    return (true);
-  }
-  else if ((option = ppdFindOption(ppd, "CNIJSGrayScale")) != NULL &&
-	   ppdFindChoice(option, "1"))
+  // "*cupsFilter2: application/pdf application/vnd.cups-pdf 0 -" or
+  // "*cupsFilter: application/vnd.cups-pdf 0 -"
+  for (i = 0; i < ppd->num_filters && !ret; i ++)
   {
-    if (optstr)
-      *optstr = "CNIJSGrayScale";
-    if (choicestr)
-      *choicestr = "1";
-    return (true);
+    filter = ppd->filters[i];
+    if ((!strncmp(filter, "application/pdf", 15) &&
+	 isspace(filter[15] & 255)) ||
+	(!strncmp(filter, "application/vnd.cups-pdf", 24) &&
+	 isspace(filter[24] & 255)))
+    {
+      for (len = strlen(filter); len > 0 && isspace(filter[len - 1] & 255);
+	   len --);
+      ret = len > 2 && filter[len - 1] == '-' &&
+	    isspace(filter[len - 2] & 255);
+    }
   }
-  else if ((option = ppdFindOption(ppd, "HPColorAsGray")) != NULL &&
-	   ppdFindChoice(option, "True"))
+
+  // "PDF" in the command set of the printer's device ID, or of the one
+  // in the PPD file
+  if (!ret && (!device_id || !device_id[0]) &&
+      (attr = ppdFindAttr(ppd, "1284DeviceID", NULL)) != NULL)
+    device_id = attr->value;
+  if (!ret && device_id &&
+      (num_did = papplDeviceParseID(device_id, &did)) > 0)
   {
-    if (optstr)
-      *optstr = "HPColorAsGray";
-    if (choicestr)
-      *choicestr = "True";
-    return (true);
+    if ((cmd = cupsGetOption("COMMAND SET", num_did, did)) == NULL)
+      cmd = cupsGetOption("CMD", num_did, did);
+    for (ptr = cmd; ptr && *ptr && !ret; ptr += len)
+    {
+      while (*ptr == ',' || isspace(*ptr & 255))
+	ptr ++;
+      len = strcspn(ptr, ",");
+      ret = len >= 3 && !strncasecmp(ptr, "PDF", 3);
+    }
+    cupsFreeOptions(num_did, did);
   }
 
-  if (optstr)
-    *optstr = NULL;
-  if (choicestr)
-    *choicestr = NULL;
-
-  return (false);
+  return (ret);
 }
 
 
 //
-// 'ps_identify()' - Identify the printer.
+// 'ps_driver_delete()' - Free dynamic data structures of the driver when
+//                        removing a printer.
 //
 
 static void
-ps_identify(
-    pappl_printer_t          *printer,	// I - Printer
-    pappl_identify_actions_t actions, 	// I - Actions to take
-    const char               *message)	// I - Message, if any
+ps_driver_delete(
+    pappl_printer_t *printer,              // I - Printer to be removed
+    pappl_pr_driver_data_t *driver_data)   // I - Printer's driver data
 {
-  pappl_pr_driver_data_t driver_data;
-  ps_driver_extension_t  *extension;
-  ppd_file_t             *ppd = NULL;	// PPD file of the printer
-  pappl_device_t         *device;       // PAPPL output device
+  int               i;
+  ps_driver_extension_t *extension;
 
 
-  (void)actions;
-  (void)message;
+  if (printer)
+    papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+		    "Freeing memory from driver data");
 
-  // Identify the printer by sending a zero-page PostScript job to
-  // make the display of the printer light up and depending on
-  // hardware mechanics move and/or signal sounds play
+  extension = (ps_driver_extension_t *)driver_data->extension;
 
-  papplPrinterGetDriverData(printer, &driver_data);
-  extension = (ps_driver_extension_t *)driver_data.extension;
-  ppd = extension->ppd;
+  // PPD file
+  ppdClose(extension->ppd);
 
-  //
-  // Open access to printer device...
-  //
+  // Media source
+  for (i = 0; i < driver_data->num_source; i ++)
+    if (driver_data->source[i])
+      free((char *)(driver_data->source[i]));
 
-  if ((device = papplPrinterOpenDevice(printer)) == NULL)
-  {
-    papplLogPrinter(printer, PAPPL_LOGLEVEL_WARN,
-		    "Cannot access printer: Busy or otherwise not reachable");
-    return;
-  }
+  // Media type
+  for (i = 0; i < driver_data->num_type; i ++)
+    if (driver_data->type[i])
+      free((char *)(driver_data->type[i]));
 
-  // Note: We directly output to the printer device without using
-  //       ps_print_filter_function() as only use printf()/puts() and
-  //       not any PPD-related function of libppd for the output to
-  //       the printer
+  // Media size
+  for (i = 0; i < driver_data->num_media; i ++)
+    if (driver_data->media[i])
+      free((char *)(driver_data->media[i]));
 
-  //
-  // Put the printer in PostScript mode and initiate a PostScript
-  // file...
-  //
+  // Output bins
+  for (i = 0; i < driver_data->num_bin; i ++)
+    if (driver_data->bin[i])
+      free((char *)(driver_data->bin[i]));
 
-  if (ppd->jcl_begin)
+  // Vendor options
+  for (i = 0; i < driver_data->num_vendor; i ++)
   {
-    papplDevicePuts(device, ppd->jcl_begin);
-    papplDevicePuts(device, ppd->jcl_ps);
+    if (driver_data->vendor[i])
+      free((char *)(driver_data->vendor[i]));
+    if (extension->vendor_ppd_options[i])
+      free((char *)(extension->vendor_ppd_options[i]));
   }
 
-  papplDevicePuts(device, "%!\n");
-  papplDeviceFlush(device);
+  // Extension
+  ps_lookup_free(&(extension->media_lookup));
+  ps_lookup_free(&(extension->source_lookup));
+  ps_lookup_free(&(extension->type_lookup));
+  ps_lookup_free(&(extension->bin_lookup));
+  ps_lookup_free(&(extension->resolution_lookup));
+  free(extension->resolutions);
+  ps_vendor_release(extension, extension->vendor_table);
+  pthread_mutex_destroy(&(extension->vendor_mutex));
+  ps_constraints_free(&(extension->constraints));
+  ps_option_memo_clear(extension);
+  pthread_mutex_destroy(&(extension->option_memo_mutex));
+  if (extension->cups_filter_ps)
+  {
+    free(extension->cups_filter_ps);
+    if (extension->temp_ppd_name)
+    {
+      unlink(extension->temp_ppd_name);
+      free(extension->temp_ppd_name);
+    }
+  }
+  free(extension);
+}
 
-  //
-  // Delay...
-  //
 
-  sleep(3);
+//
+// 'ps_cups_filter_path()' - Check whether a CUPS filter is present
+//                           and if so return its absolute path,
+//                           otherwise NULL
+//
 
-  //
-  // Finish the job...
-  //
+static char *                           // O - Executable path of filter,
+                                        //     NULL if filter not found or
+                                        //     not executable
+ps_cups_filter_path(const char *filter) // I - CUPS filter name 
+{
+  char		*filter_path;      /* Path to filter executable */
 
-  if (ppd->jcl_end)
-    papplDevicePuts(device, ppd->jcl_end);
+  if (!filter || !filter[0] || !filter_dir[0])
+    return (NULL);
+
+  if (filter[0] == '/')
+  {
+    if ((filter_path = (char *)calloc(strlen(filter) + 1,
+				      sizeof(char))) == NULL)
+      return (NULL);
+    snprintf(filter_path, (strlen(filter) + 1) * sizeof(char), "%s", filter);
+  }
   else
-    papplDevicePuts(device, "\004");
-  papplDeviceFlush(device);
+  {
+    if ((filter_path = (char *)calloc(strlen(filter_dir) + strlen(filter) + 2,
+				    sizeof(char))) == NULL)
+      return (NULL);
+    snprintf(filter_path, (strlen(filter_dir) + strlen(filter) + 2) *
+	     sizeof(filter_path), "%s/%s", filter_dir, filter);
+  }
 
-  //
-  // Close connection to the printer device...
-  //
+  if (access(filter_path, X_OK) == 0)
+    return (filter_path);
 
-  papplPrinterCloseDevice(printer);
+  free(filter_path);
+  return (NULL);
 }
 
 
 //
-// 'ps_job_is_canceled()' - Return 1 if the job is canceled, which is
-//                          the case when papplJobIsCanceled() returns
-//                          true.
+// 'ps_ppd_find_cups_filter()' - Check the strings of the
+//                               "*cupsFilter(2):" lines in a PPD file
+//                               whether there is a suitable filter
+//                               applying to a given input
+//                               format. Return the path to call the
+//                               filter or NULL if there is no
+//                               suitable one.
 //
 
-static int
-ps_job_is_canceled(void *data)
+static char *                           // O - Executable path of filter,
+                                        //     NULL if filter not found or
+                                        //     not executable
+ps_ppd_find_cups_filter(const char *input_format, // I - Input data format
+			int num_filters,          // I - Number of filter
+			                          //     entries in PPD
+			char **filters)           // I - Pointer to PPD's
+                                                  //     filter list entries
 {
-  pappl_job_t *job = (pappl_job_t *)data;
+  int i,
+      cost,
+      lowest_cost = 9999999;
+  char *filter_str,
+       *filter_name,
+       *filter_cost,
+       *filter_path = NULL,
+       *filter_selected = NULL;
+
+  for (i = 0, filter_str = *filters; i < num_filters; i++, filter_str ++)
+  {
+    // First word of the filter entry string is the input format of the filter
+    if (strncmp(filter_str, input_format, strlen(input_format)) == 0 &&
+	isspace(filter_str[strlen(input_format)]))
+    {
+      // This filter takes the desired input data format
 
+      // The name of the filter executable is the last word
+      filter_name = filter_str + strlen(filter_str) - 1;
+      while (!isspace(*filter_name) && filter_name > filter_str)
+	filter_name --;
+      if (filter_name == filter_str)
+	continue;
 
-  return (papplJobIsCanceled(job) ? 1 : 0);
+      // The cost value of the filter is the second last word
+      filter_cost = filter_name;
+      filter_name ++;
+      while (isspace(*filter_cost) && filter_cost > filter_str)
+	filter_cost --;
+      while (!isspace(*filter_cost) && filter_cost > filter_str)
+	filter_cost --;
+      if (filter_cost == filter_str)
+	continue;
+      filter_cost ++;
+      if (!isdigit(*filter_cost))
+	continue;
+      cost = atoi(filter_cost);
+
+      // Is the filter installed?
+      if (strcmp(filter_name, "-") == 0 ||
+	  (filter_path = ps_cups_filter_path(filter_name)) == NULL)
+	continue;
+
+      // If there is more than one suitable filter entry, take the one with
+      // the lowest cost value
+      if (cost < lowest_cost)
+      {
+	if (filter_selected)
+	  free(filter_selected);
+	filter_selected = filter_path;
+	lowest_cost = cost;
+	if (cost == 0)
+	  break;
+      }
+      else
+	free(filter_path);
+    }
+  }
+
+  return (filter_selected);
 }
 
 
 //
-// 'ps_job_log()' - Job log function which calls
-//                  papplJobSetImpressionsCompleted() on page logs of
-//                  filter functions
+// 'ps_ppd_hash()' - Compute the SHA-256 hash of a PPD file in the
+//                   collections, so that conversion cache entries made
+//                   with an older version of the PPD file do not get
+//                   used.
 //
 
-static void
-ps_job_log(void *data,
-	   filter_loglevel_t level,
-	   const char *message,
-	   ...)
+static bool				// O - `true` on success
+ps_ppd_hash(pappl_system_t *system,	// I - System
+	    const char     *ppd_path,	// I - PPD path in collections
+	    char           *hashstr,	// O - Hash as hexadecimal string
+	    size_t         hashsize)	// I - Size of string buffer
 {
-  va_list arglist;
-  pappl_job_t *job = (pappl_job_t *)data;
-  char buf[1024];
-  int page, copies;
+  cups_file_t	*fp;			// PPD file
+  unsigned char	*data = NULL,		// Contents of the PPD file
+		*ptr,			// Pointer for reallocating
+		hash[64];		// SHA-256 hash
+  size_t	datasize = 0,		// Bytes read
+		dataalloc = 0;		// Size of buffer
+  ssize_t	bytes,			// Bytes read by last call
+		hashlen = -1;		// Length of hash
 
 
-  va_start(arglist, message);
-  vsnprintf(buf, sizeof(buf) - 1, message, arglist);
-  fflush(stdout);
-  va_end(arglist);
-  if (level == FILTER_LOGLEVEL_CONTROL)
+  *hashstr = '\0';
+
+  if ((fp = ppdCollectionGetPPD(ppd_path, NULL, (filter_logfunc_t)papplLog,
+				system)) == NULL)
+    return (false);
+
+  for (;;)
   {
-    if (sscanf(buf, "PAGE: %d %d", &page, &copies) == 2)
+    if (datasize == dataalloc)
     {
-      papplJobSetImpressionsCompleted(job, copies);
-      papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Printing page %d, %d copies",
-		  page, copies);
+      dataalloc = dataalloc ? 2 * dataalloc : 65536;
+      if ((ptr = (unsigned char *)realloc(data, dataalloc)) == NULL)
+	break;
+      data = ptr;
     }
-    else
-      papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Unused control message: %s",
-		  buf);
+    if ((bytes = cupsFileRead(fp, (char *)data + datasize,
+			      dataalloc - datasize)) <= 0)
+    {
+      if (bytes == 0)
+	hashlen = cupsHashData("sha2-256", data, datasize, hash,
+			       sizeof(hash));
+      break;
+    }
+    datasize += bytes;
   }
-  else
-    papplLogJob(job, (pappl_loglevel_t)level, "%s", buf);
+  cupsFileClose(fp);
+  free(data);
+
+  if (hashlen < 0)
+    return (false);
+
+  cupsHashString(hash, hashlen, hashstr, hashsize);
+  return (true);
 }
 
 
 //
-// 'ps_media_col()' - Create a media-col entry
+// 'ps_str_has_code()' - Check a string whether it contains active PostScript
+//                       or PJL code and not only whitespace and comments
 //
 
-static void
-ps_media_col(pwg_size_t *pwg_size,            // I - Media size entry from PPD
-	                                      //     cache
-	     const char *def_source,          // I - Default media source
-	     const char *def_type,            // I - Default media type
-	     int left_offset,                 // I - Left offset
-	     int top_offset,                  // I - Top offset
-	     pappl_media_tracking_t tracking, // I - Media tracking
-	     pappl_media_col_t *col)          // O - PAPPL media col entry
+bool
+ps_str_has_code(
+    const char *str)   // I - String to check
 {
-  strncpy(col->size_name, pwg_size->map.pwg, sizeof(col->size_name));
-  col->size_width = pwg_size->width;
-  col->size_length = pwg_size->length;
-  col->left_margin = pwg_size->left;
-  col->right_margin = pwg_size->right;
-  col->top_margin = pwg_size->top;
-  col->bottom_margin = pwg_size->bottom;
-  strncpy(col->source, def_source, sizeof(col->source));
-  strncpy(col->type, def_type, sizeof(col->type));
-  col->left_offset = left_offset;
-  col->top_offset = top_offset;
-  col->tracking = tracking;
+  const char *ptr;
+  bool       incomment = false;
+
+
+  for (ptr = str; *ptr; ptr ++)
+  {
+    if (*ptr == '%' && *(ptr + 1) == '%')  // PostScript comment up to end of
+                                           // line
+      incomment = true;
+    else if (*ptr == '\n' || *ptr == '\r') // New line
+      incomment = false;
+    else if (!incomment && !isspace(*ptr)) // Active code character
+      return (true);
+  }
+  return (false);
 }
 
 
-//
-// 'ps_one_bit_dither_on_draft()' - If a PWG/Apple-Raster or image job
-//                                  is printed in grayscale in draft mode
-//                                  switch to 1-bit dithering mode to get
-//                                  printing as fast as possible
+// 'ps_option_has_code()' - Check a PPD option whether it has active
+//                          PostScript or PJL code in enough choices
+//                          for the option and all its choices making
+//                          sense.
+//                          This means that at maximum one choice can
+//                          be without code.
 //
 
-static void
-ps_one_bit_dither_on_draft(
-    pappl_job_t      *job,       // I   - Job
-    pappl_pr_options_t *options) // I/O - Job options
+bool
+ps_option_has_code(
+    pappl_system_t *system, // I - System (for logging)
+    ppd_file_t     *ppd,    // I - PPD file
+    ppd_option_t   *option) // I - Option to check
 {
-  pappl_pr_driver_data_t driver_data;
+  int i;
+  int codeless_choices = 0;
 
 
-  papplPrinterGetDriverData(papplJobGetPrinter(job), &driver_data);
-  if (options->print_quality == IPP_QUALITY_DRAFT &&
-      options->print_color_mode != PAPPL_COLOR_MODE_COLOR &&
-      options->header.cupsNumColors == 1)
+  if (option->ui == PPD_UI_PICKONE || option->ui == PPD_UI_BOOLEAN)
   {
-    cupsRasterInitPWGHeader(&options->header,
-			    pwgMediaForPWG(options->media.size_name),
-			    "black_1",
-			    options->printer_resolution[0],
-			    options->printer_resolution[1],
-			    (options->header.Duplex ?
-			     (options->header.Tumble ?
-			      "two-sided-short-edge" : "two-sided-long-edge") :
-			     "one-sided"),
-			    "normal");
-    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
-		"Monochrome draft quality job -> 1-bit dithering for speed-up");
-    if (options->print_content_optimize == PAPPL_CONTENT_PHOTO ||
-	!strcmp(papplJobGetFormat(job), "image/jpeg") ||
-	!strcmp(papplJobGetFormat(job), "image/png"))
-    {
-      memcpy(options->dither, driver_data.pdither, sizeof(options->dither));
-      papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
-		  "Photo/Image-optimized dither matrix");
-    }
-    else
+    for (i = 0; i < option->num_choices; i ++)
+      if (!ps_str_has_code(option->choices[i].code))
+	codeless_choices ++;
+    if (codeless_choices > 1)
     {
-      memcpy(options->dither, driver_data.gdither, sizeof(options->dither));
-      papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
-		  "General-purpose dither matrix");
+      papplLog(system, PAPPL_LOGLEVEL_WARN,
+	       "Skipping option \"%s\", the PPD file does not provide PostScript/PJL code for all its choices.",
+	       option->keyword);
+      if (ppd->num_filters)
+	papplLog(system, PAPPL_LOGLEVEL_WARN,
+		 "This option most probably needs a CUPS filter to work. Is this a PostScript PPD?");
+      else
+	papplLog(system, PAPPL_LOGLEVEL_WARN,
+		 "The PPD file is probably broken.");
+      return (false);
     }
   }
+  return (true);
 }
 
 
 //
-// 'ps_print_filter_function()' - Print file.
-//                                This function has the format of a filter
-//                                function of libcupsfilters, so we can chain
-//                                it with other filter functions using the
-//                                special filter function filterChain() and
-//                                so we do not need to care with forking. As
-//                                we send off the data to the device instead
-//                                of filtering, it behaves more like a
-//                                backend than a filter, and sends nothing
-//                                to its output FD. Therefore it must always
-//                                be in the end of a chain.
-//                                This function does not do any filtering or
-//                                conversion, this has to be done by filters
-//                                applied to the data before.
+// 'ps_default_paper_size()' - Determine default paper size
+//                             (A4/Letter) based on the location,
+//                             Letter for US and Canada, A4 for the
+//                             rest of the world. Use the locale
+//                             environment variables ("LC_...") for
+//                             that.
 //
 
-int                                           // O - Error status
-ps_print_filter_function(int inputfd,         // I - File descriptor input 
-			                      //     stream
-			 int outputfd,        // I - File descriptor output
-			                      //     stream (unused)
-			 int inputseekable,   // I - Is input stream
-			                      //     seekable? (unused)
-			 filter_data_t *data, // I - Job and printer data
-			 void *parameters)    // I - PAPPL output device
+static const char *ps_default_paper_size()
 {
-  ssize_t	       bytes;	              // Bytes read/written
-  char	               buffer[65536];         // Read/write buffer
-  pappl_device_t       *device = (pappl_device_t *)parameters;
-                                              // PAPPL output device
-  filter_logfunc_t     log = data->logfunc;   // Log function
-  void                 *ld = data->logdata;   // log function data
+  static char result[128];            // Resulting default paper size
+  char        *val;                   // Paper size/locale value
+  int         i;
+  const char  * const lc_env_vars[] = // Environment variables with suitable
+  {                                   // locale information
+    "LC_PAPER",
+    "LC_CTYPE",
+    "LC_ALL",
+    "LANG",
+  };
 
-  (void)inputseekable;
 
-  //int fd = open("/tmp/printout", O_CREAT | O_WRONLY);
-  while ((bytes = read(inputfd, buffer, sizeof(buffer))) > 0)
+  memset(result, 0, sizeof(result));
+  for (i = 0; i < sizeof(lc_env_vars) / sizeof(lc_env_vars[0]); i ++)
   {
-    //write(fd, buffer, (size_t)bytes);
-    if (papplDeviceWrite(device, buffer, (size_t)bytes) < 0)
-    {
-      if (log)
-	log(ld, FILTER_LOGLEVEL_ERROR,
-	    "Output to device: Unable to send %d bytes to printer.\n",
-	    (int)bytes);
-      close(inputfd);
-      close(outputfd);
-      return (1);
-    }
+    if ((val = getenv(lc_env_vars[i])) == NULL)
+      continue;
+    if (!strcmp(val, "C") ||
+	!strcmp(val, "POSIX"))
+      continue;
+    if (!strcmp(val, "en") ||
+	!strncmp(val, "en.", 3) ||
+	!strncmp(val, "en_US", 5) ||
+	!strncmp(val, "en_CA", 5) ||
+	!strncmp(val, "fr_CA", 5))
+      // These are the only locales that will default to "Letter" size...
+      strcpy(result, "Letter");
+    else
+      // Rest of the world is A4
+      strcpy(result, "A4");
+    if (result[0])
+      break;
   }
-  papplDeviceFlush(device);
-  //close(fd);
-  close(inputfd);
-  close(outputfd);
-  return (0);
+  return (result[0] ? result : NULL);
 }
 
 
 //
-// 'ps_poll_device_option_defaults()' - This function uses query PostScript
-//                                      code from the PPD file to poll
-//                                      default option settings from the
-//                                      printer
+// 'ps_device_fd()' - Get the file descriptor of a socket:// or file://
+//                    device, for sending data to it with splice() or
+//                    sendfile(). PAPPL does not export it, but the data
+//                    of its socket and file devices starts with it in
+//                    the PAPPL versions accepted by the Makefile
+//                    (HAVE_PAPPL_DEVICE_FD). The file descriptor is only
+//                    used if it verifiably belongs to the device: A
+//                    socket connected to the port of the URI, or the
+//                    file of the URI. Otherwise, and for other devices
+//                    (USB, custom schemes), data goes through
+//                    papplDeviceWrite().
 //
 
-static int                      // O - Number of polled default settings
-                                //     0: Error
-ps_poll_device_option_defaults(
-    pappl_printer_t *printer,   // I - Printer to be polled
-    bool installable,           // I - Poll installable accessory configuration?
-    cups_option_t **defaults)   // O - Option list of polled default settings
+static int				// O - File descriptor or -1 if none
+ps_device_fd(pappl_device_t *device,	// I - Device
+	     pappl_job_t    *job)	// I - Job
 {
-  int                    i, j, k;       // Looping variables
-  pappl_pr_driver_data_t driver_data;
-  ps_driver_extension_t  *extension;
-  ppd_file_t             *ppd = NULL;	// PPD file of the printer
-  int                    num_defaults;  // Number of polled default settings
-  pappl_device_t         *device;       // PAPPL output device
-  int		         status = 0;	// Exit status
-  ppd_group_t            *group;
-  ppd_option_t	         *option;	// Current option in PPD
-  ppd_attr_t	         *attr;		// Query command attribute
-  const char	         *valptr;	// Pointer into attribute value
-  char		         buf[1024],	// String buffer
-                         *bufptr;	// Pointer into buffer
-  ssize_t	         bytes;		// Number of bytes read
-
+#ifdef HAVE_PAPPL_DEVICE_FD
+  char		uri[1024],		// Device URI
+		scheme[32],		// Scheme of the URI
+		userpass[256],		// User name and password (unused)
+		host[256],		// Host name or file directory
+		resource[1024];		// Resource or file name
+  int		port,			// Port number
+		*fd;			// Device data starting with the FD
+  struct stat	st,			// Information about the FD
+		fst;			// Information about the file
+  struct sockaddr_storage addr;		// Peer address of the socket
+  socklen_t	addrlen = sizeof(addr);	// Length of the address
+
+
+  if (!papplPrinterGetDeviceURI(papplJobGetPrinter(job), uri, sizeof(uri)) ||
+      httpSeparateURI(HTTP_URI_CODING_ALL, uri, scheme, sizeof(scheme),
+		      userpass, sizeof(userpass), host, sizeof(host), &port,
+		      resource, sizeof(resource)) < HTTP_URI_STATUS_OK ||
+      (strcmp(scheme, "socket") && strcmp(scheme, "file")) ||
+      (fd = (int *)papplDeviceGetData(device)) == NULL || *fd < 0 ||
+      fstat(*fd, &st))
+    return (-1);
+
+  if (!strcmp(scheme, "socket"))
+  {
+    // Must be a socket connected to the port of the URI
+    if (!S_ISSOCK(st.st_mode) ||
+	getpeername(*fd, (struct sockaddr *)&addr, &addrlen) ||
+	(addr.ss_family == AF_INET ?
+	 ntohs(((struct sockaddr_in *)&addr)->sin_port) :
+	 addr.ss_family == AF_INET6 ?
+	 ntohs(((struct sockaddr_in6 *)&addr)->sin6_port) : -1) != port)
+      return (-1);
+  }
+  else
+  {
+    // Must be the file of the URI
+    if (stat(resource, &fst) || st.st_dev != fst.st_dev ||
+	st.st_ino != fst.st_ino)
+      return (-1);
+  }
 
-  papplPrinterGetDriverData(printer, &driver_data);
-  extension = (ps_driver_extension_t *)driver_data.extension;
-  ppd = extension->ppd;
+  return (*fd);
 
-  *defaults = NULL;
-  num_defaults = 0;
+#else
+  (void)device;
+  (void)job;
 
-  //
-  // Open access to printer device...
-  //
+  return (-1);
+#endif // HAVE_PAPPL_DEVICE_FD
+}
 
-  if ((device = papplPrinterOpenDevice(printer)) == NULL)
-  {
-    papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-		    "Cannot access printer: Busy or otherwise not reachable");
-    return (0);
-  }
 
+//
+// 'ps_driver_setup()' - PostScript driver setup callback.
+//
+//                       Runs in two modes: Init and Update
+//
+//                       It runs in Init mode when the
+//                       driver_data->extension is still NULL, meaning
+//                       that the extension structure is not yet
+//                       defined. This is the case when the printer
+//                       data structure is created on startup or on
+//                       adding a printer. Then we load and read the
+//                       PPD and enter the properties into the driver
+//                       data structure, not taking into account any
+//                       user defaults or accessory settings.
+//
+//                       When called again with the data structure
+//                       already present, it runs in Update mode,
+//                       applying user defaults and modifying the data
+//                       structure if the user changed the
+//                       configuration of installable accessories.
+//                       This mode is triggered when called by the
+//                       ps_status() callback which in turn is called
+//                       after completely loading the printer's state
+//                       file entry or when doing changes on the
+//                       "Device Settings" web interface page.
+//
 
-  // Note: We directly output to the printer device without using
-  //       ps_print_filter_function() as the original code
-  //       (commandtops filter of CUPS) only uses printf()/puts() and
-  //       not any PPD-related function of libcups (eq. libppd)
-  //       for the output to the printer
+static bool				   // O - `true` on success, `false`
+                                           //     on failure
+ps_driver_setup(
+    pappl_system_t       *system,	   // I - System
+    const char           *driver_name,     // I - Driver name
+    const char           *device_uri,	   // I - Device URI
+    const char           *device_id,	   // I - Device ID
+    pappl_pr_driver_data_t *driver_data,   // O - Driver data
+    ipp_t                **driver_attrs,   // O - Driver attributes
+    void                 *data)	           // I - Callback data
+{
+  int          i, j, k, l, m;              // Looping variables
+  bool         update;                     // Are we updating the data
+                                           // structure and not freshly
+                                           // creating it?
+  ps_driver_extension_t *extension;
+  cups_array_t *ppd_paths = (cups_array_t *)data;
+  ps_ppd_path_t *ppd_path,
+               search_ppd_path;
+  ppd_file_t   *ppd = NULL;		   // PPD file loaded from collection
+  ppd_cache_t  *pc;
+  cups_file_t  *tempfp;
+  int          tempfd,
+               bytes;
+  char         tempfile[1024];
+  ipp_attribute_t *attr;
+  int          num_options;
+  cups_option_t *options,
+               *opt;
+  char         *keyword;
+  const char   *ptr, *ptr2;		   // Pointers into strings
+  ipp_res_t    units;			   // Resolution units
+  const char   *def_source,
+               *def_type;
+  char         *def_bin;
+  pwg_size_t   *def_media;
+  int          def_res_x, def_res_y,
+               def_left, def_right, def_top, def_bottom;
+  ppd_group_t  *group;
+  ppd_option_t *option;
+  ppd_choice_t *choice, *def_choice;
+  ppd_attr_t   *ppd_attr;
+  pwg_map_t    *pwg_map;
+  pwg_size_t   *pwg_size;
+  ps_resolution_t *res;                    // Entry of the resolution table
+  ppd_pwg_finishings_t *finishings;
+  ppd_coption_t *coption;
+  ppd_cparam_t *cparam;
+  int          num_cparams;
+  pappl_media_col_t tmp_col;
+  int          count;
+  bool         pollable;
+  char         buf[1024],
+               ipp_opt[80],
+               ipp_supported[256],
+               ipp_default[256],
+               ipp_choice[80],
+               ipp_custom_opt[192],
+               ipp_param[80];
+  char         **choice_list;
+  int          default_choice,
+               first_choice;
+  static const char * const pdf_formats[] = { "pdf", "postscript" };
+  const char * const pappl_handled_options[] =
+  {
+   "PageSize",
+   "PageRegion",
+   "InputSlot",
+   "MediaType",
+   "Resolution",
+   "ColorModel",
+   "OutputBin",
+   "Duplex",
+   NULL
+  };
 
-  //
-  // Put the printer in PostScript mode...
-  //
 
-  if (ppd->jcl_begin)
+  if (!driver_data || !driver_attrs)
   {
-    papplDevicePuts(device, ppd->jcl_begin);
-    papplDevicePuts(device, ppd->jcl_ps);
+    papplLog(system, PAPPL_LOGLEVEL_ERROR,
+	     "Driver callback called without required information.");
+    return (false);
   }
 
-  papplDevicePuts(device, "%!\n");
-  papplDevicePuts(device, "userdict dup(\\004)cvn{}put (\\004\\004)cvn{}put\n");
+  if (driver_data->extension == NULL)
+  {
+    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	     "Initializing driver data for driver \"%s\"", driver_name);
 
-  papplDeviceFlush(device);
+    if (!ppd_paths || cupsArrayCount(ppd_paths) == 0)
+    {
+      papplLog(system, PAPPL_LOGLEVEL_ERROR,
+	       "Driver callback did not find PPD indices.");
+      return (false);
+    }
 
-  //
-  // https://github.com/apple/cups/issues/4028
-  //
-  // As a lot of PPDs contain bad PostScript query code, we need to prevent one
-  // bad query sequence from affecting all auto-configuration.  The following
-  // error handler allows us to log PostScript errors to cupsd.
-  //
-
-  papplDevicePuts(device,
-    "/cups_handleerror {\n"
-    "  $error /newerror false put\n"
-    "  (:PostScript error in \") print cups_query_keyword print (\": ) "
-    "print\n"
-    "  $error /errorname get 128 string cvs print\n"
-    "  (; offending command:) print $error /command get 128 string cvs "
-    "print (\n) print flush\n"
-    "} bind def\n"
-    "errordict /timeout {} put\n"
-    "/cups_query_keyword (?Unknown) def\n");
-  papplDeviceFlush(device);
-
-  //
-  // Loop through every option in the PPD file and ask for the current
-  // value...
-  //
-
-  papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-		  "Reading printer-internal default settings...");
+    //
+    // Load assigned PPD file from the PPD collection, mark defaults, create
+    // cache
+    //
 
-  for (i = ppd->num_groups, group = ppd->groups;
-       i > 0;
-       i --, group ++)
-  {
+  retry:
+    if (strcasecmp(driver_name, "auto") == 0)
+    {
+      // Auto-select driver
+      papplLog(system, PAPPL_LOGLEVEL_INFO,
+	       "Automatic printer driver selection for device with URI \"%s\" "
+	       "and device ID \"%s\" ...", device_uri, device_id);
+      search_ppd_path.driver_name = ps_autoadd(NULL, device_uri, device_id,
+					       NULL);
+      if (search_ppd_path.driver_name)
+	papplLog(system, PAPPL_LOGLEVEL_INFO,
+		 "Automatically selected driver \"%s\".",
+		 search_ppd_path.driver_name);
+      else
+      {
+	papplLog(system, PAPPL_LOGLEVEL_ERROR,
+		 "Automatic printer driver selection for printer "
+		 "\"%s\" with device ID \"%s\" failed.",
+		 device_uri, device_id);
+	return (false);
+      }
+    }
+    else
+      search_ppd_path.driver_name = driver_name;
 
-    // When "installable" is true, We are treating only the
-    // "Installable Options" group of options in the PPD file here
-    // otherwise only the other options
+    ppd_path = (ps_ppd_path_t *)cupsArrayFind(ppd_paths, &search_ppd_path);
 
-    if (strncasecmp(group->name, "Installable", 11) == 0)
+    if (ppd_path == NULL)
     {
-      if (!installable)
-	continue;
+      if (strcasecmp(driver_name, "auto") == 0)
+      {
+	papplLog(system, PAPPL_LOGLEVEL_ERROR,
+		 "For the printer driver \"%s\" got auto-selected which does "
+		 "not exist in this Printer Application.",
+		 search_ppd_path.driver_name);
+	return (false);
+      }
+      else
+      {
+	papplLog(system, PAPPL_LOGLEVEL_WARN,
+		 "Printer uses driver \"%s\" which does not exist in this "
+		 "Printer Application, switching to \"auto\".", driver_name);
+	driver_name = "auto";
+	goto retry;
+      }
     }
-    else if (installable)
-      continue;
 
-    for (j = group->num_options, option = group->options;
-	 j > 0;
-	 j --, option ++)
+    if ((ppd = ppdOpen2(ppdCollectionGetPPD(ppd_path->ppd_path, NULL,
+					    (filter_logfunc_t)papplLog,
+					    system))) == NULL)
     {
-      // Does the option have less than 2 choices? Then it does not make
-      // sense to query its default value
-      if (option->num_choices < 2)
-	continue;
-
-      //
-      // See if we have a query command for this option...
-      //
+      ppd_status_t	err;		// Last error in file
+      int		line;		// Line number in file
 
-      snprintf(buf, sizeof(buf), "?%s", option->keyword);
+      err = ppdLastError(&line);
+      papplLog(system, PAPPL_LOGLEVEL_ERROR,
+	       "PPD %s: %s on line %d", ppd_path->ppd_path,
+	       ppdErrorString(err), line);
+      return (false);
+    }
 
-      if ((attr = ppdFindAttr(ppd, buf, NULL)) == NULL || !attr->value)
-      {
-	papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-			"Skipping %s option...", option->keyword);
-	continue;
-      }
+    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	     "Using PPD %s: %s", ppd_path->ppd_path, ppd->nickname);
 
-      //
-      // Send the query code to the printer...
-      //
+    ppdMarkDefaults(ppd);
 
-      papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-		      "Querying %s...", option->keyword);
+    if ((pc = ppdCacheCreateWithPPD(ppd)) != NULL)
+      ppd->cache = pc;
 
-      for (bufptr = buf, valptr = attr->value; *valptr; valptr ++)
-      {
-	//
-	// Log the query code, breaking at newlines...
-	//
+    //
+    // Populate driver data record
+    //
 
-	if (*valptr == '\n')
-	{
-	  *bufptr = '\0';
-	  papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-			  "%s\\n", buf);
-	  bufptr = buf;
-	}
-	else if (*valptr < ' ')
-        {
-	  if (bufptr >= (buf + sizeof(buf) - 4))
-          {
-	    *bufptr = '\0';
-	    papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-			    "%s", buf);
-	    bufptr = buf;
-	  }
+    // Callback functions end general properties
+    driver_data->extension =
+      (ps_driver_extension_t *)calloc(1, sizeof(ps_driver_extension_t));
+    extension = (ps_driver_extension_t *)driver_data->extension;
+    extension->ppd                  = ppd;
+    extension->defaults_pollable    = false;
+    extension->installable_options  = false;
+    extension->installable_pollable = false;
+    extension->updated              = false;
+    extension->cups_filter_ps       = NULL;
+    extension->temp_ppd_name        = NULL;
+    // The PPD file identifies the printer-ready data in the conversion
+    // cache and in conversions shared between jobs
+    if (!ps_ppd_hash(system, ppd_path->ppd_path, extension->ppd_hash,
+		     sizeof(extension->ppd_hash)))
+      papplLog(system, PAPPL_LOGLEVEL_WARN,
+	       "Unable to compute hash of PPD %s, conversions not cached or "
+	       "shared for this printer.", ppd_path->ppd_path);
+    pthread_mutex_init(&(extension->option_memo_mutex), NULL);
+    pthread_mutex_init(&(extension->vendor_mutex), NULL);
+    driver_data->delete_cb          = ps_driver_delete;
+    driver_data->identify_cb        = ps_identify;
+    driver_data->identify_default   = PAPPL_IDENTIFY_ACTIONS_SOUND;
+    driver_data->identify_supported = PAPPL_IDENTIFY_ACTIONS_DISPLAY |
+                                      PAPPL_IDENTIFY_ACTIONS_SOUND;
+    driver_data->printfile_cb       = NULL;
+    driver_data->rendjob_cb         = ps_rendjob;
+    driver_data->rendpage_cb        = ps_rendpage;
+    driver_data->rstartjob_cb       = ps_rstartjob;
+    driver_data->rstartpage_cb      = ps_rstartpage;
+    driver_data->rwriteline_cb      = ps_rwriteline;
+    driver_data->status_cb          = ps_status;
+    driver_data->testpage_cb        = ps_testpage;
+    driver_data->format             = "application/vnd.printer-specific";
+    driver_data->orient_default     = IPP_ORIENT_NONE;
 
-	  if (*valptr == '\r')
-          {
-	    *bufptr++ = '\\';
-	    *bufptr++ = 'r';
-	  }
-	  else if (*valptr == '\t')
-          {
-	    *bufptr++ = '\\';
-	    *bufptr++ = 't';
-          }
-	  else
-          {
-	    *bufptr++ = '\\';
-	    *bufptr++ = '0' + ((*valptr / 64) & 7);
-	    *bufptr++ = '0' + ((*valptr / 8) & 7);
-	    *bufptr++ = '0' + (*valptr & 7);
-	  }
-	}
-	else
-        {
-	  if (bufptr >= (buf + sizeof(buf) - 1))
-          {
-	    *bufptr = '\0';
-	    papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-			    "%s", buf);
-	    bufptr = buf;
-	  }
+    // Make and model
+    strncpy(driver_data->make_and_model,
+	    ppd->nickname,
+	    sizeof(driver_data->make_and_model));
 
-	  *bufptr++ = *valptr;
-	}
+    // Does the PPD file have "*cupsFilter(2): ..." lines? If so, there
+    // could some enhanced functionality working with a filter.
+    //
+    // Check whether the filter is installed and note its execution path.
+    // If we have a filter we will also accept options and choices without
+    // PostScript or JCL code as these are most probably handled by the
+    // filter.
+    extension->cups_filter_ps =
+      ps_ppd_find_cups_filter("application/vnd.cups-postscript",
+			      ppd->num_filters, ppd->filters);
+    if (extension->cups_filter_ps)
+    {
+      papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	       "CUPS filter to be applied to the PostScript output: %s",
+	       extension->cups_filter_ps);
+      // Create a physical copy of the PPD file in a temporary file so that
+      // the CUPS filter can read it.
+      tempfp = ppdCollectionGetPPD(ppd_path->ppd_path, NULL,
+				   (filter_logfunc_t)papplLog,
+				   system);
+      if ((tempfd = cupsTempFd(tempfile, sizeof(tempfile))) >= 0)
+      {
+	papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+		 "Creating physical PPD file for the CUPS filter: %s",
+		 tempfile);
+	while ((bytes = cupsFileRead(tempfp, buf, sizeof(buf))) > 0)
+	  bytes = write(tempfd, buf, bytes);
+	cupsFileClose(tempfp);
+	close(tempfd);
+	extension->temp_ppd_name = strdup(tempfile);
       }
+      else
+	papplLog(system, PAPPL_LOGLEVEL_WARN,
+		 "Unable to create physical PPD file for the CUPS filter, filter may not work correctly.");
+    }
+    else
+      papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	       "No CUPS filter to be applied to the PostScript output");
 
-      if (bufptr > buf)
+    // Can the printer receive binary data? Prefer TBCP, as it gets
+    // explicitly switched on at the beginning of the job
+    extension->binary_transport = PS_TRANSPORT_ASCII85;
+    for (ptr = ppd->protocols; ptr && *ptr;)
+    {
+      while (isspace(*ptr & 255))
+	ptr ++;
+      for (ptr2 = ptr; *ptr2 && !isspace(*ptr2 & 255); ptr2 ++);
+      if (ptr2 - ptr == 4 && !strncasecmp(ptr, "TBCP", 4))
+	extension->binary_transport = PS_TRANSPORT_TBCP;
+      else if (ptr2 - ptr == 3 && !strncasecmp(ptr, "BCP", 3) &&
+	       extension->binary_transport == PS_TRANSPORT_ASCII85)
+	extension->binary_transport = PS_TRANSPORT_BCP;
+      ptr = ptr2;
+    }
+    if (extension->binary_transport != PS_TRANSPORT_ASCII85)
+      papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	       "Printer accepts binary data with %s",
+	       extension->binary_transport == PS_TRANSPORT_TBCP ?
+	       "TBCP" : "BCP");
+
+    // Can the printer take PDF directly? Then PDF jobs do not need to get
+    // converted to PostScript
+    extension->pdf_native = ps_driver_accepts_pdf(ppd, device_id);
+    if (extension->pdf_native)
+      papplLog(system, PAPPL_LOGLEVEL_DEBUG, "Printer accepts PDF directly");
+
+    // Lookup tables for mapping the standard job options to PPD options,
+    // so that jobs do not need to search the PPD cache or parse the
+    // choices of the Resolution option
+    if (pc)
+    {
+      if (pc->num_sizes > 0)
+	ps_lookup_build(&(extension->media_lookup), &(pc->sizes[0].map),
+			sizeof(pwg_size_t), pc->num_sizes);
+      ps_lookup_build(&(extension->source_lookup), pc->sources,
+		      sizeof(pwg_map_t), pc->num_sources);
+      ps_lookup_build(&(extension->type_lookup), pc->types,
+		      sizeof(pwg_map_t), pc->num_types);
+      ps_lookup_build(&(extension->bin_lookup), pc->bins,
+		      sizeof(pwg_map_t), pc->num_bins);
+    }
+    if ((option = ppdFindOption(ppd, "Resolution")) != NULL &&
+	option->num_choices > 0 &&
+	(extension->resolutions =
+	 (ps_resolution_t *)calloc(option->num_choices,
+				   sizeof(ps_resolution_t))) != NULL)
+    {
+      extension->num_resolutions = option->num_choices;
+      for (i = 0, choice = option->choices, res = extension->resolutions;
+	   i < option->num_choices; i ++, choice ++, res ++)
       {
-	*bufptr = '\0';
-	papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-			"%s", buf);
+	res->map.ppd = choice->choice;
+	if ((j = sscanf(choice->choice, "%dx%d", &(res->x), &(res->y))) == 1)
+	  res->y = res->x;
+	else if (j <= 0)
+	  res->x = res->y = 0;
+	if (res->x <= 0 || res->y <= 0)
+	  continue;
+	// The first choice with a resolution gets used for it
+	snprintf(res->key, sizeof(res->key), "%dx%d", res->x, res->y);
+	for (j = 0; j < i && (!extension->resolutions[j].map.pwg ||
+			      strcmp(extension->resolutions[j].key, res->key));
+	     j ++);
+	if (j == i)
+	  res->map.pwg = res->key;
       }
+      ps_lookup_build(&(extension->resolution_lookup),
+		      &(extension->resolutions[0].map), sizeof(ps_resolution_t),
+		      extension->num_resolutions);
+    }
 
-      papplDevicePrintf(device, "/cups_query_keyword (?%s) def\n",
-			option->keyword); // Set keyword for error reporting
-      papplDevicePuts(device, "{ (");
-      for (valptr = attr->value; *valptr; valptr ++)
-      {
-	if (*valptr == '(' || *valptr == ')' || *valptr == '\\')
-	  papplDevicePuts(device, "\\");
-	papplDeviceWrite(device, valptr, 1);
-      }
-      papplDevicePuts(device,
-		      ") cvx exec } stopped { cups_handleerror } if clear\n");
-                                          // Send query code
-      papplDeviceFlush(device);
-
-      //
-      // Read the response data...
-      //
+    // Constraint index for checking choices against the installable
+    // accessories with bit masks instead of ppdInstallableConflict()
+    ps_constraints_build(&(extension->constraints), ppd);
 
-      bufptr    = buf;
-      buf[0] = '\0';
-      // If no bytes get read (bytes <= 0), repeat up to 100 times in
-      // 100 msec intervals (10 sec timeout)
-      for (k = 0; k < 100; k ++)
-      {
-	//
-	// Read answer from device ...
-	//
+    // We are in Init mode
+    update = false;
+  }
+  else
+  {
+    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	     "Updating driver data for %s", driver_data->make_and_model);
+    extension = (ps_driver_extension_t *)driver_data->extension;
+    ppd = extension->ppd;
+    pc = ppd->cache;
+    extension->updated = true;
 
-	bytes = papplDeviceRead(device, bufptr,
-				sizeof(buf) - (size_t)(bufptr - buf) - 1);
+    // We are in Update mode
+    update = true;
+  }
 
-	//
-	// No bytes of the answer arrived yet? Retry ...
-	//
+  // Note that we take into account option choice conflicts with the
+  // configuration of installable accessories only in Update mode,
+  // this way all options and choices are available after first
+  // initialization (Init mode) so that all user defaults loaded from
+  // the state file get accepted.
+  //
+  // Only at the end of the printer entry in the state file the
+  // accessory configuration gets read. After that we re-run in Update
+  // mode to correct the options and choices for the actual accessory
+  // configuration.
 
-	if (bytes <= 0)
-        {
-	  papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-			  "Answer not ready yet, retrying in 100 ms.");
-	  usleep(100000);
-	  continue;
-        }
+  // Get settings of the "Installable Options" from the previous session
+  if (*driver_attrs &&
+      (attr = ippFindAttribute(*driver_attrs, "installable-options-default",
+			       IPP_TAG_ZERO)) != NULL &&
+      ippAttributeString(attr, buf, sizeof(buf)) > 0)
+  {
+    options = NULL;
+    num_options = cupsParseOptions(buf, 0, &options);
+    ppdMarkOptions(ppd, num_options, options);
+  }
 
-	//
-	// No newline at the end? Go on reading ...
-	//
+  // Find the choices which conflict with this accessory configuration
+  ps_constraints_update(&(extension->constraints));
 
-	bufptr += bytes;
-	*bufptr = '\0';
+  // Print speed in pages per minute (PPDs do not show different values for
+  // Grayscale and Color)
+  driver_data->ppm = ppd->throughput;
+  if (driver_data->ppm <= 1)
+    driver_data->ppm = 1;
+  if (ppd->color_device)
+    driver_data->ppm_color = driver_data->ppm;
+  else
+    driver_data->ppm_color = 0;
 
-	if (bytes == 0 ||
-	    (bufptr > buf && bufptr[-1] != '\r' && bufptr[-1] != '\n'))
-	  continue;
+  // Properties not supported by the PPD
+  driver_data->has_supplies = false;
+  driver_data->input_face_up = false;
 
-	//
-	// Trim whitespace and control characters from both ends...
-	//
+  // Pages face-up or face-down in output bin?
+  if (pc->num_bins > 0)
+    driver_data->output_face_up =
+      (strstr(pc->bins->pwg, "face-up") != NULL);
+  else
+    driver_data->output_face_up = false;
 
-	bytes = bufptr - buf;
+  // No orientation requested by default
+  if (!update) driver_data->orient_default = IPP_ORIENT_NONE;
 
-	for (bufptr --; bufptr >= buf; bufptr --)
-	  if (isspace(*bufptr & 255) || iscntrl(*bufptr & 255))
-	    *bufptr = '\0';
-	  else
-	    break;
+  // Supported color modes
+  if (ppd->color_device)
+  {
+    driver_data->color_supported =
+      PAPPL_COLOR_MODE_AUTO | PAPPL_COLOR_MODE_COLOR |
+      PAPPL_COLOR_MODE_MONOCHROME;
+    if (!update) driver_data->color_default = PAPPL_COLOR_MODE_AUTO;
+  }
+  else
+  {
+    driver_data->color_supported = PAPPL_COLOR_MODE_MONOCHROME;
+    driver_data->color_default = PAPPL_COLOR_MODE_MONOCHROME;
+  }
 
-	for (bufptr = buf; isspace(*bufptr & 255) || iscntrl(*bufptr & 255);
-	     bufptr ++);
+  // These parameters are usually not defined in PPDs but standard IPP
+  // options settable in the web interface
+  if (!update)
+  {
+    driver_data->content_default = PAPPL_CONTENT_AUTO;
+    driver_data->quality_default = IPP_QUALITY_NORMAL;
+    driver_data->scaling_default = PAPPL_SCALING_AUTO;
+  }
 
-	if (bufptr > buf)
-        {
-	  memmove(buf, bufptr, strlen(bufptr) + 1);
-	  bufptr = buf;
-	}
+  // Raster graphics modes fo PWG Raster input
+  if (ppd->color_device)
+    driver_data->raster_types =
+      PAPPL_PWG_RASTER_TYPE_BLACK_1 | PAPPL_PWG_RASTER_TYPE_SGRAY_8 |
+      PAPPL_PWG_RASTER_TYPE_SRGB_8;
+  else
+    driver_data->raster_types =
+      PAPPL_PWG_RASTER_TYPE_BLACK_1 | PAPPL_PWG_RASTER_TYPE_SGRAY_8;
+  driver_data->force_raster_type = 0;
 
-	papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-			"Got %d bytes.", (int)bytes);
+  // Duplex
+  driver_data->sides_supported = PAPPL_SIDES_ONE_SIDED;
+  driver_data->duplex = PAPPL_DUPLEX_NONE;
+  if (!update) driver_data->sides_default = PAPPL_SIDES_ONE_SIDED;
+  if (pc->sides_option &&
+      (option = ppdFindOption(ppd, pc->sides_option)) != NULL &&
+      (extension->cups_filter_ps ||
+       ps_option_has_code(system, ppd, option)))
+  {
+    if (pc->sides_2sided_long &&
+	!(update &&
+	  ps_constraints_conflict(&(extension->constraints),
+				  pc->sides_option, pc->sides_2sided_long)))
+    {
+      driver_data->sides_supported |= PAPPL_SIDES_TWO_SIDED_LONG_EDGE;
+      driver_data->duplex = PAPPL_DUPLEX_NORMAL;
+      if (!update &&
+	  (choice = ppdFindMarkedChoice(ppd, pc->sides_option)) != NULL &&
+	  strcmp(choice->choice, pc->sides_2sided_long) == 0)
+	driver_data->sides_default = PAPPL_SIDES_TWO_SIDED_LONG_EDGE;
+    }
+    if (pc->sides_2sided_short &&
+	!(update &&
+	  ps_constraints_conflict(&(extension->constraints),
+				  pc->sides_option, pc->sides_2sided_short)))
+    {
+      driver_data->sides_supported |= PAPPL_SIDES_TWO_SIDED_SHORT_EDGE;
+      driver_data->duplex = PAPPL_DUPLEX_NORMAL;
+      if (!update &&
+	  (choice = ppdFindMarkedChoice(ppd, pc->sides_option)) != NULL &&
+	  strcmp(choice->choice, pc->sides_2sided_short) == 0)
+	driver_data->sides_default = PAPPL_SIDES_TWO_SIDED_SHORT_EDGE;
+    }
+  }
+  if ((driver_data->sides_default & driver_data->sides_supported) == 0)
+  {
+    driver_data->sides_default = PAPPL_SIDES_ONE_SIDED;
+    if (pc->sides_option)
+      ppdMarkOption(ppd, pc->sides_option, pc->sides_1sided);
+  }
 
-	//
-	// Skip blank lines...
-	//
+  // Finishings
+  driver_data->finishings = PAPPL_FINISHINGS_NONE;
+  for (finishings = (ppd_pwg_finishings_t *)cupsArrayFirst(pc->finishings);
+       finishings;
+       finishings = (ppd_pwg_finishings_t *)cupsArrayNext(pc->finishings))
+  {
+    for (i = finishings->num_options, opt = finishings->options; i > 0;
+	 i --, opt ++)
+    {
+      if (update &&
+	  ps_constraints_conflict(&(extension->constraints), opt->name,
+				  opt->value))
+	break;
+      if ((option = ppdFindOption(ppd, opt->name)) == NULL ||
+	  (!extension->cups_filter_ps &&
+	   !ps_option_has_code(system, ppd, option)))
+	break;
+    }
+    if (i > 0)
+      continue;
+    if (finishings->value == IPP_FINISHINGS_STAPLE)
+      driver_data->finishings |= PAPPL_FINISHINGS_STAPLE;
+    else  if (finishings->value == IPP_FINISHINGS_PUNCH)
+      driver_data->finishings |= PAPPL_FINISHINGS_PUNCH;
+    else if (finishings->value == IPP_FINISHINGS_TRIM)
+      driver_data->finishings |= PAPPL_FINISHINGS_TRIM;
+  }
 
-	if (!buf[0])
+  // Resolution
+  driver_data->num_resolution = 0;
+  if ((option = ppdFindOption(ppd, "Resolution")) != NULL &&
+      (count = option->num_choices) > 0 &&
+      (extension->cups_filter_ps ||
+       ps_option_has_code(system, ppd, option)))
+  {
+    // Valid "Resolution" option, make a sorted list of resolutions.
+    if (update)
+    {
+      def_res_x = driver_data->x_default;
+      def_res_y = driver_data->y_default;
+    }
+    driver_data->x_default = 0;
+    driver_data->y_default = 0;
+    for (i = 0, j = 0, choice = option->choices;
+	 i < count && j < PAPPL_MAX_SOURCE;
+	 i ++, choice ++)
+      if (!(update &&
+	    ps_constraints_conflict(&(extension->constraints),
+				    "Resolution", choice->choice)))
+      {
+	if ((k = sscanf(choice->choice, "%dx%d",
+			&(driver_data->x_resolution[j]),
+			&(driver_data->y_resolution[j]))) == 1)
+	  driver_data->y_resolution[j] = driver_data->x_resolution[j];
+	else if (k <= 0)
+	{
+	  papplLog(system, PAPPL_LOGLEVEL_ERROR,
+		   "Invalid resolution: %s", choice->choice);
 	  continue;
-
-	//
-	// Check the response...
-	//
-
-	if ((bufptr = strchr(buf, ':')) != NULL)
-        {
-	  //
-	  // PostScript code for this option in the PPD is broken; show the
-	  // interpreter's error message that came back...
-	  //
-
-	  papplLogPrinter(printer, PAPPL_LOGLEVEL_WARN,
-			  "%s", bufptr + 1);
-	  status = 1;
-	  break;
 	}
-
-	//
-	// Verify the result is a valid option choice...
-	//
-
-	if (!ppdFindChoice(option, buf))
+	// Default resolution
+	if (j == 0 ||
+	    (!update && choice->marked) ||
+	    (update &&
+	     def_res_x == driver_data->x_resolution[j] &&
+	     def_res_y == driver_data->y_resolution[j]))
         {
-	  if (!strcasecmp(buf, "Unknown"))
+	  def_choice = choice;
+	  driver_data->x_default = driver_data->x_resolution[j];
+	  driver_data->y_default = driver_data->y_resolution[j];
+	}
+	for (k = j - 1; k >= 0; k --)
+	{
+	  int       x1, y1,               // First X and Y resolution
+	            x2, y2,               // Second X and Y resolution
+	            temp;                 // Swap variable
+	  x1 = driver_data->x_resolution[k];
+	  y1 = driver_data->y_resolution[k];
+	  x2 = driver_data->x_resolution[k + 1];
+	  y2 = driver_data->y_resolution[k + 1];
+	  if (x2 < x1 || (x2 == x1 && y2 < y1))
 	  {
-	    papplLogPrinter(printer, PAPPL_LOGLEVEL_WARN,
-			    "Unknown default setting for option \"%s\"",
-			    option->keyword);
-	    status = 1;
-	    break;
+	    temp                             = driver_data->x_resolution[k];
+	    driver_data->x_resolution[k]     = driver_data->x_resolution[k + 1];
+	    driver_data->x_resolution[k + 1] = temp;
+	    temp                             = driver_data->y_resolution[k];
+	    driver_data->y_resolution[k]     = driver_data->y_resolution[k + 1];
+	    driver_data->y_resolution[k + 1] = temp;
 	  }
-
-	  bufptr    = buf;
-	  buf[0] = '\0';
-	  continue;
 	}
-
-        //
-        // Write out the result and move on to the next option...
-	//
-
-	papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-			"Read default setting for \"%s\": \"%s\"",
-			option->keyword, buf);
-	num_defaults = cupsAddOption(option->keyword, buf, num_defaults,
-				     defaults);
-	break;
-      }
-
-      //
-      // Printer did not answer this option's query
-      //
-
-      if (bytes <= 0)
-      {
-	papplLogPrinter(printer, PAPPL_LOGLEVEL_WARN,
-			"No answer to query for option %s within 10 sec "
-			"timeout.", option->keyword);
-	status = 1;
+	j ++;
       }
+    if (j > 0)
+    {
+      driver_data->num_resolution = j;
+      ppdMarkOption(ppd, "Resolution", def_choice->choice);
     }
+    else
+      papplLog(system, PAPPL_LOGLEVEL_WARN,
+	       "No valid resolution choice found, using 300 dpi");
+  }
+  else if ((ppd_attr = ppdFindAttr(ppd, "DefaultResolution", NULL)) != NULL)
+  {
+    // Use the PPD-defined default resolution...
+    if ((j = sscanf(ppd_attr->value, "%dx%d",
+		    &(driver_data->x_resolution[0]),
+		    &(driver_data->y_resolution[0]))) == 1)
+      driver_data->y_resolution[0] = driver_data->x_resolution[0];
+    else if (j <= 0)
+      papplLog(system, PAPPL_LOGLEVEL_ERROR,
+	       "Invalid default resolution: %s, using 300 dpi",
+	       ppd_attr->value);
+    driver_data->num_resolution = (j > 0 ? 1 : 0);
   }
-
-  //
-  // Finish the job...
-  //
-
-  papplDeviceFlush(device);
-  if (ppd->jcl_end)
-    papplDevicePuts(device, ppd->jcl_end);
   else
-    papplDevicePuts(device, "\004");
-  papplDeviceFlush(device);
+    papplLog(system, PAPPL_LOGLEVEL_WARN,
+	     "No resolution information in PPD, using 300 dpi");
+  if (driver_data->num_resolution == 0)
+  {
+    driver_data->x_resolution[0] = 300;
+    driver_data->y_resolution[0] = 300;
+    driver_data->num_resolution = 1;
+  }
+  if (driver_data->x_default == 0 || driver_data->y_default == 0)
+  {
+    driver_data->x_default = driver_data->x_resolution[0];
+    driver_data->y_default = driver_data->y_resolution[0];
+  }
 
+  // For the options Media Source and Media Type we do not need to
+  // assure that both have PostScript/PJL code to tell the printer
+  // which choices are selected, as they depend on each other, by
+  // which media is loaded in which tray.
   //
-  // Close connection to the printer device...
-  //
-
-  papplPrinterCloseDevice(printer);
-
+  // If Media Source has PostScript/PJL code and Media Type not, the
+  // code of Media Source selects the tray with whatever is loaded in
+  // it. The Media Type selection in this Printer Application only
+  // serves as a reminder what we have loaded then.
   //
-  // Return...
+  // If Media Type has PostScript/PJL code and Media Source not, the
+  // printer, guided by the code of Media Size and Media Type searches
+  // for the tray which carries this combo, so our codeless Media
+  // Source option only serves for easy selection in this Printer
+  // Application.
   //
+  // Note that Media Size is required to have PostScript/PJL code
 
-  if (status)
-    papplLogPrinter(printer, PAPPL_LOGLEVEL_WARN,
-		    "Unable to configure some printer options.");
-
-  return (num_defaults);
-}
-
-
-//
-// 'ps_printer_update_for_installable_options() - Update printer's driver
-//                                                data and driver IPP
-//                                                attributes for changes
-//                                                in the "Installable Options"
-//                                                settings.
-//
-
-static void
-ps_printer_update_for_installable_options(
-    pappl_printer_t *printer,           // I - Printer
-    pappl_pr_driver_data_t driver_data, // I - Driver data
-    const char *instoptstr)             // I - Installable options in a string 
-                                        //     of key=value pairs or NULL for
-                                        //     keeping current settings
-{
-  int                    i;
-  pappl_system_t         *system;       // System
-  ipp_t                  *driver_attrs,
-                         *vendor_attrs;
-  ipp_attribute_t        *attr;
-  char                   buf[1024];
-
-
-  // Get system...
-  system = papplPrinterGetSystem(printer);
-
-  papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-		  "Updating printer's driver data and attributes to the \"Installable Options\" settings.");
-  if (instoptstr)
-    papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-		    "New \"Installable Options\" settings: %s", instoptstr);
-
-  // Get a copy of the driver IPP attributes to save the vendor option settings
-  driver_attrs = papplPrinterGetDriverAttributes(printer);
-  if ((attr = ippFindAttribute(driver_attrs, "installable-options-default",
-			       IPP_TAG_ZERO)) != NULL &&
-      ippAttributeString(attr, buf, sizeof(buf)) > 0)
+  // Media source
+  if ((count = pc->num_sources) > 0)
   {
-    papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-		    "Previous installable accessories settings: %s", buf);
-    if (!instoptstr)
-      instoptstr = buf;
+    if (!update)
+      choice = ppdFindMarkedChoice(ppd, pc->source_option);
+    else
+      for (i = 0; i < driver_data->num_source; i ++)
+	free((char *)(driver_data->source[i]));
+    def_source = NULL;
+    for (i = 0, j = 0, pwg_map = pc->sources;
+	 i < count && j < PAPPL_MAX_SOURCE;
+	 i ++, pwg_map ++)
+      if (!(update &&
+	    ps_constraints_conflict(&(extension->constraints),
+				    pc->source_option, pwg_map->ppd)))
+      {
+	driver_data->source[j] = strdup(pwg_map->pwg);
+	if (j == 0 ||
+	    (!update && choice && !strcmp(pwg_map->ppd, choice->choice)) ||
+	    (update &&
+	     !strcmp(pwg_map->pwg, driver_data->media_default.source)))
+	{
+	  def_source = driver_data->source[j];
+	  ppdMarkOption(ppd, pc->source_option, pwg_map->ppd);
+	}
+	j ++;
+      }
+    driver_data->num_source = j;
   }
-  else
-    papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-		    "Installable Options settings not found");
-
-  // If we have new installable options settings update them in driver_attrs
-  if (instoptstr != buf)
+  if (count == 0 || driver_data->num_source == 0)
   {
-    if ((attr = ippFindAttribute(driver_attrs, "installable-options-default",
-				 IPP_TAG_ZERO)) != NULL)
-      ippDeleteAttribute(driver_attrs, attr);
-    ippAddString(driver_attrs, IPP_TAG_PRINTER, IPP_TAG_TEXT,
-		 "installable-options-default", NULL, instoptstr);
+    driver_data->num_source = 1;
+    driver_data->source[0] = strdup("default");
+    def_source = driver_data->source[0];
   }
 
-  // Update the driver data to correspond with the printer hardware
-  // accessory configuration ("Installable Options" in the PPD)
-  ps_driver_setup(system, NULL, NULL, NULL, &driver_data, &driver_attrs,
-		  NULL);
-
-  // Data structure for vendor options IPP attributes
-  vendor_attrs = ippNew();
-
-  // Copy the vendor option IPP attributes
-  for (i = 0; i < driver_data.num_vendor; i ++)
+  // Media type
+  if ((count = pc->num_types) > 0)
   {
-    snprintf(buf, sizeof(buf), "%s-default", driver_data.vendor[i]);
-    attr = ippFindAttribute(driver_attrs, buf, IPP_TAG_ZERO);
-    if (attr)
-      ippCopyAttribute(vendor_attrs, attr, 0);
-    else
-      papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-		      "Default setting for vendor option \"%s\" not found",
-		      driver_data.vendor[i]);
-    if (!strcmp(driver_data.vendor[i], "installable-options"))
-      continue;
-    snprintf(buf, sizeof(buf), "%s-supported", driver_data.vendor[i]);
-    attr = ippFindAttribute(driver_attrs, buf, IPP_TAG_ZERO);
-    if (attr)
-      ippCopyAttribute(vendor_attrs, attr, 0);
+    if (!update)
+      choice = ppdFindMarkedChoice(ppd, "MediaType");
     else
-      papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-		      "Supported choices for vendor option \"%s\" not found",
-		      driver_data.vendor[i]);
-  }
-
-  // Save the updated driver data back to the printer
-  papplPrinterSetDriverData(printer, &driver_data, vendor_attrs);
-
-  // Clean up
-  ippDelete(driver_attrs);
-  ippDelete(vendor_attrs);
-}
+      for (i = 0; i < driver_data->num_type; i ++)
+	free((char *)(driver_data->type[i]));
+    def_type = NULL;
+    for (i = 0, j = 0, pwg_map = pc->types;
+	 i < count && j < PAPPL_MAX_TYPE;
+	 i ++, pwg_map ++)
+      if (!(update &&
+	    ps_constraints_conflict(&(extension->constraints),
+				    "MediaType", pwg_map->ppd)))
+      {
+	driver_data->type[j] = strdup(pwg_map->pwg);
+	if (j == 0 ||
+	    (!update && choice && !strcmp(pwg_map->ppd, choice->choice)) ||
+	    (update &&
+	     !strcmp(pwg_map->pwg, driver_data->media_default.type)))
+	{
+	  def_type = driver_data->type[j];
+	  ppdMarkOption(ppd, "MediaType", pwg_map->ppd);
+	}
+	j ++;
+      }
+    driver_data->num_type = j;
+  }
+  if (count == 0 || driver_data->num_type == 0)
+  {
+    driver_data->num_type = 1;
+    driver_data->type[0] = strdup("auto");
+    def_type = driver_data->type[0];
+  }
 
+  // Media size, margins
+  if ((option = ppdFindOption(ppd, "PageSize")) == NULL ||
+      (!extension->cups_filter_ps &&
+       !ps_option_has_code(system, ppd, option)))
+  {
+    papplLog(system, PAPPL_LOGLEVEL_ERROR,
+	     "PPD does not have a \"PageSize\" option or the option is "
+	     "missing PostScript/PJL code for selecting the page size.");
+    ps_driver_delete(NULL, driver_data);
+    return (false);
+  }
+  def_left = def_right = def_top = def_bottom = 9999999;
+  driver_data->borderless = false;
+  count = pc->num_sizes;
+  if (!update)
+  {
+    // If we can determine a default page size (Letter/A4) depending
+    // on the user's location via ps_default_paper_size() and there is
+    // either no default page size set or the default page size is A4
+    // or Letter, we correct the default to the page size of the
+    // user's location, but only if it is actually available in the
+    // PPD. Otherwise we take the default page size from the PPD file.
+    // Most PPDs have Letter as default but most places on the world
+    // use A4, so this switches the deafult to A4 in most cases.  This
+    // affects only new print queues or newly added media sources.
+    const char *val;
+    if ((val = ps_default_paper_size()) == NULL ||
+	(option = ppdFindOption(ppd, "PageSize")) == NULL ||
+	((choice = ppdFindMarkedChoice(ppd, "PageSize")) != NULL &&
+	 strcasecmp(choice->choice, "Letter") &&
+	 strcasecmp(choice->choice, "A4")) ||
+	(choice = ppdFindChoice(option, val)) == NULL)
+      choice = ppdFindMarkedChoice(ppd, "PageSize");
+  }
+  else
+    for (i = 0; i < driver_data->num_media; i ++)
+      free((char *)(driver_data->media[i]));
+  def_media = NULL;
+  j = 0;
 
-//
-// 'ps_printer_web_device_config()' - Web interface page for entering/polling
-//                                    the configuration of printer add-ons
-//                                    ("Installable Options" in PPD and polling
-//                                    default option settings
-//
+  // Custom page size (if defined in PPD)
+  if (pc->custom_min_keyword && pc->custom_max_keyword &&
+      pc->custom_max_width > pc->custom_min_width &&
+      pc->custom_max_length > pc->custom_min_length)
+  {
+    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	     "Adding custom page size:");
+    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	     "  PWG keyword min dimensions: \"%s\"", pc->custom_min_keyword);
+    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	     "  PWG keyword max dimensions: \"%s\"", pc->custom_max_keyword);
+    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	     "  Minimum dimensions (width, length): %dx%d",
+	     pc->custom_min_width, pc->custom_min_length);
+    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	     "  Maximum dimensions (width, length): %dx%d",
+	     pc->custom_max_width, pc->custom_max_length);
+    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	     "  Margins (left, bottom, right, top): %d, %d, %d, %d",
+	     pc->custom_size.left, pc->custom_size.bottom,
+	     pc->custom_size.right, pc->custom_size.top);
+    driver_data->media[j] = strdup(pc->custom_max_keyword);
+    j ++;
+    driver_data->media[j] = strdup(pc->custom_min_keyword);
+    j ++;
+  }
 
-static void
-ps_printer_web_device_config(
-    pappl_client_t  *client,		// I - Client
-    pappl_printer_t *printer)		// I - Printer
-{
-  int          i, j, k;                 // Looping variables
-  const char   *status = NULL;		// Status text, if any
-  const char   *uri = NULL;             // Client URI
-  pappl_system_t *system;               // System
-  pappl_pr_driver_data_t driver_data;
-  ipp_t        *driver_attrs;
-  ps_driver_extension_t *extension;
-  ppd_file_t   *ppd = NULL;		// PPD file of the printer
-  ppd_cache_t  *pc;
-  char         *keyword;
-  ppd_group_t  *group;
-  ppd_option_t *option;
-  ppd_choice_t *choice;
-  ppd_attr_t   *ppd_attr;
-  int          default_choice;
-  int          num_options = 0;         // Number of polled options
-  cups_option_t	*options = NULL;        // Polled options
-  cups_option_t *opt;
-  bool         polled_installables = false,
-               polled_defaults = false;
+  // Standard page sizes
+  for (i = 0, pwg_size = pc->sizes;
+       i < count && j < PAPPL_MAX_MEDIA;
+       i ++, pwg_size ++)
+    if (!(update &&
+	  ps_constraints_conflict(&(extension->constraints),
+				  "PageSize", pwg_size->map.ppd)))
+    {
+      driver_data->media[j] =
+	strdup(pwg_size->map.pwg);
+      if (j == 0 ||
+	  (!update && choice && !strcmp(pwg_size->map.ppd, choice->choice)) ||
+	  (update &&
+	   !strcmp(pwg_size->map.pwg, driver_data->media_default.size_name)))
+      {
+	def_media = pwg_size;
+	ppdMarkOption(ppd, "PageSize", pwg_size->map.ppd);
+      }
+      if (pwg_size->left == 0 && pwg_size->right == 0 &&
+	  pwg_size->top == 0 && pwg_size->bottom == 0)
+	driver_data->borderless = true;
+      else
+      {
+	if (pwg_size->left < def_left)
+	  def_left = pwg_size->left;
+	if (pwg_size->right < def_right)
+	  def_right = pwg_size->right;
+	if (pwg_size->top < def_top)
+	  def_top = pwg_size->top;
+	if (pwg_size->bottom < def_bottom)
+	  def_bottom = pwg_size->bottom;
+      }
+      j ++;
+    }
 
+  // Number of media entries (Note that custom page size uses 2 entries,
+  // one holding the minimum, one the maximum dimensions)
+  driver_data->num_media = j;
 
-  if (!papplClientHTMLAuthorize(client))
-    return;
+  // If margin info missing in the page size entries, use "HWMargins"
+  // line of the PPD file, otherwise zero
+  if (def_left >= 9999999)
+    def_left = (ppd->custom_margins[0] ?
+		(int)(ppd->custom_margins[0] / 72.0 * 2540.0) : 0);
+  if (def_bottom >= 9999999)
+    def_bottom = (ppd->custom_margins[1] ?
+		  (int)(ppd->custom_margins[1] / 72.0 * 2540.0) : 0);
+  if (def_right >= 9999999)
+    def_right = (ppd->custom_margins[2] ?
+		 (int)(ppd->custom_margins[2] / 72.0 * 2540.0) : 0);
+  if (def_top >= 9999999)
+    def_top = (ppd->custom_margins[3] ?
+	       (int)(ppd->custom_margins[3] / 72.0 * 2540.0) : 0);
 
-  system = papplPrinterGetSystem(printer);
-  papplPrinterGetDriverData(printer, &driver_data);
-  driver_attrs = papplPrinterGetDriverAttributes(printer);
-  extension = (ps_driver_extension_t *)driver_data.extension;
-  ppd = extension->ppd;
-  pc = ppd->cache;
+  // Set margin info
+  driver_data->left_right = (def_left < def_right ? def_left : def_right);
+  driver_data->bottom_top = (def_bottom < def_top ? def_bottom : def_top);
+  papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	   "Margins: Left/Right: %d, Bottom/Top: %d",
+	   driver_data->left_right, driver_data->bottom_top);
 
-  // Handle POSTs to set "Installable Options" and poll default settings...
-  if (papplClientGetMethod(client) == HTTP_STATE_POST)
-  {
-    int			num_form = 0;	// Number of form variables
-    cups_option_t	*form = NULL;	// Form variables
-    int                 num_installables = 0; // Number of installable options 
-    cups_option_t	*installables = NULL; // Set installable options
-    int                 num_vendor = 0; // Number of vendor-specific options 
-    cups_option_t	*vendor = NULL; // vendor-specific options
-    ipp_attribute_t     *attr;
-    const char		*action;	// Form action
-    char                buf[1024];
-    const char          *value;
-    char                *ptr1, *ptr2;
-    pwg_map_t           *pwg_map;
-    pwg_size_t          *pwg_size;
-    int                 polled_def_source = -1;
-    const char          *polled_def_size = NULL,
-                        *polled_def_type = NULL;
-    int                 best = 0;
-    char                ipp_supported[128],
-                        ipp_choice[80];
+  // Set default for media
+  if (def_media)
+    ps_media_col(def_media, def_source, def_type, 0, 0, 0,
+		 &(driver_data->media_default));
 
-    if ((num_form = papplClientGetForm(client, &form)) == 0)
-    {
-      status = "Invalid form data.";
-    }
-    else if (!papplClientIsValidForm(client, num_form, form))
-    {
-      status = "Invalid form submission.";
-    }
-    else if ((action = cupsGetOption("action", num_form, form)) == NULL)
-    {
-      status = "Missing action.";
-    }
-    else if (!strcmp(action, "set-installable"))
+  // "media-ready" not defined in PPDs, also cannot be polled from printer
+  // The user configures in the web interface what is loaded.
+  //
+  // The web interface shows only the input trays which are actually
+  // installed on the printer, according to the configuration of
+  // installable accessories on the "Device Settings" page.
+  //
+  // If the user accidentally removes a tray on the "Device Settings" page
+  // and re-adds it while the Printer Application is still running, the
+  // loaded media configuration gets restored.
+  if (update)
+  {
+    for (i = 0, j = 0, pwg_map = pc->sources;
+	 i < pc->num_sources && j < PAPPL_MAX_SOURCE;
+	 i ++, pwg_map ++)
     {
-      status = "Installable accessory configuration saved.";
-      buf[0] = '\0';
-      for (i = num_form, opt = form; i > 0;
-	   i --, opt ++)
-	if (opt->name[0] == '\t')
+      tmp_col.source[0] = '\0';
+      // Go through all media sources of the PPD file, to keep the order
+      if (!strcasecmp(pwg_map->pwg, driver_data->source[j]))
+      {
+	// Current PPD media source is available (installed)
+	if (strcasecmp(pwg_map->pwg, driver_data->media_ready[j].source))
 	{
-	  if (opt->name[1] == '\t')
-	  {
-	    ptr1 = strdup(opt->name + 2);
-	    ptr2 = strchr(ptr1, '\t');
-	    *ptr2 = '\0';
-	    ptr2 ++;
-	    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf) - 1,
-		     " %s=%s", ptr1, ptr2);
-	    num_installables = cupsAddOption(ptr1, ptr2,
-					     num_installables, &installables);
-	    free(ptr1);
-	  }
+	  // There is no media-col-ready item for the current media source,
+	  // so first check whether we have it in the hidden "Undo" space
+	  // beyond the actually used media items (it should be there when
+	  // we had already set the source as installed earlier during this
+	  // session of the Printer Application
+	  for (k = j;
+	       k < PAPPL_MAX_SOURCE && driver_data->media_ready[k].source[0] &&
+		 strcasecmp(pwg_map->pwg, driver_data->media_ready[k].source);
+	       k ++);
+	  if (!strcasecmp(pwg_map->pwg, driver_data->media_ready[k].source))
+	    // Found desired item in hidden "Undo" space beyond the actually
+	    // used media-col-ready items
+	    memcpy(&tmp_col, &(driver_data->media_ready[k]),
+		   sizeof(pappl_media_col_t));
+	  else if (k == PAPPL_MAX_SOURCE)
+	    k --; // Do not push beyond the memory
+	  else if (k < PAPPL_MAX_SOURCE - 1)
+	    k ++; // Push up also the terminating zero item
+	  // Move up the other items to make space for the new item
+	  memmove(&(driver_data->media_ready[j + 1]),
+		  &(driver_data->media_ready[j]),
+		  (k - j) * sizeof(pappl_media_col_t));
+	  if (tmp_col.source[0])
+	    // Insert item from "Undo" space
+	    memcpy(&(driver_data->media_ready[j]), &tmp_col,
+		   sizeof(pappl_media_col_t));
 	  else
 	  {
-	    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf) - 1,
-		     " %s=%s", opt->name + 1, opt->value);
-	    num_installables = cupsAddOption(opt->name + 1, opt->value,
-					     num_installables, &installables);
+	    // Create new item, as this was not in "Undo" space
+	    memcpy(&(driver_data->media_ready[j]),
+		   &(driver_data->media_default),
+		   sizeof(pappl_media_col_t));
+	    strncpy(driver_data->media_ready[j].source, driver_data->source[j],
+		    sizeof(driver_data->media_ready[j].source));
 	  }
 	}
-      papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-		      "\"Installable Options\" from web form:%s", buf);
-
-      buf[0] = '\0';
-      for (i = ppd->num_groups, group = ppd->groups;
-	   i > 0;
-	   i --, group ++)
+	// Go on with next media source
+	j ++;
+      }
+      else
       {
+	// Current PPD media source is unavailable (accessory not installed)
+	if (!strcasecmp(pwg_map->pwg, driver_data->media_ready[j].source))
+	{
+	  // Current media-col-ready item is the unavailable media source,
+	  // so move current media-col-ready away into the "Undo" space beyond
+	  // the actually used media-col-ready items, so its configuration
+	  // stays saved case we have removed the tray in the installable
+	  // accessories by accident
+	  memcpy(&tmp_col, &(driver_data->media_ready[j]),
+		 sizeof(pappl_media_col_t));
+	  // Pull down the rest
+	  for (k = j + 1;
+	       k < PAPPL_MAX_SOURCE && driver_data->media_ready[k].source[0];
+	       k ++);
+	  memmove(&(driver_data->media_ready[j]),
+		  &(driver_data->media_ready[j + 1]),
+		  (k - j - 1) * sizeof(pappl_media_col_t));
+	  // Drop the saved item into the freed slot in the "Undo" space
+	  memcpy(&(driver_data->media_ready[k - 1]), &tmp_col,
+		 sizeof(pappl_media_col_t));
+	}
+      }
+    }
+    // If there is no InputSlot (media source) option in the PPD file,
+    // set a single entry for the default media size and type
+    if (j == 0)
+    {
+      memcpy(&(driver_data->media_ready[0]), &(driver_data->media_default),
+	     sizeof(pappl_media_col_t));
+      j = 1;
+    }
+    // During initial loading of the state file add a terminating zero
+    // item to manage the "Undo" space when configuring available
+    // media trays on the printer
+    if (!papplSystemIsRunning(system) && j < PAPPL_MAX_SOURCE)
+      driver_data->media_ready[j].source[0] = '\0';
+  }
+  else
+  {
+    // Create media-col-ready items for each media source
+    for (i = 0; i < driver_data->num_source; i ++)
+    {
+      memcpy(&(driver_data->media_ready[i]), &(driver_data->media_default),
+	     sizeof(pappl_media_col_t));
+      strncpy(driver_data->media_ready[i].source, driver_data->source[i],
+	      sizeof(driver_data->media_ready[i].source));
+    }
+    // Add a terminating zero item to manage the "Undo" space when configuring
+    // available media trays on the printer
+    if (i < PAPPL_MAX_SOURCE)
+      driver_data->media_ready[i].source[0] = '\0';
+  }
 
-	// We are treating only the "Installable Options" group of options
-	// in the PPD file here
+  // Log "media-ready" entries
+  papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	   "Entries for \"media-ready\":");
+  for (i = 0;
+       i < PAPPL_MAX_SOURCE && driver_data->media_ready[i].source[0];
+       i ++)
+  {
+    if (i == driver_data->num_source)
+      papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	       "Undo buffer for \"media-ready\":");
+    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	     "  %s: %s, %s%s, L=%d, B=%d, R=%d, T=%d",
+	     driver_data->media_ready[i].source,
+	     driver_data->media_ready[i].size_name,
+	     driver_data->media_ready[i].type,
+	     (driver_data->media_ready[i].bottom_margin ||
+	      driver_data->media_ready[i].left_margin ||
+	      driver_data->media_ready[i].right_margin ||
+	      driver_data->media_ready[i].top_margin ? "" : ", Borderless"),
+	     driver_data->media_ready[i].left_margin,
+	     driver_data->media_ready[i].bottom_margin,
+	     driver_data->media_ready[i].right_margin,
+	     driver_data->media_ready[i].top_margin);
+  }
 
-	if (strncasecmp(group->name, "Installable", 11) != 0)
-	  continue;
+  // Offsets not defined in PPDs
+  driver_data->left_offset_supported[0] = 0;
+  driver_data->left_offset_supported[1] = 0;
+  driver_data->top_offset_supported[0] = 0;
+  driver_data->top_offset_supported[1] = 0;
 
-	for (j = group->num_options, option = group->options;
-	     j > 0;
-	     j --, option ++)
-        {
-	  // Does the option have less than 2 choices? Then it does not make
-	  // sense to let it show in the web interface
-	  if (option->num_choices < 2)
-	    continue;
+  // Media tracking not defined in PPDs
+  driver_data->tracking_supported = 0;
 
-	  if ((value = cupsGetOption(option->keyword,
-				     num_installables, installables)) == NULL)
-	  {
-	    // Unchecked check box option
-	    if (!strcasecmp(option->choices[0].text, "false"))
-	      value = option->choices[0].choice;
-	    else if (!strcasecmp(option->choices[1].text, "false"))
-	      value = option->choices[1].choice;
-	  }
-	  ppdMarkOption(ppd, option->keyword, value);
-	  snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf) - 1,
-		   "%s=%s ", option->keyword, value);
+  // Output bins
+  if ((count = pc->num_bins) > 0 &&
+      (option = ppdFindOption(ppd, "OutputBin")) != NULL &&
+      (extension->cups_filter_ps ||
+       ps_option_has_code(system, ppd, option)))
+  {
+    if (!update)
+      choice = ppdFindMarkedChoice(ppd, "OutputBin");
+    else
+    {
+      def_bin = strdup(driver_data->bin[driver_data->bin_default]);
+      for (i = 0; i < driver_data->num_bin; i ++)
+	free((char *)(driver_data->bin[i]));
+    }
+    driver_data->bin_default = 0;
+    for (i = 0, j = 0, pwg_map = pc->bins;
+	 i < count && j < PAPPL_MAX_BIN;
+	 i ++, pwg_map ++)
+      if (!(update &&
+	    ps_constraints_conflict(&(extension->constraints),
+				    "OutputBin", pwg_map->ppd)))
+      {
+	driver_data->bin[j] = strdup(pwg_map->pwg);
+	if ((!update && choice && !strcmp(pwg_map->ppd, choice->choice)) ||
+	    (update && !strcmp(pwg_map->pwg, def_bin)))
+	{
+	  driver_data->bin_default = j;
+	  ppdMarkOption(ppd, "OutputBin", pwg_map->ppd);
 	}
-	if (buf[0])
-	  buf[strlen(buf) - 1] = '\0';
+	j ++;
       }
-      cupsFreeOptions(num_installables, installables);
+    driver_data->num_bin = j;
+    if (update)
+      free(def_bin);
+  }
+  else
+  {
+    driver_data->num_bin = 0;
+    driver_data->bin_default = 0;
+  }
 
-      // Update the driver data to only show options and choices which make
-      // sense with the current installable accessory configuration
-      papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-		      "\"Installable Options\" marked in PPD: %s", buf);
-      ps_printer_update_for_installable_options(printer, driver_data, buf);
+  // Properties not defined in PPDs
+  driver_data->mode_configured = 0;
+  driver_data->mode_supported = 0;
+  driver_data->tear_offset_configured = 0;
+  driver_data->tear_offset_supported[0] = 0;
+  driver_data->tear_offset_supported[1] = 0;
+  driver_data->speed_supported[0] = 0;
+  driver_data->speed_supported[1] = 0;
+  driver_data->speed_default = 0;
+  driver_data->darkness_default = 0;
+  driver_data->darkness_configured = 0;
+  driver_data->darkness_supported = 0;
+  driver_data->num_features = 0;
 
-      // Save the changes
-      papplSystemSaveState(system, state_file);
+  // For each PPD option which is not supported by PAPPL/IPP add a
+  // vendor option, so that the default for the options can get set in
+  // the web interface or settings of these options can be supplied on
+  // the command line.
+
+  // Clean up old option lists on update
+  if (update)
+    for (i = 0; i < driver_data->num_vendor; i ++)
+    {
+      free((char *)(driver_data->vendor[i]));
+      if (extension->vendor_ppd_options[i])
+	free((char *)(extension->vendor_ppd_options[i]));
     }
-    else if (!strcmp(action, "poll-installable"))
+
+  // Go through all the options of the PPD file
+  driver_data->num_vendor = 0;
+  for (i = ppd->num_groups, group = ppd->groups;
+       i > 0;
+       i --, group ++)
+  {
+    for (j = group->num_options, option = group->options;
+         j > 0;
+         j --, option ++)
     {
-      // Poll installed options info
-      num_options = ps_poll_device_option_defaults(printer, true, &options);
-      if (num_options)
-      {
-	status = "Installable accessory configuration polled from printer.";
-	polled_installables = true;
+      // Does the option allow custom values?
+      num_cparams = 0;
+      if ((coption = ppdFindCustomOption(ppd, option->keyword)) != NULL)
+	num_cparams = cupsArrayCount(coption->params);
 
-	// Get current settings of the "Installable Options"
-	num_installables = 0;
-	installables = NULL;
-	if ((attr = ippFindAttribute(driver_attrs,
-				     "installable-options-default",
-				     IPP_TAG_ZERO)) != NULL)
-	{
-	  if (ippAttributeString(attr, buf, sizeof(buf)) > 0)
-	  {
-	    num_installables = cupsParseOptions(buf, 0, &installables);
-	    ppdMarkOptions(ppd, num_installables, installables);
-	  }
-	  ippDeleteAttribute(driver_attrs, attr);
-	}
+      // Does the option have less than 2 choices and also does not
+      // allow custom values? Then it does not make sense to let it
+      // show in the web interface
+      if (option->num_choices < 2 && num_cparams == 0)
+	continue;
 
-	// Join polled settings and mark them in the PPD
-	for (i = num_options, opt = options; i > 0; i --, opt ++)
-        {
-	  ppdMarkOption(ppd, opt->name, opt->value);
-	  num_installables = cupsAddOption(opt->name, opt->value,
-					   num_installables, &installables);
-        }
+      // Can printer's default setting of this option be polled from the
+      // printer?
+      snprintf(buf, sizeof(buf), "?%s", option->keyword);
+      if ((ppd_attr = ppdFindAttr(ppd, buf, NULL)) != NULL &&
+	  ppd_attr->value)
+      {
+	pollable = true;
+	papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+		 "Default of option \"%s\" (\"%s\") can get queried from "
+		 "printer.", option->keyword, option->text);
+      }
+      else
+	pollable = false;
 
-	// Create new option string for saving in the state file
-	buf[0] = '\0';
-	for (i = num_installables, opt = installables; i > 0; i --, opt ++)
-	  snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf) - 1,
-		   "%s=%s ", opt->name, opt->value);
-        if (buf[0])
-	  buf[strlen(buf) - 1] = '\0';
+      // Skip the group for installable options here, as they should not
+      // show on the "Printing Defaults" page nor be listed in the response
+      // to a get-printer-atrributes IPP request from a client.
+      // Only note the fact that we have such options in the PPD file
+      if (strncasecmp(group->name, "Installable", 11) == 0)
+      {
+	papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+		 "Installable accessory option: \"%s\" (\"%s\")",
+		 option->keyword, option->text);
+	extension->installable_options = true;
+	if (pollable)
+	  extension->installable_pollable = true;
+	continue;
+      }
 
-	// Clean up
-	cupsFreeOptions(num_installables, installables);
+      // Do we have a pollable option? Mark that we have one so that
+      // we can show an appropriate poll button in the web interface
+      if (pollable)
+	extension->defaults_pollable = true;
 
-	// Update the driver data to only show options and choices which make
-	// sense with the current installable accessory configuration
-	papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-			"\"Installable Options\" marked in PPD: %s", buf);
-	ps_printer_update_for_installable_options(printer, driver_data, buf);
+      // Is this option already handled by PAPPL/IPP
+      for (k = 0; pappl_handled_options[k]; k ++)
+	if (!strcasecmp(option->keyword, pappl_handled_options[k]))
+	  break;
+      if (pappl_handled_options[k] ||
+	  (pc->source_option &&
+	   !strcasecmp(option->keyword, pc->source_option)) ||
+	  (pc->sides_option &&
+	   !strcasecmp(option->keyword, pc->sides_option)))
+	continue;
 
-	// Save the changes
-	papplSystemSaveState(system, state_file);
-      }
-      else
-	status = "Could not poll installable accessory configuration from "
-	         "printer.";
-    }
-    else if (!strcmp(action, "poll-defaults"))
-    {
-      // Poll default option values
-      num_options = ps_poll_device_option_defaults(printer, false,
-						   &options);
-      if (num_options)
+      // Check whether there is not more than one at least all but one choice
+      // without active PostScript or PJL code to inject into the job stream
+      if (!extension->cups_filter_ps &&
+	  !ps_option_has_code(system, ppd, option))
+	continue;
+
+      // Stop and warn if we have no slots for vendor attributes any more
+      // Note that we reserve one slot for saving the "Installable Options"
+      // in the state file and PS_NUM_APP_VENDOR slots for the options of
+      // the Printer Application itself
+      // We also take into account here that each custom parameter for this
+      // option requires one additional vendor option
+      if (driver_data->num_vendor >=
+	  PAPPL_MAX_VENDOR - 1 - PS_NUM_APP_VENDOR - num_cparams)
       {
-	// Read the polled option settings, mark them in the PPD, update them
-	// in the printer data and create a summary for logging
-	status = "Option defaults polled from printer.";
-	polled_defaults = true;
+	papplLog(system, PAPPL_LOGLEVEL_WARN,
+		 "Too many options in PPD file, \"%s\" (\"%s\") will not be controllable!",
+		 option->keyword, option->text);
+	continue;
+      }
 
-	snprintf(buf, sizeof(buf) - 1, "Option defaults polled from printer:");
-	for (i = num_options, opt = options; i > 0; i --, opt ++)
+      // IPP-style option name
+      ppdPwgUnppdizeName(option->text, ipp_opt, sizeof(ipp_opt), NULL);
+
+      // Check whether we have a duplicate (PPD bug: 2 Options have same
+      // Human-readable string)
+      for (k = 0; k < driver_data->num_vendor; k ++)
+	if (strcmp(ipp_opt, driver_data->vendor[k]) == 0)
 	{
-	  ppdMarkOption(ppd, opt->name, opt->value);
-	  snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf) - 1,
-		   " %s=%s", opt->name, opt->value);
-	  if (!strcasecmp(opt->name, "PageSize"))
-	  {
-	    for (j = 0, pwg_size = pc->sizes; j < pc->num_sizes;
-		 j ++, pwg_size ++)
-	      if (!strcasecmp(opt->value, pwg_size->map.ppd))
-		break;
-	    if (j < pc->num_sizes)
+	  papplLog(system, PAPPL_LOGLEVEL_WARN,
+		   "Two options with the same human-readable name in the PPD file (PPD file bug): \"%s\" and \"%s\" both have \"%s\", giving the IPP attribute name \"%s\"",
+		   extension->vendor_ppd_options[k],
+		   option->keyword, option->text, ipp_opt);
+	  break;
+	}
+      if (k < driver_data->num_vendor)
+	continue;
+
+      // IPP attribute names for available values and default value
+      snprintf(ipp_supported, sizeof(ipp_supported), "%s-supported", ipp_opt);
+      snprintf(ipp_default, sizeof(ipp_default), "%s-default", ipp_opt);
+
+      // Add vendor option and its choices to driver IPP attributes
+      if (option->ui == PPD_UI_PICKONE || option->ui == PPD_UI_BOOLEAN)
+      {
+	papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+		 "Adding vendor-specific option \"%s\" (\"%s\") as IPP option "
+		 "\"%s\"", option->keyword, option->text, ipp_opt);
+	if (*driver_attrs == NULL)
+	  *driver_attrs = ippNew();
+	if (option->num_choices == 2 &&
+	    ((!strcasecmp(option->choices[0].text, "true") &&
+	      !strcasecmp(option->choices[1].text, "false")) ||
+	     (!strcasecmp(option->choices[0].text, "false") &&
+	      !strcasecmp(option->choices[1].text, "true"))))
+	{
+	  // Create a boolean IPP option, as human-readable choices "true"
+	  // and "false" are not very user-friendly
+
+	  // On update, remove IPP attributes, keep default
+	  default_choice = 0;
+	  if (update)
+          {
+	    ippDeleteAttribute(*driver_attrs,
+			       ippFindAttribute(*driver_attrs, ipp_supported,
+						IPP_TAG_ZERO));
+	    attr = ippFindAttribute(*driver_attrs, ipp_default, IPP_TAG_ZERO);
+	    if (attr)
 	    {
-	      for (k = 0; k < driver_data.num_media; k ++)
-		if (!strcasecmp(pwg_size->map.pwg, driver_data.media[k]))
-		  break;
-	      if (k < driver_data.num_media)
-		polled_def_size = driver_data.media[k];
+	      default_choice = ippGetBoolean(attr, 0);
+	      ippDeleteAttribute(*driver_attrs, attr);
 	    }
-	  }
-	  else if (!strcasecmp(opt->name, pc->source_option)) // InputSlot
-	  {
-	    for (j = 0, pwg_map = pc->sources; j < pc->num_sources;
-		 j ++, pwg_map ++)
-	      if (!strcasecmp(opt->value, pwg_map->ppd))
-		break;
-	    if (j < pc->num_sources)
+	    else
+	      default_choice = 0;
+	    if (ps_constraints_conflict(&(extension->constraints),
+					option->keyword,
+					option->choices[0].choice))
+	      default_choice = -1;
+	    if (ps_constraints_conflict(&(extension->constraints),
+					option->keyword,
+					option->choices[1].choice))
 	    {
-	      for (k = 0; k < driver_data.num_source; k ++)
-		if (!strcasecmp(pwg_map->pwg, driver_data.source[k]))
-		  break;
-	      if (k < driver_data.num_source)
-		polled_def_source = k;
+	      if (default_choice >= 0)
+		ppdMarkOption(ppd, option->keyword, option->choices[0].choice);
+	      default_choice = -1;
 	    }
-	  }
-	  else if (!strcasecmp(opt->name, "MediaType"))
-	  {
-	    for (j = 0, pwg_map = pc->types; j < pc->num_types;
-		 j ++, pwg_map ++)
-	      if (!strcasecmp(opt->value, pwg_map->ppd))
-		break;
-	    if (j < pc->num_types)
+	    else if (default_choice < 0)
+	      ppdMarkOption(ppd, option->keyword, option->choices[1].choice);
+	    if (default_choice < 0)
 	    {
-	      for (k = 0; k < driver_data.num_type; k ++)
-		if (!strcasecmp(pwg_map->pwg, driver_data.type[k]))
-		  break;
-	      if (k < driver_data.num_type)
-		polled_def_type = driver_data.type[k];
+	      papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+		       "  -> Skipping - Boolean option does not make sense with current accessory configuration");
+	      continue;
 	    }
 	  }
-	  else if (!strcasecmp(opt->name, "Resolution"))
+	  else
 	  {
-	    if (sscanf(opt->value, "%dx%ddpi",
-		       &driver_data.x_default, &driver_data.y_default) == 1)
-	      driver_data.y_default = driver_data.x_default;
+	    default_choice = 0;
+	    for (k = 0; k < 2; k ++)
+	      if (option->choices[k].marked &&
+		  !strcasecmp(option->choices[k].text, "true"))
+		default_choice = 1;
 	  }
-	  else if (!strcasecmp(opt->name, "ColorModel"))
-	  {
-	    if (ppd->color_device)
+	  papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+		   "  Default: %s", (default_choice ? "true" : "false"));
+	  ippAddBoolean(*driver_attrs, IPP_TAG_PRINTER, ipp_supported, 1);
+	  ippAddBoolean(*driver_attrs, IPP_TAG_PRINTER, ipp_default,
+			default_choice);
+	}
+	else
+	{
+	  // Create an enumerated-choice IPP option
+
+	  // On update, remove IPP attributes, keep default
+	  if (update)
+          {
+	    ippDeleteAttribute(*driver_attrs,
+			       ippFindAttribute(*driver_attrs, ipp_supported,
+						IPP_TAG_ZERO));
+	    attr = ippFindAttribute(*driver_attrs, ipp_default, IPP_TAG_ZERO);
+	    if (attr)
 	    {
-	      if (strcasestr(opt->value, "Gray") ||
-		  strcasestr(opt->value, "Mono") ||
-		  strcasestr(opt->value, "Black"))
-		driver_data.color_default = PAPPL_COLOR_MODE_MONOCHROME;
-	      else if (strcasestr(opt->value, "Color") ||
-		       strcasestr(opt->value, "RGB") ||
-		       strcasestr(opt->value, "CMY"))
-		driver_data.color_default = PAPPL_COLOR_MODE_COLOR;
-	      else
-		driver_data.color_default = PAPPL_COLOR_MODE_AUTO;
-	    }
-	  }
-	  else if (!strcasecmp(opt->name, "OutputBin"))
-	  {
-	    for (j = 0, pwg_map = pc->bins; j < pc->num_bins; j ++, pwg_map ++)
-	      if (!strcasecmp(opt->value, pwg_map->ppd))
-		break;
-	    if (j < pc->num_bins)
-	    {
-	      for (k = 0; k < driver_data.num_bin; k ++)
-		if (!strcasecmp(pwg_map->pwg, driver_data.bin[k]))
-		  break;
-	      if (k < driver_data.num_bin)
-		driver_data.bin_default = k;
+	      ippAttributeString(attr, buf, sizeof(buf));
+	      ippDeleteAttribute(*driver_attrs, attr);
 	    }
+	    else
+	      buf[0] = '\0';
 	  }
-	  else if (!strcasecmp(opt->name, pc->sides_option)) // Duplex
-	  {
-	    if (!strcasecmp(opt->value, pc->sides_1sided))
-	      driver_data.sides_default = PAPPL_SIDES_ONE_SIDED;
-	    else if (!strcasecmp(opt->value, pc->sides_2sided_long))
-	      driver_data.sides_default = PAPPL_SIDES_TWO_SIDED_LONG_EDGE;
-	    else if (!strcasecmp(opt->value, pc->sides_2sided_short))
-	      driver_data.sides_default = PAPPL_SIDES_TWO_SIDED_SHORT_EDGE;
-	  }
-	  else if (strcasecmp(opt->name, "PageRegion"))
-	  {
-	    // Vendor options
-	    for (j = 0; j < driver_data.num_vendor; j ++)
+	  choice_list = (char **)calloc(option->num_choices, sizeof(char *));
+	  first_choice = -1;
+	  default_choice = -1;
+	  for (k = 0, l = 0; k < option->num_choices; k ++)
+	    if (!(update &&
+		  ps_constraints_conflict(&(extension->constraints),
+					  option->keyword,
+					  option->choices[k].choice)))
 	    {
-	      if (extension->vendor_ppd_options[j] &&
-		  !(strcasecmp(opt->name, extension->vendor_ppd_options[j])))
+	      // If we have custom parameters (we accept a custom value)
+	      // the last choice of this option is "Custom". Only accept
+	      // this choice if PAPPL supports all the parameters (only
+	      // strings and integer numbers are supported)
+	      if (k == option->num_choices - 1 && num_cparams > 0)
 	      {
-		if ((option = ppdFindOption(ppd, opt->name)) != NULL &&
-		    (choice = ppdFindChoice(option, opt->value)) != NULL)
+		for (m = 0; m < num_cparams; m++)
 		{
-		  snprintf(ipp_supported, sizeof(ipp_supported),
-			   "%s-supported", driver_data.vendor[j]);
-		  if ((attr = ippFindAttribute(driver_attrs, ipp_supported,
-					       IPP_TAG_ZERO)) != NULL)
-		  {
-		    if (ippGetValueTag(attr) == IPP_TAG_BOOLEAN)
-		    {
-		      if (!strcasecmp(choice->text, "True"))
-			num_vendor = cupsAddOption(driver_data.vendor[j],
-						   "true", num_vendor, &vendor);
-		      else if (!strcasecmp(choice->text, "False"))
-			num_vendor = cupsAddOption(driver_data.vendor[j],
-						   "false",
-						   num_vendor, &vendor);
-		    }
-		    else
-		    {
-		      ppdPwgUnppdizeName(choice->text, ipp_choice,
-					 sizeof(ipp_choice), NULL);
-		      num_vendor = cupsAddOption(driver_data.vendor[j],
-						 ipp_choice,
-						 num_vendor, &vendor);
-		    }
-		  }
+		  cparam = (ppd_cparam_t *)cupsArrayIndex(coption->params, m);
+		  if (cparam->type != PPD_CUSTOM_INT &&
+		      cparam->type != PPD_CUSTOM_STRING &&
+		      cparam->type != PPD_CUSTOM_PASSWORD &&
+		      cparam->type != PPD_CUSTOM_PASSCODE)
+		    break;
+		}
+		if (m < num_cparams)
+		{
+		  papplLog(system, PAPPL_LOGLEVEL_WARN,
+			   "  Custom setting for this option not possible, as the parameter \"%s\" (\"%s\") is of a format not supported by PAPPL",
+			   cparam->name, cparam->text);
+		  num_cparams = 0;
+		  continue;
 		}
 	      }
-	    }
-	  }
-	}
-
-	// Media Source
-	if (polled_def_source < 0)
-	{
-	  if (polled_def_size || polled_def_type)
-	    for (i = 0; i < driver_data.num_source; i ++)
-	    {
-	      j = 0;
-	      if (polled_def_size &&
-		  !strcasecmp(polled_def_size,
-			      driver_data.media_ready[i].size_name))
-		j += 2;
-	      if (polled_def_type &&
-		  !strcasecmp(polled_def_type,
-			      driver_data.media_ready[i].type))
-		j += 1;
-	      if (j > best)
+	      ppdPwgUnppdizeName(option->choices[k].text,
+				 ipp_choice, sizeof(ipp_choice), NULL);
+	      // Check whether we have a duplicate (PPD bug: 2 Choices have same
+	      // Human-readable string)
+	      for (m = 0; m < l; m ++)
+		if (strcmp(ipp_choice, choice_list[m]) == 0)
+		{
+		  papplLog(system, PAPPL_LOGLEVEL_WARN,
+			   "  Two choices with the same human-readable name in the PPD file (PPD file bug): Choice \"%s\" (\"%s\") giving the IPP choice name \"%s\"",
+			   option->choices[k].choice,
+			   option->choices[k].text, ipp_choice);
+		  if (k == option->num_choices - 1 && num_cparams > 0)
+		    num_cparams = 0;
+		  break;
+		}
+	      if (m < l)
+		continue;
+	      // Choice is valid, add it
+	      choice_list[l] = strdup(ipp_choice);
+	      if (first_choice < 0)
+		first_choice = k;
+	      if ((!update && option->choices[k].marked) ||
+		  (update && buf[0] && !strcasecmp(ipp_choice, buf)))
 	      {
-		best = j;
-		driver_data.media_default = driver_data.media_ready[i];
+		default_choice = l;
+		ppdMarkOption(ppd, option->keyword, option->choices[k].choice);
 	      }
+	      papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+		       "  Adding choice \"%s\" (\"%s\") as \"%s\"%s",
+		       option->choices[k].choice, option->choices[k].text,
+		       ipp_choice,
+		       default_choice == l ? " (default)" : "");
+	      l ++;
 	    }
+	    else if (k == option->num_choices - 1 && num_cparams > 0)
+	      // Last choice is the "custom" choice if an option allows custom
+	      // values, if it is dropped, this option does not allow custom
+	      // values any more
+	      num_cparams = 0;
+	  if (l > 0 && default_choice < 0)
+	  {
+	    default_choice = 0;
+	    ppdMarkOption(ppd, option->keyword,
+			  option->choices[first_choice].choice);
+	  }
+	  if (l >= 2)
+	  {
+	    ippAddStrings(*driver_attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD,
+			  ipp_supported, l, NULL,
+			  (const char * const *)choice_list);
+	    ippAddString(*driver_attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD,
+			 ipp_default, NULL, choice_list[default_choice]);
+	  }
+	  for (k = 0; k < l; k ++)
+	    free(choice_list[k]);
+	  free(choice_list);
+	  if (l == 0 || (l == 1 && num_cparams == 0))
+	  {
+	    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+		     "   -> Skipping - Option does not make sense with current accessory configuration");
+	    continue;
+	  }
 	}
-	else
-	  driver_data.media_default =
-	    driver_data.media_ready[polled_def_source];
-
-	papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG, "%s", buf);
-
-	// Submit the changed default values
-	papplPrinterSetDriverDefaults(printer, &driver_data,
-				      num_vendor, vendor);
-
-	// Clean up
-	if (num_vendor)
-	  cupsFreeOptions(num_vendor, vendor);
       }
       else
-	status = "Could not poll option defaults from printer.";
-    }
-    else
-      status = "Unknown action.";
-
-    cupsFreeOptions(num_form, form);
-  }
-
-  papplClientHTMLPrinterHeader(client, printer, "Printer Device Settings", 0, NULL, NULL);
-
-  if (status)
-    papplClientHTMLPrintf(client, "          <div class=\"banner\">%s</div>\n", status);
-
-  uri = papplClientGetURI(client);
-
-  if (extension->installable_options)
-  {
-    papplClientHTMLPuts(client,
-			"          <h3>Installable printer accessories</h3>\n");
-    if (polled_installables)
-      papplClientHTMLPuts(client,
-			  "          <br>Settings obtained from polling the printer are marked with an asterisk (\"*\")</br>\n");
-
-    papplClientHTMLStartForm(client, uri, false);
-
-    papplClientHTMLPuts(client,
-			"          <table class=\"form\">\n"
-			"            <tbody>\n");
+	continue;
 
-    for (i = ppd->num_groups, group = ppd->groups;
-	 i > 0;
-	 i --, group ++)
-    {
+      // Add vendor option to lookup lists
+      driver_data->vendor[driver_data->num_vendor] = strdup(ipp_opt);
+      extension->vendor_ppd_options[driver_data->num_vendor] =
+	strdup(option->keyword);
 
-      // We are treating only the "Installable Options" group of options
-      // in the PPD file here
+      // Next entry ...
+      driver_data->num_vendor ++;
 
-      if (strncasecmp(group->name, "Installable", 11) != 0)
+      // Does the option allow a custom value?
+      if (num_cparams == 0)
 	continue;
 
-      for (j = group->num_options, option = group->options;
-	   j > 0;
-	   j --, option ++)
+      // Go through all custom parameters of the option
+      for (k = 0; k < num_cparams; k++)
       {
-	// Does the option have less than 2 choices? Then it does not make
-	// sense to let it show in the web interface
-	if (option->num_choices < 2)
-	  continue;
-
-	papplClientHTMLPrintf(client, "              <tr><th>%s:</th><td>",
-			      option->text);
-
-	if (option->num_choices == 2 &&
-	    ((!strcasecmp(option->choices[0].text, "true") &&
-	      !strcasecmp(option->choices[1].text, "false")) ||
-	     (!strcasecmp(option->choices[0].text, "false") &&
-	      !strcasecmp(option->choices[1].text, "true"))))
+	cparam = (ppd_cparam_t *)cupsArrayIndex(coption->params, k);
+	// Name for extra vendor option to set this parameter
+	if (num_cparams == 1)
+	  snprintf(ipp_custom_opt, sizeof(ipp_custom_opt), "custom-%s", ipp_opt);
+	else
 	{
-	  // Create a check box widget, as human-readable choices "true"
-	  // and "false" are not very user-friendly
-	  default_choice = 0;
-	  for (k = 0; k < 2; k ++)
-	    if (!strcasecmp(option->choices[k].text, "true"))
-	    {
-	      if (option->choices[k].marked)
-		default_choice = 1;
-	      // Stop here to make k be the index of the "True" value of this
-	      // option so that we can extract its machine-readable value
-	      break;
-	    }
-	  // We precede the option name with a two tabs to mark it as an
-	  // option represented by a check box, we also add the machine-
-	  // readable choice name for "True" (checked). This way we can treat
-	  // the result correctly, taking into account that nothing for this
-	  // option gets submitted when the box is unchecked.
-	  papplClientHTMLPrintf(client, "<input type=\"checkbox\" name=\"\t\t%s\t%s\"%s>", option->keyword, option->choices[k].choice, default_choice == 1 ? " checked" : "");
+	  ppdPwgUnppdizeName(cparam->text, ipp_param, sizeof(ipp_param), NULL);
+	  snprintf(ipp_custom_opt, sizeof(ipp_custom_opt), "custom-%s-for-%s",
+		   ipp_param, ipp_opt);
 	}
-	else
+	snprintf(ipp_supported, sizeof(ipp_supported), "%s-supported",
+		 ipp_custom_opt);
+	snprintf(ipp_default, sizeof(ipp_default), "%s-default",
+		 ipp_custom_opt);
+	// Create extra vendor option for each custom parameter, according to
+	// the data type
+	switch (cparam->type)
 	{
-	  // Create a drop-down widget
-	  // We precede the option name with a single tab to tell that this
-	  // option comes from a drop-down. The drop-down choice always gets
-	  // submitted, so the option name in the name field is enough for
-	  // parsing the submitted result.
-	  // The tab in the beginning also assures that the PPD option names
-	  // never conflict with fixed option names of this function, like
-	  // "action" or "session".
-	  papplClientHTMLPrintf(client, "<select name=\"\t%s\">", option->keyword);
-	  default_choice = 0;
-	  for (k = 0; k < option->num_choices; k ++)
-	    papplClientHTMLPrintf(client, "<option value=\"%s\"%s>%s</option>", option->choices[k].choice, option->choices[k].marked ? " selected" : "", option->choices[k].text);
-	  papplClientHTMLPuts(client, "</select>");
+	case PPD_CUSTOM_INT:
+	  if (!ippFindAttribute(*driver_attrs, ipp_default, IPP_TAG_ZERO))
+	    ippAddInteger(*driver_attrs, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
+			  ipp_default,
+			  (cparam->minimum.custom_int <= 0 &&
+			   cparam->maximum.custom_int >= 0 ? 0 :
+			   (cparam->maximum.custom_int < 0 ?
+			    cparam->maximum.custom_int :
+			    cparam->minimum.custom_int)));
+	  if (!ippFindAttribute(*driver_attrs, ipp_supported, IPP_TAG_ZERO))
+	    ippAddRange(*driver_attrs, IPP_TAG_PRINTER, ipp_supported,
+			cparam->minimum.custom_int, cparam->maximum.custom_int);
+	  break;
+	case PPD_CUSTOM_STRING:
+	case PPD_CUSTOM_PASSCODE:
+	case PPD_CUSTOM_PASSWORD:
+	  if (!ippFindAttribute(*driver_attrs, ipp_default, IPP_TAG_ZERO))
+	    ippAddString(*driver_attrs, IPP_TAG_PRINTER, IPP_TAG_TEXT,
+			 ipp_default, NULL, "");
+	  break;
+	case PPD_CUSTOM_CURVE:
+	case PPD_CUSTOM_INVCURVE:
+	case PPD_CUSTOM_POINTS:
+	case PPD_CUSTOM_REAL:
+	case PPD_CUSTOM_UNKNOWN:
+	default:
+	  papplLog(system, PAPPL_LOGLEVEL_ERROR,
+		   "  Unsupported parameter \"%s\" (\"%s\") as IPP attribute \"%s\" -> This should never happen, \"Custom\" choice should have been rejected",
+		   cparam->name, cparam->text, ipp_custom_opt);
+	  break;
 	}
-
-	// Mark options which got updated by polling from the printer with
-	// an asterisk
-	papplClientHTMLPrintf(client, "%s",
-			      (polled_installables &&
-			       cupsGetOption(option->keyword, num_options,
-					     options) != NULL ? " *" : ""));
-
-	papplClientHTMLPuts(client, "</td></tr>\n");
+	papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+		 "  Adding custom parameter \"%s\" (\"%s\") as IPP attribute \"%s\"",
+		 cparam->name, cparam->text, ipp_custom_opt);
+	// Add parameter vendor option to lookup lists
+	driver_data->vendor[driver_data->num_vendor] = strdup(ipp_custom_opt);
+	snprintf(buf, sizeof(buf), "%s:%s", option->keyword, cparam->name);
+	extension->vendor_ppd_options[driver_data->num_vendor] = strdup(buf);
+	// Next entry ...
+	driver_data->num_vendor ++;
       }
     }
-    papplClientHTMLPuts(client,
-			"              <tr><th></th><td><button type=\"submit\" name=\"action\" value=\"set-installable\">Set</button>");
-    if (extension->installable_pollable)
-    {
-      papplClientHTMLStartForm(client, uri, false);
-      papplClientHTMLPrintf(client, "\n          &nbsp;<button type=\"submit\" name=\"action\" value=\"poll-installable\">Poll from printer</button>\n");
-    }
-    papplClientHTMLPuts(client,
-			"</td></tr>\n"
-			"            </tbody>\n"
-			"          </table>\n"
-			"        </form>\n");
-
   }
 
-  if (extension->installable_options &&
-      extension->defaults_pollable)
-    papplClientHTMLPrintf(client, "          <hr>\n");
-
-  if (extension->defaults_pollable)
+  // Add the options of the Printer Application itself, which control how
+  // jobs get converted to PostScript. They do not correspond to
+  // a PPD option, so they have no PPD option name in the lookup list.
+  // On update, existing defaults are kept.
+  if (ppd->language_level >= 2)
   {
-    papplClientHTMLPuts(client,
-			"          <h3>Poll printing defaults from the printer</h3>\n");
-
-    papplClientHTMLPuts(client,
-			"          <p>Note that settings polled from the printer overwrite your original settings.</p>\n");
-    if (polled_defaults)
-      papplClientHTMLPuts(client,
-			  "          <br>Polling results:</br>\n");
-
-    papplClientHTMLStartForm(client, uri, false);
-    papplClientHTMLPuts(client,
-			"          <table class=\"form\">\n"
-			"            <tbody>\n");
-
-    // If we have already polled and display the page again, show poll
-    // results as options which got updated by polling with their
-    // values (they are in list "options").
-    if (polled_defaults && num_options)
-      for (i = num_options, opt = options; i > 0; i --, opt ++)
-	if ((option = ppdFindOption(ppd, opt->name)) != NULL &&
-	    (choice = ppdFindChoice(option, opt->value)) != NULL)
-	  papplClientHTMLPrintf(client,
-			    "              <tr><th>%s:</th><td>%s</td></tr>\n",
-			    option->text, choice->text);
+    // Compression of the raster data, automatic choice or a fixed
+    // compressor, Flate needs PostScript level 3
+    static const char * const compressions[] =
+      { "auto", "none", "runlength", "lzw", "flate" };
+
+    if (*driver_attrs == NULL)
+      *driver_attrs = ippNew();
+    if (!ippFindAttribute(*driver_attrs, "raster-compression-supported",
+			  IPP_TAG_ZERO))
+      ippAddStrings(*driver_attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD,
+		    "raster-compression-supported",
+		    (int)(sizeof(compressions) / sizeof(compressions[0])) -
+		    (ppd->language_level >= 3 ? 0 : 1),
+		    NULL, compressions);
+    if (!ippFindAttribute(*driver_attrs, "raster-compression-default",
+			  IPP_TAG_ZERO))
+      ippAddString(*driver_attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD,
+		   "raster-compression-default", NULL, "auto");
+    driver_data->vendor[driver_data->num_vendor] =
+      strdup("raster-compression");
+    extension->vendor_ppd_options[driver_data->num_vendor] = NULL;
+    driver_data->num_vendor ++;
+  }
+  if (ppd->language_level >= 3)
+  {
+    if (*driver_attrs == NULL)
+      *driver_attrs = ippNew();
+    if (!ippFindAttribute(*driver_attrs, "raster-compression-level-supported",
+			  IPP_TAG_ZERO))
+      ippAddRange(*driver_attrs, IPP_TAG_PRINTER,
+		  "raster-compression-level-supported", 1, 9);
+    if (!ippFindAttribute(*driver_attrs, "raster-compression-level-default",
+			  IPP_TAG_ZERO))
+      ippAddInteger(*driver_attrs, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
+		    "raster-compression-level-default",
+		    PS_DEFAULT_COMPRESSION_LEVEL);
+    driver_data->vendor[driver_data->num_vendor] =
+      strdup("raster-compression-level");
+    extension->vendor_ppd_options[driver_data->num_vendor] = NULL;
+    driver_data->num_vendor ++;
+  }
+  if (ppd->language_level >= 2)
+  {
+    // JPEG quality for photo pages, /DCTDecode needs PostScript level 2
+    if (*driver_attrs == NULL)
+      *driver_attrs = ippNew();
+    if (!ippFindAttribute(*driver_attrs, "jpeg-quality-supported",
+			  IPP_TAG_ZERO))
+      ippAddRange(*driver_attrs, IPP_TAG_PRINTER, "jpeg-quality-supported",
+		  1, 100);
+    if (!ippFindAttribute(*driver_attrs, "jpeg-quality-default",
+			  IPP_TAG_ZERO))
+      ippAddInteger(*driver_attrs, IPP_TAG_PRINTER, IPP_TAG_INTEGER,
+		    "jpeg-quality-default", PS_DEFAULT_JPEG_QUALITY);
+    driver_data->vendor[driver_data->num_vendor] = strdup("jpeg-quality");
+    extension->vendor_ppd_options[driver_data->num_vendor] = NULL;
+    driver_data->num_vendor ++;
+  }
+  if (extension->binary_transport != PS_TRANSPORT_ASCII85)
+  {
+    // Binary image data, can be switched off for printers which claim
+    // to support it but fail
+    static const char * const transports[] = { "binary", "ascii85" };
+
+    if (*driver_attrs == NULL)
+      *driver_attrs = ippNew();
+    if (!ippFindAttribute(*driver_attrs, "image-data-transport-supported",
+			  IPP_TAG_ZERO))
+      ippAddStrings(*driver_attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD,
+		    "image-data-transport-supported",
+		    (int)(sizeof(transports) / sizeof(transports[0])),
+		    NULL, transports);
+    if (!ippFindAttribute(*driver_attrs, "image-data-transport-default",
+			  IPP_TAG_ZERO))
+      ippAddString(*driver_attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD,
+		   "image-data-transport-default", NULL, "binary");
+    driver_data->vendor[driver_data->num_vendor] =
+      strdup("image-data-transport");
+    extension->vendor_ppd_options[driver_data->num_vendor] = NULL;
+    driver_data->num_vendor ++;
+  }
 
-    papplClientHTMLPrintf(client, "          <tr><th></th><td><input type=\"hidden\" name=\"action\" value=\"poll-defaults\"><input type=\"submit\" value=\"%s\"></td>\n",
-			  (polled_defaults ? "Poll again" : "Poll"));
+  // PDF jobs sent as PDF, without converting them to PostScript, default
+  // if the printer tells that it accepts PDF, can be switched on for
+  // printers which do not tell it and off for printers which fail on it
+  if (*driver_attrs == NULL)
+    *driver_attrs = ippNew();
+  if (!ippFindAttribute(*driver_attrs, "pdf-job-format-supported",
+			IPP_TAG_ZERO))
+    ippAddStrings(*driver_attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD,
+		  "pdf-job-format-supported",
+		  (int)(sizeof(pdf_formats) / sizeof(pdf_formats[0])),
+		  NULL, pdf_formats);
+  if (!ippFindAttribute(*driver_attrs, "pdf-job-format-default",
+			IPP_TAG_ZERO))
+    ippAddString(*driver_attrs, IPP_TAG_PRINTER, IPP_TAG_KEYWORD,
+		 "pdf-job-format-default", NULL,
+		 extension->pdf_native ? "pdf" : "postscript");
+  driver_data->vendor[driver_data->num_vendor] = strdup("pdf-job-format");
+  extension->vendor_ppd_options[driver_data->num_vendor] = NULL;
+  driver_data->num_vendor ++;
 
-    papplClientHTMLPuts(client,
-			"            </tbody>\n"
-			"          </table>\n"
-			"        </form>\n");
+  // Add a vendor option as placeholder for saving the settings for the
+  // "Installable Options" in the state file. With no "...-supported" IPP
+  // attribute and IPP_TAG_TEXT format it will not appear on the "Printing
+  // Defaults" web interface page.
+  if (extension->installable_options)
+  {
+    driver_data->vendor[driver_data->num_vendor] =
+      strdup("installable-options");
+    extension->vendor_ppd_options[driver_data->num_vendor] = NULL;
+    driver_data->num_vendor ++;
+    if (!update)
+      ippAddString(*driver_attrs, IPP_TAG_PRINTER, IPP_TAG_TEXT,
+		   "installable-options-default", NULL, "");
   }
 
-  papplClientHTMLPrinterFooter(client);
+  // Compile the vendor options for mapping the settings of jobs
+  ps_vendor_compile(system, ppd, driver_data);
 
-  // Clean up
-  ippDelete(driver_attrs);
-  if (num_options)
-    cupsFreeOptions(num_options, options);
+  return (true);
 }
 
 
 //
-// 'ps_printer_extra_setup()' - Extra code for setting up a printer, for
-//                              example to get extra buttons/pages on the web
-//                              interface for this printer.
+// 'ps_dsc_add()' - Add a byte range of the file to the assembled output,
+//                  after the text generated since the last call. With
+//                  `data` being `NULL` only the generated text gets
+//                  added.
 //
 
-static void   ps_printer_extra_setup(pappl_printer_t *printer,
-				     void *data)
+static bool				// O - `true` on success, `false` on error
+ps_dsc_add(ps_dsc_out_t *out,		// I - Output
+	   const char   *data,		// I - Mapped file or `NULL`
+	   size_t       offset,		// I - Offset of range
+	   size_t       length)		// I - Length of range
 {
-  char                   path[256];     // Path to resource
-  pappl_system_t         *system;	// System
-  pappl_pr_driver_data_t driver_data;
-  ps_driver_extension_t  *extension;
+  long		pos;			// Size of generated text
+  int		n;			// Segments to add
+  struct iovec	*iov;			// Reallocated segments
+  bool		*gen;			// Reallocated flags
 
 
-  system = papplPrinterGetSystem(printer);
+  fflush(out->fp);
+  pos = ftell(out->fp);
+  n   = (pos > out->text_pos) + (data && length > 0);
 
-  papplPrinterGetDriverData(printer, &driver_data);
-  extension = (ps_driver_extension_t *)driver_data.extension;
-  if (extension->defaults_pollable ||
-      extension->installable_options)
+  if (out->num_iov + n > out->alloc_iov)
   {
-    papplPrinterGetPath(printer, "device", path, sizeof(path));
-    papplSystemAddResourceCallback(system, path, "text/html",
-			     (pappl_resource_cb_t)ps_printer_web_device_config,
-			     printer);
-    papplPrinterAddLink(printer, "Device Settings", path,
-			PAPPL_LOPTIONS_NAVIGATION | PAPPL_LOPTIONS_STATUS);
+    out->alloc_iov = 2 * out->alloc_iov + 64;
+    if ((iov = (struct iovec *)realloc(out->iov, out->alloc_iov *
+				       sizeof(struct iovec))) == NULL)
+      return (false);
+    out->iov = iov;
+    if ((gen = (bool *)realloc(out->gen, out->alloc_iov *
+			       sizeof(bool))) == NULL)
+      return (false);
+    out->gen = gen;
+  }
+
+  if (pos > out->text_pos)
+  {
+    out->iov[out->num_iov].iov_base = (void *)(intptr_t)out->text_pos;
+    out->iov[out->num_iov].iov_len  = (size_t)(pos - out->text_pos);
+    out->gen[out->num_iov ++]       = true;
+    out->text_pos                   = pos;
+  }
+
+  if (data && length > 0)
+  {
+    // Ranges following each other get merged
+    if (out->num_iov > 0 && !out->gen[out->num_iov - 1] &&
+	(const char *)out->iov[out->num_iov - 1].iov_base +
+	out->iov[out->num_iov - 1].iov_len == data + offset)
+      out->iov[out->num_iov - 1].iov_len += length;
+    else
+    {
+      out->iov[out->num_iov].iov_base = (void *)(data + offset);
+      out->iov[out->num_iov].iov_len  = length;
+      out->gen[out->num_iov ++]       = false;
+    }
   }
+
+  return (true);
 }
 
 
 //
-// 'ps_rendjob()' - End a job.
+// 'ps_dsc_filter_function()' - Pass DSC-conforming PostScript through,
+//                              inserting only the JCL and the code of the
+//                              PPD options into the prolog and setup
+//                              sections, instead of rewriting it with
+//                              pstops(). Page ranges, page sets, reverse
+//                              order and copies are done by picking the
+//                              byte ranges of the pages from the page
+//                              index, the output gets written from the
+//                              file mapped by ps_dsc_map() with writev().
 //
 
-static bool                     // O - `true` on success, `false` on failure
-ps_rendjob(
-    pappl_job_t      *job,      // I - Job
-    pappl_pr_options_t *options,// I - Options
-    pappl_device_t   *device)   // I - Device
+static int				// O - Error status
+ps_dsc_filter_function(int           inputfd,
+					// I - File descriptor input stream
+					//     (unused, data is mapped)
+		       int           outputfd,
+					// I - File descriptor output stream
+		       int           inputseekable,
+					// I - Is input stream seekable?
+					//     (unused)
+		       filter_data_t *data,
+					// I - Job and printer data
+		       void          *parameters)
+					// I - Job data
 {
-  ps_job_data_t *job_data;      // PPD data for job
-  FILE *devout;
-  int num_pages;
+  ps_job_data_t	*job_data = (ps_job_data_t *)parameters;
+					// Job data
+  ps_dsc_t	*dsc = &(job_data->dsc);// DSC page index of the file
+  ppd_file_t	*ppd = job_data->ppd;	// PPD file with marked options
+  filter_logfunc_t log = data->logfunc;	// Log function
+  void		*ld = data->logdata;	// Log function data
+  ps_dsc_out_t	out;			// Assembled output
+  const char	*ranges,		// Page ranges
+		*page_set,		// Odd or even pages
+		*val,			// Option value
+		*body;			// Page after its "%%Page:" line
+  int		*order = NULL,		// Pages to print, in order
+		num_order,		// Number of them
+		copies,			// Number of copies
+		num_out = 0,		// Pages written
+		i, j, k,		// Looping vars
+		page,			// Current page
+		status = 1;		// Exit status
+  bool		collate,		// Collate copies?
+		renumber;		// Pages selected or reordered?
+  size_t	end;			// End of current page
+  struct iovec	*iov;			// Segments left to write
+  int		num_iov;		// Number of them
+  ssize_t	bytes;			// Bytes written
 
 
-  (void)options;
-  job_data = (ps_job_data_t *)papplJobGetData(job);
-  devout = job_data->device_file;
+  (void)inputseekable;
 
-  fputs("%%Trailer\n", devout);
-  if ((num_pages = papplJobGetImpressionsCompleted(job)) > 0)
-    fprintf(devout,"%%%%Pages: %d\n", num_pages);
-  fputs("%%EOF\n", devout);
+  close(inputfd);
 
-  if (job_data->ppd->jcl_end)
-    ppdEmitJCLEnd(job_data->ppd, devout);
+  memset(&out, 0, sizeof(out));
+  if ((out.fp = open_memstream(&out.text, &out.text_size)) == NULL ||
+      (order = (int *)malloc((dsc->num_pages + 1) * sizeof(int))) == NULL)
+    goto error;
+
+  // Pages to print, in order of output
+  ranges   = cupsGetOption("page-ranges", job_data->num_options,
+			   job_data->options);
+  page_set = cupsGetOption("page-set", job_data->num_options,
+			   job_data->options);
+  for (i = 0, num_order = 0; i < dsc->num_pages; i ++)
+    if (ps_dsc_page_selected(ranges, page_set, i + 1))
+      order[num_order ++] = i;
+  if (ps_job_output_reversed(job_data))
+    for (i = 0, j = num_order - 1; i < j; i ++, j --)
+    {
+      k        = order[i];
+      order[i] = order[j];
+      order[j] = k;
+    }
+  copies   = data->copies > 1 ? data->copies : 1;
+  collate  = (val = cupsGetOption("Collate", job_data->num_options,
+				  job_data->options)) != NULL &&
+             !strcasecmp(val, "True");
+  renumber = num_order != dsc->num_pages || copies > 1 ||
+             (num_order > 1 && order[0] != 0);
+
+  ppdEmitJCL(ppd, out.fp, data->job_id, data->job_user,
+	     data->job_title ? data->job_title : "Unknown");
+
+  // Header and prolog, with the page count adjusted and the PPD option
+  // code at the end of the prolog
+  if (renumber && dsc->header_pages)
+  {
+    body = memchr(dsc->data + dsc->header_pages, '\n',
+		  dsc->end_prolog - dsc->header_pages);
+    ps_dsc_add(&out, dsc->data, 0, dsc->header_pages);
+    fprintf(out.fp, "%%%%Pages: %d\n", num_order * copies);
+    ps_dsc_add(&out, dsc->data, body + 1 - dsc->data,
+	       dsc->end_prolog - (body + 1 - dsc->data));
+  }
   else
-    fputc(0x04, devout);
+    ps_dsc_add(&out, dsc->data, 0, dsc->end_prolog);
+  if (ppd->patches)
+  {
+    fputs("%%BeginFeature: *JobPatchFile 1\n", out.fp);
+    fputs(ppd->patches, out.fp);
+    fputs("\n%%EndFeature\n", out.fp);
+  }
+  ppdEmit(ppd, out.fp, PPD_ORDER_PROLOG);
+
+  // Setup, PPD option code at its end, so that it overrides the settings
+  // of the document, a setup section gets added if there is none
+  ps_dsc_add(&out, dsc->data, dsc->end_prolog,
+	     dsc->setup - dsc->end_prolog);
+  if (!dsc->has_setup)
+    fputs("%%BeginSetup\n", out.fp);
+  ppdEmit(ppd, out.fp, PPD_ORDER_DOCUMENT);
+  ppdEmit(ppd, out.fp, PPD_ORDER_ANY);
+  if (!dsc->has_setup)
+    fputs("%%EndSetup\n", out.fp);
+  ps_dsc_add(&out, dsc->data, dsc->setup, dsc->pages[0] - dsc->setup);
+
+  // Pages, copied byte range by byte range, with new "%%Page:" lines if
+  // not all pages are printed in their order
+  for (i = 0; i < copies; i = collate ? i + 1 : copies)
+    for (j = 0; j < num_order; j ++)
+      for (k = 0; k < (collate ? 1 : copies); k ++)
+      {
+	page = order[j];
+	end  = page + 1 < dsc->num_pages ? dsc->pages[page + 1] :
+	                                   dsc->trailer;
+	num_out ++;
+	if (renumber)
+	{
+	  body = memchr(dsc->data + dsc->pages[page], '\n',
+			end - dsc->pages[page]);
+	  body = body ? body + 1 : dsc->data + end;
+	  fprintf(out.fp, "%%%%Page: (%d) %d\n", num_out, num_out);
+	  if (!ps_dsc_add(&out, dsc->data, body - dsc->data,
+			  dsc->data + end - body))
+	    goto error;
+	}
+	else if (!ps_dsc_add(&out, dsc->data, dsc->pages[page],
+			     end - dsc->pages[page]))
+	  goto error;
+      }
 
-  //
-  // Clean up
-  //
+  // Trailer, with the page count adjusted
+  if (renumber && dsc->trailer_pages)
+  {
+    body = memchr(dsc->data + dsc->trailer_pages, '\n',
+		  dsc->size - dsc->trailer_pages);
+    ps_dsc_add(&out, dsc->data, dsc->trailer,
+	       dsc->trailer_pages - dsc->trailer);
+    fprintf(out.fp, "%%%%Pages: %d\n", num_out);
+    if (body)
+      ps_dsc_add(&out, dsc->data, body + 1 - dsc->data,
+		 dsc->size - (body + 1 - dsc->data));
+  }
+  else
+    ps_dsc_add(&out, dsc->data, dsc->trailer, dsc->size - dsc->trailer);
 
-  fclose(job_data->device_file);
-  filterPClose(job_data->device_fd, job_data->device_pid,
-	       job_data->filter_data);
+  if (ppd->jcl_end)
+    ppdEmitJCLEnd(ppd, out.fp);
+  else
+    fputc(0x04, out.fp);
+  if (!ps_dsc_add(&out, NULL, 0, 0))
+    goto error;
 
-  if (job_data->cups_filter_ps)
-    free(job_data->ppd_filter->parameters);
-  ps_free_job_data(job_data);
-  papplJobSetData(job, NULL);
+  // Now that the generated text is complete, point to it and write
+  // everything
+  if (fclose(out.fp))
+  {
+    out.fp = NULL;
+    goto error;
+  }
+  out.fp = NULL;
+  for (i = 0; i < out.num_iov; i ++)
+    if (out.gen[i])
+      out.iov[i].iov_base = out.text + (intptr_t)out.iov[i].iov_base;
 
-  return (true);
+  for (iov = out.iov, num_iov = out.num_iov; num_iov > 0;)
+  {
+    if ((bytes = writev(outputfd, iov,
+			num_iov < IOV_MAX ? num_iov : IOV_MAX)) < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN)
+	continue;
+      if (log)
+	log(ld, FILTER_LOGLEVEL_ERROR,
+	    "DSC: Unable to send PostScript data: %s", strerror(errno));
+      goto done;
+    }
+    while (num_iov > 0 && (size_t)bytes >= iov->iov_len)
+    {
+      bytes -= iov->iov_len;
+      iov ++;
+      num_iov --;
+    }
+    if (num_iov > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + bytes;
+      iov->iov_len  -= bytes;
+    }
+  }
+
+  for (i = 1; i <= num_out; i ++)
+    if (log)
+      log(ld, FILTER_LOGLEVEL_CONTROL, "PAGE: %d 1", i);
+
+  status = 0;
+  goto done;
+
+ error:
+
+  if (log)
+    log(ld, FILTER_LOGLEVEL_ERROR,
+	"DSC: Unable to assemble PostScript output");
+
+ done:
+
+  if (out.fp)
+    fclose(out.fp);
+  free(out.text);
+  free(out.iov);
+  free(out.gen);
+  free(order);
+  close(outputfd);
+
+  return (status);
 }
 
 
 //
-// 'ps_rendpage()' - End a page.
+// 'ps_dsc_keyword()' - Check whether a line starts with the given DSC
+//                      comment keyword.
 //
 
-static bool                     // O - `true` on success, `false` on failure
-ps_rendpage(
-    pappl_job_t      *job,      // I - Job
-    pappl_pr_options_t *options,// I - Job options
-    pappl_device_t   *device,   // I - Device
-    unsigned         page)      // I - Page number
+static bool				// O - `true` if it does
+ps_dsc_keyword(const char *line,	// I - Line
+	       size_t     len,		// I - Length of line
+	       const char *keyword)	// I - DSC keyword, with "%%"
 {
-  ps_job_data_t         *job_data;      // PPD data for job
-  FILE *devout;
-  unsigned char *pixels;
+  size_t	kwlen = strlen(keyword);// Length of keyword
 
 
-  job_data = (ps_job_data_t *)papplJobGetData(job);
-  devout = job_data->device_file;
+  return (len >= kwlen && !memcmp(line, keyword, kwlen));
+}
 
-  // If we got too few raster lines pad with blank lines
-  if (job_data->line_count < options->header.cupsHeight)
+
+//
+// 'ps_dsc_map()' - Map a spooled PostScript file into memory and build the
+//                  DSC page index, to find out whether it can be passed
+//                  through without pstops(). It must start with
+//                  "%!PS-Adobe-", have a prolog ended by "%%EndProlog"
+//                  before the first "%%Page:", and no "%%IncludeFeature:"
+//                  (needs PPD code inserted) and no binary sections (could
+//                  contain false DSC comments). DSC comments of embedded
+//                  documents are skipped.
+//
+
+static bool				// O - `true` if conforming
+ps_dsc_map(pappl_job_t *job,		// I - Job
+	   ps_dsc_t    *dsc,		// O - DSC page index of the file
+	   int         fd)		// I - File descriptor of spooled file
+{
+  struct stat	st;			// File information
+  void		*map;			// Mapped file
+  const char	*line,			// Current line
+		*next,			// Next line
+		*end;			// End of file
+  size_t	len,			// Length of current line
+		eof = 0,		// Offset of "%%EOF" line
+		*pages;			// Reallocated page offsets
+  int		depth = 0,		// Depth of embedded documents
+		alloc_pages = 0;	// Allocated page offsets
+  bool		have_prolog = false;	// "%%EndProlog" found?
+  const char	*reason = NULL;		// Why not conforming
+
+
+  memset(dsc, 0, sizeof(ps_dsc_t));
+
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size < 11 ||
+      (map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd,
+		  0)) == MAP_FAILED)
+    return (false);
+  madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+  dsc->data = (const char *)map;
+  dsc->size = (size_t)st.st_size;
+  end       = dsc->data + dsc->size;
+
+  if (memcmp(dsc->data, "%!PS-Adobe-", 11))
+    reason = "no \"%!PS-Adobe-\" header";
+
+  for (line = dsc->data; line < end && !reason; line = next)
   {
-    pixels = (unsigned char *)malloc(options->header.cupsBytesPerLine);
-    if (options->header.cupsColorSpace == CUPS_CSPACE_K ||
-	options->header.cupsColorSpace == CUPS_CSPACE_CMYK)
-      memset(pixels, 0x00, options->header.cupsBytesPerLine);
+    if ((next = memchr(line, '\n', end - line)) == NULL)
+      next = end;
     else
-      memset(pixels, 0xff, options->header.cupsBytesPerLine);
-    for (; job_data->line_count < options->header.cupsHeight;
-	 job_data->line_count ++)
-      ps_ascii85(devout, pixels, options->header.cupsBytesPerLine, 0);
-    free (pixels);
+      next ++;
+    len = next - line;
+
+    if (len < 3 || line[0] != '%' || line[1] != '%')
+      continue;
+
+    if (ps_dsc_keyword(line, len, "%%BeginDocument"))
+      depth ++;
+    else if (ps_dsc_keyword(line, len, "%%EndDocument"))
+    {
+      if (depth > 0)
+	depth --;
+    }
+    else if (depth > 0)
+      continue;
+    else if (ps_dsc_keyword(line, len, "%%IncludeFeature:"))
+      reason = "\"%%IncludeFeature:\" comments";
+    else if (ps_dsc_keyword(line, len, "%%BeginBinary:") ||
+	     ps_dsc_keyword(line, len, "%%BeginData:"))
+      reason = "binary data sections";
+    else if (ps_dsc_keyword(line, len, "%%EndProlog"))
+    {
+      if (dsc->num_pages > 0 || have_prolog)
+	reason = "misplaced \"%%EndProlog\"";
+      have_prolog     = true;
+      dsc->end_prolog = line - dsc->data;
+      dsc->setup      = next - dsc->data;
+    }
+    else if (ps_dsc_keyword(line, len, "%%EndSetup"))
+    {
+      if (!have_prolog || dsc->num_pages > 0 || dsc->has_setup)
+	reason = "misplaced \"%%EndSetup\"";
+      dsc->setup     = line - dsc->data;
+      dsc->has_setup = true;
+    }
+    else if (ps_dsc_keyword(line, len, "%%Page:"))
+    {
+      if (!have_prolog)
+	reason = "no \"%%EndProlog\" before the first page";
+      else if (dsc->trailer)
+	reason = "page after the trailer";
+      else if (dsc->num_pages >= alloc_pages)
+      {
+	alloc_pages = 2 * alloc_pages + 64;
+	if ((pages = (size_t *)realloc(dsc->pages, alloc_pages *
+				       sizeof(size_t))) == NULL)
+	{
+	  reason = "out of memory";
+	  continue;
+	}
+	dsc->pages = pages;
+      }
+      if (!reason)
+	dsc->pages[dsc->num_pages ++] = line - dsc->data;
+    }
+    else if (ps_dsc_keyword(line, len, "%%Pages:") &&
+	     !memmem(line, len, "(atend)", 7))
+    {
+      // Page counts to adjust when printing a selection of pages
+      if (!have_prolog && !dsc->header_pages)
+	dsc->header_pages = line - dsc->data;
+      else if (dsc->trailer)
+	dsc->trailer_pages = line - dsc->data;
+    }
+    else if (ps_dsc_keyword(line, len, "%%Trailer"))
+    {
+      if (dsc->num_pages > 0 && !dsc->trailer)
+	dsc->trailer = line - dsc->data;
+    }
+    else if (ps_dsc_keyword(line, len, "%%EOF"))
+    {
+      if (dsc->num_pages > 0 && !dsc->trailer)
+	eof = line - dsc->data;
+    }
   }
 
-  // Flush out remaining bytes of the bitmap 
-  ps_ascii85(devout, NULL, 0, 1);
+  // The last page ends with the trailer, or "%%EOF" if there is none
+  if (!dsc->trailer)
+    dsc->trailer = eof ? eof : dsc->size;
 
-  // Finish page and get it printed
-  fprintf(devout, "grestore\n");
-  fprintf(devout, "showpage\n");
-  fprintf(devout, "%%%%PageTrailer\n");
+  if (!reason && dsc->num_pages == 0)
+    reason = "no \"%%Page:\" comments";
+  else if (!reason && depth > 0)
+    reason = "unterminated embedded document";
 
-  papplDeviceFlush(device);
+  if (reason)
+  {
+    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+		"PostScript input not DSC-conforming (%s), using pstops",
+		reason);
+    munmap(map, dsc->size);
+    free(dsc->pages);
+    memset(dsc, 0, sizeof(ps_dsc_t));
+    return (false);
+  }
 
   return (true);
 }
 
 
 //
-// 'ps_rstartjob()' - Start a job.
+// 'ps_dsc_page_selected()' - Check whether a page is in the page ranges
+//                            ("1-3,7,9-" as with pstops()) and the page
+//                            set ("odd" or "even") of a job.
 //
 
-static bool                     // O - `true` on success, `false` on failure
-ps_rstartjob(
-    pappl_job_t      *job,      // I - Job
-    pappl_pr_options_t *options,// I - Job options
-    pappl_device_t   *device)   // I - Device
+static bool				// O - `true` if page gets printed
+ps_dsc_page_selected(const char *ranges,// I - Page ranges or `NULL`
+		     const char *page_set,
+					// I - Page set or `NULL`
+		     int        page)	// I - Page number, starting with 1
 {
-  ps_job_data_t      *job_data;      // PPD data for job
-  const char	     *job_name;
-  int                nullfd;
-  FILE               *devout;
-  filter_external_cups_t* ppd_filter_params; // Parameters for CUPS
-                                     // filter defined in the PPD
+  const char	*ptr;			// Pointer into ranges
+  char		*end;			// End of number
+  long		lower,			// Lower end of range
+		upper;			// Upper end of range
 
-  // Load PPD file and determine the PPD options equivalent to the job options
-  job_data = ps_create_job_data(job, options);
-  // The filter has no output, data is going directly to the device
-  nullfd = open("/dev/null", O_RDWR);
-  // Create file descriptor/pipe to which the functions of libppd can send
-  // the data so that it gets passed on to the device
-  if (job_data->cups_filter_ps)
+
+  if (page_set &&
+      ((!strcasecmp(page_set, "odd") && !(page & 1)) ||
+       (!strcasecmp(page_set, "even") && (page & 1))))
+    return (false);
+
+  if (!ranges || !*ranges)
+    return (true);
+
+  for (ptr = ranges; *ptr;)
   {
-    // Create filter chain of the CUPS filter defined in the PPD file
-    // and the print filter function
-    job_data->chain = cupsArrayNew(NULL, NULL);
-    ppd_filter_params =
-      (filter_external_cups_t *)calloc(1, sizeof(filter_external_cups_t));
-    ppd_filter_params->filter = job_data->cups_filter_ps;
-    job_data->ppd_filter =
-      (filter_filter_in_chain_t *)calloc(1, sizeof(filter_filter_in_chain_t));
-    job_data->ppd_filter->function = filterExternalCUPS;
-    job_data->ppd_filter->parameters = ppd_filter_params;
-    job_data->ppd_filter->name = "Post-filtering";
-    cupsArrayAdd(job_data->chain, job_data->ppd_filter);
-    job_data->print =
-      (filter_filter_in_chain_t *)calloc(1, sizeof(filter_filter_in_chain_t));
-    job_data->print->function = ps_print_filter_function;
-    job_data->print->parameters = device;
-    job_data->print->name = "Printing";
-    cupsArrayAdd(job_data->chain, job_data->print);
+    if (*ptr == '-')
+      lower = 1;
+    else if ((lower = strtol(ptr, &end, 10)) < 1 || end == ptr)
+      return (false);
+    else
+      ptr = end;
 
-    job_data->device_fd = filterPOpen(filterChain, -1, nullfd,
-				      0, job_data->filter_data, job_data->chain,
-				      &(job_data->device_pid));
+    if (*ptr == '-')
+    {
+      ptr ++;
+      if (isdigit(*ptr & 255))
+      {
+	upper = strtol(ptr, &end, 10);
+	ptr   = end;
+      }
+      else
+	upper = LONG_MAX;
+    }
+    else
+      upper = lower;
+
+    if (page >= lower && page <= upper)
+      return (true);
+
+    if (*ptr == ',')
+      ptr ++;
+    else if (*ptr)
+      return (false);
+  }
+
+  return (false);
+}
+
+
+//
+// 'ps_emit_band()' - Send the buffered band of non-blank lines as an image
+//                    of its own, placed on the page by the image matrix.
+//                    Blank lines at the end of the band are left out. The
+//                    compressor for the page gets chosen with the first
+//                    band.
+//
+
+static void
+ps_emit_band(pappl_job_t        *job,	// I - Job
+	     pappl_pr_options_t *options,// I - Job options
+	     ps_job_data_t      *job_data)// I - Job data
+{
+  ps_encoder_t	*enc = &(job_data->encoder);
+					// Encoder chain
+  FILE		*devout = job_data->device_file;
+					// Output to device
+  int		num_lines = job_data->band_lines - job_data->band_blank,
+					// Lines of the band
+		height = options->header.cupsHeight,
+					// Height of the page
+		colors = enc->colors,	// Colors of the page
+		i;			// Looping var
+  size_t	bytes_per_line = enc->bytes_per_line;
+					// Bytes per line of the page
+  bool		gray = false;		// Band sent as gray?
+
+
+  job_data->band_lines = 0;
+  job_data->band_blank = 0;
+  if (num_lines <= 0)
+    return;
+
+  enc->height = num_lines;
+
+  // Bands without color on color pages are sent as gray, with a third or
+  // quarter of the data
+  if (colors > 1 && enc->bpc == 8 &&
+      ps_pixels_are_neutral(job_data->band, (size_t)num_lines * enc->width,
+			    colors))
+  {
+    ps_pixels_to_gray(job_data->band, (size_t)num_lines * enc->width,
+		      colors);
+    enc->colors         = 1;
+    enc->bytes_per_line = enc->width;
+    gray                = true;
+  }
+
+  if (!job_data->codec_chosen)
+  {
+    job_data->page_codec =
+      ps_encoder_choose(job, enc, job_data->page_codecs, job_data->band,
+			num_lines < PS_SAMPLE_LINES ? num_lines :
+			PS_SAMPLE_LINES, job_data->page);
+    job_data->codec_chosen = true;
+  }
+
+  // The data gets encoded first and held, so that binary data can be
+  // checked for the end-of-data string before the data source of the
+  // image is chosen
+  ps_transport_hold(&(job_data->transport));
+  if (!ps_encoder_start(enc, job_data->page_codec, &(job_data->transport)))
+  {
+    papplLogJob(job, PAPPL_LOGLEVEL_ERROR,
+		"Page %u: Unable to set up %s compression of the raster "
+		"data, sending uncompressed data", job_data->page,
+		ps_codec_names[job_data->page_codec]);
+    job_data->page_codec = PS_CODEC_NONE;
+    ps_encoder_start(enc, PS_CODEC_NONE, &(job_data->transport));
+  }
+  for (i = 0; i < num_lines; i ++)
+    ps_encoder_write_line(enc, job_data->band + i * enc->bytes_per_line);
+  ps_encoder_end(enc);
+
+  if (job_data->ppd->language_level < 2)
+  {
+    // PostScript level 1: The image operator reads the lines with a
+    // procedure
+    fprintf(devout, "/picstr %u string def\n",
+	    (unsigned)enc->bytes_per_line);
+    fprintf(devout, "%d %d %d [%d 0 0 %d 0 %d]\n%s\n",
+	    enc->width, num_lines, enc->bpc, enc->width, -1 * height,
+	    height - job_data->band_y, ps_transport_source(enc->transport));
+    if (enc->colors == 1)
+      fputs("image\n", devout);
+    else
+      fprintf(devout, "false %d colorimage\n", enc->colors);
   }
   else
-    // No extra filter needed, make print filter function be called
-    // directly
-    job_data->device_fd = filterPOpen(ps_print_filter_function, -1, nullfd,
-				      0, job_data->filter_data, device,
-				      &(job_data->device_pid));
-  if (job_data->device_fd < 0)
-    return (false);
+  {
+    if (enc->colors != job_data->space_colors)
+    {
+      fprintf(devout, "%s setcolorspace\n",
+	      enc->colors == 4 ? "/DeviceCMYK" :
+	      enc->colors == 3 ? "/DeviceRGB" : "/DeviceGray");
+      job_data->space_colors = enc->colors;
+    }
 
-  job_data->device_file = fdopen(job_data->device_fd, "w");
-  devout = job_data->device_file;
+    fprintf(devout, "<< \n"
+	    "/ImageType 1\n"
+	    "/Width %d\n"
+	    "/Height %d\n"
+	    "/BitsPerComponent %d\n",
+	    enc->width, num_lines, enc->bpc);
 
-  // Save data for the other raster callback functions
-  papplJobSetData(job, job_data);
+    switch (gray ? CUPS_CSPACE_SW : options->header.cupsColorSpace)
+    {
+    case CUPS_CSPACE_RGB:
+    case CUPS_CSPACE_SRGB:
+    case CUPS_CSPACE_ADOBERGB:
+      fprintf(devout, "/Decode [0 1 0 1 0 1]\n");
+      break;
 
-  // Print 1 bit per pixel for monochrome draft printing
-  ps_one_bit_dither_on_draft(job, options);
+    case CUPS_CSPACE_CMYK:
+      fprintf(devout, "/Decode [0 1 0 1 0 1 0 1]\n");
+      break;
 
-  // DSC header
-  job_name = papplJobGetName(job);
+    case CUPS_CSPACE_SW:
+      fprintf(devout, "/Decode [0 1]\n");
+      break;
+
+    default:
+    case CUPS_CSPACE_K:
+    case CUPS_CSPACE_W:
+      fprintf(devout, "/Decode [1 0]\n");
+      break;
+    }
+
+    ps_encoder_source(enc, devout);
+    fprintf(devout, "/ImageMatrix [%d 0 0 %d 0 %d]\n",
+	    enc->width, -1 * height, height - job_data->band_y);
+    fprintf(devout, ">> image\n");
+  }
+  ps_transport_release(&(job_data->transport));
+
+  if (enc->codec == PS_CODEC_DCT && enc->jpeg_error)
+    papplLogJob(job, PAPPL_LOGLEVEL_ERROR,
+		"Page %u: JPEG encoding of raster data failed",
+		job_data->page);
+
+  job_data->num_bands ++;
+  job_data->page_bytes_in  += enc->bytes_in;
+  job_data->page_bytes_out += job_data->transport.bytes;
+  if (gray)
+  {
+    job_data->num_gray_bands ++;
+    job_data->page_gray_saved += enc->bytes_in * (colors - 1);
+    enc->colors         = colors;
+    enc->bytes_per_line = bytes_per_line;
+  }
+}
+
+
+//
+// 'ps_emit_job_header()' - Emit the JCL, the DSC header comments, the
+//                          prolog and the setup section of a PostScript
+//                          job generated by this Printer Application,
+//                          including the code of the marked PPD options
+//
 
-  ppdEmitJCL(job_data->ppd, devout, papplJobGetID(job),
-	     papplJobGetUsername(job), job_name ? job_name : "Unknown");
+static void
+ps_emit_job_header(FILE       *fp,	// I - Output file
+		   ppd_file_t *ppd,	// I - PPD file with marked options
+		   int        job_id,	// I - Job ID
+		   const char *user,	// I - User name
+		   const char *title,	// I - Job title or `NULL`
+		   int        copies,	// I - Number of copies
+		   int        width,	// I - Page width in points
+		   int        length,	// I - Page length in points
+		   int        num_pages,// I - Number of pages, 0 if not known
+		   ps_transport_mode_t transport)
+					// I - Transport of image data
+{
+  ppdEmitJCL(ppd, fp, job_id, user, title ? title : "Unknown");
 
-  fputs("%!PS-Adobe-3.0\n", devout);
-  fprintf(devout, "%%%%LanguageLevel: %d\n", job_data->ppd->language_level);
-  fprintf(devout, "%%%%Creator: %s/%d.%d.%d.%d\n", SYSTEM_NAME,
+  // Switch the printer into TBCP mode
+  if (transport == PS_TRANSPORT_TBCP)
+    fputs("\001M", fp);
+
+  fputs("%!PS-Adobe-3.0\n", fp);
+  fprintf(fp, "%%%%LanguageLevel: %d\n", ppd->language_level);
+  fprintf(fp, "%%%%Creator: %s/%d.%d.%d.%d\n", SYSTEM_NAME,
 	  SYSTEM_VERSION_ARR_0, SYSTEM_VERSION_ARR_1,
 	  SYSTEM_VERSION_ARR_2, SYSTEM_VERSION_ARR_3);
-  if (job_name)
+  if (title)
   {
-    fputs("%%Title: ", devout);
-    while (*job_name)
+    fputs("%%Title: ", fp);
+    while (*title)
     {
-      if (*job_name >= 0x20 && *job_name < 0x7f)
-        fputc(*job_name, devout);
+      if (*title >= 0x20 && *title < 0x7f)
+        fputc(*title, fp);
       else
-        fputc('?', devout);
+        fputc('?', fp);
 
-      job_name ++;
+      title ++;
     }
-    fputc('\n', devout);
+    fputc('\n', fp);
   }
-  fprintf(devout, "%%%%BoundingBox: 0 0 %d %d\n",
-	  options->header.PageSize[0], options->header.PageSize[1]);
-  fputs("%%Pages: (atend)\n", devout);
-  fputs("%%EndComments\n", devout);
+  fprintf(fp, "%%%%BoundingBox: 0 0 %d %d\n", width, length);
+  if (num_pages > 0)
+    fprintf(fp, "%%%%Pages: %d\n", num_pages);
+  else
+    fputs("%%Pages: (atend)\n", fp);
+  fputs("%%EndComments\n", fp);
 
-  fputs("%%BeginProlog\n", devout);
+  fputs("%%BeginProlog\n", fp);
 
   // Number of copies (uncollated and hardware only due to job
   // not being spooled and infinite job supported
-  if (job_data->ppd->language_level == 1)
-    fprintf(devout, "/#copies %d def\n", options->copies);
+  if (ppd->language_level == 1)
+    fprintf(fp, "/#copies %d def\n", copies);
   else
-    fprintf(devout, "<</NumCopies %d>>setpagedevice\n", options->copies);
+    fprintf(fp, "<</NumCopies %d>>setpagedevice\n", copies);
 
-  if (job_data->ppd->patches)
+  if (ppd->patches)
   {
-    fputs("%%BeginFeature: *JobPatchFile 1\n", devout);
-    fputs(job_data->ppd->patches, devout);
-    fputs("\n%%EndFeature\n", devout);
+    fputs("%%BeginFeature: *JobPatchFile 1\n", fp);
+    fputs(ppd->patches, fp);
+    fputs("\n%%EndFeature\n", fp);
   }
-  ppdEmit(job_data->ppd, devout, PPD_ORDER_PROLOG);
-  fputs("%%EndProlog\n", devout);
-
-  fputs("%%BeginSetup\n", devout);
-  ppdEmit(job_data->ppd, devout, PPD_ORDER_DOCUMENT);
-  ppdEmit(job_data->ppd, devout, PPD_ORDER_ANY);
-  fputs("%%EndSetup\n", devout);
+  ppdEmit(ppd, fp, PPD_ORDER_PROLOG);
+  fputs("%%EndProlog\n", fp);
 
-  return (true);
+  fputs("%%BeginSetup\n", fp);
+  ppdEmit(ppd, fp, PPD_ORDER_DOCUMENT);
+  ppdEmit(ppd, fp, PPD_ORDER_ANY);
+  fputs("%%EndSetup\n", fp);
 }
 
 
 //
-// 'ps_rstartpage()' - Start a page.
+// 'ps_emit_job_trailer()' - Emit the DSC trailer and the JCL end of a
+//                           PostScript job generated by this Printer
+//                           Application
 //
 
-static bool                      // O - `true` on success, `false` on failure
-ps_rstartpage(
-    pappl_job_t       *job,       // I - Job
-    pappl_pr_options_t  *options, // I - Job options
-    pappl_device_t    *device,    // I - Device
-    unsigned          page)       // I - Page number
+static void
+ps_emit_job_trailer(FILE       *fp,	// I - Output file
+		    ppd_file_t *ppd,	// I - PPD file
+		    int        num_pages)// I - Number of pages, 0 if already
+                                        //     in header
 {
-  ps_job_data_t          *job_data;      // PPD data for job
-  FILE *devout;
-  int bpc;
-
-
-  job_data = (ps_job_data_t *)papplJobGetData(job);
-  devout = job_data->device_file;
-  job_data->line_count = 0;
+  fputs("%%Trailer\n", fp);
+  if (num_pages > 0)
+    fprintf(fp,"%%%%Pages: %d\n", num_pages);
+  fputs("%%EOF\n", fp);
 
-  // Print 1 bit per pixel for monochrome draft printing
-  ps_one_bit_dither_on_draft(job, options);
+  if (ppd->jcl_end)
+    ppdEmitJCLEnd(ppd, fp);
+  else
+    fputc(0x04, fp);
+}
 
-  // DSC header
-  fprintf(devout, "%%%%Page: (%d) %d\n", page, page);
-  fputs("%%BeginPageSetup\n", devout);
-  ppdEmit(job_data->ppd, devout, PPD_ORDER_PAGE);
-  fputs("%%EndPageSetup\n", devout);
 
-  // Start raster image output
-  fprintf(devout, "gsave\n");
+//
+// 'ps_encoder_choose()' - Choose the compressor for the raster image of a
+//                         page. With more than one candidate the buffered
+//                         lines from the beginning of the page are
+//                         encoded with each of them and the one with the
+//                         shortest expected time for compressing and
+//                         sending the data wins, the output size is
+//                         converted to time with the assumed throughput
+//                         to the printer, PS_LINK_RATE. Without lines
+//                         the candidate which usually compresses best
+//                         is taken.
+//
 
-  switch (options->header.cupsColorSpace)
+static ps_codec_t			// O - Compressor
+ps_encoder_choose(
+    pappl_job_t         *job,		// I - Job
+    ps_encoder_t        *enc,		// I - Encoder chain
+    unsigned            codecs,		// I - Candidates, bit mask
+    const unsigned char *lines,		// I - Buffered lines or `NULL`
+    int                 num_lines,	// I - Number of buffered lines
+    unsigned            page)		// I - Page number
+{
+  static const ps_codec_t preferred[] =	// Candidates by usual efficiency
   {
-  case CUPS_CSPACE_RGB:
-  case CUPS_CSPACE_SRGB:
-  case CUPS_CSPACE_ADOBERGB:
-    fprintf(devout, "/DeviceRGB setcolorspace\n");
-    break;
-
-  case CUPS_CSPACE_CMYK:
-    fprintf(devout, "/DeviceCMYK setcolorspace\n");
-    break;
+    PS_CODEC_DCT,
+    PS_CODEC_CCITT,
+    PS_CODEC_FLATE,
+    PS_CODEC_LZW,
+    PS_CODEC_RUNLENGTH
+  };
+  ps_transport_t	null;		// Transport only counting the bytes
+  int			codec,		// Current candidate
+			best = PS_CODEC_NONE,
+					// Best candidate
+			i;		// Looping var
+  struct timespec	start,		// CPU time at start of trial
+			end;		// CPU time at end of trial
+  double		cpu,		// CPU time of trial in seconds
+			cost,		// Expected time of trial in seconds
+			best_cost = -1.0;// Expected time of best candidate
+  char			buf[1024];	// Log message
+
+
+  if (!(codecs & (codecs - 1)) || !lines || num_lines <= 0)
+  {
+    // One or no candidate or nothing to try
+    for (i = 0; i < (int)(sizeof(preferred) / sizeof(preferred[0])); i ++)
+      if (codecs & (1 << preferred[i]))
+      {
+	best = preferred[i];
+	break;
+      }
 
-  default:
-  case CUPS_CSPACE_K:
-  case CUPS_CSPACE_W:
-  case CUPS_CSPACE_SW:
-    fprintf(devout, "/DeviceGray setcolorspace\n");
-    break;
+    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+		"Page %u: Raster data compression: %s", page,
+		ps_codec_names[best]);
+    return ((ps_codec_t)best);
   }
 
-  fprintf(devout, "%d %d scale\n",
-	  options->header.PageSize[0], options->header.PageSize[1]);
-  fprintf(devout, "<< \n"
-	 "/ImageType 1\n"
-	 "/Width %d\n"
-	 "/Height %d\n"
-	 "/BitsPerComponent %d\n",
-	  options->header.cupsWidth, options->header.cupsHeight,
-	  options->header.cupsBitsPerColor);
-
-  switch (options->header.cupsColorSpace)
-  {
-  case CUPS_CSPACE_RGB:
-  case CUPS_CSPACE_SRGB:
-  case CUPS_CSPACE_ADOBERGB:
-    fprintf(devout, "/Decode [0 1 0 1 0 1]\n");
-    break;
+  memset(&null, 0, sizeof(null));
+  null.mode = PS_TRANSPORT_NULL;
 
-  case CUPS_CSPACE_CMYK:
-    fprintf(devout, "/Decode [0 1 0 1 0 1 0 1]\n");
-    break;
+  snprintf(buf, sizeof(buf), "Page %u: Trial encoding of %d lines:", page,
+	   num_lines);
 
-  case CUPS_CSPACE_SW:
-    fprintf(devout, "/Decode [0 1]\n");
-    break;
+  for (codec = PS_CODEC_NONE; codec < PS_CODEC_MAX; codec ++)
+  {
+    if (!(codecs & (1 << codec)))
+      continue;
 
-  default:
-  case CUPS_CSPACE_K:
-  case CUPS_CSPACE_W:
-    fprintf(devout, "/Decode [1 0]\n");
-    break;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    if (!ps_encoder_start(enc, (ps_codec_t)codec, &null))
+      continue;
+    for (i = 0; i < num_lines; i ++)
+      ps_encoder_write_line(enc, lines + i * enc->bytes_per_line);
+    ps_encoder_end(enc);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+
+    cpu  = (double)(end.tv_sec - start.tv_sec) +
+	   (double)(end.tv_nsec - start.tv_nsec) / 1000000000.0;
+    cost = cpu + (double)null.bytes / PS_LINK_RATE;
+    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf),
+	     " %s %lu bytes %.2f msec", ps_codec_names[codec], null.bytes,
+	     cpu * 1000.0);
+
+    if (best_cost < 0.0 || cost < best_cost)
+    {
+      best      = codec;
+      best_cost = cost;
+    }
   }
 
-  fprintf(devout, "/DataSource currentfile /ASCII85Decode filter\n");
+  papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "%s -> %s", buf,
+	      ps_codec_names[best]);
 
-  fprintf(devout, "/ImageMatrix [%d 0 0 %d 0 %d]\n",
-	  options->header.cupsWidth, -1 * options->header.cupsHeight,
-	  options->header.cupsHeight);
-  fprintf(devout, ">> image\n");
-
-  return (true);
+  return ((ps_codec_t)best);
 }
 
 
 //
-// 'ps_rwriteline()' - Write a line.
+// 'ps_encoder_end()' - Finish the encoded data of an image
 //
 
-static bool				// O - `true` on success, `false` on failure
-ps_rwriteline(
-    pappl_job_t         *job,		// I - Job
-    pappl_pr_options_t  *options,	// I - Job options
-    pappl_device_t      *device,	// I - Device
-    unsigned            y,		// I - Line number
-    const unsigned char *pixels)	// I - Line
+static void
+ps_encoder_end(ps_encoder_t *enc)	// I - Encoder chain
 {
-  ps_job_data_t         *job_data;      // PPD data for job
-  FILE *devout;
-  int out_length;
+  unsigned char	eod = 128;		// RunLengthDecode end of data
 
-  job_data = (ps_job_data_t *)papplJobGetData(job);
-  devout = job_data->device_file;
 
-  if (job_data->line_count < options->header.cupsHeight)
-    ps_ascii85(devout, pixels, options->header.cupsBytesPerLine, 0);
-  job_data->line_count ++;
+  switch (enc->codec)
+  {
+    case PS_CODEC_RUNLENGTH :
+        ps_transport_write(enc->transport, &eod, 1);
+	break;
 
-  return (true);
-}
+    case PS_CODEC_LZW :
+        ps_lzw_end(enc->lzw);
+	break;
+
+    case PS_CODEC_FLATE :
+        ps_flate_write(enc, NULL, 0, Z_FINISH);
+	break;
+
+    case PS_CODEC_CCITT :
+        ps_ccitt_end(&(enc->ccitt));
+	break;
+
+    case PS_CODEC_DCT :
+        ps_jpeg_end(enc);
+	break;
+
+    default :
+        break;
+  }
+
+  ps_transport_end(enc->transport);
+}
 
 
 //
-// 'ps_setup_driver_list()' - Create a driver list of the available PPD files.
-//
+// 'ps_encoder_free()' - Free the buffers and compressors of an encoder
+//                       chain
+//
 
 static void
-ps_setup_driver_list(pappl_system_t *system)      // I - System
+ps_encoder_free(ps_encoder_t *enc)	// I - Encoder chain
 {
-  int              i, j, k;
-  char             *ptr1, *ptr2;
-  char             *generic_ppd, *mfg_mdl, *mdl, *dev_id;
-  ps_ppd_path_t    *ppd_path;
-  int              num_options = 0;
-  cups_option_t    *options = NULL;
-  cups_array_t     *ppds;
-  ppd_info_t       *ppd;
-  char             buf1[1024], buf2[1024];
-  int              pre_normalized;
-  pappl_pr_driver_t swap;
+  if (enc->zstream_init)
+    deflateEnd(&(enc->zstream));
+  if (enc->prev_line)
+    free(enc->prev_line);
+  if (enc->pred_line)
+    free(enc->pred_line);
+  if (enc->buffer)
+    free(enc->buffer);
+  if (enc->lzw)
+    free(enc->lzw);
+  if (enc->ccitt.ref)
+    free(enc->ccitt.ref);
+  if (enc->ccitt.cur)
+    free(enc->ccitt.cur);
+  if (enc->jpeg_init)
+    jpeg_destroy_compress(&(enc->jpeg));
+  if (enc->jpeg_dest)
+    free(enc->jpeg_dest);
+}
 
 
-  //
-  // Create the list of all available PPD files
-  //
+//
+// 'ps_encoder_source()' - Send the /DataSource entry of the image
+//                         dictionary, the transport's data source with
+//                         the decoding filter of the compressor
+//
 
-  ppds = ppdCollectionListPPDs(ppd_collections, 0,
-			       num_options, options,
-			       (filter_logfunc_t)papplLog, system);
+static void
+ps_encoder_source(ps_encoder_t *enc,	// I - Encoder chain
+		  FILE         *fp)	// I - Output file
+{
+  fprintf(fp, "/DataSource %s\n", ps_transport_source(enc->transport));
 
-  //
-  // Create driver list from the PPD list and submit it
-  //
-  
-  if (ppds)
+  switch (enc->codec)
   {
-    i = 0;
-    num_drivers = cupsArrayCount(ppds);
-    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-	     "Found %d PPD files.", num_drivers);
-    // Search for a generic PPD to use as generic PostScript driver
-    generic_ppd = NULL;
-    for (ppd = (ppd_info_t *)cupsArrayFirst(ppds);
-	 ppd;
-	 ppd = (ppd_info_t *)cupsArrayNext(ppds))
-    {
-      if (!strcasecmp(ppd->record.make, "Generic") ||
-	  !strncasecmp(ppd->record.make_and_model, "Generic", 7) ||
-	  !strncasecmp(ppd->record.products[0], "Generic", 7))
-      {
-	generic_ppd = ppd->record.name;
+    case PS_CODEC_RUNLENGTH :
+        fputs("/RunLengthDecode filter\n", fp);
 	break;
-      }
-    }
-    if (generic_ppd)
-      papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-	       "Found generic PPD file: %s", generic_ppd);
-    else
-      papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-	       "No generic PPD file found, "
-	       "Printer Application will only support printers "
-	       "explicitly supported by the PPD files");
-    // Create driver indices
-    if (drivers)
-      free(drivers);
-    drivers = (pappl_pr_driver_t *)calloc(num_drivers + PPD_MAX_PROD,
-					  sizeof(pappl_pr_driver_t));
-    // Create list of PPD file paths
-    if (ppd_paths)
-      cupsArrayDelete(ppd_paths);
-    ppd_paths = cupsArrayNew(ps_compare_ppd_paths, NULL);
-    if (generic_ppd)
-    {
-      drivers[i].name = strdup("generic");
-      drivers[i].description = strdup("Generic PostScript Printer");
-      drivers[i].device_id = strdup("CMD:POSTSCRIPT;");
-      drivers[i].extension = strdup(" generic");
-      i ++;
-      ppd_path = (ps_ppd_path_t *)calloc(1, sizeof(ps_ppd_path_t));
-      ppd_path->driver_name = strdup("generic");
-      ppd_path->ppd_path = strdup(generic_ppd);
-      cupsArrayAdd(ppd_paths, ppd_path);
-    }
-    for (ppd = (ppd_info_t *)cupsArrayFirst(ppds);
-	 ppd;
-	 ppd = (ppd_info_t *)cupsArrayNext(ppds))
-    {
-      if (!generic_ppd || strcmp(ppd->record.name, generic_ppd))
-      {
-	// Note: The last entry in the product list is the ModelName of the
-	// PPD not an actual Product entry. Therefore we ignore it
-	// (Hidden feature of ppdCollectionListPPDs())
-        for (j = -1; j < PPD_MAX_PROD - 1; j ++)
-	{
-	  // End of product list;
-          if (j >= 0 &&
-	      (!ppd->record.products[j][0] || !ppd->record.products[j + 1][0]))
-            break;
-	  // If there is only 1 product, ignore it, it is either the
-	  // model of the PPD itself or something weird
-	  if (j == 0 &&
-	      (!ppd->record.products[1][0] || !ppd->record.products[2][0]))
-	    break;
-	  pre_normalized = 0;
-	  dev_id = NULL;
-	  if (j < 0)
-	  {
-	    // Model of PPD itself
-	    if (ppd->record.device_id[0] &&
-		(strstr(ppd->record.device_id, "MFG:") ||
-		 strstr(ppd->record.device_id, "MANUFACTURER:")) &&
-		(strstr(ppd->record.device_id, "MDL:") ||
-		 strstr(ppd->record.device_id, "MODEL:")) &&
-		!strstr(ppd->record.device_id, "MDL:hp_") &&
-		!strstr(ppd->record.device_id, "MDL:hp-") &&
-		!strstr(ppd->record.device_id, "MDL:HP_") &&
-		!strstr(ppd->record.device_id, "MODEL:hp2") &&
-		!strstr(ppd->record.device_id, "MODEL:hp3") &&
-		!strstr(ppd->record.device_id, "MODEL:hp9") &&
-		!strstr(ppd->record.device_id, "MODEL:HP2"))
-	    {
-	      // Convert device ID to make/model string, so that we can add
-	      // the language for building final index strings
-	      mfg_mdl = ieee1284NormalizeMakeAndModel(ppd->record.device_id,
-						      NULL,
-						      IEEE1284_NORMALIZE_HUMAN,
-						      buf2, sizeof(buf2),
-						      NULL, NULL);
-	      pre_normalized = 1;
-	    }
-	    else if (ppd->record.products[0][0])
-	      mfg_mdl = ppd->record.products[0];
-	    else
-	      mfg_mdl = ppd->record.make_and_model;
-	    if (ppd->record.device_id[0])
-	      dev_id = ppd->record.device_id;
-	  }
-	  else
-	    // Extra models in list of products
-	    mfg_mdl = ppd->record.products[j];
-	  ppd_path = (ps_ppd_path_t *)calloc(1, sizeof(ps_ppd_path_t));
-	  // Base make/model/language string to generate the needed index
-	  // strings
-	  snprintf(buf1, sizeof(buf1) - 1, "%s%s (%s)",
-		   mfg_mdl,
-		   (!strncmp(ppd->record.name, extra_ppd_dir,
-			     strlen(extra_ppd_dir)) ? " - USER-ADDED" : ""),
-		   ppd->record.languages[0]);
-	  // IPP-compatible string as driver name
-	  drivers[i].name =
-	    strdup(ieee1284NormalizeMakeAndModel(buf1, ppd->record.make,
-						 IEEE1284_NORMALIZE_IPP,
-						 buf2, sizeof(buf2),
-						 NULL, NULL));
-	  ppd_path->driver_name = strdup(drivers[i].name);
-	  // Path to grab PPD from repositories
-	  ppd_path->ppd_path = strdup(ppd->record.name);
-	  cupsArrayAdd(ppd_paths, ppd_path);
-	  // Human-readable string to appear in the driver drop-down
-	  if (pre_normalized)
-	    drivers[i].description = strdup(buf1);
-	  else
-	    drivers[i].description =
-	      strdup(ieee1284NormalizeMakeAndModel(buf1, ppd->record.make,
-						   IEEE1284_NORMALIZE_HUMAN,
-						   buf2, sizeof(buf2),
-						   NULL, NULL));
-	  // We only register device IDs actually found in the PPD files,
-	  // PPDs without explicit device ID get matched by the
-	  // ieee1284NormalizeMakeAndModel() function
-	  drivers[i].device_id = (dev_id ? strdup(dev_id) : strdup(""));
-	  // List sorting index with padded numbers (typos in example intended)
-	  // "LaserJet 3P" < "laserjet 4P" < "Laserjet3000P" < "LaserJet 4000P"
-	  drivers[i].extension =
-	    strdup(ieee1284NormalizeMakeAndModel(buf1, ppd->record.make,
-					IEEE1284_NORMALIZE_COMPARE |
-					IEEE1284_NORMALIZE_LOWERCASE |
-					IEEE1284_NORMALIZE_SEPARATOR_SPACE |
-					IEEE1284_NORMALIZE_PAD_NUMBERS,
-					buf2, sizeof(buf2),
-					NULL, NULL));
-	  papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-		   "File: %s; Printer (%d): %s; --> Entry %d: Driver %s; "
-		   "Description: %s; Device ID: %s; Sorting index: %s",
-		   ppd_path->ppd_path, j, buf1, i, drivers[i].name,
-		   drivers[i].description, drivers[i].device_id,
-		   (char *)(drivers[i].extension));
-	  // Sort the new entry into the list via the extension
-	  for (k = i;
-	       k > 0 &&
-	       strcmp((char *)(drivers[k - 1].extension),
-		      (char *)(drivers[k].extension)) > 0;
-	       k --)
-	  {
-	    swap = drivers[k - 1];
-	    drivers[k - 1] = drivers[k];
-	    drivers[k] = swap;
-	  }
-	  // Check for duplicates
-	  if (k > 0 &&
-	      (strcmp(drivers[k - 1].name, drivers[k].name) == 0 ||
-	       strcasecmp(drivers[k - 1].description,
-			  drivers[k].description) == 0))
-	  {
-	    // Remove the duplicate
-	    // We do not count the freeable memory here as in the end
-	    // we adjust the allocated memory anyway
-	    memmove(&drivers[k], &drivers[k + 1],
-		    (i - k) * sizeof(pappl_pr_driver_t));
-	    i --;
-	    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-		     "DUPLICATE REMOVED!");
-	  }
-	  // Next position in the list
-	  i ++;
-	}
-	// Add memory for PPD with multiple product entries
-	num_drivers += j;
-	drivers = (pappl_pr_driver_t *)reallocarray(drivers,
-						    num_drivers +
-						    PPD_MAX_PROD,
-						    sizeof(pappl_pr_driver_t));
-      }
-      free(ppd);
-    }
-    cupsArrayDelete(ppds);
 
-    // Final adjustment of allocated memory
-    drivers = (pappl_pr_driver_t *)reallocarray(drivers, i,
-						sizeof(pappl_pr_driver_t));
-    num_drivers = i;
-    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
-	     "Created %d driver entries.", num_drivers);
-  }
-  else
-    papplLog(system, PAPPL_LOGLEVEL_FATAL, "No PPD files found.");
+    case PS_CODEC_LZW :
+        fputs("/LZWDecode filter\n", fp);
+	break;
 
-  papplSystemSetPrinterDrivers(system, num_drivers, drivers,
-			       ps_autoadd, ps_printer_extra_setup,
-			       ps_driver_setup, ppd_paths);
+    case PS_CODEC_FLATE :
+        fprintf(fp,
+		"<< /Predictor 15 /Colors %d /BitsPerComponent %d "
+		"/Columns %d >>\n"
+		"/FlateDecode filter\n",
+		enc->colors, enc->bpc, enc->width);
+	break;
+
+    case PS_CODEC_CCITT :
+        fprintf(fp, "<< /K -1 /Columns %d /Rows %d /BlackIs1 %s >>\n"
+		"/CCITTFaxDecode filter\n",
+		enc->width, enc->height, enc->black_is_1 ? "true" : "false");
+	break;
+
+    case PS_CODEC_DCT :
+        fputs("/DCTDecode filter\n", fp);
+	break;
+
+    default :
+        break;
+  }
 }
 
 
 //
-// 'ps_setup()' - Setup PostScript driver.
+// 'ps_encoder_start()' - Start encoding an image with the given
+//                        compressor, width, height, and color format
+//                        of the image have to be set in the encoder chain
 //
 
-static void
-ps_setup(pappl_system_t *system)      // I - System
+static bool				// O - `true` on success, `false` on error
+ps_encoder_start(
+    ps_encoder_t   *enc,		// I - Encoder chain
+    ps_codec_t     codec,		// I - Compressor
+    ps_transport_t *transport)		// I - Transport for the output
 {
-  int              i;
-  char             *ptr1, *ptr2;
-  ppd_collection_t *col = NULL;
-  ps_filter_data_t *ps_filter_data,
-                   *pdf_filter_data;
+  size_t	bytes = enc->bytes_per_line,
+					// Bytes per line
+		bufsize = 0;		// Size of compressed data buffer
+  unsigned char	*ptr;			// Reallocated buffer
 
-  //
-  // Create PPD collection index data structure
+
+  enc->codec       = codec;
+  enc->transport   = transport;
+  enc->bytes_in    = 0;
+  transport->bytes = 0;
+
+  switch (codec)
+  {
+    case PS_CODEC_NONE :
+        break;
+
+    case PS_CODEC_RUNLENGTH :
+        // Worst case: One length byte for each 128 bytes of the line
+        bufsize = bytes + bytes / 128 + 2;
+	break;
+
+    case PS_CODEC_LZW :
+        if (!enc->lzw &&
+	    (enc->lzw = (ps_lzw_t *)malloc(sizeof(ps_lzw_t))) == NULL)
+	  return (false);
+	ps_lzw_start(enc->lzw, transport);
+	break;
+
+    case PS_CODEC_FLATE :
+        if (!enc->zstream_init)
+	{
+	  if (deflateInit(&(enc->zstream), enc->flate_level) != Z_OK)
+	    return (false);
+	  enc->zstream_init = true;
+	}
+	else
+	  deflateReset(&(enc->zstream));
+
+	if ((ptr = (unsigned char *)realloc(enc->prev_line, bytes)) == NULL)
+	  return (false);
+	enc->prev_line = ptr;
+	if ((ptr = (unsigned char *)realloc(enc->pred_line, bytes + 1)) ==
+	    NULL)
+	  return (false);
+	enc->pred_line = ptr;
+
+	// The predictor for the first line refers to a line of zeros
+	memset(enc->prev_line, 0, bytes);
+	enc->pred_bpp = (enc->colors * enc->bpc + 7) / 8;
+	bufsize = PS_ZBUF_SIZE;
+	break;
+
+    case PS_CODEC_CCITT :
+        return (ps_ccitt_start(&(enc->ccitt), enc->width, enc->black_is_1,
+			       transport));
+
+    case PS_CODEC_DCT :
+        return (ps_jpeg_start(enc));
+
+    default :
+        return (false);
+  }
+
+  if (bufsize > enc->bufsize)
+  {
+    if ((ptr = (unsigned char *)realloc(enc->buffer, bufsize)) == NULL)
+      return (false);
+    enc->buffer  = ptr;
+    enc->bufsize = bufsize;
+  }
+
+  return (true);
+}
+
+
+//
+// 'ps_encoder_write_line()' - Encode a raster line of the image
+//
+
+static void
+ps_encoder_write_line(
+    ps_encoder_t        *enc,		// I - Encoder chain
+    const unsigned char *line)		// I - Raster line
+{
+  size_t	bytes = enc->bytes_per_line;
+					// Bytes per line
+
+
+  enc->bytes_in += bytes;
+
+  switch (enc->codec)
+  {
+    case PS_CODEC_NONE :
+        ps_transport_write(enc->transport, line, bytes);
+	break;
+
+    case PS_CODEC_RUNLENGTH :
+        ps_runlength_encode_line(enc, line);
+	break;
+
+    case PS_CODEC_LZW :
+        ps_lzw_write(enc->lzw, line, bytes);
+	break;
+
+    case PS_CODEC_FLATE :
+        ps_png_predict_line(line, enc->prev_line, bytes, enc->pred_bpp,
+			    enc->pred_line);
+	memcpy(enc->prev_line, line, bytes);
+	ps_flate_write(enc, enc->pred_line, bytes + 1, Z_NO_FLUSH);
+	break;
+
+    case PS_CODEC_CCITT :
+        ps_ccitt_encode_line(&(enc->ccitt), line);
+	break;
+
+    case PS_CODEC_DCT :
+        ps_jpeg_write_line(enc, line);
+	break;
+
+    default :
+        break;
+  }
+}
+
+
+//
+// 'ps_filter()' - PAPPL generic filter function wrapper
+//
+
+bool
+ps_filter(
+    pappl_job_t    *job,		// I - Job
+    pappl_device_t *device,		// I - Device
+    void           *data)		// I - Filter data
+{
+  int                   i, j, count;
+  ps_job_data_t         *job_data;      // PPD data for job
+  ps_filter_data_t	*psfd = (ps_filter_data_t *)data;
+  const char		*filename;	// Input filename
+  int			fd;		// Input file descriptor
+  int                   nullfd = -1;    // File descriptor for /dev/null
+  int                   pages;          // Pages of PDF converted in chunks
+  int                   cachefd = -1;   // Printer-ready data from the
+                                        // conversion cache
+  int                   impressions = -1;
+                                        // Impressions of cached job
+  int                   slicefd;        // Pages cut out of PDF input
+  char                  slicename[1024] = "";
+                                        // Temporary file with these pages
+  pappl_pr_options_t	*job_options;	// Job options
+  bool			ret = false;	// Return value
+  char                  buf[1024];      // Buffer for building strings
+  filter_external_cups_t* ppd_filter_params = NULL; // Parameters for CUPS
+                                        // filter defined in the PPD
+  pappl_printer_t       *printer = papplJobGetPrinter(job);
+
+  //
+  // Load the printer's assigned PPD file, and find out which PPD option
+  // seetings correspond to our job options
   //
 
-  ppd_paths = cupsArrayNew(ps_compare_ppd_paths, NULL);
-  ppd_collections = cupsArrayNew(NULL, NULL);
+  job_options = papplJobCreatePrintOptions(job, INT_MAX, 1);
+  job_data = ps_create_job_data(job, job_options);
+  // The print filter function records the time to first page in it
+  papplJobSetData(job, job_data);
 
   //
-  // Build PPD list from all repositories
+  // Open the input file...
   //
 
-  if ((ptr1 = getenv("PPD_PATHS")) != NULL)
+  filename = papplJobGetFilename(job);
+  if ((fd = open(filename, O_RDONLY)) < 0)
   {
-    strncpy(ppd_dirs_env, ptr1, sizeof(ppd_dirs_env));
-    ptr1 = ppd_dirs_env;
-    while (ptr1 && *ptr1)
-    {
-      ptr2 = strchr(ptr1, ':');
-      if (ptr2)
-	*ptr2 = '\0';
-      col = (ppd_collection_t *)calloc(1, sizeof(ppd_collection_t));
-      col->name = NULL;
-      col->path = ptr1;
-      cupsArrayAdd(ppd_collections, col);
-      if (ptr2)
-	ptr1 = ptr2 + 1;
-      else
-	ptr1 = NULL;
-    }
+    papplLogJob(job, PAPPL_LOGLEVEL_ERROR, "Unable to open input file '%s': %s",
+		filename, strerror(errno));
+    papplJobSetData(job, NULL);
+    return (false);
   }
-  else
-    for (i = 0; i < sizeof(col_paths)/sizeof(col_paths[0]); i ++)
-    {
-      col = (ppd_collection_t *)calloc(1, sizeof(ppd_collection_t));
-      col->name = NULL;
-      col->path = (char *)col_paths[i];
-      cupsArrayAdd(ppd_collections, col);
-    }
 
   //
-  // Last entry in the list is the directory for the user to drop
-  // extra PPD files in via the web interface
+  // Set up filter function chain
   //
 
-  if (col && !extra_ppd_dir[0])
-    strncpy(extra_ppd_dir, col->path, sizeof(extra_ppd_dir));
+  job_data->chain = cupsArrayNew(NULL, NULL);
+  job_data->filter =
+    (filter_filter_in_chain_t *)calloc(1, sizeof(filter_filter_in_chain_t));
+  job_data->filter->function = psfd->filter_function;
+  // Our own filter functions get the job data as parameters
+  if (psfd->filter_function == ps_jpeg_filter_function)
+    job_data->filter->parameters = job_data;
+  else
+    job_data->filter->parameters = psfd->filter_parameters;
+  // DSC-conforming PostScript which needs no page-level processing gets
+  // passed through with only the PPD option code inserted, instead of
+  // getting parsed and rewritten by pstops()
+  if (psfd->filter_function == pstops &&
+      !ps_job_needs_pstops(job, job_data) &&
+      ps_dsc_map(job, &(job_data->dsc), fd))
+  {
+    papplLogJob(job, PAPPL_LOGLEVEL_INFO,
+		"Passing through DSC-conforming PostScript with %d pages",
+		job_data->dsc.num_pages);
+    job_data->filter->function   = ps_dsc_filter_function;
+    job_data->filter->parameters = job_data;
+  }
+  // Reprints of a document with the same settings get the printer-ready
+  // data from the conversion cache, except DSC pass-through which is not
+  // more expensive than reading from the cache. Jobs with the same
+  // document and settings which come while it gets converted for another
+  // job get the data of that conversion while it is written, also with
+  // the cache off. The data gets sent with the JCL job header of this
+  // job. The spooled file stays open, for converting on our own if the
+  // shared conversion fails before sending anything.
+  if (job_data->filter->function != ps_dsc_filter_function &&
+      ps_cache_key(job, job_data, fd) &&
+      (cachefd = ps_cache_open(job, job_data, &impressions)) >= 0)
+  {
+    job_data->follow_filter =
+      (filter_filter_in_chain_t *)calloc(1, sizeof(filter_filter_in_chain_t));
+    job_data->follow_filter->function = ps_cache_follow_filter_function;
+    job_data->follow_filter->parameters = job_data;
+    job_data->follow_filter->name = job_data->fanout ? "Sharing" : "Cache";
+    cupsArrayAdd(job_data->chain, job_data->follow_filter);
+    goto print;
+  }
 
-  //
-  // Create the list of all available PPD files
-  //
+ convert:
+  // Of a PDF file only the pages of the page range get converted (or
+  // sent as they are), if they are only a small part of it
+  if (psfd->filter_function == pdftops &&
+      (slicefd = ps_pdf_slice(job, job_data, filename, slicename,
+			      sizeof(slicename))) >= 0)
+  {
+    close(fd);
+    fd       = slicefd;
+    filename = slicename;
+  }
+  // PDF goes to printers which accept it as it is, without the expensive
+  // conversion to PostScript and without the PPD's PostScript filter
+  if (psfd->filter_function == pdftops && job_data->pdf_native &&
+      !ps_job_needs_pdftops(job, job_data))
+  {
+    papplLogJob(job, PAPPL_LOGLEVEL_INFO,
+		"Sending PDF to the printer without conversion");
+    job_data->filter->function   = ps_pdf_filter_function;
+    job_data->filter->parameters = job_data;
+  }
+  // Big PDF files get converted by several pdftops() in parallel, in
+  // chunks of pages, pstops() does the page management of the whole job
+  // afterwards
+  if (job_data->filter->function == pdftops &&
+      (pages = ps_pdf_parallel_pages(job, job_data, filename)) > 0 &&
+      (job_data->pdf_parallel =
+       (ps_pdf_parallel_t *)calloc(1, sizeof(ps_pdf_parallel_t))) != NULL)
+  {
+    job_data->pdf_parallel->filename   = filename;
+    job_data->pdf_parallel->num_pages  = pages;
+    job_data->pdf_parallel->parameters = psfd->filter_parameters;
+    job_data->filter->function         = ps_pdf_parallel_filter_function;
+    job_data->filter->parameters       = job_data->pdf_parallel;
+  }
+  job_data->filter->name = "Filtering";
+  cupsArrayAdd(job_data->chain, job_data->filter);
+  if (job_data->pdf_parallel)
+  {
+    job_data->page_filter =
+      (filter_filter_in_chain_t *)calloc(1, sizeof(filter_filter_in_chain_t));
+    job_data->page_filter->function = pstops;
+    job_data->page_filter->parameters = "PS";
+    job_data->page_filter->name = "Page management";
+    cupsArrayAdd(job_data->chain, job_data->page_filter);
+  }
+  if (job_data->cups_filter_ps &&
+      job_data->filter->function != ps_pdf_filter_function)
+  {
+    ppd_filter_params =
+      (filter_external_cups_t *)calloc(1, sizeof(filter_external_cups_t));
+    ppd_filter_params->filter = job_data->cups_filter_ps;
+    job_data->ppd_filter =
+      (filter_filter_in_chain_t *)calloc(1, sizeof(filter_filter_in_chain_t));
+    job_data->ppd_filter->function = filterExternalCUPS;
+    job_data->ppd_filter->parameters = ppd_filter_params;
+    job_data->ppd_filter->name = "Post-filtering";
+    cupsArrayAdd(job_data->chain, job_data->ppd_filter);
+  }
+  // The printer-ready data of converted jobs goes into the conversion
+  // cache, PDF sent as it is does not need it, jobs waiting to share its
+  // conversion do their own then. A shared conversion runs on its own,
+  // this job sends the data from the cache file like the others.
+  if (job_data->cache_key[0] &&
+      job_data->filter->function != ps_pdf_filter_function)
+  {
+    if (ps_cache_start(job, job_data))
+      cachefd = ps_cache_share(job, job_data, fd);
+  }
+  else
+    ps_cache_finish(job, job_data, false);
 
-  ps_setup_driver_list(system);
+ print:
+  if (!job_data->print)
+  {
+    job_data->print =
+      (filter_filter_in_chain_t *)calloc(1, sizeof(filter_filter_in_chain_t));
+    job_data->print->function = ps_print_filter_function;
+    job_data->print->parameters = device;
+    job_data->print->name = "Printing";
+  }
+  cupsArrayAdd(job_data->chain, job_data->print);
 
   //
-  // Add web admin interface page for adding PPD files
+  // Fire up the filter functions
   //
 
-  papplSystemAddResourceCallback(system, "/addppd", "text/html",
-				 (pappl_resource_cb_t)ps_system_web_add_ppd,
-				 system);
-  papplSystemAddLink(system, "Add PPD Files", "/addppd",
-		     PAPPL_LOPTIONS_OTHER | PAPPL_LOPTIONS_HTTPS_REQUIRED);
+  papplJobSetImpressions(job, 1);
+
+  // The filter chain has no output, data is going to the device
+  if (nullfd < 0)
+    nullfd = open("/dev/null", O_RDWR);
+
+  ret = ps_filter_chain(cachefd >= 0 ? cachefd : fd, nullfd, 1,
+			job_data->filter_data, job_data->chain) == 0;
+  if (ret && impressions >= 0)
+    papplJobSetImpressionsCompleted(job, impressions);
+
+  if (job_data->cache_chain)
+  {
+    // The shared conversion goes on while other jobs read its data
+    if (papplJobIsCanceled(job))
+      papplLogJob(job, PAPPL_LOGLEVEL_INFO,
+		  "Job canceled, the conversion goes on while other jobs "
+		  "share it");
+    pthread_join(job_data->cache_thread, NULL);
+    ps_cache_finish(job, job_data, job_data->cache_status == 0);
+  }
+  else
+    ps_cache_finish(job, job_data, ret && !papplJobIsCanceled(job));
+
+  // If the shared conversion failed before sending anything, convert on
+  // our own, without the cache. The job converting failed already, unless
+  // only writing the cache file failed.
+  if (job_data->cache_fallback && !papplJobIsCanceled(job) &&
+      (!job_data->cache_chain || job_data->cache_status == 0))
+  {
+    job_data->cache_fallback = false;
+    job_data->cache_key[0]   = '\0';
+    close(cachefd);
+    cachefd = -1;
+    if (lseek(fd, 0, SEEK_SET) == 0)
+    {
+      cupsArrayDelete(job_data->chain);
+      job_data->chain = cupsArrayNew(NULL, NULL);
+      if (!job_data->cache_chain)
+	goto convert;
+
+      for (i = 0; i < cupsArrayCount(job_data->cache_chain); i ++)
+	if (cupsArrayIndex(job_data->cache_chain, i) !=
+	    job_data->cache_filter)
+	  cupsArrayAdd(job_data->chain,
+		       cupsArrayIndex(job_data->cache_chain, i));
+      cupsArrayDelete(job_data->cache_chain);
+      job_data->cache_chain = NULL;
+      goto print;
+    }
+  }
+
+ done:
 
   //
-  // Add filters for the different input data formats
+  // Clean up
   //
 
-  ps_filter_data =
-    (ps_filter_data_t *)calloc(1, sizeof(ps_filter_data_t));
-  ps_filter_data->filter_function = pstops;
-  ps_filter_data->filter_parameters = "PS";
-  papplSystemAddMIMEFilter(system,
-			   "application/postscript",
-			   "application/vnd.printer-specific",
-			   ps_filter, ps_filter_data);
+  if (slicename[0])
+    unlink(slicename);
+  if (ppd_filter_params)
+    free(ppd_filter_params);
+  papplJobDeletePrintOptions(job_options);
+  papplJobSetData(job, NULL);
+  ps_free_job_data(job_data);
+  close(fd);
+  if (cachefd >= 0)
+    close(cachefd);
+  if (nullfd >= 0)
+    close(nullfd);
 
-  pdf_filter_data =
-    (ps_filter_data_t *)calloc(1, sizeof(ps_filter_data_t));
-  pdf_filter_data->filter_function = pdftops;
-  pdf_filter_data->filter_parameters = "PDF";
-  papplSystemAddMIMEFilter(system,
-			   "application/pdf",
-			   "application/vnd.printer-specific",
-			   ps_filter, pdf_filter_data);
+  return (ret);
 }
 
 
 //
-// 'ps_system_web_add_ppd()' - Web interface page for adding/deleting
-//                             PPD files by the user, to add support for
-//                             printers not supported by the built-in PPD
-//                             files
+// 'ps_filter_chain()' - Run a chain of filter functions like filterChain(),
+//                       connected by pipes, but the filter functions of
+//                       this Printer Application run as threads of this
+//                       process instead of forking a process for each of
+//                       them. The filter functions of libcupsfilters
+//                       (pdftops(), pstops(), filterExternalCUPS(), ...)
+//                       still get forked, as they share the filter data
+//                       and the PPD and reap their own sub-processes,
+//                       which would race with each other and with other
+//                       jobs as threads. The last filter function runs in
+//                       the calling thread if it is one of ours. When it
+//                       returns on a cancellation, the forked ones get
+//                       terminated. Like with filterChain() the caller
+//                       keeps the input and output file descriptors.
 //
 
-static void
-ps_system_web_add_ppd(
-    pappl_client_t *client,		// I - Client
-    pappl_system_t *system)		// I - System
+static int				// O - Error status
+ps_filter_chain(int           inputfd,	// I - File descriptor input stream
+		int           outputfd,	// I - File descriptor output stream
+		int           inputseekable,
+					// I - Is input stream seekable?
+		filter_data_t *data,	// I - Job and printer data
+		cups_array_t  *chain)	// I - Filter function chain
 {
-  int                 i, j;             // Looping variables
-  const char          *status = NULL;	// Status text, if any
-  const char          *uri = NULL;      // Client URI
-  pappl_version_t     version;
-  cups_array_t        *uploaded,        // List of uploaded PPDs, to delete
-                                        // them in certain error conditions
-                      *accepted_report, // Report of accepted PPDs with warnings
-                      *rejected_report; // Report of rejected PPDs with errors
-  cups_dir_t          *dir;             // User PPD file directory
-  cups_dentry_t       *dent;            // Entry in user PPD file directory
-  cups_array_t        *user_ppd_files;  // List of user-uploaded PPD files
+  int			i, j,		// Looping vars
+			num_stages,	// Number of filter functions
+			pipefds[2],	// Pipe between two filter functions
+			wstatus,	// Status of sub-process
+			status = 0;	// Exit status
+  pid_t			pid;		// Sub-process which exited
+  ps_chain_stage_t	*stages;	// Filter functions of the chain
+  filter_filter_in_chain_t *filter;	// Filter function in the chain
+  filter_logfunc_t	log = data->logfunc;
+					// Log function
+  void			*ld = data->logdata;
+					// Log function data
+  static const filter_function_t own[] =
+  {					// Filter functions run as threads
+    ps_cache_filter_function,
+    ps_cache_follow_filter_function,
+    ps_dsc_filter_function,
+    ps_jpeg_filter_function,
+    ps_pdf_filter_function,
+    ps_pdf_parallel_filter_function,
+    ps_print_filter_function
+  };
 
 
-  if (!papplClientHTMLAuthorize(client))
-    return;
+  if ((num_stages = cupsArrayCount(chain)) == 0)
+    return (0);
+  if ((stages = (ps_chain_stage_t *)calloc(num_stages,
+					   sizeof(ps_chain_stage_t))) == NULL)
+    return (1);
+
+  // Connect the filter functions, each one gets its own file descriptors,
+  // as filter functions close them
+  for (i = 0, filter = (filter_filter_in_chain_t *)cupsArrayFirst(chain);
+       filter;
+       i ++, filter = (filter_filter_in_chain_t *)cupsArrayNext(chain))
+  {
+    stages[i].filter        = filter;
+    stages[i].data          = data;
+    stages[i].pid           = -1;
+    for (j = 0; j < (int)(sizeof(own) / sizeof(own[0])) &&
+		own[j] != filter->function; j ++);
+    stages[i].forked        = j == (int)(sizeof(own) / sizeof(own[0]));
+    stages[i].inputseekable = i == 0 ? inputseekable : 0;
+    stages[i].inputfd       = i == 0 ?
+                              fcntl(inputfd, F_DUPFD_CLOEXEC, 0) :
+                              stages[i - 1].outputfd == -1 ? -1 : pipefds[0];
+    if (i == num_stages - 1)
+      stages[i].outputfd = fcntl(outputfd, F_DUPFD_CLOEXEC, 0);
+    else if (!pipe2(pipefds, O_CLOEXEC))
+    {
+      // Larger pipe buffer, so that a page of PostScript fits in, the
+      // size is limited by /proc/sys/fs/pipe-max-size, on error the
+      // default is used
+      fcntl(pipefds[1], F_SETPIPE_SZ, PS_CHAIN_PIPE_SIZE);
+      stages[i].outputfd = pipefds[1];
+      stages[i].pipe_out = true;
+    }
+    else
+      stages[i].outputfd = -1;
+    stages[i].pipe_in = i > 0 && stages[i].inputfd >= 0;
+    if (stages[i].inputfd < 0 || stages[i].outputfd < 0)
+      status = 1;
+  }
 
-  // Create arrays to log PPD file upload
-  uploaded = cupsArrayNew3(NULL, NULL, NULL, 0, NULL,
-			   (cups_afree_func_t)free);
-  accepted_report = cupsArrayNew3(NULL, NULL, NULL, 0, NULL,
-				  (cups_afree_func_t)free);
-  rejected_report = cupsArrayNew3(NULL, NULL, NULL, 0, NULL,
-				  (cups_afree_func_t)free);
+  if (status)
+  {
+    if (log)
+      log(ld, FILTER_LOGLEVEL_ERROR,
+	  "Filter chain: Unable to create pipes: %s", strerror(errno));
+    for (i = 0; i < num_stages; i ++)
+    {
+      if (stages[i].inputfd >= 0)
+	close(stages[i].inputfd);
+      if (stages[i].outputfd >= 0)
+	close(stages[i].outputfd);
+    }
+    free(stages);
+    return (1);
+  }
 
-  // Handle POSTs to add and delete PPD files...
-  if (papplClientGetMethod(client) == HTTP_STATE_POST)
+  // Fork the sub-processes before starting any thread, so that the file
+  // descriptors of all other filter functions are still open and each
+  // child can close its copies of them, otherwise the pipes would never
+  // get EOF
+  for (i = 0; i < num_stages; i ++)
   {
-    int			num_form = 0;	// Number of form variables
-    cups_option_t	*form = NULL;	// Form variables
-    cups_option_t	*opt;
-    const char		*action;	// Form action
-    char                strbuf[2048],
-                        destpath[2048];	// File destination path
-    const char	        *content_type;	// Content-Type header
-    const char	        *boundary;	// boundary value for multi-part
-    http_t              *http;
-    bool                error = false;
-    bool                ppd_repo_changed = false; // PPD(s) added or removed?
-    char		*ptr;		// Pointer into string
-
+    if (!stages[i].forked)
+      continue;
 
-    http = papplClientGetHTTP(client);
-    content_type = httpGetField(http, HTTP_FIELD_CONTENT_TYPE);
-    if (!strcmp(content_type, "application/x-www-form-urlencoded"))
+    if ((stages[i].pid = fork()) == 0)
     {
-      // URL-encoded form data, PPD file uploads not possible in this format 
-      // Use papplClientGetForm() to do the needed decoding
-      error = true;
-      if ((num_form = papplClientGetForm(client, &form)) == 0)
+      for (j = 0; j < num_stages; j ++)
+	if (j != i)
+	{
+	  if (stages[j].inputfd >= 0)
+	    close(stages[j].inputfd);
+	  if (stages[j].outputfd >= 0)
+	    close(stages[j].outputfd);
+	}
+      _exit((stages[i].filter->function)(stages[i].inputfd,
+					 stages[i].outputfd,
+					 stages[i].inputseekable, data,
+					 stages[i].filter->parameters));
+    }
+    else if (stages[i].pid < 0)
+    {
+      // The neighbours get EOF or EPIPE
+      if (log)
+	log(ld, FILTER_LOGLEVEL_ERROR,
+	    "Filter chain: Unable to fork process: %s", strerror(errno));
+      stages[i].status = 1;
+    }
+
+    // The child has them now
+    close(stages[i].inputfd);
+    close(stages[i].outputfd);
+    stages[i].inputfd = stages[i].outputfd = -1;
+  }
+
+  // Start our own filter functions as threads, except the last one of
+  // the chain, which runs in this thread
+  for (i = 0; i < num_stages - 1; i ++)
+  {
+    if (stages[i].forked)
+      continue;
+    if ((errno = pthread_create(&(stages[i].thread), NULL,
+				ps_filter_chain_stage, stages + i)) != 0)
+      break;
+    stages[i].started = true;
+  }
+
+  if (i == num_stages - 1)
+  {
+    if (!stages[i].forked)
+      ps_filter_chain_stage(stages + i);
+  }
+  else
+  {
+    // Thread creation failed, close the file descriptors of the filter
+    // functions not started, so that the others get EOF or EPIPE
+    if (log)
+      log(ld, FILTER_LOGLEVEL_ERROR,
+	  "Filter chain: Unable to start thread: %s", strerror(errno));
+    stages[i].status = 1;
+    for (; i < num_stages; i ++)
+      if (!stages[i].forked)
       {
-	status = "Invalid form data.";
+	close(stages[i].inputfd);
+	close(stages[i].outputfd);
       }
-      else if (!papplClientIsValidForm(client, num_form, form))
+  }
+
+  // Filter processes do not see a cancellation in this process, the
+  // cancellation state they have is a copy from the time of the fork
+  if (data->iscanceledfunc && (data->iscanceledfunc)(data->iscanceleddata))
+    for (i = 0; i < num_stages; i ++)
+      if (stages[i].pid > 0)
+	kill(stages[i].pid, SIGTERM);
+
+  for (i = 0; i < num_stages; i ++)
+    if (stages[i].started)
+      pthread_join(stages[i].thread, NULL);
+    else if (stages[i].pid > 0)
+    {
+      while ((pid = waitpid(stages[i].pid, &wstatus, 0)) < 0 &&
+	     errno == EINTR);
+      if (pid < 0)
+	stages[i].status = 1;
+      else if (WIFEXITED(wstatus))
+	stages[i].status = WEXITSTATUS(wstatus);
+      else
       {
-	status = "Invalid form submission.";
+	if (log)
+	  log(ld, FILTER_LOGLEVEL_ERROR,
+	      "Filter chain: %s (PID %d) crashed on signal %d",
+	      stages[i].filter->name ? stages[i].filter->name : "Filter",
+	      (int)stages[i].pid, WTERMSIG(wstatus));
+	stages[i].status = 256 * WTERMSIG(wstatus);
       }
-      else
-	error = false;
     }
-    else if (!strncmp(content_type, "multipart/form-data; ", 21) &&
-	     (boundary = strstr(content_type, "boundary=")) != NULL)
-    {
-      // Multi-part form data, probably we have a PPD file upload
-      // Use our own reading method to allow for submitting more than
-      // one PPD file through the single input widget and for a larger
-      // total amount of data
-      char	buf[32768],		// Message buffer
-		*bufinptr,		// Pointer end of incoming data
-		*bufreadptr,		// Pointer for reading buffer
-		*bufend;		// End of message buffer
-      size_t	body_size = 0;		// Size of message body
-      ssize_t	bytes;			// Bytes read
-      http_state_t initial_state;	// Initial HTTP state
-      char	name[1024],		// Form variable name
-		filename[1024],		// Form filename
-		bstring[256],		// Boundary string to look for
-		*bend,			// End of value (boundary)
-		*line;			// Start of line
-      size_t	blen;			// Length of boundary string
-      FILE      *fp = NULL;
-      ppd_file_t *ppd = NULL;		// PPD file data for verification
-      ppd_group_t *group;
-      ppd_option_t *option;
-      bool      codeless_option_found;
-      bool      pagesize_option_ok;
-      bool      filter_installed;
-      char      *filter_path;
 
+  for (i = 0; i < num_stages; i ++)
+    if (stages[i].status)
+    {
+      if (log)
+	log(ld, FILTER_LOGLEVEL_ERROR,
+	    "Filter chain: %s failed with status %d",
+	    stages[i].filter->name ? stages[i].filter->name : "Filter",
+	    stages[i].status);
+      status = stages[i].status;
+    }
 
-      // Read one buffer full of data, then search for \r only up to a
-      // position in the buffer so that the boundary string still fits
-      // after the \r, check for line end \r\n (in header) or boundary
-      // string (after header, file/value), then save value into
-      // "form" option list or file data into destination file, move
-      // rest of buffer content (after line break/boundary) to
-      // beginning of buffer, read rest of buffer space full,
-      // continue. If no line end found, error (too long line), if no
-      // boundary found, error in case of option value, write to
-      // destination file in case of file. Move rest of buffer content
-      // to the beginning of buffer, read buffer full, continue.
-      initial_state = httpGetState(http);
+  free(stages);
 
-      // Format the boundary string we are looking for...
-      snprintf(bstring, sizeof(bstring), "\r\n--%s", boundary + 9);
-      blen = strlen(bstring);
-      papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
-		     "Boundary string: \"%s\", %ld bytes",
-		     bstring, (long)blen);
+  return (status);
+}
 
-      // Parse lines in the message body...
-      name[0] = '\0';
-      filename[0] = '\0';
 
-      for (bufinptr = buf, bufend = buf + sizeof(buf);
-	   (bytes = httpRead2(http, bufinptr,
-			      (size_t)(bufend - bufinptr))) > 0 ||
-	     bufinptr > buf;)
-      {
-	body_size += (size_t)bytes;
-	papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
-		       "Bytes left over: %ld; Bytes read: %ld; Total bytes read: %ld",
-		       (long)(bufinptr - buf), (long)bytes, (long)body_size);
-	bufinptr += bytes;
-	*bufinptr = '\0';
+//
+// 'ps_filter_chain_stage()' - Run a filter function of ps_filter_chain().
+//
 
-	for (bufreadptr = buf; bufreadptr < bufinptr;)
-        {
-	  if (fp == NULL)
-	  {
-	    // Split out a line...
-	    for (line = bufreadptr; bufreadptr < bufinptr - 1; bufreadptr ++)
-	    {
-	      if (!memcmp(bufreadptr, "\r\n", 2))
-	      {
-		*bufreadptr = '\0';
-		bufreadptr += 2;
-		break;
-	      }
-	    }
+static void *				// O - Thread exit status (unused)
+ps_filter_chain_stage(void *data)	// I - Filter function to run
+{
+  ps_chain_stage_t	*stage = (ps_chain_stage_t *)data;
+					// Filter function to run
+  sigset_t		mask,		// Signals to block
+			oldmask,	// Signal mask of the thread before
+			pending;	// Pending signals
+  struct timespec	timeout = { 0, 0 };
+					// Do not wait for pending SIGPIPE
+  struct stat		in_st,		// Input pipe before
+			out_st,		// Output pipe before
+			st;		// File descriptor after
+
+
+  // A filter function writing into a pipe closed by the next one must get
+  // EPIPE instead of SIGPIPE killing the whole Printer Application
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+
+  fstat(stage->inputfd, &in_st);
+  fstat(stage->outputfd, &out_st);
+
+  stage->status = (stage->filter->function)(stage->inputfd, stage->outputfd,
+					    stage->inputseekable, stage->data,
+					    stage->filter->parameters);
+
+  // Filter functions are supposed to close their file descriptors. If
+  // one of the pipe ends is still open, close it, otherwise the next
+  // filter function never gets EOF or the previous one blocks. Pipes are
+  // unique to us, so the same inode means that the file descriptor was
+  // not reused meanwhile.
+  if (stage->pipe_in && !fstat(stage->inputfd, &st) &&
+      st.st_dev == in_st.st_dev && st.st_ino == in_st.st_ino)
+    close(stage->inputfd);
+  if (stage->pipe_out && !fstat(stage->outputfd, &st) &&
+      st.st_dev == out_st.st_dev && st.st_ino == out_st.st_ino)
+    close(stage->outputfd);
+
+  // The last filter function runs in the caller's thread, restore its
+  // signal mask, after discarding a SIGPIPE caused by the filter
+  // function, which would get delivered when unblocking it
+  if (!sigismember(&oldmask, SIGPIPE))
+  {
+    if (!sigpending(&pending) && sigismember(&pending, SIGPIPE))
+      sigtimedwait(&mask, NULL, &timeout);
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+  }
 
-	    if (bufreadptr >= bufinptr)
-	      break;
-	  }
+  return (NULL);
+}
 
-	  if (!*line || fp)
-          {
-	    papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
-			   "Data (value or file).");
 
-	    // End of headers, grab value...
-	    if (!name[0])
-	    {
-	      // No name value...
-	      papplLogClient(client, PAPPL_LOGLEVEL_ERROR,
-			     "Invalid multipart form data: Form field name missing.");
-	      // Stop here
-	      status = "Invalid form data.";
-	      error = true;
-	      break;
-	    }
+//
+// 'ps_flate_write()' - Feed data into the Flate stream and send the
+//                      compressed output via the image data transport
+//
 
-	    for (bend = bufinptr - blen - 2,
-		   ptr = memchr(bufreadptr, '\r', (size_t)(bend - bufreadptr));
-		 ptr;
-		 ptr = memchr(ptr + 1, '\r', (size_t)(bend - ptr - 1)))
-	    {
-	      // Check for boundary string...
-	      if (!memcmp(ptr, bstring, blen))
-		break;
-	    }
+static void
+ps_flate_write(ps_encoder_t        *enc,// I - Encoder chain
+	       const unsigned char *data,// I - Data to write
+	       size_t              bytes,// I - Number of bytes
+	       int                 flush)// I - Z_NO_FLUSH or Z_FINISH (end of
+                                        //     image)
+{
+  z_stream	*zs = &enc->zstream;	// Compression stream
+  int		ret;			// Return value of deflate()
+  size_t	outbytes;		// Compressed bytes to output
 
-	    if (!ptr && !filename[0])
-	    {
-	      // When reading a file, write out curremt data into destination
-	      // file, when not reading a file, error out
-	      // No boundary string, invalid data...
-	      papplLogClient(client, PAPPL_LOGLEVEL_ERROR,
-			     "Invalid multipart form data: Form field %s: File without filename or excessively long value.",
-			     name);
-	      // Stop here
-	      status = "Invalid form data.";
-	      error = true;
-	      break;
-	    }
 
-	    // Value/file data is in buffer range from ptr to bend,
-	    // Reading continues at bufreadptr
-	    if (ptr)
-	    {
-	      bend       = ptr;
-	      ptr        = bufreadptr;
-	      bufreadptr = bend + blen;
-	    }
-	    else
-	    {
-	      ptr        = bufreadptr;
-	      bufreadptr = bend;
-	    }
+  zs->next_in  = (Bytef *)data;
+  zs->avail_in = (uInt)bytes;
 
-	    if (filename[0])
-	    {
-	      // Save data of an embedded file...
+  do
+  {
+    zs->next_out  = enc->buffer;
+    zs->avail_out = (uInt)enc->bufsize;
+    if ((ret = deflate(zs, flush)) == Z_STREAM_ERROR)
+      break;
+    if ((outbytes = enc->bufsize - zs->avail_out) > 0)
+      ps_transport_write(enc->transport, enc->buffer, outbytes);
+  }
+  while (zs->avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+}
 
-	      // New file
-	      if (fp == NULL) // First data portion
-	      {
-		snprintf(destpath, sizeof(destpath), "%s/%s", extra_ppd_dir,
-			 filename);
-		papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
-			       "Creating file: %s", destpath);
-		if ((fp = fopen(destpath, "w+")) == NULL)
-		{
-		  papplLogClient(client, PAPPL_LOGLEVEL_ERROR,
-				 "Unable to create file: %s",
-				 strerror(errno));
-		  // Report error
-		  snprintf(strbuf, sizeof(strbuf),
-			   "%s: Cannot create file - %s",
-			   filename, strerror(errno));
-		  cupsArrayAdd(rejected_report, strdup(strbuf));
-		  // Stop here
-		  status = "Error uploading PPD file(s), uploading stopped.";
-		  error = true;
-		  break;
-		}
-	      }
 
-	      if (fp)
-	      {
-		// Write the data
-		while (bend > ptr) // We have data to write
-		{
-		  bytes = fwrite(ptr, 1, (size_t)(bend - ptr), fp);
-		  papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
-				 "Bytes to write: %ld; %ld bytes written",
-				 (long)(bend - ptr), (long)bytes);
-		  if (errno)
-		  {
-		    papplLogClient(client, PAPPL_LOGLEVEL_ERROR,
-				   "Error writing into file %s: %s",
-				   destpath, strerror(errno));
-		    // Report error
-		    snprintf(strbuf, sizeof(strbuf),
-			     "%s: Cannot write file - %s",
-			     filename, strerror(errno));
-		    cupsArrayAdd(rejected_report, strdup(strbuf));
-		    // PPD incomplete, close and delete it.
-		    fclose(fp);
-		    fp = NULL;
-		    unlink(destpath);
-		    // Stop here
-		    status = "Error uploading PPD file(s), uploading stopped.";
-		    error = true;
-		    break;
-		  }
-		  ptr += bytes;
-		}
+//
+// 'ps_free_job_data()' - Clean up job data with PPD options.
+//
 
-		// Close the file and verify whether it is a usable PPD file
-		if (bufreadptr > bend) // We have read the boundary string
-		{
+static void   ps_free_job_data(ps_job_data_t *job_data)
+{
+  free(job_data->filter_data->printer);
+  free(job_data->filter_data->job_user);
+  free(job_data->filter_data->job_title);
+  free(job_data->filter_data);
+  if (job_data->filter)
+    free(job_data->filter);
+  if (job_data->ppd_filter)
+    free(job_data->ppd_filter);
+  if (job_data->page_filter)
+    free(job_data->page_filter);
+  if (job_data->pdf_parallel)
+    free(job_data->pdf_parallel);
+  if (job_data->cache_filter)
+    free(job_data->cache_filter);
+  if (job_data->follow_filter)
+    free(job_data->follow_filter);
+  if (job_data->print)
+    free(job_data->print);
+  if (job_data->chain)
+    cupsArrayDelete(job_data->chain);
+  if (job_data->cache_chain)
+    cupsArrayDelete(job_data->cache_chain);
+  free(job_data->cache_jcl);
+  if (job_data->transport.ascii85.buffer)
+    free(job_data->transport.ascii85.buffer);
+  free(job_data->transport.held);
+  ps_encoder_free(&(job_data->encoder));
+  if (job_data->band)
+    free(job_data->band);
+  if (job_data->dsc.data)
+    munmap((void *)job_data->dsc.data, job_data->dsc.size);
+  if (job_data->dsc.pages)
+    free(job_data->dsc.pages);
+  cupsFreeOptions(job_data->num_options, job_data->options);
+  free(job_data);
+}
+
+
+//
+// 'ps_have_force_gray()' - Check PPD file whether there is an option setting
+//                          which forces grayscale output. Return the first
+//                          suitable one as pair of option name and value.
+//
+
+static bool                                // O - True if suitable setting found
+ps_have_force_gray(ppd_file_t *ppd,        // I - PPD file to check
+		   const char **optstr,    // I - Option name of found option
+		   const char **choicestr) // I - Choice name to force grayscale
+{
+  ppd_option_t *option;
+
+
+  if ((option = ppdFindOption(ppd, "ColorModel")) != NULL &&
+      ppdFindChoice(option, "Gray"))
+  {
+    if (optstr)
+      *optstr = "ColorModel";
+    if (choicestr)
+      *choicestr = "Gray";
+    return (true);
+  }
+  else if ((option = ppdFindOption(ppd, "ColorModel")) != NULL &&
+	   ppdFindChoice(option, "Grayscale"))
+  {
+    if (optstr)
+      *optstr = "ColorModel";
+    if (choicestr)
+      *choicestr = "Grayscale";
+    return (true);
+  }
+  else if ((option = ppdFindOption(ppd, "HPColorMode")) != NULL &&
+	   ppdFindChoice(option, "grayscale"))
+  {
+    if (optstr)
+      *optstr = "HPColorMode";
+    if (choicestr)
+      *choicestr = "grayscale";
+    return (true);
+  }
+  else if ((option = ppdFindOption(ppd, "BRMonoColor")) != NULL &&
+	   ppdFindChoice(option, "Mono"))
+  {
+    if (optstr)
+      *optstr = "BRMonoColor";
+    if (choicestr)
+      *choicestr = "Mono";
+    return (true);
+  }
+  else if ((option = ppdFindOption(ppd, "CNIJSGrayScale")) != NULL &&
+	   ppdFindChoice(option, "1"))
+  {
+    if (optstr)
+      *optstr = "CNIJSGrayScale";
+    if (choicestr)
+      *choicestr = "1";
+    return (true);
+  }
+  else if ((option = ppdFindOption(ppd, "HPColorAsGray")) != NULL &&
+	   ppdFindChoice(option, "True"))
+  {
+    if (optstr)
+      *optstr = "HPColorAsGray";
+    if (choicestr)
+      *choicestr = "True";
+    return (true);
+  }
+
+  if (optstr)
+    *optstr = NULL;
+  if (choicestr)
+    *choicestr = NULL;
+
+  return (false);
+}
+
+
+//
+// 'ps_identify()' - Identify the printer.
+//
+
+static void
+ps_identify(
+    pappl_printer_t          *printer,	// I - Printer
+    pappl_identify_actions_t actions, 	// I - Actions to take
+    const char               *message)	// I - Message, if any
+{
+  pappl_pr_driver_data_t driver_data;
+  ps_driver_extension_t  *extension;
+  ppd_file_t             *ppd = NULL;	// PPD file of the printer
+  pappl_device_t         *device;       // PAPPL output device
+
+
+  (void)actions;
+  (void)message;
+
+  // Identify the printer by sending a zero-page PostScript job to
+  // make the display of the printer light up and depending on
+  // hardware mechanics move and/or signal sounds play
+
+  papplPrinterGetDriverData(printer, &driver_data);
+  extension = (ps_driver_extension_t *)driver_data.extension;
+  ppd = extension->ppd;
+
+  //
+  // Open access to printer device...
+  //
+
+  if ((device = papplPrinterOpenDevice(printer)) == NULL)
+  {
+    papplLogPrinter(printer, PAPPL_LOGLEVEL_WARN,
+		    "Cannot access printer: Busy or otherwise not reachable");
+    return;
+  }
+
+  // Note: We directly output to the printer device without using
+  //       ps_print_filter_function() as only use printf()/puts() and
+  //       not any PPD-related function of libppd for the output to
+  //       the printer
+
+  //
+  // Put the printer in PostScript mode and initiate a PostScript
+  // file...
+  //
+
+  if (ppd->jcl_begin)
+  {
+    papplDevicePuts(device, ppd->jcl_begin);
+    papplDevicePuts(device, ppd->jcl_ps);
+  }
+
+  papplDevicePuts(device, "%!\n");
+  papplDeviceFlush(device);
+
+  //
+  // Delay...
+  //
+
+  sleep(3);
+
+  //
+  // Finish the job...
+  //
+
+  if (ppd->jcl_end)
+    papplDevicePuts(device, ppd->jcl_end);
+  else
+    papplDevicePuts(device, "\004");
+  papplDeviceFlush(device);
+
+  //
+  // Close connection to the printer device...
+  //
+
+  papplPrinterCloseDevice(printer);
+}
+
+
+//
+// 'ps_job_first_page()' - Record the time to first page, from the start
+//                         of processing the job until its first page is
+//                         completely sent to the device. Only the first
+//                         call for a job counts.
+//
+
+static void
+ps_job_first_page(pappl_job_t *job)	// I - Job
+{
+  ps_job_data_t		*job_data;	// Job data
+  struct timespec	now;		// Current time
+
+
+  if ((job_data = (ps_job_data_t *)papplJobGetData(job)) == NULL ||
+      job_data->first_page >= 0.0)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  job_data->first_page = (now.tv_sec - job_data->start.tv_sec) +
+			 (now.tv_nsec - job_data->start.tv_nsec) / 1e9;
+
+  papplLogJob(job, PAPPL_LOGLEVEL_INFO, "Time to first page: %.3f seconds",
+	      job_data->first_page);
+  papplJobSetMessage(job, "First page sent after %.1f seconds",
+		     job_data->first_page);
+}
+
+
+//
+// 'ps_job_is_canceled()' - Return 1 if the job is canceled, which is
+//                          the case when papplJobIsCanceled() returns
+//                          true.
+//
+
+static int
+ps_job_is_canceled(void *data)
+{
+  pappl_job_t *job = (pappl_job_t *)data;
+
+
+  return (papplJobIsCanceled(job) ? 1 : 0);
+}
+
+
+//
+// 'ps_job_log()' - Job log function which calls
+//                  papplJobSetImpressionsCompleted() on page logs of
+//                  filter functions
+//
+
+static void
+ps_job_log(void *data,
+	   filter_loglevel_t level,
+	   const char *message,
+	   ...)
+{
+  va_list arglist;
+  pappl_job_t *job = (pappl_job_t *)data;
+  char buf[1024];
+  int page, copies;
+
+
+  va_start(arglist, message);
+  vsnprintf(buf, sizeof(buf) - 1, message, arglist);
+  fflush(stdout);
+  va_end(arglist);
+  if (level == FILTER_LOGLEVEL_CONTROL)
+  {
+    if (sscanf(buf, "PAGE: %d %d", &page, &copies) == 2)
+    {
+      papplJobSetImpressionsCompleted(job, copies);
+      papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Printing page %d, %d copies",
+		  page, copies);
+    }
+    else
+      papplLogJob(job, PAPPL_LOGLEVEL_DEBUG, "Unused control message: %s",
+		  buf);
+  }
+  else
+    papplLogJob(job, (pappl_loglevel_t)level, "%s", buf);
+}
+
+
+//
+// 'ps_job_needs_pdftops()' - Check whether a PDF job has to get converted
+//                            to PostScript even though the printer accepts
+//                            PDF: Page-level processing, page selection,
+//                            copies without JCL to repeat the job, or
+//                            options changed from the PPD default which
+//                            are only PostScript code. The PDF's own page
+//                            sizes select the paper.
+//
+
+static bool				// O - `true` if pdftops() is needed
+ps_job_needs_pdftops(pappl_job_t   *job,// I - Job
+		     ps_job_data_t *job_data)
+					// I - Job data
+{
+  ppd_file_t	*ppd = job_data->ppd;	// PPD file with marked options
+  ppd_option_t	*option;		// Current option
+  ppd_choice_t	*choice;		// Marked choice
+  const char	*reason;		// Why pdftops() is needed
+  char		buf[256];		// Reason with option name
+
+
+  if ((reason = ps_job_page_processing(job_data)) != NULL)
+    ;
+  else if (cupsGetOption("page-ranges", job_data->num_options,
+			 job_data->options))
+    reason = "page-ranges";
+  else if (cupsGetOption("page-set", job_data->num_options,
+			 job_data->options))
+    reason = "page-set";
+  else if (job_data->filter_data->copies > 1 &&
+	   (!ppd->jcl_begin || !ppd->jcl_ps))
+    reason = "copies without JCL";
+  else
+    for (option = ppdFirstOption(ppd); option && !reason;
+	 option = ppdNextOption(ppd))
+      if (option->section != PPD_ORDER_JCL &&
+	  strcasecmp(option->keyword, "PageSize") &&
+	  strcasecmp(option->keyword, "PageRegion") &&
+	  (choice = ppdFindMarkedChoice(ppd, option->keyword)) != NULL &&
+	  strcmp(choice->choice, option->defchoice) &&
+	  choice->code && ps_str_has_code(choice->code))
+      {
+	snprintf(buf, sizeof(buf), "PostScript code for %s=%s",
+		 option->keyword, choice->choice);
+	reason = buf;
+      }
+
+  if (reason)
+    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+		"PDF cannot be sent as it is (%s), using pdftops", reason);
+
+  return (reason != NULL);
+}
+
+
+//
+// 'ps_job_needs_pstops()' - Check whether a PostScript job needs pstops()
+//                           for page-level processing: N-up, scaling,
+//                           copies of duplex jobs, or PPD option code to be
+//                           inserted into each page. Page ranges, reverse
+//                           order, and other copies get done by picking
+//                           pages of a DSC-conforming document.
+//
+
+static bool				// O - `true` if pstops() is needed
+ps_job_needs_pstops(pappl_job_t   *job,	// I - Job
+		    ps_job_data_t *job_data)
+					// I - Job data
+{
+  const char	*reason;		// Why pstops() is needed
+  char		*code;			// PPD code for each page
+  ppd_choice_t	*choice;		// Marked choice
+
+
+  if ((reason = ps_job_page_processing(job_data)) != NULL)
+    ;
+  else if (job_data->filter_data->copies > 1 &&
+	   (choice = ppdFindMarkedChoice(job_data->ppd, "Duplex")) != NULL &&
+	   strcasecmp(choice->choice, "None") &&
+	   strcasecmp(choice->choice, "False"))
+    reason = "copies of duplex job";	// Copies must start on a new sheet
+  else if ((code = ppdEmitString(job_data->ppd, PPD_ORDER_PAGE, 0.0)) !=
+	   NULL)
+  {
+    if (code[0])
+      reason = "PPD option code for each page";
+    free(code);
+  }
+
+  if (reason)
+    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+		"Page-level processing needed (%s), using pstops", reason);
+
+  return (reason != NULL);
+}
+
+
+//
+// 'ps_job_output_reversed()' - Check whether the pages of a job need to be
+//                              sent in reverse order, as the printer
+//                              outputs them face-up.
+//
+
+static bool				// O - `true` for reverse order
+ps_job_output_reversed(ps_job_data_t *job_data)
+					// I - Job data
+{
+  ppd_choice_t	*choice;		// Marked choice
+  ppd_attr_t	*attr;			// PPD attribute
+
+
+  if ((choice = ppdFindMarkedChoice(job_data->ppd, "OutputOrder")) != NULL)
+    return (!strcasecmp(choice->choice, "Reverse"));
+
+  return ((attr = ppdFindAttr(job_data->ppd, "DefaultOutputOrder",
+			      NULL)) != NULL &&
+	  attr->value && !strcasecmp(attr->value, "Reverse"));
+}
+
+
+//
+// 'ps_job_page_processing()' - Check whether a job uses options which need
+//                              its pages to get rendered differently: N-up,
+//                              scaling, mirroring, rotation, borders or
+//                              labels.
+//
+
+static const char *			// O - Option needing it, `NULL` if none
+ps_job_page_processing(ps_job_data_t *job_data)
+					// I - Job data
+{
+  int		i;			// Looping var
+  const char	*val;			// Option value
+  static const char * const page_options[] =
+  {					// Options handled by pstops() on the
+    "page-label",			// pages
+    "page-border",
+    "fit-to-page",
+    "fitplot"
+  };
+
+
+  for (i = 0; i < (int)(sizeof(page_options) / sizeof(page_options[0]));
+       i ++)
+    if (cupsGetOption(page_options[i], job_data->num_options,
+		      job_data->options))
+      return (page_options[i]);
+
+  if ((val = cupsGetOption("number-up", job_data->num_options,
+			   job_data->options)) != NULL &&
+      strcmp(val, "1"))
+    return ("number-up");
+  else if ((val = cupsGetOption("mirror", job_data->num_options,
+				job_data->options)) != NULL &&
+	   (!strcasecmp(val, "true") || !strcasecmp(val, "yes") ||
+	    !strcasecmp(val, "on")))
+    return ("mirror");
+  else if ((val = cupsGetOption("orientation-requested",
+				job_data->num_options,
+				job_data->options)) != NULL &&
+	   strcmp(val, "3"))
+    return ("orientation-requested");
+  else if ((val = cupsGetOption("print-scaling", job_data->num_options,
+				job_data->options)) != NULL &&
+	   (!strcmp(val, "fit") || !strcmp(val, "fill")))
+    return ("print-scaling");
+
+  return (NULL);
+}
+
+
+//
+// 'ps_job_vendor_attribute()' - Get the IPP attribute of a vendor option
+//                               for a job, the job's own setting or, if
+//                               not supplied, the printer's default.
+//
+
+static ipp_attribute_t *		// O - Attribute or `NULL` if not found
+ps_job_vendor_attribute(
+    pappl_job_t *job,			// I - Job
+    ipp_t       *driver_attrs,		// I - Printer (driver) IPP attributes
+    const char  *name)			// I - Name of vendor option
+{
+  ipp_attribute_t *attr;		// IPP attribute
+  char            buf[1024];		// Name of default attribute
+
+
+  if ((attr = papplJobGetAttribute(job, name)) == NULL ||
+      (ippGetValueTag(attr) != IPP_TAG_INTEGER &&
+       ippGetValueTag(attr) != IPP_TAG_BOOLEAN &&
+       ippGetString(attr, 0, NULL) == NULL))
+  {
+    snprintf(buf, sizeof(buf), "%s-default", name);
+    attr = ippFindAttribute(driver_attrs, buf, IPP_TAG_ZERO);
+  }
+
+  return (attr);
+}
+
+
+//
+// 'ps_jpeg_dest_empty()' - Output the full buffer of the JPEG destination
+//
+
+static boolean				// O - Always TRUE
+ps_jpeg_dest_empty(j_compress_ptr cinfo)// I - JPEG compressor
+{
+  ps_jpeg_dest_t *dest = (ps_jpeg_dest_t *)cinfo->dest;
+					// Destination
+
+
+  ps_transport_write(dest->transport, dest->buffer, sizeof(dest->buffer));
+  dest->pub.next_output_byte = dest->buffer;
+  dest->pub.free_in_buffer   = sizeof(dest->buffer);
+
+  return (TRUE);
+}
+
+
+//
+// 'ps_jpeg_dest_init()' - Initialize the JPEG destination for a new image
+//
+
+static void
+ps_jpeg_dest_init(j_compress_ptr cinfo)	// I - JPEG compressor
+{
+  ps_jpeg_dest_t *dest = (ps_jpeg_dest_t *)cinfo->dest;
+					// Destination
+
+
+  dest->pub.next_output_byte = dest->buffer;
+  dest->pub.free_in_buffer   = sizeof(dest->buffer);
+}
+
+
+//
+// 'ps_jpeg_dest_term()' - Output the rest of the JPEG data at the end of
+//                         the image
+//
+
+static void
+ps_jpeg_dest_term(j_compress_ptr cinfo)	// I - JPEG compressor
+{
+  ps_jpeg_dest_t *dest = (ps_jpeg_dest_t *)cinfo->dest;
+					// Destination
+  size_t         bytes = sizeof(dest->buffer) - dest->pub.free_in_buffer;
+					// Bytes in buffer
+
+
+  if (bytes > 0)
+    ps_transport_write(dest->transport, dest->buffer, bytes);
+}
+
+
+//
+// 'ps_jpeg_end()' - Finish the JPEG-encoded image of a photo page
+//
+
+static void
+ps_jpeg_end(ps_encoder_t *enc)		// I - Encoder chain
+{
+  if (!enc->jpeg_error)
+  {
+    if (setjmp(enc->jpeg_err.env))
+    {
+      enc->jpeg_error = true;
+      jpeg_abort_compress(&(enc->jpeg));
+    }
+    else
+      jpeg_finish_compress(&(enc->jpeg));
+  }
+}
+
+
+//
+// 'ps_jpeg_error_exit()' - Error handler for libjpeg, return to the caller
+//                          instead of exiting
+//
+
+static void
+ps_jpeg_error_exit(j_common_ptr cinfo)	// I - JPEG (de)compressor
+{
+  ps_jpeg_error_t *err = (ps_jpeg_error_t *)cinfo->err;
+					// Error handler
+
+
+  longjmp(err->env, 1);
+}
+
+
+//
+// 'ps_jpeg_filter_function()' - Filter function to print JPEG image files.
+//                               The JPEG data is embedded as it is, using
+//                               the /DCTDecode filter, if the printer
+//                               supports the JPEG variant (baseline with
+//                               PostScript level 2, also progressive with
+//                               level 3). Otherwise the image is decoded
+//                               and the pixels are embedded, in grayscale
+//                               with hex encoding for level 1, and also
+//                               for monochrome jobs if the JPEG is in
+//                               color. The image is placed on the
+//                               imageable area of the page according to
+//                               "print-scaling" ("fit" if not supplied)
+//                               and "orientation-requested" (rotated if
+//                               its orientation differs from the page's,
+//                               if not supplied).
+//
+
+static int				// O - Error status
+ps_jpeg_filter_function(
+    int           inputfd,		// I - File descriptor input stream
+    int           outputfd,		// I - File descriptor output stream
+    int           inputseekable,	// I - Is input stream seekable? (unused)
+    filter_data_t *data,		// I - Job and printer data
+    void          *parameters)		// I - Job data (ps_job_data_t) or
+                                        //     `NULL`
+{
+  ps_job_data_t	   *job_data = (ps_job_data_t *)parameters;
+					// Job data
+  ppd_file_t	   *ppd = data->ppd;	// PPD file with marked options
+  filter_logfunc_t log = data->logfunc;	// Log function
+  void             *ld = data->logdata;	// Log function data
+  FILE		   *outputfp;		// Output file
+  unsigned char	   *jpeg = NULL,	// JPEG file data
+		   *ptr;		// Pointer for reallocating
+  size_t	   jpeg_size = 0,	// Size of JPEG data
+		   jpeg_alloc = 0;	// Size of buffer
+  ssize_t	   bytes;		// Bytes read
+  struct jpeg_decompress_struct cinfo;	// JPEG decompressor
+  ps_jpeg_error_t  jerr;		// JPEG error handler
+  ps_transport_t   transport;		// Image data transport
+  JSAMPROW volatile row = NULL;		// Decoded pixel row
+  JSAMPROW	   rowptr;		// Row to decode into
+  ppd_size_t	   *size;		// Page size
+  float		   left, bottom,	// Imageable area
+		   iwidth, ilength,
+		   xres, yres,		// Resolution of the image
+		   iw, il,		// Natural size of the image on the
+					// page, after rotating
+		   fitscale,		// Scaling factor to fit the page
+		   fillscale,		// Scaling factor to fill the page
+		   scale,		// Scaling factor
+		   dwidth, dlength;	// Size of the image on the page
+  unsigned	   width, height;	// Size of the image in pixels
+  volatile int	   components;		// Color components
+  volatile bool	   passthrough;		// Embed the JPEG data as it is?
+  bool		   gray,		// Print in grayscale?
+		   cmyk_to_gray;	// Convert CMYK pixels to gray?
+  int		   rotate,		// Rotation in degrees (counterclockwise)
+		   orient;		// Requested orientation
+  unsigned	   x;			// Looping var
+  JSAMPLE	   *pix;		// Current pixel
+  int		   c, m, y, k;		// CMYK values of the pixel
+  const char	   *colorspace,		// PostScript color space
+		   *decode,		// Decode array
+		   *val,		// Option value
+		   *scaling;		// Requested scaling
+  int		   ret = 1;		// Return value
+
+
+  (void)inputseekable;
+
+  //
+  // Read the JPEG file into memory
+  //
+
+  while (1)
+  {
+    if (jpeg_size == jpeg_alloc)
+    {
+      jpeg_alloc = jpeg_alloc ? 2 * jpeg_alloc : 1024 * 1024;
+      if ((ptr = (unsigned char *)realloc(jpeg, jpeg_alloc)) == NULL)
+      {
+	if (log)
+	  log(ld, FILTER_LOGLEVEL_ERROR,
+	      "JPEG: Unable to allocate memory for the image data.");
+	free(jpeg);
+	close(inputfd);
+	close(outputfd);
+	return (1);
+      }
+      jpeg = ptr;
+    }
+    if ((bytes = read(inputfd, jpeg + jpeg_size, jpeg_alloc - jpeg_size)) <= 0)
+      break;
+    jpeg_size += bytes;
+  }
+  close(inputfd);
+
+  if ((outputfp = fdopen(outputfd, "w")) == NULL)
+  {
+    free(jpeg);
+    close(outputfd);
+    return (1);
+  }
+
+  //
+  // Read the JPEG header to find out what we have
+  //
+
+  memset(&transport, 0, sizeof(transport));
+  transport.mode     = ppd->language_level < 2 ? PS_TRANSPORT_HEX :
+		       job_data ? job_data->transport.mode :
+		       PS_TRANSPORT_ASCII85;
+  transport.outputfp = outputfp;
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = ps_jpeg_error_exit;
+  if (setjmp(jerr.env))
+  {
+    char message[JMSG_LENGTH_MAX];	// Error message
+
+    (*cinfo.err->format_message)((j_common_ptr)&cinfo, message);
+    if (log)
+      log(ld, FILTER_LOGLEVEL_ERROR, "JPEG: %s", message);
+    goto finish;
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, jpeg, jpeg_size);
+  jpeg_read_header(&cinfo, TRUE);
+
+  // Monochrome jobs get color JPEGs converted to grayscale, the same way
+  // as the presets for print-color-mode get chosen
+  gray = (!ppd->color_device || ppd->language_level < 2 ||
+	  ((val = cupsGetOption("ColorModel", data->num_options,
+				data->options)) != NULL &&
+	   (strcasestr(val, "Gray") || strcasestr(val, "Mono") ||
+	    strcasestr(val, "Black"))));
+
+  width      = cinfo.image_width;
+  height     = cinfo.image_height;
+  components = cinfo.num_components;
+  passthrough = (ppd->language_level >= 2 && !cinfo.arith_code &&
+		 (!cinfo.progressive_mode || ppd->language_level >= 3) &&
+		 (components == 1 || (!gray && (components == 3 ||
+						components == 4))));
+
+  if (log)
+    log(ld, FILTER_LOGLEVEL_DEBUG,
+	"JPEG: %ux%u pixels, %d components%s%s -> %s", width, height,
+	components, cinfo.progressive_mode ? ", progressive" : "",
+	cinfo.arith_code ? ", arithmetic coding" : "",
+	passthrough ? "embedding JPEG data as it is" :
+	"decoding and embedding the pixels");
+
+  // libjpeg cannot convert CMYK to grayscale, so we do it ourselves
+  cmyk_to_gray = false;
+  if (!passthrough)
+  {
+    if (gray)
+    {
+      if (cinfo.jpeg_color_space == JCS_CMYK ||
+	  cinfo.jpeg_color_space == JCS_YCCK)
+      {
+	cinfo.out_color_space = JCS_CMYK;
+	cmyk_to_gray          = true;
+      }
+      else
+	cinfo.out_color_space = JCS_GRAYSCALE;
+    }
+    jpeg_start_decompress(&cinfo);
+    components = cmyk_to_gray ? 1 : cinfo.output_components;
+    if ((row = (JSAMPROW)malloc(width * cinfo.output_components)) == NULL)
+      goto finish;
+  }
+
+  switch (components)
+  {
+    case 1 :
+        colorspace = "/DeviceGray";
+	decode     = "[0 1]";
+	break;
+    case 3 :
+        colorspace = "/DeviceRGB";
+	decode     = "[0 1 0 1 0 1]";
+	break;
+    default :
+        // Adobe CMYK JPEGs are stored inverted
+        colorspace = "/DeviceCMYK";
+	decode     = cinfo.saw_Adobe_marker ? "[1 0 1 0 1 0 1 0]" :
+					      "[0 1 0 1 0 1 0 1]";
+	break;
+  }
+
+  //
+  // Place the image on the page
+  //
+
+  if ((size = ppdPageSize(ppd, NULL)) != NULL)
+  {
+    left    = size->left;
+    bottom  = size->bottom;
+    iwidth  = size->right - size->left;
+    ilength = size->top - size->bottom;
+  }
+  else
+  {
+    // US Letter
+    left    = 18.0;
+    bottom  = 36.0;
+    iwidth  = 576.0;
+    ilength = 720.0;
+  }
+
+  // Natural size of the image, from the resolution in the JPEG file,
+  // 72 dpi if there is none
+  xres = yres = 72.0;
+  if (cinfo.X_density > 0 && cinfo.Y_density > 0 &&
+      (cinfo.density_unit == 1 || cinfo.density_unit == 2))
+  {
+    xres = cinfo.X_density * (cinfo.density_unit == 2 ? 2.54 : 1.0);
+    yres = cinfo.Y_density * (cinfo.density_unit == 2 ? 2.54 : 1.0);
+  }
+
+  // IPP landscape is the content rotated counterclockwise
+  if ((val = cupsGetOption("orientation-requested", data->num_options,
+			   data->options)) != NULL &&
+      (orient = atoi(val)) >= IPP_ORIENT_PORTRAIT &&
+      orient <= IPP_ORIENT_REVPORTRAIT)
+    rotate = orient == IPP_ORIENT_LANDSCAPE ? 90 :
+	     orient == IPP_ORIENT_REVLANDSCAPE ? 270 :
+	     orient == IPP_ORIENT_REVPORTRAIT ? 180 : 0;
+  else
+    rotate = ((iwidth > ilength && width < height) ||
+	      (iwidth < ilength && width > height)) ? 90 : 0;
+
+  if (rotate == 90 || rotate == 270)
+  {
+    iw = height * 72.0 / yres;
+    il = width * 72.0 / xres;
+  }
+  else
+  {
+    iw = width * 72.0 / xres;
+    il = height * 72.0 / yres;
+  }
+  fitscale  = iwidth / iw < ilength / il ? iwidth / iw : ilength / il;
+  fillscale = iwidth / iw > ilength / il ? iwidth / iw : ilength / il;
+
+  // "auto" fills borderless pages and fits otherwise, "auto-fit" only
+  // shrinks images which are too large
+  if ((scaling = cupsGetOption("print-scaling", data->num_options,
+			       data->options)) == NULL)
+    scaling = "fit";
+  else if (!strcmp(scaling, "auto"))
+    scaling = (size && size->left == 0.0 && size->bottom == 0.0 &&
+	       size->right == size->width && size->top == size->length) ?
+	      "fill" : "fit";
+  else if (!strcmp(scaling, "auto-fit"))
+    scaling = fitscale < 1.0 ? "fit" : "none";
+
+  if (!strcmp(scaling, "fill"))
+    scale = fillscale;
+  else if (!strcmp(scaling, "none"))
+    scale = 1.0;
+  else
+    scale = fitscale;
+  dwidth  = iw * scale;
+  dlength = il * scale;
+
+  if (log)
+    log(ld, FILTER_LOGLEVEL_DEBUG,
+	"JPEG: print-scaling=%s, rotated by %d degrees, %.2fx%.2f points",
+	scaling, rotate, dwidth, dlength);
+
+  //
+  // Write the PostScript job
+  //
+
+  ps_emit_job_header(outputfp, ppd, data->job_id, data->job_user,
+		     data->job_title, data->copies,
+		     size ? (int)size->width : 612,
+		     size ? (int)size->length : 792, 1, transport.mode);
+
+  fputs("%%Page: 1 1\n", outputfp);
+  fputs("%%BeginPageSetup\n", outputfp);
+  ppdEmit(ppd, outputfp, PPD_ORDER_PAGE);
+  fputs("%%EndPageSetup\n", outputfp);
+  fputs("gsave\n", outputfp);
+  // Filled or unscaled images can be larger than the imageable area
+  if (dwidth > iwidth + 0.01 || dlength > ilength + 0.01)
+    fprintf(outputfp,
+	    "newpath %.2f %.2f moveto %.2f 0 rlineto 0 %.2f rlineto "
+	    "%.2f 0 rlineto closepath clip newpath\n",
+	    left, bottom, iwidth, ilength, -iwidth);
+  fprintf(outputfp, "%.2f %.2f translate\n",
+	  left + (iwidth - dwidth) / 2, bottom + (ilength - dlength) / 2);
+  if (rotate == 90)
+    fprintf(outputfp, "%.2f 0 translate 90 rotate %.2f %.2f scale\n",
+	    dwidth, dlength, dwidth);
+  else if (rotate == 180)
+    fprintf(outputfp, "%.2f %.2f translate 180 rotate %.2f %.2f scale\n",
+	    dwidth, dlength, dwidth, dlength);
+  else if (rotate == 270)
+    fprintf(outputfp, "0 %.2f translate -90 rotate %.2f %.2f scale\n",
+	    dlength, dlength, dwidth);
+  else
+    fprintf(outputfp, "%.2f %.2f scale\n", dwidth, dlength);
+
+  // The data gets held, so that binary data can be checked for the
+  // end-of-data string before the data source of the image is chosen
+  ps_transport_hold(&transport);
+  if (passthrough)
+    ps_transport_write(&transport, jpeg, jpeg_size);
+  else
+    while (cinfo.output_scanline < height)
+    {
+      rowptr = row;
+      jpeg_read_scanlines(&cinfo, &rowptr, 1);
+      if (cmyk_to_gray)
+      {
+	// Adobe CMYK JPEGs are stored inverted
+	for (x = 0, pix = row; x < width; x ++, pix += 4)
+	{
+	  c = cinfo.saw_Adobe_marker ? 255 - pix[0] : pix[0];
+	  m = cinfo.saw_Adobe_marker ? 255 - pix[1] : pix[1];
+	  y = cinfo.saw_Adobe_marker ? 255 - pix[2] : pix[2];
+	  k = (cinfo.saw_Adobe_marker ? 255 - pix[3] : pix[3]) +
+	      (30 * c + 59 * m + 11 * y) / 100;
+	  row[x] = k > 255 ? 0 : 255 - k;
+	}
+      }
+      ps_transport_write(&transport, row, width * components);
+    }
+  ps_transport_end(&transport);
+
+  if (ppd->language_level < 2)
+  {
+    // Level 1: Grayscale image, hex-encoded
+    fprintf(outputfp, "/picstr %u string def\n", width);
+    fprintf(outputfp, "%u %u 8 [%u 0 0 %d 0 %u]\n", width, height, width,
+	    -(int)height, height);
+    fprintf(outputfp, "%s image\n", ps_transport_source(&transport));
+  }
+  else
+  {
+    fprintf(outputfp, "%s setcolorspace\n", colorspace);
+    fprintf(outputfp, "<<\n"
+	    "/ImageType 1\n"
+	    "/Width %u\n"
+	    "/Height %u\n"
+	    "/BitsPerComponent 8\n"
+	    "/Decode %s\n"
+	    "/DataSource %s%s\n"
+	    "/ImageMatrix [%u 0 0 %d 0 %u]\n"
+	    ">> image\n",
+	    width, height, decode, ps_transport_source(&transport),
+	    passthrough ? " /DCTDecode filter" : "",
+	    width, -(int)height, height);
+  }
+  ps_transport_release(&transport);
+  if (!passthrough)
+    jpeg_finish_decompress(&cinfo);
+  if (transport.failed)
+  {
+    if (log)
+      log(ld, FILTER_LOGLEVEL_ERROR,
+	  "Unable to allocate memory for encoding the image data");
+    goto finish;
+  }
+
+  fputs("grestore\n", outputfp);
+  fputs("showpage\n", outputfp);
+  fputs("%%PageTrailer\n", outputfp);
+  ps_emit_job_trailer(outputfp, ppd, 0);
+
+  if (log)
+    log(ld, FILTER_LOGLEVEL_CONTROL, "PAGE: 1 %d", data->copies);
+  ret = 0;
+
+ finish:
+  jpeg_destroy_decompress(&cinfo);
+  if (row)
+    free(row);
+  if (transport.ascii85.buffer)
+    free(transport.ascii85.buffer);
+  free(transport.held);
+  free(jpeg);
+  fclose(outputfp);
+
+  return (ret);
+}
+
+
+//
+// 'ps_jpeg_start()' - Start the JPEG-encoded image of a photo page
+//
+
+static bool				// O - `true` on success, `false` on error
+ps_jpeg_start(ps_encoder_t *enc)	// I - Encoder chain, 8-bit gray or RGB
+{
+  struct jpeg_compress_struct *cinfo = &(enc->jpeg);
+					// JPEG compressor
+
+
+  if (!enc->jpeg_dest &&
+      (enc->jpeg_dest =
+       (ps_jpeg_dest_t *)calloc(1, sizeof(ps_jpeg_dest_t))) == NULL)
+    return (false);
+
+  if (setjmp(enc->jpeg_err.env))
+  {
+    if (enc->jpeg_init)
+      jpeg_abort_compress(cinfo);
+    return (false);
+  }
+
+  if (!enc->jpeg_init)
+  {
+    cinfo->err = jpeg_std_error(&(enc->jpeg_err.pub));
+    enc->jpeg_err.pub.error_exit = ps_jpeg_error_exit;
+    jpeg_create_compress(cinfo);
+    enc->jpeg_init = true;
+
+    enc->jpeg_dest->pub.init_destination    = ps_jpeg_dest_init;
+    enc->jpeg_dest->pub.empty_output_buffer = ps_jpeg_dest_empty;
+    enc->jpeg_dest->pub.term_destination    = ps_jpeg_dest_term;
+    cinfo->dest = &(enc->jpeg_dest->pub);
+  }
+
+  enc->jpeg_dest->transport = enc->transport;
+  enc->jpeg_error           = false;
+
+  cinfo->image_width      = enc->width;
+  cinfo->image_height     = enc->height;
+  cinfo->input_components = enc->colors;
+  cinfo->in_color_space   = enc->colors == 3 ? JCS_RGB : JCS_GRAYSCALE;
+  jpeg_set_defaults(cinfo);
+  jpeg_set_quality(cinfo, enc->jpeg_quality, TRUE);
+  jpeg_start_compress(cinfo, TRUE);
+
+  return (true);
+}
+
+
+//
+// 'ps_jpeg_write_line()' - Add a raster line to the JPEG-encoded image
+//
+
+static void
+ps_jpeg_write_line(
+    ps_encoder_t        *enc,		// I - Encoder chain
+    const unsigned char *line)		// I - Raster line
+{
+  JSAMPROW row = (JSAMPROW)line;	// Row to compress
+
+
+  if (enc->jpeg_error)
+    return;
+
+  if (setjmp(enc->jpeg_err.env))
+  {
+    enc->jpeg_error = true;
+    jpeg_abort_compress(&(enc->jpeg));
+    return;
+  }
+
+  jpeg_write_scanlines(&(enc->jpeg), &row, 1);
+}
+
+
+//
+// 'ps_line_is_blank()' - Check whether a raster line is blank, comparing
+//                        whole words
+//
+
+static bool				// O - `true` if blank
+ps_line_is_blank(
+    const unsigned char *line,		// I - Raster line
+    size_t              bytes,		// I - Bytes per line
+    unsigned char       blank)		// I - Value of blank bytes
+{
+  unsigned long long	pattern = 0x0101010101010101ULL * blank,
+					// Word of blank bytes
+			word;		// Word of the line
+  size_t		i;		// Looping var
+
+
+  for (i = 0; i + sizeof(word) <= bytes; i += sizeof(word))
+  {
+    memcpy(&word, line + i, sizeof(word));
+    if (word != pattern)
+      return (false);
+  }
+
+  for (; i < bytes; i ++)
+    if (line[i] != blank)
+      return (false);
+
+  return (true);
+}
+
+
+//
+// 'ps_lookup_build()' - Build a perfect hash table from PWG names to PPD
+//                       choices. The first hash sorts the names into
+//                       buckets, then, biggest bucket first, each bucket
+//                       gets the seed for the second hash which puts all
+//                       its names into free slots. Names which occur more
+//                       than once are left out, jobs look them up in the
+//                       PPD cache as before.
+//
+
+static void
+ps_lookup_build(ps_lookup_t     *lookup,// O - Lookup table
+		const pwg_map_t *maps,	// I - First PWG name/PPD choice
+		size_t          stride,	// I - Bytes from one to the next
+		int             num_maps)
+					// I - Number of PWG names
+{
+  const pwg_map_t *map,			// Current map
+		**entries = NULL;	// Maps with unique names
+  int		num_entries = 0,	// Number of them
+		*bucket = NULL,		// Bucket of each of them
+		*count = NULL,		// Entries per bucket
+		*members = NULL,	// Entries of the current bucket
+		*slots = NULL,		// Slots of them
+		max = 0,		// Entries of the biggest bucket
+		i, j, b, n;		// Looping vars
+  uint32_t	seed;			// Seed of the second hash
+
+
+  memset(lookup, 0, sizeof(ps_lookup_t));
+  if (num_maps <= 0 ||
+      (entries = (const pwg_map_t **)calloc(num_maps,
+					    sizeof(pwg_map_t *))) == NULL)
+    return;
+
+  for (i = 0; i < num_maps; i ++)
+  {
+    map = (const pwg_map_t *)((const char *)maps + i * stride);
+    if (!map->pwg || !map->ppd)
+      continue;
+    for (j = 0; j < num_maps; j ++)
+      if (j != i &&
+	  ((const pwg_map_t *)((const char *)maps + j * stride))->pwg &&
+	  !strcasecmp(((const pwg_map_t *)((const char *)maps +
+					   j * stride))->pwg, map->pwg))
+	break;
+    if (j == num_maps)
+      entries[num_entries ++] = map;
+  }
+  if (num_entries == 0)
+    goto done;
+
+  lookup->num_buckets = num_entries;
+  for (lookup->size = 2; lookup->size < 2 * num_entries; lookup->size *= 2);
+  lookup->seeds  = (uint32_t *)calloc(num_entries, sizeof(uint32_t));
+  lookup->keys   = (const char **)calloc(lookup->size, sizeof(char *));
+  lookup->values = (const char **)calloc(lookup->size, sizeof(char *));
+  lookup->indices = (int *)calloc(lookup->size, sizeof(int));
+  bucket  = (int *)calloc(num_entries, sizeof(int));
+  count   = (int *)calloc(num_entries, sizeof(int));
+  members = (int *)calloc(num_entries, sizeof(int));
+  slots   = (int *)calloc(num_entries, sizeof(int));
+  if (!lookup->seeds || !lookup->keys || !lookup->values ||
+      !lookup->indices || !bucket ||
+      !count || !members || !slots)
+  {
+    ps_lookup_free(lookup);
+    goto done;
+  }
+
+  for (i = 0; i < num_entries; i ++)
+  {
+    bucket[i] = ps_lookup_hash(0, entries[i]->pwg) % num_entries;
+    if (++ count[bucket[i]] > max)
+      max = count[bucket[i]];
+  }
+
+  for (n = max; n > 0; n --)
+    for (b = 0; b < num_entries; b ++)
+    {
+      if (count[b] != n)
+	continue;
+      for (i = 0, j = 0; i < num_entries; i ++)
+	if (bucket[i] == b)
+	  members[j ++] = i;
+
+      // Find a seed which puts all names of the bucket into free,
+      // different slots
+      for (seed = 1; seed <= PS_LOOKUP_SEEDS; seed ++)
+      {
+	for (i = 0; i < n; i ++)
+	{
+	  slots[i] = ps_lookup_hash(seed, entries[members[i]]->pwg) &
+		     (lookup->size - 1);
+	  if (lookup->keys[slots[i]])
+	    break;
+	  for (j = 0; j < i && slots[j] != slots[i]; j ++);
+	  if (j < i)
+	    break;
+	}
+	if (i == n)
+	  break;
+      }
+      if (seed > PS_LOOKUP_SEEDS)
+      {
+	// Should never happen, all names get looked up in the PPD cache
+	ps_lookup_free(lookup);
+	goto done;
+      }
+
+      lookup->seeds[b] = seed;
+      for (i = 0; i < n; i ++)
+      {
+	lookup->keys[slots[i]]    = entries[members[i]]->pwg;
+	lookup->values[slots[i]]  = entries[members[i]]->ppd;
+	lookup->indices[slots[i]] =
+	  (int)(((const char *)entries[members[i]] - (const char *)maps) /
+		stride);
+      }
+    }
+
+ done:
+  free(entries);
+  free(bucket);
+  free(count);
+  free(members);
+  free(slots);
+}
+
+
+//
+// 'ps_lookup_find()' - Look up the PPD choice for a PWG name.
+//
+
+static const char *			// O - PPD choice or `NULL` if not in
+					//     the table
+ps_lookup_find(const ps_lookup_t *lookup,
+					// I - Lookup table
+	       const char        *key)	// I - PWG name
+{
+  int		slot;			// Slot of the name
+
+
+  if (!lookup->num_buckets || !key)
+    return (NULL);
+
+  slot = ps_lookup_hash(lookup->seeds[ps_lookup_hash(0, key) %
+				      lookup->num_buckets], key) &
+	 (lookup->size - 1);
+
+  return (lookup->keys[slot] && !strcmp(lookup->keys[slot], key) ?
+	  lookup->values[slot] : NULL);
+}
+
+
+//
+// 'ps_lookup_free()' - Free a lookup table. The names and choices belong
+//                      to the PPD cache.
+//
+
+static void
+ps_lookup_free(ps_lookup_t *lookup)	// I - Lookup table
+{
+  free(lookup->seeds);
+  free(lookup->keys);
+  free(lookup->values);
+  free(lookup->indices);
+  memset(lookup, 0, sizeof(ps_lookup_t));
+}
+
+
+//
+// 'ps_lookup_hash()' - Seeded FNV-1a hash of a PWG name, with a final
+//                      mix, so that the low bits for the slot number
+//                      depend on all characters.
+//
+
+static uint32_t				// O - Hash
+ps_lookup_hash(uint32_t   seed,		// I - Seed
+	       const char *key)		// I - PWG name
+{
+  uint32_t	hash = 2166136261U ^ (seed * 0x9e3779b9U);
+					// Hash
+
+
+  for (; *key; key ++)
+    hash = (hash ^ (unsigned char)*key) * 16777619U;
+
+  hash ^= hash >> 15;
+  hash *= 0x2c1b3c6dU;
+  hash ^= hash >> 12;
+
+  return (hash);
+}
+
+
+//
+// 'ps_lookup_index()' - Look up the index of the map of a PWG name, as
+//                       passed to ps_lookup_build().
+//
+
+static int				// O - Index or -1 if not found
+ps_lookup_index(const ps_lookup_t *lookup,
+					// I - Lookup table
+		const char        *key)	// I - PWG name
+{
+  int		slot;			// Slot of the name
+
+
+  if (!lookup->num_buckets || !key)
+    return (-1);
+
+  slot = ps_lookup_hash(lookup->seeds[ps_lookup_hash(0, key) %
+				      lookup->num_buckets], key) &
+	 (lookup->size - 1);
+
+  return (lookup->keys[slot] && !strcmp(lookup->keys[slot], key) ?
+	  lookup->indices[slot] : -1);
+}
+
+
+//
+// 'ps_lzw_end()' - Finish LZW-encoded data with the EOD code, pad to a
+//                  full byte and flush the output
+//
+
+static void
+ps_lzw_end(ps_lzw_t *lzw)		// I - Encoder state
+{
+  if (lzw->prefix >= 0)
+  {
+    ps_lzw_put_code(lzw, lzw->prefix);
+
+    // The decoder adds a string for this code before reading the EOD
+    // code, so the code length can change here
+    if (++ lzw->next_code == 4094)
+    {
+      ps_lzw_put_code(lzw, 256);
+      lzw->code_bits = 9;
+    }
+    else if (lzw->next_code > (1 << lzw->code_bits) - 1)
+      lzw->code_bits ++;
+  }
+
+  ps_lzw_put_code(lzw, 257);
+
+  if (lzw->num_bits > 0)
+    lzw->buffer[lzw->bufused ++] =
+      (unsigned char)(lzw->bits << (8 - lzw->num_bits));
+
+  ps_transport_write(lzw->transport, lzw->buffer, lzw->bufused);
+  lzw->bufused = 0;
+}
+
+
+//
+// 'ps_lzw_put_code()' - Add a code with the current code length to the
+//                       LZW output
+//
+
+static void
+ps_lzw_put_code(ps_lzw_t *lzw,		// I - Encoder state
+		int      code)		// I - Code
+{
+  lzw->bits = (lzw->bits << lzw->code_bits) | code;
+  lzw->num_bits += lzw->code_bits;
+
+  while (lzw->num_bits >= 8)
+  {
+    lzw->num_bits -= 8;
+    lzw->buffer[lzw->bufused ++] = (unsigned char)(lzw->bits >> lzw->num_bits);
+    if (lzw->bufused >= (int)sizeof(lzw->buffer))
+    {
+      ps_transport_write(lzw->transport, lzw->buffer, lzw->bufused);
+      lzw->bufused = 0;
+    }
+  }
+
+  lzw->bits &= (1 << lzw->num_bits) - 1;
+}
+
+
+//
+// 'ps_lzw_reset()' - Clear the string table of the LZW encoder
+//
+
+static void
+ps_lzw_reset(ps_lzw_t *lzw)		// I - Encoder state
+{
+  memset(lzw->hash_key, 0xff, sizeof(lzw->hash_key));
+  lzw->next_code = 258;
+  lzw->code_bits = 9;
+}
+
+
+//
+// 'ps_lzw_start()' - Start LZW-encoded data, as read by /LZWDecode with
+//                    the default /EarlyChange 1: Codes of 9 to 12 bits,
+//                    256 clears the table, 257 is the end of the data
+//
+
+static void
+ps_lzw_start(ps_lzw_t       *lzw,	// I - Encoder state
+	     ps_transport_t *transport)	// I - Transport for the output
+{
+  ps_lzw_reset(lzw);
+  lzw->prefix    = -1;
+  lzw->bits      = 0;
+  lzw->num_bits  = 0;
+  lzw->bufused   = 0;
+  lzw->transport = transport;
+
+  ps_lzw_put_code(lzw, 256);
+}
+
+
+//
+// 'ps_lzw_write()' - LZW-encode data. The current string is extended as
+//                    long as it is in the table, when not, the code of
+//                    the string is output and the extended string added
+//                    to the table. A full table is cleared.
+//
+
+static void
+ps_lzw_write(ps_lzw_t            *lzw,	// I - Encoder state
+	     const unsigned char *data,	// I - Data
+	     size_t              bytes)	// I - Number of bytes
+{
+  const unsigned char	*end = data + bytes;
+					// End of data
+  int			c,		// Current byte
+			key,		// Key of extended string
+			h;		// Position in hash table
+
+
+  if (lzw->prefix < 0 && data < end)
+    lzw->prefix = *data ++;
+
+  for (; data < end; data ++)
+  {
+    c   = *data;
+    key = (c << 12) | lzw->prefix;
+
+    for (h = (c << 5) ^ lzw->prefix;
+	 lzw->hash_key[h] >= 0 && lzw->hash_key[h] != key;
+	 h = h + 1 < PS_LZW_HSIZE ? h + 1 : 0);
+
+    if (lzw->hash_key[h] == key)
+    {
+      lzw->prefix = lzw->hash_code[h];
+      continue;
+    }
+
+    ps_lzw_put_code(lzw, lzw->prefix);
+    lzw->prefix = c;
+
+    lzw->hash_key[h]  = key;
+    lzw->hash_code[h] = (unsigned short)lzw->next_code ++;
+    if (lzw->next_code == 4094)
+    {
+      // Table full
+      ps_lzw_put_code(lzw, 256);
+      ps_lzw_reset(lzw);
+    }
+    else if (lzw->next_code > (1 << lzw->code_bits) - 1)
+      lzw->code_bits ++;
+  }
+}
+
+
+//
+// 'ps_media_col()' - Create a media-col entry
+//
+
+static void
+ps_media_col(pwg_size_t *pwg_size,            // I - Media size entry from PPD
+	                                      //     cache
+	     const char *def_source,          // I - Default media source
+	     const char *def_type,            // I - Default media type
+	     int left_offset,                 // I - Left offset
+	     int top_offset,                  // I - Top offset
+	     pappl_media_tracking_t tracking, // I - Media tracking
+	     pappl_media_col_t *col)          // O - PAPPL media col entry
+{
+  strncpy(col->size_name, pwg_size->map.pwg, sizeof(col->size_name));
+  col->size_width = pwg_size->width;
+  col->size_length = pwg_size->length;
+  col->left_margin = pwg_size->left;
+  col->right_margin = pwg_size->right;
+  col->top_margin = pwg_size->top;
+  col->bottom_margin = pwg_size->bottom;
+  strncpy(col->source, def_source, sizeof(col->source));
+  strncpy(col->type, def_type, sizeof(col->type));
+  col->left_offset = left_offset;
+  col->top_offset = top_offset;
+  col->tracking = tracking;
+}
+
+
+//
+// 'ps_one_bit_dither_on_draft()' - If a PWG/Apple-Raster or image job
+//                                  is printed in grayscale in draft mode
+//                                  switch to 1-bit dithering mode to get
+//                                  printing as fast as possible
+//
+
+static void
+ps_one_bit_dither_on_draft(
+    pappl_job_t      *job,       // I   - Job
+    pappl_pr_options_t *options) // I/O - Job options
+{
+  pappl_pr_driver_data_t driver_data;
+
+
+  papplPrinterGetDriverData(papplJobGetPrinter(job), &driver_data);
+  if (options->print_quality == IPP_QUALITY_DRAFT &&
+      options->print_color_mode != PAPPL_COLOR_MODE_COLOR &&
+      options->header.cupsNumColors == 1)
+  {
+    cupsRasterInitPWGHeader(&options->header,
+			    pwgMediaForPWG(options->media.size_name),
+			    "black_1",
+			    options->printer_resolution[0],
+			    options->printer_resolution[1],
+			    (options->header.Duplex ?
+			     (options->header.Tumble ?
+			      "two-sided-short-edge" : "two-sided-long-edge") :
+			     "one-sided"),
+			    "normal");
+    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+		"Monochrome draft quality job -> 1-bit dithering for speed-up");
+    if (options->print_content_optimize == PAPPL_CONTENT_PHOTO ||
+	!strcmp(papplJobGetFormat(job), "image/jpeg") ||
+	!strcmp(papplJobGetFormat(job), "image/png"))
+    {
+      memcpy(options->dither, driver_data.pdither, sizeof(options->dither));
+      papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+		  "Photo/Image-optimized dither matrix");
+    }
+    else
+    {
+      memcpy(options->dither, driver_data.gdither, sizeof(options->dither));
+      papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+		  "General-purpose dither matrix");
+    }
+  }
+}
+
+
+//
+// 'ps_option_memo_clear()' - Forget all job option mappings of a printer.
+//
+
+static void
+ps_option_memo_clear(ps_driver_extension_t *extension)
+					// I - Driver data extension
+{
+  int			i;		// Looping var
+  ps_option_memo_t	*memo;		// Current slot
+
+
+  pthread_mutex_lock(&(extension->option_memo_mutex));
+  for (i = 0, memo = extension->option_memo; i < PS_OPTION_MEMO_SIZE;
+       i ++, memo ++)
+    if (memo->key)
+    {
+      free(memo->key);
+      cupsFreeOptions(memo->num_options, memo->options);
+      memset(memo, 0, sizeof(ps_option_memo_t));
+    }
+  extension->option_memo_generation ++;
+  pthread_mutex_unlock(&(extension->option_memo_mutex));
+}
+
+
+//
+// 'ps_option_memo_get()' - Add the PPD options of an earlier job with the
+//                          same settings to the options of a job. The
+//                          generation of the memo is returned also if
+//                          the settings are not found, for putting the
+//                          mapping of the job with ps_option_memo_put().
+//
+
+static bool				// O - `true` if found in the memo
+ps_option_memo_get(
+    ps_driver_extension_t *extension,	// I - Driver data extension
+    const char            *key,		// I - Settings of the job
+    uint64_t              hash,		// I - Hash of them
+    ps_job_data_t         *job_data,	// I - Job data
+    unsigned              *generation)	// O - Generation of the memo
+{
+  ps_option_memo_t	*memo;		// Slot of the key
+  cups_option_t		*opt;		// Current option
+  int			i;		// Looping var
+  bool			found;		// Found in the memo?
+
+
+  memo = extension->option_memo + hash % PS_OPTION_MEMO_SIZE;
+
+  pthread_mutex_lock(&(extension->option_memo_mutex));
+  *generation = extension->option_memo_generation;
+  if ((found = memo->key && memo->hash == hash && !strcmp(memo->key, key)))
+    for (i = memo->num_options, opt = memo->options; i > 0; i --, opt ++)
+      job_data->num_options = cupsAddOption(opt->name, opt->value,
+					    job_data->num_options,
+					    &(job_data->options));
+  pthread_mutex_unlock(&(extension->option_memo_mutex));
+
+  return (found);
+}
+
+
+//
+// 'ps_option_memo_key()' - Put all settings of a job which decide about
+//                          its PPD options into a string, the key for the
+//                          printer's memo, and compute its FNV-1a hash.
+//
+
+static char *				// O - Key, to be freed, or `NULL`
+ps_option_memo_key(
+    pappl_job_t            *job,	// I - Job
+    pappl_pr_options_t     *job_options,// I - Job options
+    pappl_pr_driver_data_t *driver_data,// I - Printer's driver data
+    ps_vendor_table_t      *vendor,	// I - Compiled vendor options
+    ipp_t                  *driver_attrs,
+					// I - Printer (driver) IPP attributes
+    uint64_t               *hash)	// O - Hash of the key
+{
+  ps_driver_extension_t	*extension =
+    (ps_driver_extension_t *)driver_data->extension;
+					// Driver data extension
+  ipp_attribute_t	*attr;		// IPP attribute
+  const char		*val;		// Value string
+  char			buf[1024],	// Attribute value
+			*key = NULL,	// Key
+			*ptr;		// Pointer into key
+  size_t		keysize = 0;	// Size of key
+  FILE			*fp;		// Stream for key
+  int			i;		// Looping var
+
+
+  if ((fp = open_memstream(&key, &keysize)) == NULL)
+    return (NULL);
+
+  // Job options, the Resolution option depends also on whether the
+  // resolution was requested explicitly
+  fprintf(fp, "%u\n%d %d %s %d %d %d %d %s %s\n%d\n%s\n%d %d %d\n%d %d %d\n"
+	  "%d\n",
+	  (unsigned)job_options->finishings,
+	  job_options->media.size_width, job_options->media.size_length,
+	  job_options->media.size_name, job_options->media.left_margin,
+	  job_options->media.right_margin, job_options->media.top_margin,
+	  job_options->media.bottom_margin, job_options->media.source,
+	  job_options->media.type, (int)job_options->orientation_requested,
+	  job_options->output_bin, (int)job_options->print_color_mode,
+	  (int)job_options->print_quality, (int)job_options->print_scaling,
+	  job_options->printer_resolution[0],
+	  job_options->printer_resolution[1],
+	  papplJobGetAttribute(job, "printer-resolution") != NULL ||
+	  papplJobGetAttribute(job, "Resolution") != NULL,
+	  (int)job_options->sides);
+
+  // Vendor options, looked up like in ps_create_job_data()
+  for (i = 0; vendor && i < vendor->num_options; i ++)
+  {
+    if (extension->vendor_ppd_options[i] == NULL)
+      continue;
+    if ((attr = papplJobGetAttribute(job, driver_data->vendor[i])) == NULL ||
+	ippGetString(attr, 0, NULL) == NULL)
+      attr = ippFindAttribute(driver_attrs, vendor->options[i].default_name,
+			      IPP_TAG_ZERO);
+    if (attr && ippAttributeString(attr, buf, sizeof(buf)) > 0)
+      fprintf(fp, "%s=%s\n", driver_data->vendor[i], buf);
+    else
+      fprintf(fp, "%s\n", driver_data->vendor[i]);
+  }
+
+  // Collate
+  if ((attr = papplJobGetAttribute(job, "multiple-document-handling")) !=
+      NULL && (val = ippGetString(attr, 0, NULL)) != NULL)
+    fprintf(fp, "%s\n", val);
+
+  if (fclose(fp) || !key)
+  {
+    free(key);
+    return (NULL);
+  }
+
+  for (*hash = 0xcbf29ce484222325ULL, ptr = key; *ptr; ptr ++)
+    *hash = (*hash ^ (unsigned char)*ptr) * 0x100000001b3ULL;
+
+  return (key);
+}
+
+
+//
+// 'ps_option_memo_put()' - Remember the PPD options of a job for later
+//                          jobs with the same settings, replacing the
+//                          mapping which had the same slot. If the memo
+//                          got cleared while the job was mapping its
+//                          options, for example because of a change of
+//                          the installable accessories, the mapping is
+//                          outdated and does not get remembered.
+//
+
+static void
+ps_option_memo_put(
+    ps_driver_extension_t *extension,	// I - Driver data extension
+    const char            *key,		// I - Settings of the job
+    uint64_t              hash,		// I - Hash of them
+    ps_job_data_t         *job_data,	// I - Job data with PPD options
+    unsigned              generation)	// I - Generation of the memo when
+					//     the job started mapping
+{
+  ps_option_memo_t	*memo;		// Slot of the key
+  cups_option_t		*opt;		// Current option
+  int			i;		// Looping var
+
+
+  memo = extension->option_memo + hash % PS_OPTION_MEMO_SIZE;
+
+  pthread_mutex_lock(&(extension->option_memo_mutex));
+  if (generation != extension->option_memo_generation)
+  {
+    pthread_mutex_unlock(&(extension->option_memo_mutex));
+    return;
+  }
+  if (memo->key)
+  {
+    free(memo->key);
+    cupsFreeOptions(memo->num_options, memo->options);
+  }
+  memo->hash        = hash;
+  memo->key         = strdup(key);
+  memo->num_options = 0;
+  memo->options     = NULL;
+  for (i = job_data->num_options, opt = job_data->options; i > 0;
+       i --, opt ++)
+    memo->num_options = cupsAddOption(opt->name, opt->value,
+				      memo->num_options, &(memo->options));
+  pthread_mutex_unlock(&(extension->option_memo_mutex));
+}
+
+
+//
+// 'ps_page_scan()' - Search PostScript output for the end of the first
+//                    page: The "%%Page:" comment of the second page (not
+//                    of an embedded document) or the trailer. Output
+//                    without "%!" line after the JCL is not searched.
+//
+
+static bool				// O - `true` when done searching
+ps_page_scan(ps_page_scan_t *scan,	// I - Search state
+	     const char     *buffer,	// I - Output data
+	     size_t         bytes)	// I - Bytes of output data
+{
+  const char	*ptr,			// Pointer into buffer
+		*end = buffer + bytes;	// End of buffer
+
+
+  for (ptr = buffer; ptr < end; ptr ++)
+  {
+    if (*ptr != '\n' && *ptr != '\r')
+    {
+      if (scan->len < sizeof(scan->line))
+	scan->line[scan->len ++] = *ptr;
+      continue;
+    }
+
+    if (scan->len < 2 || scan->line[0] != '%')
+      ;
+    else if (!scan->postscript)
+      scan->postscript = scan->line[1] == '!';
+    else if (scan->len >= 7 && !memcmp(scan->line, "%%Page:", 7))
+    {
+      if (scan->depth == 0 && ++ scan->pages > 1)
+	return (true);
+    }
+    else if (scan->len >= 15 && !memcmp(scan->line, "%%BeginDocument", 15))
+      scan->depth ++;
+    else if (scan->len >= 13 && !memcmp(scan->line, "%%EndDocument", 13))
+    {
+      if (scan->depth > 0)
+	scan->depth --;
+    }
+    else if (scan->len >= 9 && !memcmp(scan->line, "%%Trailer", 9) &&
+	     scan->depth == 0 && scan->pages > 0)
+    {
+      scan->pages ++;
+      return (true);
+    }
+    scan->len = 0;
+  }
+
+  scan->bytes += bytes;
+
+  return (!scan->postscript && scan->bytes >= PS_PAGE_SCAN_HEADER);
+}
+
+
+//
+// 'ps_pdf_filter_function()' - Send a PDF job as it is to a printer which
+//                              accepts PDF, wrapped in the JCL of the PPD
+//                              file, with the printer's interpreter
+//                              switched to PDF. Copies get sent as
+//                              separate JCL jobs.
+//
+
+static int				// O - Error status
+ps_pdf_filter_function(int           inputfd,
+					// I - File descriptor input stream
+		       int           outputfd,
+					// I - File descriptor output stream
+		       int           inputseekable,
+					// I - Is input stream seekable?
+		       filter_data_t *data,
+					// I - Job and printer data
+		       void          *parameters)
+					// I - Job data
+{
+  ps_job_data_t	*job_data = (ps_job_data_t *)parameters;
+					// Job data
+  ppd_file_t	*ppd = job_data->ppd;	// PPD file with marked options
+  filter_logfunc_t log = data->logfunc;	// Log function
+  void		*ld = data->logdata;	// Log function data
+  ppd_attr_t	*attr;			// "*JCLToPDFInterpreter:" of PPD
+  char		*jcl_ps = ppd->jcl_ps,	// Switch to PostScript interpreter
+		*jcl_pdf = NULL,	// Switch to PDF interpreter
+		*header = NULL,		// JCL job header
+		*trailer = NULL,	// JCL job trailer
+		*ptr;			// Pointer into string
+  size_t	header_size = 0,	// Size of JCL job header
+		trailer_size = 0;	// Size of JCL job trailer
+  FILE		*fp,			// JCL output
+		*outputfp = NULL;	// Output stream
+  struct stat	st;			// Input file information
+  off_t		offset;			// Position in input file
+  ssize_t	bytes;			// Bytes sent
+  char		buffer[65536];		// Copy buffer
+  int		copies,			// Number of copies
+		i,			// Looping var
+		status = 1;		// Exit status
+  bool		use_sendfile;		// Copy input with sendfile()?
+
+
+  // JCL job header which switches the printer to PDF, with
+  // "*JCLToPDFInterpreter:" of the PPD file, or by changing the switch to
+  // PostScript. If it switches to something else, leave the choice of the
+  // interpreter to the printer's auto-detection.
+  if ((attr = ppdFindAttr(ppd, "JCLToPDFInterpreter", NULL)) != NULL &&
+      attr->value)
+    jcl_pdf = strdup(attr->value);
+  else if (jcl_ps && (jcl_pdf = strdup(jcl_ps)) != NULL)
+  {
+    if ((ptr = strcasestr(jcl_pdf, "POSTSCRIPT")) != NULL)
+    {
+      memcpy(ptr, "PDF", 3);
+      memmove(ptr + 3, ptr + 10, strlen(ptr + 10) + 1);
+    }
+    else
+      jcl_pdf[0] = '\0';
+  }
+
+  if ((fp = open_memstream(&header, &header_size)) == NULL)
+    goto error;
+  ppd->jcl_ps = jcl_pdf;
+  ppdEmitJCL(ppd, fp, data->job_id, data->job_user,
+	     data->job_title ? data->job_title : "Unknown");
+  ppd->jcl_ps = jcl_ps;
+  if (fclose(fp) ||
+      (fp = open_memstream(&trailer, &trailer_size)) == NULL)
+    goto error;
+  if (header_size > 0 && ppd->jcl_end)
+    ppdEmitJCLEnd(ppd, fp);
+  if (fclose(fp) || (outputfp = fdopen(outputfd, "w")) == NULL)
+    goto error;
+
+  // Copies can only be sent as separate JCL jobs of a spooled file
+  use_sendfile = !fstat(inputfd, &st) && S_ISREG(st.st_mode);
+  copies       = data->copies > 1 && header_size > 0 && inputseekable &&
+                 use_sendfile ? data->copies : 1;
+
+  for (i = 0; i < copies; i ++)
+  {
+    if (fwrite(header, 1, header_size, outputfp) < header_size ||
+	fflush(outputfp))
+      goto write_error;
+
+    // The PDF data goes from the spooled file to the next filter without
+    // getting copied into a buffer, if possible
+    for (offset = 0; use_sendfile && offset < st.st_size;)
+    {
+      if ((bytes = sendfile(outputfd, inputfd, &offset,
+			    PS_SPLICE_SIZE)) == 0)
+	break;
+      else if (bytes > 0)
+      {
+	if (data->iscanceledfunc &&
+	    (data->iscanceledfunc)(data->iscanceleddata))
+	  goto done;
+      }
+      else if (errno == EINVAL || errno == ENOSYS)
+	use_sendfile = false;		// Copy the rest below
+      else if (errno != EINTR && errno != EAGAIN)
+	goto write_error;
+    }
+    if (!use_sendfile)
+    {
+      if (inputseekable && lseek(inputfd, offset, SEEK_SET) < 0)
+	goto write_error;
+      while ((bytes = read(inputfd, buffer, sizeof(buffer))) > 0)
+	if (fwrite(buffer, 1, (size_t)bytes, outputfp) < (size_t)bytes)
+	  goto write_error;
+    }
+
+    if (fwrite(trailer, 1, trailer_size, outputfp) < trailer_size)
+      goto write_error;
+  }
+
+  if (fflush(outputfp))
+    goto write_error;
+
+  if (log)
+  {
+    log(ld, FILTER_LOGLEVEL_INFO,
+	"PDF: Sent PDF to the printer without conversion, %d copies", copies);
+    log(ld, FILTER_LOGLEVEL_CONTROL, "PAGE: 1 %d", copies);
+  }
+
+  status = 0;
+  goto done;
+
+ write_error:
+
+  if (log)
+    log(ld, FILTER_LOGLEVEL_ERROR, "PDF: Unable to send PDF data: %s",
+	strerror(errno));
+  goto done;
+
+ error:
+
+  if (log)
+    log(ld, FILTER_LOGLEVEL_ERROR, "PDF: Unable to create JCL job header");
+
+ done:
+
+  if (outputfp)
+    fclose(outputfp);
+  else
+    close(outputfd);
+  close(inputfd);
+  free(jcl_pdf);
+  free(header);
+  free(trailer);
+
+  return (status);
+}
+
+
+//
+// 'ps_pdf_chunk_log()' - Log function for converting the chunks of a PDF
+//                        job, the page counts of the chunks are left out,
+//                        pstops() logs the pages of the whole job.
+//
+
+static void
+ps_pdf_chunk_log(void              *data,// I - Job
+		 filter_loglevel_t level,// I - Log level
+		 const char        *message,
+					// I - printf-style message
+		 ...)			// I - Additional arguments
+{
+  va_list	arglist;		// Additional arguments
+  char		buf[1024];		// Message
+
+
+  if (level == FILTER_LOGLEVEL_CONTROL)
+    return;
+
+  va_start(arglist, message);
+  vsnprintf(buf, sizeof(buf), message, arglist);
+  va_end(arglist);
+  papplLogJob((pappl_job_t *)data, (pappl_loglevel_t)level, "%s", buf);
+}
+
+
+//
+// 'ps_pdf_parallel_filter_function()' - Convert PDF to PostScript with
+//                                       pdftops() on several threads,
+//                                       each converting chunks of pages,
+//                                       every one in its own process,
+//                                       cut out of the PDF with qpdf. The
+//                                       chunks get stitched together in
+//                                       order into one document with one
+//                                       prolog, each chunk sent as soon
+//                                       as it and the ones before it are
+//                                       done. The first chunk has only one
+//                                       page, so that the printer can
+//                                       start early, the following ones
+//                                       double in size.
+//
+
+static int				// O - Error status
+ps_pdf_parallel_filter_function(
+    int           inputfd,		// I - File descriptor input stream
+					//     (unused, chunks are cut out of
+					//     the spooled file)
+    int           outputfd,		// I - File descriptor output stream
+    int           inputseekable,	// I - Is input stream seekable?
+					//     (unused)
+    filter_data_t *data,		// I - Job and printer data
+    void          *parameters)		// I - Parallel conversion, with
+					//     file name, pages and parameters
+					//     for pdftops() filled in
+{
+  ps_pdf_parallel_t *par = (ps_pdf_parallel_t *)parameters;
+					// Parallel conversion
+  filter_logfunc_t log = data->logfunc;	// Log function
+  void		*ld = data->logdata;	// Log function data
+  ps_pdf_chunk_t *chunk;		// Current chunk
+  pthread_t	threads[PS_PDF_MAX_THREADS];
+					// Worker threads
+  int		num_threads = 0,	// Number of worker threads
+		chunk_pages,		// Pages per chunk
+		pages,			// Pages of current chunk
+		first,			// First page of current chunk
+		i,			// Looping var
+		err,			// Error from pthread_create()
+		status = 1;		// Exit status
+  FILE		*fp,			// Converted chunk
+		*outputfp = NULL;	// Output stream
+
+
+  (void)inputseekable;
+
+  close(inputfd);
+
+  // Chunks of pages, small enough that each thread gets several of them,
+  // so that pages of different complexity get balanced. pdftops() takes
+  // language level, resolution and renderer from the PPD file, only the
+  // final pstops() inserts JCL and PPD code and does copies. It starts
+  // from scratch, also when the job gets converted again.
+  par->next_chunk   = 0;
+  par->page         = 0;
+  par->canceled     = false;
+  par->prolog_size  = 0;
+  par->trailer_size = 0;
+  par->data         = *data;
+  par->data.copies  = 1;
+  par->data.logfunc = ps_pdf_chunk_log;
+  chunk_pages       = (par->num_pages + pdf_threads *
+		       PS_PDF_CHUNKS_PER_THREAD - 1) /
+		      (pdf_threads * PS_PDF_CHUNKS_PER_THREAD);
+  if (chunk_pages < PS_PDF_MIN_CHUNK)
+    chunk_pages = PS_PDF_MIN_CHUNK;
+  for (par->num_chunks = 0, first = 1, pages = PS_PDF_FIRST_CHUNK;
+       first <= par->num_pages;
+       par->num_chunks ++, first += pages,
+	 pages = pages * 2 < chunk_pages ? pages * 2 : chunk_pages);
+  pthread_mutex_init(&par->mutex, NULL);
+  pthread_cond_init(&par->cond, NULL);
+
+  if ((par->chunks = (ps_pdf_chunk_t *)calloc(par->num_chunks,
+					     sizeof(ps_pdf_chunk_t))) ==
+      NULL || (outputfp = fdopen(outputfd, "w")) == NULL)
+    goto done;
+  for (i = 0, first = 1, pages = PS_PDF_FIRST_CHUNK; i < par->num_chunks;
+       i ++, first += pages,
+	 pages = pages * 2 < chunk_pages ? pages * 2 : chunk_pages)
+  {
+    par->chunks[i].first  = first;
+    par->chunks[i].last   = first + pages - 1 < par->num_pages ?
+                            first + pages - 1 : par->num_pages;
+    par->chunks[i].status = -1;
+  }
+
+  for (i = 0; i < pdf_threads && i < par->num_chunks; i ++)
+    if ((err = pthread_create(threads + num_threads, NULL, ps_pdf_worker,
+			      par)) != 0)
+    {
+      if (log)
+	log(ld, FILTER_LOGLEVEL_WARN,
+	    "PDF: Unable to create worker thread: %s", strerror(err));
+    }
+    else
+      num_threads ++;
+  if (num_threads == 0)
+    goto done;
+
+  if (log)
+    log(ld, FILTER_LOGLEVEL_INFO,
+	"PDF: Converting %d pages in %d chunks on %d threads",
+	par->num_pages, par->num_chunks, num_threads);
+
+  // Stitch the chunks together in order, as they get done
+  for (i = 0, chunk = par->chunks; i < par->num_chunks; i ++, chunk ++)
+  {
+    pthread_mutex_lock(&par->mutex);
+    while (chunk->status < 0)
+      pthread_cond_wait(&par->cond, &par->mutex);
+    pthread_mutex_unlock(&par->mutex);
+
+    if (chunk->status)
+    {
+      if (log)
+	log(ld, FILTER_LOGLEVEL_ERROR,
+	    "PDF: Unable to convert pages %d to %d", chunk->first,
+	    chunk->last);
+      goto done;
+    }
+
+    // Each chunk goes on right away, not only when the buffer is full
+    if ((fp = fopen(chunk->filename, "r")) == NULL)
+      goto done;
+    if (!ps_pdf_stitch(par, fp, outputfp, i == 0,
+		       i == par->num_chunks - 1) ||
+	fflush(outputfp))
+    {
+      if (log)
+	log(ld, FILTER_LOGLEVEL_ERROR,
+	    "PDF: Unable to send converted pages %d to %d: %s",
+	    chunk->first, chunk->last, strerror(errno));
+      fclose(fp);
+      goto done;
+    }
+    fclose(fp);
+    unlink(chunk->filename);
+    chunk->filename[0] = '\0';
+
+    if (data->iscanceledfunc &&
+	(data->iscanceledfunc)(data->iscanceleddata))
+      goto done;
+  }
+
+  status = 0;
+
+ done:
+
+  // Stop the workers after their current chunks and remove what they
+  // leave
+  pthread_mutex_lock(&par->mutex);
+  par->canceled = true;
+  pthread_mutex_unlock(&par->mutex);
+  for (i = 0; i < num_threads; i ++)
+    pthread_join(threads[i], NULL);
+  for (i = 0; par->chunks && i < par->num_chunks; i ++)
+    if (par->chunks[i].filename[0])
+      unlink(par->chunks[i].filename);
+
+  pthread_mutex_destroy(&par->mutex);
+  pthread_cond_destroy(&par->cond);
+  free(par->chunks);
+  free(par->prolog);
+  free(par->trailer);
+  par->chunks  = NULL;
+  par->prolog  = NULL;
+  par->trailer = NULL;
+  if (outputfp)
+    fclose(outputfp);
+  else
+    close(outputfd);
+
+  return (status);
+}
+
+
+//
+// 'ps_pdf_parallel_pages()' - Check whether a PDF job gets converted in
+//                             chunks of pages and count its pages. This
+//                             needs enough pages, and no page selection,
+//                             reordering or page-level processing, as the
+//                             setup code of later chunks gets sent in the
+//                             page setup of their first pages.
+//                             With only one thread the chunks get
+//                             converted one after the other, still the
+//                             first page gets sent early.
+//
+
+static int				// O - Number of pages, 0 for
+					//     converting as a whole
+ps_pdf_parallel_pages(pappl_job_t   *job,// I - Job
+		      ps_job_data_t *job_data,
+					// I - Job data
+		      const char    *filename)
+					// I - PDF file
+{
+  const char	*reason = NULL;		// Why not in parallel
+  char		buf[256];		// Output of qpdf
+  int		pages = 0;		// Number of pages
+  const char	*args[] =		// qpdf command line
+  {
+    "qpdf",
+    "--show-npages",
+    filename,
+    NULL
+  };
+
+
+  if (job_data->ppd->language_level < 2)
+    reason = "PostScript level 1 printer";
+  else if ((reason = ps_job_page_processing(job_data)) != NULL)
+    ;
+  else if (cupsGetOption("page-ranges", job_data->num_options,
+			 job_data->options))
+    reason = "page-ranges";
+  else if (cupsGetOption("page-set", job_data->num_options,
+			 job_data->options))
+    reason = "page-set";
+  else if (ps_job_output_reversed(job_data))
+    reason = "reverse output order";
+  else if (ps_run_qpdf(job, args, buf, sizeof(buf)) != 0 ||
+	   (pages = atoi(buf)) < 1)
+    reason = "unable to count pages with qpdf";
+  else if (pages < PS_PDF_MIN_PAGES)
+    reason = "few pages";
+
+  if (reason)
+  {
+    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+		"Converting PDF as a whole (%s)", reason);
+    return (0);
+  }
+
+  return (pages);
+}
+
+
+//
+// 'ps_pdf_slice()' - Cut the pages of the job's page range out of the PDF
+//                    file with qpdf, together with the resources they
+//                    use, so that pdftops() does not need to parse and
+//                    convert the whole file. This is done when the range
+//                    is a small part of the document, or when it lets a
+//                    printer which accepts PDF get the pages without
+//                    conversion. The page range is removed from the
+//                    options then.
+//
+
+static int				// O - File descriptor of the pages,
+					//     -1 for using the whole file
+ps_pdf_slice(pappl_job_t   *job,	// I - Job
+	     ps_job_data_t *job_data,	// I - Job data
+	     const char    *filename,	// I - PDF file
+	     char          *slicename,	// O - Temporary file with the pages
+	     size_t        slicesize)	// I - Size of file name buffer
+{
+  const char	*ranges,		// Page range of the job
+		*reason = NULL;		// Why not cut out
+  char		buf[256],		// Output of qpdf
+		range[64];		// Page range for qpdf
+  int		first,			// First page of range
+		last,			// Last page of range
+		pages = 0,		// Pages of the PDF file
+		status,			// Exit status of qpdf
+		fd;			// Temporary file
+  const char	*count_args[] =		// qpdf command line for counting
+  {
+    "qpdf",
+    "--show-npages",
+    filename,
+    NULL
+  };
+  const char	*slice_args[] =		// qpdf command line for cutting
+  {
+    "qpdf",
+    "--empty",
+    "--pages",
+    filename,
+    range,
+    "--",
+    slicename,
+    NULL
+  };
+
+
+  *slicename = '\0';
+
+  // ps_create_job_data() makes a single range of the first and last page
+  if ((ranges = cupsGetOption("page-ranges", job_data->num_options,
+			      job_data->options)) == NULL ||
+      sscanf(ranges, "%d-%d", &first, &last) != 2)
+    return (-1);
+
+  // Odd and even pages of page-set count in the original document
+  if (!(first & 1) && cupsGetOption("page-set", job_data->num_options,
+				    job_data->options))
+    reason = "page-set with range starting on an even page";
+  else if (ps_run_qpdf(job, count_args, buf, sizeof(buf)) != 0 ||
+	   (pages = atoi(buf)) < 1)
+    reason = "unable to count pages with qpdf";
+  else if (first > pages)
+    reason = "range after the last page";
+  else
+  {
+    if (last > pages)
+      last = pages;
+    if ((last - first + 1) * PS_PDF_SLICE_FRACTION > pages &&
+	!job_data->pdf_native)
+      reason = "range is a big part of the document";
+  }
+
+  if (reason)
+  {
+    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+		"Not cutting the page range out of the PDF (%s)", reason);
+    return (-1);
+  }
+
+  // qpdf exits with 3 on warnings
+  snprintf(range, sizeof(range), "%d-%d", first, last);
+  if ((fd = cupsTempFd(slicename, (int)slicesize)) < 0)
+    return (-1);
+  close(fd);
+  if (((status = ps_run_qpdf(job, slice_args, NULL, 0)) != 0 &&
+       status != 3) ||
+      (fd = open(slicename, O_RDONLY | O_CLOEXEC)) < 0)
+  {
+    papplLogJob(job, PAPPL_LOGLEVEL_WARN,
+		"Unable to cut pages %s out of the PDF, converting the whole "
+		"file", range);
+    unlink(slicename);
+    *slicename = '\0';
+    return (-1);
+  }
+
+  papplLogJob(job, PAPPL_LOGLEVEL_INFO,
+	      "Printing pages %d to %d of %d, cut out of the PDF", first, last,
+	      pages);
+
+  job_data->num_options = cupsRemoveOption("page-ranges",
+					   job_data->num_options,
+					   &(job_data->options));
+  job_data->filter_data->num_options = job_data->num_options;
+  job_data->filter_data->options     = job_data->options;
+
+  return (fd);
+}
+
+
+//
+// 'ps_pdf_stitch()' - Append a converted chunk of pages to the output.
+//                     The first chunk supplies header, prolog and setup,
+//                     the last one the trailer. Of the other chunks only
+//                     the code of prolog (if it differs from the one of
+//                     the first chunk) and setup gets sent, without DSC
+//                     comments, in the page setup of their first page,
+//                     after the trailer code of the chunk before, so that
+//                     all code stays within the DSC structure of the
+//                     document. The pages get renumbered.
+//
+
+static bool				// O - `true` on success
+ps_pdf_stitch(ps_pdf_parallel_t *par,	// I - Parallel conversion
+	      FILE              *fp,	// I - Converted chunk
+	      FILE              *outputfp,
+					// I - Output stream
+	      bool              first,	// I - First chunk?
+	      bool              last)	// I - Last chunk?
+{
+  char		*line = NULL,		// Current line
+		*prolog = NULL,		// Prolog of chunk
+		*setup = NULL,		// Setup code of chunk
+		*trailer = NULL,	// Trailer code of chunk
+		*ptr,			// Pointer into prolog
+		*next;			// Next line in prolog
+  size_t	linesize = 0,		// Allocated size of line
+		prolog_size = 0,	// Size of prolog
+		setup_size = 0,		// Size of setup code
+		trailer_size = 0;	// Size of trailer code
+  ssize_t	len;			// Length of line
+  FILE		*prologfp,		// Prolog being collected
+		*setupfp = NULL,	// Setup code being collected
+		*trailerfp = NULL;	// Trailer code being collected
+  ps_dsc_section_t section = PS_DSC_HEADER;
+					// Current section
+  int		depth = 0;		// Depth of embedded documents
+  bool		dsc,			// DSC comment line?
+		page_setup = false,	// Setup code waiting for the page
+					// setup of the first page?
+		ret = true;		// Return value
+
+
+  if ((prologfp = open_memstream(&prolog, &prolog_size)) == NULL ||
+      (!first && (setupfp = open_memstream(&setup, &setup_size)) == NULL) ||
+      (!last && (trailerfp = open_memstream(&trailer, &trailer_size)) ==
+       NULL))
+  {
+    ret = false;
+    goto done;
+  }
+
+  while ((len = getline(&line, &linesize, fp)) > 0)
+  {
+    dsc = len > 2 && line[0] == '%' && line[1] == '%';
+
+    // Section changes, not within embedded documents
+    if (dsc && ps_dsc_keyword(line, len, "%%BeginDocument"))
+      depth ++;
+    else if (dsc && ps_dsc_keyword(line, len, "%%EndDocument"))
+    {
+      if (depth > 0)
+	depth --;
+    }
+    else if (depth > 0)
+      ;
+    else if (section == PS_DSC_HEADER && !dsc && strncmp(line, "%!", 2))
+      section = PS_DSC_PROLOG;
+    else if (section <= PS_DSC_PROLOG &&
+	     ps_dsc_keyword(line, len, "%%BeginProlog"))
+      section = PS_DSC_PROLOG;
+    else if (section <= PS_DSC_SETUP &&
+	     ps_dsc_keyword(line, len, "%%BeginSetup"))
+      section = PS_DSC_SETUP;
+    else if (section <= PS_DSC_SETUP &&
+	     ps_dsc_keyword(line, len, "%%Page:"))
+      section = PS_DSC_PAGES;
+    else if (section == PS_DSC_PAGES &&
+	     ps_dsc_keyword(line, len, "%%Trailer"))
+      section = PS_DSC_TRAILER;
+
+    // The prolog of a later chunk only gets sent if it differs from the
+    // one of the first chunk
+    if (!first && section > PS_DSC_PROLOG && prologfp)
+    {
+      fclose(prologfp);
+      prologfp = NULL;
+      if (prolog_size != par->prolog_size ||
+	  memcmp(prolog, par->prolog, prolog_size))
+	for (ptr = prolog; ptr < prolog + prolog_size; ptr = next)
+	{
+	  if ((next = memchr(ptr, '\n', prolog + prolog_size - ptr)) == NULL)
+	    next = prolog + prolog_size;
+	  else
+	    next ++;
+	  if (ptr[0] != '%' || ptr[1] != '%')
+	    fwrite(ptr, 1, next - ptr, setupfp);
+	}
+    }
+
+    switch (section)
+    {
+      case PS_DSC_HEADER :
+	  if (!first)
+	    break;
+	  if (ps_dsc_keyword(line, len, "%%Pages:"))
+	    fprintf(outputfp, "%%%%Pages: %d\n", par->num_pages);
+	  else
+	    fwrite(line, 1, len, outputfp);
+	  break;
+
+      case PS_DSC_PROLOG :
+	  fwrite(line, 1, len, prologfp);
+	  if (first)
+	    fwrite(line, 1, len, outputfp);
+	  if (depth == 0 && ps_dsc_keyword(line, len, "%%EndProlog"))
+	    section = PS_DSC_SETUP;
+	  break;
+
+      case PS_DSC_SETUP :
+	  if (first)
+	    fwrite(line, 1, len, outputfp);
+	  else if (!dsc)
+	    fwrite(line, 1, len, setupfp);
+	  break;
+
+      case PS_DSC_PAGES :
+	  if (depth == 0 && ps_dsc_keyword(line, len, "%%Page:"))
+	  {
+	    par->page ++;
+	    fprintf(outputfp, "%%%%Page: %d %d\n", par->page, par->page);
+	    if (setupfp)
+	    {
+	      fclose(setupfp);
+	      setupfp    = NULL;
+	      page_setup = true;
+	    }
+	  }
+	  else if (page_setup && ps_dsc_keyword(line, len,
+						"%%BeginPageSetup"))
+	  {
+	    // The setup code goes first into the page's own page setup
+	    fwrite(line, 1, len, outputfp);
+	    fwrite(par->trailer, 1, par->trailer_size, outputfp);
+	    fwrite(setup, 1, setup_size, outputfp);
+	    page_setup = false;
+	  }
+	  else if (page_setup && !dsc)
+	  {
+	    // The page has no page setup, the setup code gets one
+	    fputs("%%BeginPageSetup\n", outputfp);
+	    fwrite(par->trailer, 1, par->trailer_size, outputfp);
+	    fwrite(setup, 1, setup_size, outputfp);
+	    fputs("%%EndPageSetup\n", outputfp);
+	    fwrite(line, 1, len, outputfp);
+	    page_setup = false;
+	  }
+	  else
+	    fwrite(line, 1, len, outputfp);
+	  break;
+
+      case PS_DSC_TRAILER :
+	  if (last && ps_dsc_keyword(line, len, "%%Pages:"))
+	    fprintf(outputfp, "%%%%Pages: %d\n", par->page);
+	  else if (last)
+	    fwrite(line, 1, len, outputfp);
+	  else if (!dsc)
+	    fwrite(line, 1, len, trailerfp);
+	  break;
+    }
+  }
+
+  if (ferror(fp) || ferror(outputfp) || page_setup || setupfp)
+    ret = false;
+
+ done:
+
+  if (prologfp)
+    fclose(prologfp);
+  if (setupfp)
+    fclose(setupfp);
+  if (first)
+  {
+    // Keep the prolog of the first chunk for comparing
+    par->prolog      = prolog;
+    par->prolog_size = prolog_size;
+  }
+  else
+    free(prolog);
+  free(setup);
+
+  // The trailer code of this chunk goes with the setup code of the next
+  // one
+  free(par->trailer);
+  par->trailer      = NULL;
+  par->trailer_size = 0;
+  if (trailerfp)
+  {
+    fclose(trailerfp);
+    if (ret)
+    {
+      par->trailer      = trailer;
+      par->trailer_size = trailer_size;
+    }
+    else
+      free(trailer);
+  }
+  free(line);
+
+  return (ret);
+}
+
+
+//
+// 'ps_pdf_worker()' - Worker thread of ps_pdf_parallel_filter_function(),
+//                     cuts chunks of pages out of the PDF file with qpdf
+//                     and converts them with pdftops(). pdftops() forks
+//                     the renderer and reaps it with wait calls, which
+//                     would race with the other workers and with the
+//                     other jobs, so each chunk gets converted in its
+//                     own process.
+//
+
+static void *				// O - Thread exit status (unused)
+ps_pdf_worker(void *data)		// I - Parallel conversion
+{
+  ps_pdf_parallel_t *par = (ps_pdf_parallel_t *)data;
+					// Parallel conversion
+  pappl_job_t	*job = (pappl_job_t *)par->data.logdata;
+					// Job
+  ps_pdf_chunk_t *chunk;		// Current chunk
+  filter_data_t	chunk_data;		// Job data for pdftops()
+  char		pdfname[1024],		// Chunk cut out of the PDF
+		range[64];		// Pages of chunk
+  int		fd,			// Temporary file
+		infd,			// Input for pdftops()
+		wstatus,		// Status of sub-process
+		status;			// Exit status
+  pid_t		pid,			// Sub-process running pdftops()
+		wpid;			// Sub-process which exited
+  const char	*args[] =		// qpdf command line
+  {
+    "qpdf",
+    "--empty",
+    "--pages",
+    par->filename,
+    range,
+    "--",
+    pdfname,
+    NULL
+  };
+
+
+  for (;;)
+  {
+    pthread_mutex_lock(&par->mutex);
+    if (par->canceled || par->next_chunk >= par->num_chunks)
+    {
+      pthread_mutex_unlock(&par->mutex);
+      break;
+    }
+    chunk = par->chunks + par->next_chunk ++;
+    pthread_mutex_unlock(&par->mutex);
+
+    // Cut the pages out of the PDF file, qpdf exits with 3 on warnings.
+    // Chunks of a canceled job fail, so that the stitching stops.
+    status = 1;
+    snprintf(range, sizeof(range), "%d-%d", chunk->first, chunk->last);
+    if (par->data.iscanceledfunc &&
+	(par->data.iscanceledfunc)(par->data.iscanceleddata))
+      ;
+    else if ((fd = cupsTempFd(pdfname, sizeof(pdfname))) >= 0)
+    {
+      close(fd);
+      if (((status = ps_run_qpdf(job, args, NULL, 0)) == 0 || status == 3) &&
+	  (infd = open(pdfname, O_RDONLY | O_CLOEXEC)) >= 0)
+      {
+	// pdftops() closes input and output when done
+	if ((fd = cupsTempFd(chunk->filename, sizeof(chunk->filename))) >= 0)
+	{
+	  if ((pid = fork()) == 0)
+	  {
+	    chunk_data = par->data;
+	    _exit(pdftops(infd, fd, 1, &chunk_data, par->parameters));
+	  }
+	  close(infd);
+	  close(fd);
+	  status = 1;
+	  if (pid > 0)
+	  {
+	    while ((wpid = waitpid(pid, &wstatus, 0)) < 0 && errno == EINTR);
+	    if (wpid == pid && WIFEXITED(wstatus))
+	      status = WEXITSTATUS(wstatus);
+	  }
+	}
+	else
+	{
+	  close(infd);
+	  status = 1;
+	}
+      }
+      else
+	status = 1;
+      unlink(pdfname);
+    }
+
+    pthread_mutex_lock(&par->mutex);
+    chunk->status = status ? 1 : 0;
+    if (status)
+      par->canceled = true;
+    pthread_cond_broadcast(&par->cond);
+    pthread_mutex_unlock(&par->mutex);
+  }
+
+  return (NULL);
+}
+
+
+//
+// 'ps_pixels_are_neutral()' - Check whether 8-bit RGB or CMYK pixels have
+//                             no color, R = G = B or C = M = Y = 0, so
+//                             that they are exactly represented in
+//                             DeviceGray.
+//
+//                             For RGB each byte which is not the blue
+//                             value of a pixel has to equal the following
+//                             byte. With SIMD 16 pixels (48 bytes) get
+//                             checked at once, XOR-ing each vector with
+//                             the one starting one byte later and masking
+//                             out the blue bytes, as the period of 3 does
+//                             not fit the vectors there is a mask for each
+//                             of the 3 vectors. For CMYK the C, M, and Y
+//                             bytes are OR-ed up.
+//
+
+static bool				// O - `true` if without color
+ps_pixels_are_neutral(
+    const unsigned char *data,		// I - Pixels
+    size_t              num_pixels,	// I - Number of pixels
+    int                 colors)		// I - Colors per pixel, 3 or 4
+{
+  static const unsigned char masks[48] =// Masks for 48 bytes of RGB and
+  {					// (first 16) CMYK
+    0xff, 0xff, 0x00, 0xff, 0xff, 0x00, 0xff, 0xff,
+    0x00, 0xff, 0xff, 0x00, 0xff, 0xff, 0x00, 0xff,
+    0xff, 0x00, 0xff, 0xff, 0x00, 0xff, 0xff, 0x00,
+    0xff, 0xff, 0x00, 0xff, 0xff, 0x00, 0xff, 0xff,
+    0x00, 0xff, 0xff, 0x00, 0xff, 0xff, 0x00, 0xff,
+    0xff, 0x00, 0xff, 0xff, 0x00, 0xff, 0xff, 0x00
+  };
+  static const unsigned char cmyk_mask[16] =
+  {
+    0xff, 0xff, 0xff, 0x00, 0xff, 0xff, 0xff, 0x00,
+    0xff, 0xff, 0xff, 0x00, 0xff, 0xff, 0xff, 0x00
+  };
+  size_t	i = 0,			// Current pixel
+		bytes = num_pixels * colors;
+					// Bytes of pixel data
+  const unsigned char *p;		// Current position
+
+
+#if defined(PS_SIMD_X86) && defined(__SSE2__)
+  const __m128i	zero = _mm_setzero_si128();
+  __m128i	acc;			// Accumulated differences
+
+  if (colors == 3)
+  {
+    const __m128i m0 = _mm_loadu_si128((const __m128i *)masks),
+		  m1 = _mm_loadu_si128((const __m128i *)(masks + 16)),
+		  m2 = _mm_loadu_si128((const __m128i *)(masks + 32));
+
+    for (; (i + 16) * 3 + 1 <= bytes; i += 16)
+    {
+      p   = data + 3 * i;
+      acc = _mm_and_si128(m0,
+			  _mm_xor_si128(_mm_loadu_si128((const __m128i *)p),
+					_mm_loadu_si128((const __m128i *)
+							(p + 1))));
+      acc = _mm_or_si128(acc,
+			 _mm_and_si128(m1,
+				       _mm_xor_si128(
+					 _mm_loadu_si128((const __m128i *)
+							 (p + 16)),
+					 _mm_loadu_si128((const __m128i *)
+							 (p + 17)))));
+      acc = _mm_or_si128(acc,
+			 _mm_and_si128(m2,
+				       _mm_xor_si128(
+					 _mm_loadu_si128((const __m128i *)
+							 (p + 32)),
+					 _mm_loadu_si128((const __m128i *)
+							 (p + 33)))));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+	return (false);
+    }
+  }
+  else
+  {
+    const __m128i m = _mm_loadu_si128((const __m128i *)cmyk_mask);
+
+    for (; (i + 16) * 4 <= bytes; i += 16)
+    {
+      p   = data + 4 * i;
+      acc = _mm_or_si128(
+	      _mm_or_si128(_mm_loadu_si128((const __m128i *)p),
+			   _mm_loadu_si128((const __m128i *)(p + 16))),
+	      _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + 32)),
+			   _mm_loadu_si128((const __m128i *)(p + 48))));
+      acc = _mm_and_si128(acc, m);
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+	return (false);
+    }
+  }
+#elif defined(PS_SIMD_NEON)
+  uint8x16_t	acc;			// Accumulated differences
+
+  if (colors == 3)
+  {
+    const uint8x16_t m0 = vld1q_u8(masks),
+		     m1 = vld1q_u8(masks + 16),
+		     m2 = vld1q_u8(masks + 32);
+
+    for (; (i + 16) * 3 + 1 <= bytes; i += 16)
+    {
+      p   = data + 3 * i;
+      acc = vandq_u8(m0, veorq_u8(vld1q_u8(p), vld1q_u8(p + 1)));
+      acc = vorrq_u8(acc, vandq_u8(m1, veorq_u8(vld1q_u8(p + 16),
+						vld1q_u8(p + 17))));
+      acc = vorrq_u8(acc, vandq_u8(m2, veorq_u8(vld1q_u8(p + 32),
+						vld1q_u8(p + 33))));
+      if (vmaxvq_u8(acc))
+	return (false);
+    }
+  }
+  else
+  {
+    const uint8x16_t m = vld1q_u8(cmyk_mask);
+
+    for (; (i + 16) * 4 <= bytes; i += 16)
+    {
+      p   = data + 4 * i;
+      acc = vorrq_u8(vorrq_u8(vld1q_u8(p), vld1q_u8(p + 16)),
+		     vorrq_u8(vld1q_u8(p + 32), vld1q_u8(p + 48)));
+      if (vmaxvq_u8(vandq_u8(acc, m)))
+	return (false);
+    }
+  }
+#else
+  (void)masks;
+  (void)cmyk_mask;
+  (void)bytes;
+#endif // PS_SIMD_X86 && __SSE2__
+
+  // Remaining pixels
+  if (colors == 3)
+  {
+    for (p = data + 3 * i; i < num_pixels; i ++, p += 3)
+      if (p[0] != p[1] || p[0] != p[2])
+	return (false);
+  }
+  else
+  {
+    for (p = data + 4 * i; i < num_pixels; i ++, p += 4)
+      if (p[0] | p[1] | p[2])
+	return (false);
+  }
+
+  return (true);
+}
+
+
+//
+// 'ps_pixels_to_gray()' - Convert 8-bit RGB or CMYK pixels without color
+//                         into gray (0 = black), in place
+//
+
+static void
+ps_pixels_to_gray(unsigned char *data,	// I - Pixels
+		  size_t        num_pixels,// I - Number of pixels
+		  int           colors)	// I - Colors per pixel, 3 or 4
+{
+  size_t	i;			// Looping var
+
+
+  if (colors == 3)
+  {
+    for (i = 0; i < num_pixels; i ++)
+      data[i] = data[3 * i];
+  }
+  else
+  {
+    for (i = 0; i < num_pixels; i ++)
+      data[i] = 255 - data[4 * i + 3];
+  }
+}
+
+
+//
+// 'ps_png_predict_line()' - Apply a PNG predictor to a raster line, as
+//                           understood by the /FlateDecode filter with
+//                           /Predictor 15. For each line the "Up" or the
+//                           "Paeth" predictor is chosen, whichever gives
+//                           the smaller sum of absolute differences, the
+//                           usual heuristic of PNG encoders.
+//
+
+static void
+ps_png_predict_line(
+    const unsigned char *line,		// I - Raster line
+    const unsigned char *prev,		// I - Previous raster line
+    size_t              bytes,		// I - Bytes per line
+    int                 bpp,		// I - Bytes per pixel (at least 1)
+    unsigned char       *out)		// O - Predicted line, bytes + 1
+{
+  size_t	i;			// Looping var
+  int		a, b, c,		// Left, up, upper left
+		pa, pb, pc;		// Distances for Paeth predictor
+  unsigned char	pred;			// Predicted byte
+  unsigned long	sum_up = 0,		// Cost of "Up" predictor
+		sum_paeth = 0;		// Cost of "Paeth" predictor
+
+
+  // Estimate the cost of both predictors
+  for (i = 0; i < bytes; i ++)
+  {
+    a = i >= (size_t)bpp ? line[i - bpp] : 0;
+    b = prev[i];
+    c = i >= (size_t)bpp ? prev[i - bpp] : 0;
+    pa = abs(b - c);
+    pb = abs(a - c);
+    pc = abs(a + b - 2 * c);
+    pred = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+
+    sum_up    += abs((signed char)(line[i] - b));
+    sum_paeth += abs((signed char)(line[i] - pred));
+  }
+
+  if (sum_up <= sum_paeth)
+  {
+    // PNG filter type 2: Up
+    out[0] = 2;
+    for (i = 0; i < bytes; i ++)
+      out[i + 1] = line[i] - prev[i];
+  }
+  else
+  {
+    // PNG filter type 4: Paeth
+    out[0] = 4;
+    for (i = 0; i < bytes; i ++)
+    {
+      a = i >= (size_t)bpp ? line[i - bpp] : 0;
+      b = prev[i];
+      c = i >= (size_t)bpp ? prev[i - bpp] : 0;
+      pa = abs(b - c);
+      pb = abs(a - c);
+      pc = abs(a + b - 2 * c);
+      pred = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+      out[i + 1] = line[i] - pred;
+    }
+  }
+}
+
+
+//
+// 'ps_print_filter_function()' - Print file.
+//                                This function has the format of a filter
+//                                function of libcupsfilters, so we can chain
+//                                it with other filter functions using the
+//                                special filter function filterChain() and
+//                                so we do not need to care with forking. As
+//                                we send off the data to the device instead
+//                                of filtering, it behaves more like a
+//                                backend than a filter, and sends nothing
+//                                to its output FD. Therefore it must always
+//                                be in the end of a chain.
+//                                This function does not do any filtering or
+//                                conversion, this has to be done by filters
+//                                applied to the data before.
+//
+
+int                                           // O - Error status
+ps_print_filter_function(int inputfd,         // I - File descriptor input 
+			                      //     stream
+			 int outputfd,        // I - File descriptor output
+			                      //     stream (unused)
+			 int inputseekable,   // I - Is input stream
+			                      //     seekable? (unused)
+			 filter_data_t *data, // I - Job and printer data
+			 void *parameters)    // I - PAPPL output device
+{
+  ssize_t	       bytes;	              // Bytes read/written
+  char	               buffer[65536];         // Read/write buffer
+  pappl_device_t       *device = (pappl_device_t *)parameters;
+                                              // PAPPL output device
+  filter_logfunc_t     log = data->logfunc;   // Log function
+  void                 *ld = data->logdata;   // log function data
+  int                  devfd;                 // Device FD for zero-copy
+                                              // output, -1 if none
+  struct stat          st;                    // Information about input
+  struct pollfd        pfd;                   // Waiting for the device
+  unsigned long        zero_copy = 0,         // Bytes sent zero-copy
+                       copied = 0;            // Bytes sent via buffer
+  ps_page_scan_t       scan;                  // Search for the end of the
+                                              // first page
+  bool                 scanned = false;       // First page found or not
+                                              // PostScript?
+#ifdef HAVE_LIBURING
+  int                  status;                // Status of io_uring output
+#endif // HAVE_LIBURING
+
+  (void)inputseekable;
+
+  // Device FD of socket:// and file:// devices. The log data is the job,
+  // see ps_create_job_data().
+  devfd = ps_device_fd(device, (pappl_job_t *)ld);
+
+  // Copy the first page, searching for its end for the time to first
+  // page, the rest goes zero-copy where possible. Other data than
+  // PostScript counts as a whole.
+  memset(&scan, 0, sizeof(scan));
+  while (!scanned && (bytes = read(inputfd, buffer, sizeof(buffer))) > 0)
+  {
+    scanned = ps_page_scan(&scan, buffer, (size_t)bytes);
+    if (papplDeviceWrite(device, buffer, (size_t)bytes) < 0)
+    {
+      if (log)
+	log(ld, FILTER_LOGLEVEL_ERROR,
+	    "Output to device: Unable to send %d bytes to printer.\n",
+	    (int)bytes);
+      close(inputfd);
+      close(outputfd);
+      return (1);
+    }
+    copied += bytes;
+  }
+  if (scan.pages > 1)
+  {
+    papplDeviceFlush(device);
+    ps_job_first_page((pappl_job_t *)ld);
+  }
+  if (!scanned)
+    goto done;
+
+  // Zero-copy output to socket:// and file:// devices, with splice() from
+  // a pipe or sendfile() from a spooled file
+  if (devfd >= 0 &&
+      !fstat(inputfd, &st) && (S_ISFIFO(st.st_mode) || S_ISREG(st.st_mode)))
+  {
+    // Nothing may be left in PAPPL's output buffer
+    papplDeviceFlush(device);
+    for (;;)
+    {
+      if (S_ISFIFO(st.st_mode))
+	bytes = splice(inputfd, NULL, devfd, NULL, PS_SPLICE_SIZE,
+		       SPLICE_F_MOVE | SPLICE_F_MORE);
+      else
+	bytes = sendfile(devfd, inputfd, NULL, PS_SPLICE_SIZE);
+      if (bytes > 0)
+	zero_copy += bytes;
+      else if (bytes == 0)
+	goto done;
+      else if (errno == EAGAIN)
+      {
+	pfd.fd     = devfd;
+	pfd.events = POLLOUT;
+	poll(&pfd, 1, 1000);
+      }
+      else if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)
+	// Not supported for these FDs, nothing got consumed, copy the rest
+	break;
+      else if (errno != EINTR)
+      {
+	if (log)
+	  log(ld, FILTER_LOGLEVEL_ERROR,
+	      "Output to device: Unable to send data to printer: %s\n",
+	      strerror(errno));
+	close(inputfd);
+	close(outputfd);
+	return (1);
+      }
+    }
+  }
+
+#ifdef HAVE_LIBURING
+  // Where zero-copy output is not possible, output with several writes in
+  // flight, so that a stall of the printer does not drain the pipeline,
+  // falls back to the copying below if the kernel does not support it
+  if (devfd >= 0 && !fstat(devfd, &st))
+  {
+    papplDeviceFlush(device);
+    if ((status = ps_uring_send(inputfd, devfd, !S_ISSOCK(st.st_mode),
+				data, &copied)) == 0)
+      goto done;
+    else if (status > 0)
+    {
+      close(inputfd);
+      close(outputfd);
+      return (1);
+    }
+  }
+#endif // HAVE_LIBURING
+
+  //int fd = open("/tmp/printout", O_CREAT | O_WRONLY);
+  while ((bytes = read(inputfd, buffer, sizeof(buffer))) > 0)
+  {
+    //write(fd, buffer, (size_t)bytes);
+    if (papplDeviceWrite(device, buffer, (size_t)bytes) < 0)
+    {
+      if (log)
+	log(ld, FILTER_LOGLEVEL_ERROR,
+	    "Output to device: Unable to send %d bytes to printer.\n",
+	    (int)bytes);
+      close(inputfd);
+      close(outputfd);
+      return (1);
+    }
+    copied += bytes;
+  }
+
+ done:
+  papplDeviceFlush(device);
+  ps_job_first_page((pappl_job_t *)ld);
+  if (log)
+    log(ld, FILTER_LOGLEVEL_INFO,
+	"Output to device: %lu bytes sent zero-copy, %lu bytes copied\n",
+	zero_copy, copied);
+  //close(fd);
+  close(inputfd);
+  close(outputfd);
+  return (0);
+}
+
+
+//
+// 'ps_poll_device_option_defaults()' - This function uses query PostScript
+//                                      code from the PPD file to poll
+//                                      default option settings from the
+//                                      printer
+//
+
+static int                      // O - Number of polled default settings
+                                //     0: Error
+ps_poll_device_option_defaults(
+    pappl_printer_t *printer,   // I - Printer to be polled
+    bool installable,           // I - Poll installable accessory configuration?
+    cups_option_t **defaults)   // O - Option list of polled default settings
+{
+  int                    i, j, k;       // Looping variables
+  pappl_pr_driver_data_t driver_data;
+  ps_driver_extension_t  *extension;
+  ppd_file_t             *ppd = NULL;	// PPD file of the printer
+  int                    num_defaults;  // Number of polled default settings
+  pappl_device_t         *device;       // PAPPL output device
+  int		         status = 0;	// Exit status
+  ppd_group_t            *group;
+  ppd_option_t	         *option;	// Current option in PPD
+  ppd_attr_t	         *attr;		// Query command attribute
+  const char	         *valptr;	// Pointer into attribute value
+  char		         buf[1024],	// String buffer
+                         *bufptr;	// Pointer into buffer
+  ssize_t	         bytes;		// Number of bytes read
+
+
+  papplPrinterGetDriverData(printer, &driver_data);
+  extension = (ps_driver_extension_t *)driver_data.extension;
+  ppd = extension->ppd;
+
+  *defaults = NULL;
+  num_defaults = 0;
+
+  //
+  // Open access to printer device...
+  //
+
+  if ((device = papplPrinterOpenDevice(printer)) == NULL)
+  {
+    papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+		    "Cannot access printer: Busy or otherwise not reachable");
+    return (0);
+  }
+
+
+  // Note: We directly output to the printer device without using
+  //       ps_print_filter_function() as the original code
+  //       (commandtops filter of CUPS) only uses printf()/puts() and
+  //       not any PPD-related function of libcups (eq. libppd)
+  //       for the output to the printer
+
+  //
+  // Put the printer in PostScript mode...
+  //
+
+  if (ppd->jcl_begin)
+  {
+    papplDevicePuts(device, ppd->jcl_begin);
+    papplDevicePuts(device, ppd->jcl_ps);
+  }
+
+  papplDevicePuts(device, "%!\n");
+  papplDevicePuts(device, "userdict dup(\\004)cvn{}put (\\004\\004)cvn{}put\n");
+
+  papplDeviceFlush(device);
+
+  //
+  // https://github.com/apple/cups/issues/4028
+  //
+  // As a lot of PPDs contain bad PostScript query code, we need to prevent one
+  // bad query sequence from affecting all auto-configuration.  The following
+  // error handler allows us to log PostScript errors to cupsd.
+  //
+
+  papplDevicePuts(device,
+    "/cups_handleerror {\n"
+    "  $error /newerror false put\n"
+    "  (:PostScript error in \") print cups_query_keyword print (\": ) "
+    "print\n"
+    "  $error /errorname get 128 string cvs print\n"
+    "  (; offending command:) print $error /command get 128 string cvs "
+    "print (\n) print flush\n"
+    "} bind def\n"
+    "errordict /timeout {} put\n"
+    "/cups_query_keyword (?Unknown) def\n");
+  papplDeviceFlush(device);
+
+  //
+  // Loop through every option in the PPD file and ask for the current
+  // value...
+  //
+
+  papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+		  "Reading printer-internal default settings...");
+
+  for (i = ppd->num_groups, group = ppd->groups;
+       i > 0;
+       i --, group ++)
+  {
+
+    // When "installable" is true, We are treating only the
+    // "Installable Options" group of options in the PPD file here
+    // otherwise only the other options
+
+    if (strncasecmp(group->name, "Installable", 11) == 0)
+    {
+      if (!installable)
+	continue;
+    }
+    else if (installable)
+      continue;
+
+    for (j = group->num_options, option = group->options;
+	 j > 0;
+	 j --, option ++)
+    {
+      // Does the option have less than 2 choices? Then it does not make
+      // sense to query its default value
+      if (option->num_choices < 2)
+	continue;
+
+      //
+      // See if we have a query command for this option...
+      //
+
+      snprintf(buf, sizeof(buf), "?%s", option->keyword);
+
+      if ((attr = ppdFindAttr(ppd, buf, NULL)) == NULL || !attr->value)
+      {
+	papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+			"Skipping %s option...", option->keyword);
+	continue;
+      }
+
+      //
+      // Send the query code to the printer...
+      //
+
+      papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+		      "Querying %s...", option->keyword);
+
+      for (bufptr = buf, valptr = attr->value; *valptr; valptr ++)
+      {
+	//
+	// Log the query code, breaking at newlines...
+	//
+
+	if (*valptr == '\n')
+	{
+	  *bufptr = '\0';
+	  papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+			  "%s\\n", buf);
+	  bufptr = buf;
+	}
+	else if (*valptr < ' ')
+        {
+	  if (bufptr >= (buf + sizeof(buf) - 4))
+          {
+	    *bufptr = '\0';
+	    papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+			    "%s", buf);
+	    bufptr = buf;
+	  }
+
+	  if (*valptr == '\r')
+          {
+	    *bufptr++ = '\\';
+	    *bufptr++ = 'r';
+	  }
+	  else if (*valptr == '\t')
+          {
+	    *bufptr++ = '\\';
+	    *bufptr++ = 't';
+          }
+	  else
+          {
+	    *bufptr++ = '\\';
+	    *bufptr++ = '0' + ((*valptr / 64) & 7);
+	    *bufptr++ = '0' + ((*valptr / 8) & 7);
+	    *bufptr++ = '0' + (*valptr & 7);
+	  }
+	}
+	else
+        {
+	  if (bufptr >= (buf + sizeof(buf) - 1))
+          {
+	    *bufptr = '\0';
+	    papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+			    "%s", buf);
+	    bufptr = buf;
+	  }
+
+	  *bufptr++ = *valptr;
+	}
+      }
+
+      if (bufptr > buf)
+      {
+	*bufptr = '\0';
+	papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+			"%s", buf);
+      }
+
+      papplDevicePrintf(device, "/cups_query_keyword (?%s) def\n",
+			option->keyword); // Set keyword for error reporting
+      papplDevicePuts(device, "{ (");
+      for (valptr = attr->value; *valptr; valptr ++)
+      {
+	if (*valptr == '(' || *valptr == ')' || *valptr == '\\')
+	  papplDevicePuts(device, "\\");
+	papplDeviceWrite(device, valptr, 1);
+      }
+      papplDevicePuts(device,
+		      ") cvx exec } stopped { cups_handleerror } if clear\n");
+                                          // Send query code
+      papplDeviceFlush(device);
+
+      //
+      // Read the response data...
+      //
+
+      bufptr    = buf;
+      buf[0] = '\0';
+      // If no bytes get read (bytes <= 0), repeat up to 100 times in
+      // 100 msec intervals (10 sec timeout)
+      for (k = 0; k < 100; k ++)
+      {
+	//
+	// Read answer from device ...
+	//
+
+	bytes = papplDeviceRead(device, bufptr,
+				sizeof(buf) - (size_t)(bufptr - buf) - 1);
+
+	//
+	// No bytes of the answer arrived yet? Retry ...
+	//
+
+	if (bytes <= 0)
+        {
+	  papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+			  "Answer not ready yet, retrying in 100 ms.");
+	  usleep(100000);
+	  continue;
+        }
+
+	//
+	// No newline at the end? Go on reading ...
+	//
+
+	bufptr += bytes;
+	*bufptr = '\0';
+
+	if (bytes == 0 ||
+	    (bufptr > buf && bufptr[-1] != '\r' && bufptr[-1] != '\n'))
+	  continue;
+
+	//
+	// Trim whitespace and control characters from both ends...
+	//
+
+	bytes = bufptr - buf;
+
+	for (bufptr --; bufptr >= buf; bufptr --)
+	  if (isspace(*bufptr & 255) || iscntrl(*bufptr & 255))
+	    *bufptr = '\0';
+	  else
+	    break;
+
+	for (bufptr = buf; isspace(*bufptr & 255) || iscntrl(*bufptr & 255);
+	     bufptr ++);
+
+	if (bufptr > buf)
+        {
+	  memmove(buf, bufptr, strlen(bufptr) + 1);
+	  bufptr = buf;
+	}
+
+	papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+			"Got %d bytes.", (int)bytes);
+
+	//
+	// Skip blank lines...
+	//
+
+	if (!buf[0])
+	  continue;
+
+	//
+	// Check the response...
+	//
+
+	if ((bufptr = strchr(buf, ':')) != NULL)
+        {
+	  //
+	  // PostScript code for this option in the PPD is broken; show the
+	  // interpreter's error message that came back...
+	  //
+
+	  papplLogPrinter(printer, PAPPL_LOGLEVEL_WARN,
+			  "%s", bufptr + 1);
+	  status = 1;
+	  break;
+	}
+
+	//
+	// Verify the result is a valid option choice...
+	//
+
+	if (!ppdFindChoice(option, buf))
+        {
+	  if (!strcasecmp(buf, "Unknown"))
+	  {
+	    papplLogPrinter(printer, PAPPL_LOGLEVEL_WARN,
+			    "Unknown default setting for option \"%s\"",
+			    option->keyword);
+	    status = 1;
+	    break;
+	  }
+
+	  bufptr    = buf;
+	  buf[0] = '\0';
+	  continue;
+	}
+
+        //
+        // Write out the result and move on to the next option...
+	//
+
+	papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+			"Read default setting for \"%s\": \"%s\"",
+			option->keyword, buf);
+	num_defaults = cupsAddOption(option->keyword, buf, num_defaults,
+				     defaults);
+	break;
+      }
+
+      //
+      // Printer did not answer this option's query
+      //
+
+      if (bytes <= 0)
+      {
+	papplLogPrinter(printer, PAPPL_LOGLEVEL_WARN,
+			"No answer to query for option %s within 10 sec "
+			"timeout.", option->keyword);
+	status = 1;
+      }
+    }
+  }
+
+  //
+  // Finish the job...
+  //
+
+  papplDeviceFlush(device);
+  if (ppd->jcl_end)
+    papplDevicePuts(device, ppd->jcl_end);
+  else
+    papplDevicePuts(device, "\004");
+  papplDeviceFlush(device);
+
+  //
+  // Close connection to the printer device...
+  //
+
+  papplPrinterCloseDevice(printer);
+
+  //
+  // Return...
+  //
+
+  if (status)
+    papplLogPrinter(printer, PAPPL_LOGLEVEL_WARN,
+		    "Unable to configure some printer options.");
+
+  return (num_defaults);
+}
+
+
+//
+// 'ps_printer_update_for_installable_options() - Update printer's driver
+//                                                data and driver IPP
+//                                                attributes for changes
+//                                                in the "Installable Options"
+//                                                settings.
+//
+
+static void
+ps_printer_update_for_installable_options(
+    pappl_printer_t *printer,           // I - Printer
+    pappl_pr_driver_data_t driver_data, // I - Driver data
+    const char *instoptstr)             // I - Installable options in a string 
+                                        //     of key=value pairs or NULL for
+                                        //     keeping current settings
+{
+  int                    i;
+  pappl_system_t         *system;       // System
+  ipp_t                  *driver_attrs,
+                         *vendor_attrs;
+  ipp_attribute_t        *attr;
+  char                   buf[1024];
+
+
+  // Get system...
+  system = papplPrinterGetSystem(printer);
+
+  papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+		  "Updating printer's driver data and attributes to the \"Installable Options\" settings.");
+  if (instoptstr)
+    papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+		    "New \"Installable Options\" settings: %s", instoptstr);
+
+  // Get a copy of the driver IPP attributes to save the vendor option settings
+  driver_attrs = papplPrinterGetDriverAttributes(printer);
+  if ((attr = ippFindAttribute(driver_attrs, "installable-options-default",
+			       IPP_TAG_ZERO)) != NULL &&
+      ippAttributeString(attr, buf, sizeof(buf)) > 0)
+  {
+    papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+		    "Previous installable accessories settings: %s", buf);
+    if (!instoptstr)
+      instoptstr = buf;
+  }
+  else
+    papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+		    "Installable Options settings not found");
+
+  // If we have new installable options settings update them in driver_attrs
+  if (instoptstr != buf)
+  {
+    if ((attr = ippFindAttribute(driver_attrs, "installable-options-default",
+				 IPP_TAG_ZERO)) != NULL)
+      ippDeleteAttribute(driver_attrs, attr);
+    ippAddString(driver_attrs, IPP_TAG_PRINTER, IPP_TAG_TEXT,
+		 "installable-options-default", NULL, instoptstr);
+  }
+
+  // Update the driver data to correspond with the printer hardware
+  // accessory configuration ("Installable Options" in the PPD)
+  ps_driver_setup(system, NULL, NULL, NULL, &driver_data, &driver_attrs,
+		  NULL);
+
+  // The PPD options of jobs depend on the accessory configuration, forget
+  // the ones of earlier jobs
+  ps_option_memo_clear((ps_driver_extension_t *)driver_data.extension);
+
+  // Data structure for vendor options IPP attributes
+  vendor_attrs = ippNew();
+
+  // Copy the vendor option IPP attributes
+  for (i = 0; i < driver_data.num_vendor; i ++)
+  {
+    snprintf(buf, sizeof(buf), "%s-default", driver_data.vendor[i]);
+    attr = ippFindAttribute(driver_attrs, buf, IPP_TAG_ZERO);
+    if (attr)
+      ippCopyAttribute(vendor_attrs, attr, 0);
+    else
+      papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+		      "Default setting for vendor option \"%s\" not found",
+		      driver_data.vendor[i]);
+    if (!strcmp(driver_data.vendor[i], "installable-options"))
+      continue;
+    snprintf(buf, sizeof(buf), "%s-supported", driver_data.vendor[i]);
+    attr = ippFindAttribute(driver_attrs, buf, IPP_TAG_ZERO);
+    if (attr)
+      ippCopyAttribute(vendor_attrs, attr, 0);
+    else
+      papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+		      "Supported choices for vendor option \"%s\" not found",
+		      driver_data.vendor[i]);
+  }
+
+  // Save the updated driver data back to the printer
+  papplPrinterSetDriverData(printer, &driver_data, vendor_attrs);
+
+  // Clean up
+  ippDelete(driver_attrs);
+  ippDelete(vendor_attrs);
+}
+
+
+//
+// 'ps_printer_web_device_config()' - Web interface page for entering/polling
+//                                    the configuration of printer add-ons
+//                                    ("Installable Options" in PPD and polling
+//                                    default option settings
+//
+
+static void
+ps_printer_web_device_config(
+    pappl_client_t  *client,		// I - Client
+    pappl_printer_t *printer)		// I - Printer
+{
+  int          i, j, k;                 // Looping variables
+  const char   *status = NULL;		// Status text, if any
+  const char   *uri = NULL;             // Client URI
+  pappl_system_t *system;               // System
+  pappl_pr_driver_data_t driver_data;
+  ipp_t        *driver_attrs;
+  ps_driver_extension_t *extension;
+  ppd_file_t   *ppd = NULL;		// PPD file of the printer
+  ppd_cache_t  *pc;
+  char         *keyword;
+  ppd_group_t  *group;
+  ppd_option_t *option;
+  ppd_choice_t *choice;
+  ppd_attr_t   *ppd_attr;
+  int          default_choice;
+  int          num_options = 0;         // Number of polled options
+  cups_option_t	*options = NULL;        // Polled options
+  cups_option_t *opt;
+  bool         polled_installables = false,
+               polled_defaults = false;
+
+
+  if (!papplClientHTMLAuthorize(client))
+    return;
+
+  system = papplPrinterGetSystem(printer);
+  papplPrinterGetDriverData(printer, &driver_data);
+  driver_attrs = papplPrinterGetDriverAttributes(printer);
+  extension = (ps_driver_extension_t *)driver_data.extension;
+  ppd = extension->ppd;
+  pc = ppd->cache;
+
+  // Handle POSTs to set "Installable Options" and poll default settings...
+  if (papplClientGetMethod(client) == HTTP_STATE_POST)
+  {
+    int			num_form = 0;	// Number of form variables
+    cups_option_t	*form = NULL;	// Form variables
+    int                 num_installables = 0; // Number of installable options 
+    cups_option_t	*installables = NULL; // Set installable options
+    int                 num_vendor = 0; // Number of vendor-specific options 
+    cups_option_t	*vendor = NULL; // vendor-specific options
+    ipp_attribute_t     *attr;
+    const char		*action;	// Form action
+    char                buf[1024];
+    const char          *value;
+    char                *ptr1, *ptr2;
+    pwg_map_t           *pwg_map;
+    pwg_size_t          *pwg_size;
+    int                 polled_def_source = -1;
+    const char          *polled_def_size = NULL,
+                        *polled_def_type = NULL;
+    int                 best = 0;
+    char                ipp_supported[128],
+                        ipp_choice[80];
+
+    if ((num_form = papplClientGetForm(client, &form)) == 0)
+    {
+      status = "Invalid form data.";
+    }
+    else if (!papplClientIsValidForm(client, num_form, form))
+    {
+      status = "Invalid form submission.";
+    }
+    else if ((action = cupsGetOption("action", num_form, form)) == NULL)
+    {
+      status = "Missing action.";
+    }
+    else if (!strcmp(action, "set-installable"))
+    {
+      status = "Installable accessory configuration saved.";
+      buf[0] = '\0';
+      for (i = num_form, opt = form; i > 0;
+	   i --, opt ++)
+	if (opt->name[0] == '\t')
+	{
+	  if (opt->name[1] == '\t')
+	  {
+	    ptr1 = strdup(opt->name + 2);
+	    ptr2 = strchr(ptr1, '\t');
+	    *ptr2 = '\0';
+	    ptr2 ++;
+	    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf) - 1,
+		     " %s=%s", ptr1, ptr2);
+	    num_installables = cupsAddOption(ptr1, ptr2,
+					     num_installables, &installables);
+	    free(ptr1);
+	  }
+	  else
+	  {
+	    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf) - 1,
+		     " %s=%s", opt->name + 1, opt->value);
+	    num_installables = cupsAddOption(opt->name + 1, opt->value,
+					     num_installables, &installables);
+	  }
+	}
+      papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+		      "\"Installable Options\" from web form:%s", buf);
+
+      buf[0] = '\0';
+      for (i = ppd->num_groups, group = ppd->groups;
+	   i > 0;
+	   i --, group ++)
+      {
+
+	// We are treating only the "Installable Options" group of options
+	// in the PPD file here
+
+	if (strncasecmp(group->name, "Installable", 11) != 0)
+	  continue;
+
+	for (j = group->num_options, option = group->options;
+	     j > 0;
+	     j --, option ++)
+        {
+	  // Does the option have less than 2 choices? Then it does not make
+	  // sense to let it show in the web interface
+	  if (option->num_choices < 2)
+	    continue;
+
+	  if ((value = cupsGetOption(option->keyword,
+				     num_installables, installables)) == NULL)
+	  {
+	    // Unchecked check box option
+	    if (!strcasecmp(option->choices[0].text, "false"))
+	      value = option->choices[0].choice;
+	    else if (!strcasecmp(option->choices[1].text, "false"))
+	      value = option->choices[1].choice;
+	  }
+	  ppdMarkOption(ppd, option->keyword, value);
+	  snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf) - 1,
+		   "%s=%s ", option->keyword, value);
+	}
+	if (buf[0])
+	  buf[strlen(buf) - 1] = '\0';
+      }
+      cupsFreeOptions(num_installables, installables);
+
+      // Update the driver data to only show options and choices which make
+      // sense with the current installable accessory configuration
+      papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+		      "\"Installable Options\" marked in PPD: %s", buf);
+      ps_printer_update_for_installable_options(printer, driver_data, buf);
+
+      // Save the changes
+      papplSystemSaveState(system, state_file);
+    }
+    else if (!strcmp(action, "poll-installable"))
+    {
+      // Poll installed options info
+      num_options = ps_poll_device_option_defaults(printer, true, &options);
+      if (num_options)
+      {
+	status = "Installable accessory configuration polled from printer.";
+	polled_installables = true;
+
+	// Get current settings of the "Installable Options"
+	num_installables = 0;
+	installables = NULL;
+	if ((attr = ippFindAttribute(driver_attrs,
+				     "installable-options-default",
+				     IPP_TAG_ZERO)) != NULL)
+	{
+	  if (ippAttributeString(attr, buf, sizeof(buf)) > 0)
+	  {
+	    num_installables = cupsParseOptions(buf, 0, &installables);
+	    ppdMarkOptions(ppd, num_installables, installables);
+	  }
+	  ippDeleteAttribute(driver_attrs, attr);
+	}
+
+	// Join polled settings and mark them in the PPD
+	for (i = num_options, opt = options; i > 0; i --, opt ++)
+        {
+	  ppdMarkOption(ppd, opt->name, opt->value);
+	  num_installables = cupsAddOption(opt->name, opt->value,
+					   num_installables, &installables);
+        }
+
+	// Create new option string for saving in the state file
+	buf[0] = '\0';
+	for (i = num_installables, opt = installables; i > 0; i --, opt ++)
+	  snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf) - 1,
+		   "%s=%s ", opt->name, opt->value);
+        if (buf[0])
+	  buf[strlen(buf) - 1] = '\0';
+
+	// Clean up
+	cupsFreeOptions(num_installables, installables);
+
+	// Update the driver data to only show options and choices which make
+	// sense with the current installable accessory configuration
+	papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+			"\"Installable Options\" marked in PPD: %s", buf);
+	ps_printer_update_for_installable_options(printer, driver_data, buf);
+
+	// Save the changes
+	papplSystemSaveState(system, state_file);
+      }
+      else
+	status = "Could not poll installable accessory configuration from "
+	         "printer.";
+    }
+    else if (!strcmp(action, "poll-defaults"))
+    {
+      // Poll default option values
+      num_options = ps_poll_device_option_defaults(printer, false,
+						   &options);
+      if (num_options)
+      {
+	// Read the polled option settings, mark them in the PPD, update them
+	// in the printer data and create a summary for logging
+	status = "Option defaults polled from printer.";
+	polled_defaults = true;
+
+	snprintf(buf, sizeof(buf) - 1, "Option defaults polled from printer:");
+	for (i = num_options, opt = options; i > 0; i --, opt ++)
+	{
+	  ppdMarkOption(ppd, opt->name, opt->value);
+	  snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf) - 1,
+		   " %s=%s", opt->name, opt->value);
+	  if (!strcasecmp(opt->name, "PageSize"))
+	  {
+	    for (j = 0, pwg_size = pc->sizes; j < pc->num_sizes;
+		 j ++, pwg_size ++)
+	      if (!strcasecmp(opt->value, pwg_size->map.ppd))
+		break;
+	    if (j < pc->num_sizes)
+	    {
+	      for (k = 0; k < driver_data.num_media; k ++)
+		if (!strcasecmp(pwg_size->map.pwg, driver_data.media[k]))
+		  break;
+	      if (k < driver_data.num_media)
+		polled_def_size = driver_data.media[k];
+	    }
+	  }
+	  else if (!strcasecmp(opt->name, pc->source_option)) // InputSlot
+	  {
+	    for (j = 0, pwg_map = pc->sources; j < pc->num_sources;
+		 j ++, pwg_map ++)
+	      if (!strcasecmp(opt->value, pwg_map->ppd))
+		break;
+	    if (j < pc->num_sources)
+	    {
+	      for (k = 0; k < driver_data.num_source; k ++)
+		if (!strcasecmp(pwg_map->pwg, driver_data.source[k]))
+		  break;
+	      if (k < driver_data.num_source)
+		polled_def_source = k;
+	    }
+	  }
+	  else if (!strcasecmp(opt->name, "MediaType"))
+	  {
+	    for (j = 0, pwg_map = pc->types; j < pc->num_types;
+		 j ++, pwg_map ++)
+	      if (!strcasecmp(opt->value, pwg_map->ppd))
+		break;
+	    if (j < pc->num_types)
+	    {
+	      for (k = 0; k < driver_data.num_type; k ++)
+		if (!strcasecmp(pwg_map->pwg, driver_data.type[k]))
+		  break;
+	      if (k < driver_data.num_type)
+		polled_def_type = driver_data.type[k];
+	    }
+	  }
+	  else if (!strcasecmp(opt->name, "Resolution"))
+	  {
+	    if (sscanf(opt->value, "%dx%ddpi",
+		       &driver_data.x_default, &driver_data.y_default) == 1)
+	      driver_data.y_default = driver_data.x_default;
+	  }
+	  else if (!strcasecmp(opt->name, "ColorModel"))
+	  {
+	    if (ppd->color_device)
+	    {
+	      if (strcasestr(opt->value, "Gray") ||
+		  strcasestr(opt->value, "Mono") ||
+		  strcasestr(opt->value, "Black"))
+		driver_data.color_default = PAPPL_COLOR_MODE_MONOCHROME;
+	      else if (strcasestr(opt->value, "Color") ||
+		       strcasestr(opt->value, "RGB") ||
+		       strcasestr(opt->value, "CMY"))
+		driver_data.color_default = PAPPL_COLOR_MODE_COLOR;
+	      else
+		driver_data.color_default = PAPPL_COLOR_MODE_AUTO;
+	    }
+	  }
+	  else if (!strcasecmp(opt->name, "OutputBin"))
+	  {
+	    for (j = 0, pwg_map = pc->bins; j < pc->num_bins; j ++, pwg_map ++)
+	      if (!strcasecmp(opt->value, pwg_map->ppd))
+		break;
+	    if (j < pc->num_bins)
+	    {
+	      for (k = 0; k < driver_data.num_bin; k ++)
+		if (!strcasecmp(pwg_map->pwg, driver_data.bin[k]))
+		  break;
+	      if (k < driver_data.num_bin)
+		driver_data.bin_default = k;
+	    }
+	  }
+	  else if (!strcasecmp(opt->name, pc->sides_option)) // Duplex
+	  {
+	    if (!strcasecmp(opt->value, pc->sides_1sided))
+	      driver_data.sides_default = PAPPL_SIDES_ONE_SIDED;
+	    else if (!strcasecmp(opt->value, pc->sides_2sided_long))
+	      driver_data.sides_default = PAPPL_SIDES_TWO_SIDED_LONG_EDGE;
+	    else if (!strcasecmp(opt->value, pc->sides_2sided_short))
+	      driver_data.sides_default = PAPPL_SIDES_TWO_SIDED_SHORT_EDGE;
+	  }
+	  else if (strcasecmp(opt->name, "PageRegion"))
+	  {
+	    // Vendor options
+	    for (j = 0; j < driver_data.num_vendor; j ++)
+	    {
+	      if (extension->vendor_ppd_options[j] &&
+		  !(strcasecmp(opt->name, extension->vendor_ppd_options[j])))
+	      {
+		if ((option = ppdFindOption(ppd, opt->name)) != NULL &&
+		    (choice = ppdFindChoice(option, opt->value)) != NULL)
+		{
+		  snprintf(ipp_supported, sizeof(ipp_supported),
+			   "%s-supported", driver_data.vendor[j]);
+		  if ((attr = ippFindAttribute(driver_attrs, ipp_supported,
+					       IPP_TAG_ZERO)) != NULL)
+		  {
+		    if (ippGetValueTag(attr) == IPP_TAG_BOOLEAN)
+		    {
+		      if (!strcasecmp(choice->text, "True"))
+			num_vendor = cupsAddOption(driver_data.vendor[j],
+						   "true", num_vendor, &vendor);
+		      else if (!strcasecmp(choice->text, "False"))
+			num_vendor = cupsAddOption(driver_data.vendor[j],
+						   "false",
+						   num_vendor, &vendor);
+		    }
+		    else
+		    {
+		      ppdPwgUnppdizeName(choice->text, ipp_choice,
+					 sizeof(ipp_choice), NULL);
+		      num_vendor = cupsAddOption(driver_data.vendor[j],
+						 ipp_choice,
+						 num_vendor, &vendor);
+		    }
+		  }
+		}
+	      }
+	    }
+	  }
+	}
+
+	// Media Source
+	if (polled_def_source < 0)
+	{
+	  if (polled_def_size || polled_def_type)
+	    for (i = 0; i < driver_data.num_source; i ++)
+	    {
+	      j = 0;
+	      if (polled_def_size &&
+		  !strcasecmp(polled_def_size,
+			      driver_data.media_ready[i].size_name))
+		j += 2;
+	      if (polled_def_type &&
+		  !strcasecmp(polled_def_type,
+			      driver_data.media_ready[i].type))
+		j += 1;
+	      if (j > best)
+	      {
+		best = j;
+		driver_data.media_default = driver_data.media_ready[i];
+	      }
+	    }
+	}
+	else
+	  driver_data.media_default =
+	    driver_data.media_ready[polled_def_source];
+
+	papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG, "%s", buf);
+
+	// Submit the changed default values
+	papplPrinterSetDriverDefaults(printer, &driver_data,
+				      num_vendor, vendor);
+
+	// Clean up
+	if (num_vendor)
+	  cupsFreeOptions(num_vendor, vendor);
+      }
+      else
+	status = "Could not poll option defaults from printer.";
+    }
+    else
+      status = "Unknown action.";
+
+    cupsFreeOptions(num_form, form);
+  }
+
+  papplClientHTMLPrinterHeader(client, printer, "Printer Device Settings", 0, NULL, NULL);
+
+  if (status)
+    papplClientHTMLPrintf(client, "          <div class=\"banner\">%s</div>\n", status);
+
+  uri = papplClientGetURI(client);
+
+  if (extension->installable_options)
+  {
+    papplClientHTMLPuts(client,
+			"          <h3>Installable printer accessories</h3>\n");
+    if (polled_installables)
+      papplClientHTMLPuts(client,
+			  "          <br>Settings obtained from polling the printer are marked with an asterisk (\"*\")</br>\n");
+
+    papplClientHTMLStartForm(client, uri, false);
+
+    papplClientHTMLPuts(client,
+			"          <table class=\"form\">\n"
+			"            <tbody>\n");
+
+    for (i = ppd->num_groups, group = ppd->groups;
+	 i > 0;
+	 i --, group ++)
+    {
+
+      // We are treating only the "Installable Options" group of options
+      // in the PPD file here
+
+      if (strncasecmp(group->name, "Installable", 11) != 0)
+	continue;
+
+      for (j = group->num_options, option = group->options;
+	   j > 0;
+	   j --, option ++)
+      {
+	// Does the option have less than 2 choices? Then it does not make
+	// sense to let it show in the web interface
+	if (option->num_choices < 2)
+	  continue;
+
+	papplClientHTMLPrintf(client, "              <tr><th>%s:</th><td>",
+			      option->text);
+
+	if (option->num_choices == 2 &&
+	    ((!strcasecmp(option->choices[0].text, "true") &&
+	      !strcasecmp(option->choices[1].text, "false")) ||
+	     (!strcasecmp(option->choices[0].text, "false") &&
+	      !strcasecmp(option->choices[1].text, "true"))))
+	{
+	  // Create a check box widget, as human-readable choices "true"
+	  // and "false" are not very user-friendly
+	  default_choice = 0;
+	  for (k = 0; k < 2; k ++)
+	    if (!strcasecmp(option->choices[k].text, "true"))
+	    {
+	      if (option->choices[k].marked)
+		default_choice = 1;
+	      // Stop here to make k be the index of the "True" value of this
+	      // option so that we can extract its machine-readable value
+	      break;
+	    }
+	  // We precede the option name with a two tabs to mark it as an
+	  // option represented by a check box, we also add the machine-
+	  // readable choice name for "True" (checked). This way we can treat
+	  // the result correctly, taking into account that nothing for this
+	  // option gets submitted when the box is unchecked.
+	  papplClientHTMLPrintf(client, "<input type=\"checkbox\" name=\"\t\t%s\t%s\"%s>", option->keyword, option->choices[k].choice, default_choice == 1 ? " checked" : "");
+	}
+	else
+	{
+	  // Create a drop-down widget
+	  // We precede the option name with a single tab to tell that this
+	  // option comes from a drop-down. The drop-down choice always gets
+	  // submitted, so the option name in the name field is enough for
+	  // parsing the submitted result.
+	  // The tab in the beginning also assures that the PPD option names
+	  // never conflict with fixed option names of this function, like
+	  // "action" or "session".
+	  papplClientHTMLPrintf(client, "<select name=\"\t%s\">", option->keyword);
+	  default_choice = 0;
+	  for (k = 0; k < option->num_choices; k ++)
+	    papplClientHTMLPrintf(client, "<option value=\"%s\"%s>%s</option>", option->choices[k].choice, option->choices[k].marked ? " selected" : "", option->choices[k].text);
+	  papplClientHTMLPuts(client, "</select>");
+	}
+
+	// Mark options which got updated by polling from the printer with
+	// an asterisk
+	papplClientHTMLPrintf(client, "%s",
+			      (polled_installables &&
+			       cupsGetOption(option->keyword, num_options,
+					     options) != NULL ? " *" : ""));
+
+	papplClientHTMLPuts(client, "</td></tr>\n");
+      }
+    }
+    papplClientHTMLPuts(client,
+			"              <tr><th></th><td><button type=\"submit\" name=\"action\" value=\"set-installable\">Set</button>");
+    if (extension->installable_pollable)
+    {
+      papplClientHTMLStartForm(client, uri, false);
+      papplClientHTMLPrintf(client, "\n          &nbsp;<button type=\"submit\" name=\"action\" value=\"poll-installable\">Poll from printer</button>\n");
+    }
+    papplClientHTMLPuts(client,
+			"</td></tr>\n"
+			"            </tbody>\n"
+			"          </table>\n"
+			"        </form>\n");
+
+  }
+
+  if (extension->installable_options &&
+      extension->defaults_pollable)
+    papplClientHTMLPrintf(client, "          <hr>\n");
+
+  if (extension->defaults_pollable)
+  {
+    papplClientHTMLPuts(client,
+			"          <h3>Poll printing defaults from the printer</h3>\n");
+
+    papplClientHTMLPuts(client,
+			"          <p>Note that settings polled from the printer overwrite your original settings.</p>\n");
+    if (polled_defaults)
+      papplClientHTMLPuts(client,
+			  "          <br>Polling results:</br>\n");
+
+    papplClientHTMLStartForm(client, uri, false);
+    papplClientHTMLPuts(client,
+			"          <table class=\"form\">\n"
+			"            <tbody>\n");
+
+    // If we have already polled and display the page again, show poll
+    // results as options which got updated by polling with their
+    // values (they are in list "options").
+    if (polled_defaults && num_options)
+      for (i = num_options, opt = options; i > 0; i --, opt ++)
+	if ((option = ppdFindOption(ppd, opt->name)) != NULL &&
+	    (choice = ppdFindChoice(option, opt->value)) != NULL)
+	  papplClientHTMLPrintf(client,
+			    "              <tr><th>%s:</th><td>%s</td></tr>\n",
+			    option->text, choice->text);
+
+    papplClientHTMLPrintf(client, "          <tr><th></th><td><input type=\"hidden\" name=\"action\" value=\"poll-defaults\"><input type=\"submit\" value=\"%s\"></td>\n",
+			  (polled_defaults ? "Poll again" : "Poll"));
+
+    papplClientHTMLPuts(client,
+			"            </tbody>\n"
+			"          </table>\n"
+			"        </form>\n");
+  }
+
+  papplClientHTMLPrinterFooter(client);
+
+  // Clean up
+  ippDelete(driver_attrs);
+  if (num_options)
+    cupsFreeOptions(num_options, options);
+}
+
+
+//
+// 'ps_printer_extra_setup()' - Extra code for setting up a printer, for
+//                              example to get extra buttons/pages on the web
+//                              interface for this printer.
+//
+
+static void   ps_printer_extra_setup(pappl_printer_t *printer,
+				     void *data)
+{
+  char                   path[256];     // Path to resource
+  pappl_system_t         *system;	// System
+  pappl_pr_driver_data_t driver_data;
+  ps_driver_extension_t  *extension;
+
+
+  system = papplPrinterGetSystem(printer);
+
+  papplPrinterGetDriverData(printer, &driver_data);
+  extension = (ps_driver_extension_t *)driver_data.extension;
+  if (extension->defaults_pollable ||
+      extension->installable_options)
+  {
+    papplPrinterGetPath(printer, "device", path, sizeof(path));
+    papplSystemAddResourceCallback(system, path, "text/html",
+			     (pappl_resource_cb_t)ps_printer_web_device_config,
+			     printer);
+    papplPrinterAddLink(printer, "Device Settings", path,
+			PAPPL_LOPTIONS_NAVIGATION | PAPPL_LOPTIONS_STATUS);
+  }
+}
+
+
+//
+// 'ps_rendjob()' - End a job.
+//
+
+static bool                     // O - `true` on success, `false` on failure
+ps_rendjob(
+    pappl_job_t      *job,      // I - Job
+    pappl_pr_options_t *options,// I - Options
+    pappl_device_t   *device)   // I - Device
+{
+  ps_job_data_t *job_data;      // PPD data for job
+  FILE *devout;
+  int num_pages;
+  bool ret = true;              // Return value
+
+
+  (void)options;
+  job_data = (ps_job_data_t *)papplJobGetData(job);
+  devout = job_data->device_file;
+
+  num_pages = papplJobGetImpressionsCompleted(job);
+  ps_emit_job_trailer(devout, job_data->ppd, num_pages);
+
+  if (job_data->job_gray_saved > 0)
+    papplLogJob(job, PAPPL_LOGLEVEL_INFO,
+		"Sending areas without color as gray saved %lu bytes of "
+		"raster data", job_data->job_gray_saved);
+
+  //
+  // Clean up
+  //
+
+  if (job_data->writer)
+  {
+    // Sends the rest of the data and stops the writer thread
+    if (fclose(job_data->device_file))
+      ret = false;
+    job_data->writer = NULL;
+  }
+  else
+  {
+    fclose(job_data->device_file);
+    filterPClose(job_data->device_fd, job_data->device_pid,
+		 job_data->filter_data);
+  }
+
+  if (job_data->cups_filter_ps)
+    free(job_data->ppd_filter->parameters);
+  ps_free_job_data(job_data);
+  papplJobSetData(job, NULL);
+
+  return (ret);
+}
+
+
+//
+// 'ps_rendpage()' - End a page.
+//
+
+static bool                     // O - `true` on success, `false` on failure
+ps_rendpage(
+    pappl_job_t      *job,      // I - Job
+    pappl_pr_options_t *options,// I - Job options
+    pappl_device_t   *device,   // I - Device
+    unsigned         page)      // I - Page number
+{
+  ps_job_data_t         *job_data;      // PPD data for job
+  FILE *devout;
+
+
+  job_data = (ps_job_data_t *)papplJobGetData(job);
+  devout = job_data->device_file;
+
+  // Send the last band, missing lines of short pages are blank and need
+  // no padding
+  if (job_data->band_lines > 0)
+    ps_emit_band(job, options, job_data);
+
+  if (job_data->num_bands > 0)
+    papplLogJob(job, PAPPL_LOGLEVEL_INFO,
+		"Page %u: %lu of %lu bytes of raster data in %d non-blank "
+		"bands, encoded with %s to %lu bytes", page,
+		job_data->page_bytes_in,
+		(unsigned long)options->header.cupsBytesPerLine *
+		options->header.cupsHeight, job_data->num_bands,
+		ps_codec_names[job_data->page_codec],
+		job_data->page_bytes_out);
+  else
+    papplLogJob(job, PAPPL_LOGLEVEL_INFO, "Page %u: Blank", page);
+  if (job_data->num_gray_bands > 0)
+  {
+    papplLogJob(job, PAPPL_LOGLEVEL_INFO,
+		"Page %u: %d of %d bands without color sent as gray, %lu "
+		"bytes less raster data", page, job_data->num_gray_bands,
+		job_data->num_bands, job_data->page_gray_saved);
+    job_data->job_gray_saved += job_data->page_gray_saved;
+  }
+
+  if (job_data->transport.failed)
+  {
+    papplLogJob(job, PAPPL_LOGLEVEL_ERROR,
+		"Page %u: Unable to allocate memory for encoding the raster "
+		"data", page);
+    return (false);
+  }
+
+  // Finish page and get it printed
+  fprintf(devout, "grestore\n");
+  fprintf(devout, "showpage\n");
+  fprintf(devout, "%%%%PageTrailer\n");
+
+  // With in-process output the writer thread owns the device, let it
+  // flush after sending the page
+  if (job_data->writer)
+  {
+    if (!ps_writer_flush(job_data->writer))
+      return (false);
+  }
+  else
+    papplDeviceFlush(device);
+
+  // Only the first page counts
+  ps_job_first_page(job);
+
+  return (true);
+}
+
+
+//
+// 'ps_rstartjob()' - Start a job.
+//
+
+static bool                     // O - `true` on success, `false` on failure
+ps_rstartjob(
+    pappl_job_t      *job,      // I - Job
+    pappl_pr_options_t *options,// I - Job options
+    pappl_device_t   *device)   // I - Device
+{
+  ps_job_data_t      *job_data;      // PPD data for job
+  const char	     *job_name;
+  int                nullfd;
+  FILE               *devout;
+  filter_external_cups_t* ppd_filter_params; // Parameters for CUPS
+                                     // filter defined in the PPD
+
+  // Load PPD file and determine the PPD options equivalent to the job options
+  job_data = ps_create_job_data(job, options);
+  if (job_data->cups_filter_ps)
+  {
+    // The filter has no output, data is going directly to the device
+    nullfd = open("/dev/null", O_RDWR);
+    // Create file descriptor/pipe to which the functions of libppd can
+    // send the data so that it gets passed on to the device
+    // Create filter chain of the CUPS filter defined in the PPD file
+    // and the print filter function
+    job_data->chain = cupsArrayNew(NULL, NULL);
+    ppd_filter_params =
+      (filter_external_cups_t *)calloc(1, sizeof(filter_external_cups_t));
+    ppd_filter_params->filter = job_data->cups_filter_ps;
+    job_data->ppd_filter =
+      (filter_filter_in_chain_t *)calloc(1, sizeof(filter_filter_in_chain_t));
+    job_data->ppd_filter->function = filterExternalCUPS;
+    job_data->ppd_filter->parameters = ppd_filter_params;
+    job_data->ppd_filter->name = "Post-filtering";
+    cupsArrayAdd(job_data->chain, job_data->ppd_filter);
+    job_data->print =
+      (filter_filter_in_chain_t *)calloc(1, sizeof(filter_filter_in_chain_t));
+    job_data->print->function = ps_print_filter_function;
+    job_data->print->parameters = device;
+    job_data->print->name = "Printing";
+    cupsArrayAdd(job_data->chain, job_data->print);
+
+    job_data->device_fd = filterPOpen(filterChain, -1, nullfd,
+				      0, job_data->filter_data, job_data->chain,
+				      &(job_data->device_pid));
+    if (job_data->device_fd < 0)
+      return (false);
+    job_data->device_file = fdopen(job_data->device_fd, "w");
+  }
+  else
+  {
+    // No extra filter needed, write to the device in-process, without
+    // sub-process and pipe
+    job_data->device_file = ps_writer_open(job, device, &(job_data->writer));
+    if (job_data->device_file == NULL)
+      return (false);
+  }
+  devout = job_data->device_file;
+  job_data->transport.outputfp = devout;
+  if (job_data->transport.mode == PS_TRANSPORT_BCP ||
+      job_data->transport.mode == PS_TRANSPORT_TBCP)
+    papplLogJob(job, PAPPL_LOGLEVEL_DEBUG,
+		"Sending image data in binary, %s-quoted",
+		job_data->transport.mode == PS_TRANSPORT_TBCP ? "TBCP" : "BCP");
+
+  // Save data for the other raster callback functions
+  papplJobSetData(job, job_data);
+
+  // Print 1 bit per pixel for monochrome draft printing
+  ps_one_bit_dither_on_draft(job, options);
+
+  // DSC header, prolog and setup
+  job_name = papplJobGetName(job);
+  ps_emit_job_header(devout, job_data->ppd, papplJobGetID(job),
+		     papplJobGetUsername(job), job_name, options->copies,
+		     options->header.PageSize[0], options->header.PageSize[1],
+		     0, job_data->transport.mode);
+
+  return (true);
+}
+
+
+//
+// 'ps_rstartpage()' - Start a page.
+//
+
+static bool                      // O - `true` on success, `false` on failure
+ps_rstartpage(
+    pappl_job_t       *job,       // I - Job
+    pappl_pr_options_t  *options, // I - Job options
+    pappl_device_t    *device,    // I - Device
+    unsigned          page)       // I - Page number
+{
+  ps_job_data_t          *job_data;      // PPD data for job
+  ps_encoder_t           *enc;           // Encoder chain
+  FILE *devout;
+  int colors;                             // Color components per pixel
+  unsigned codecs;                        // Compressors usable for the page
+  unsigned char *ptr;
+
+
+  job_data = (ps_job_data_t *)papplJobGetData(job);
+  devout = job_data->device_file;
+  enc = &(job_data->encoder);
+  job_data->line_count = 0;
+  job_data->page = page;
+
+  // Print 1 bit per pixel for monochrome draft printing
+  ps_one_bit_dither_on_draft(job, options);
+
+  switch (options->header.cupsColorSpace)
+  {
+  case CUPS_CSPACE_RGB:
+  case CUPS_CSPACE_SRGB:
+  case CUPS_CSPACE_ADOBERGB:
+    colors = 3;
+    break;
+
+  case CUPS_CSPACE_CMYK:
+    colors = 4;
+    break;
+
+  default:
+    colors = 1;
+    break;
+  }
+
+  // Format of the page image for the encoder chain
+  enc->width          = options->header.cupsWidth;
+  enc->height         = options->header.cupsHeight;
+  enc->colors         = colors;
+  enc->bpc            = options->header.cupsBitsPerColor;
+  enc->bytes_per_line = options->header.cupsBytesPerLine;
+  enc->black_is_1     = options->header.cupsColorSpace == CUPS_CSPACE_K;
+  job_data->blank     =
+    (options->header.cupsColorSpace == CUPS_CSPACE_K ||
+     options->header.cupsColorSpace == CUPS_CSPACE_CMYK) ? 0x00 : 0xff;
+
+  // Compressors for this page: CCITT Group 4 only for 1-bit gray, JPEG
+  // (lossy) for all photo pages with 8-bit gray or RGB, not for others
+  codecs = job_data->codecs;
+  if (colors != 1 || options->header.cupsBitsPerPixel != 1)
+    codecs &= ~(1 << PS_CODEC_CCITT);
+  if ((codecs & (1 << PS_CODEC_DCT)) &&
+      options->print_content_optimize == PAPPL_CONTENT_PHOTO &&
+      enc->bpc == 8 && (colors == 1 || colors == 3))
+    codecs = 1 << PS_CODEC_DCT;
+  else
+    codecs &= ~(1 << PS_CODEC_DCT);
+  job_data->page_codecs = codecs;
+
+  job_data->codec_chosen = false;
+
+  // Buffer for the bands of non-blank lines
+  job_data->band_lines     = 0;
+  job_data->band_blank     = 0;
+  job_data->num_bands       = 0;
+  job_data->num_gray_bands  = 0;
+  job_data->space_colors    = 0;
+  job_data->page_bytes_in   = 0;
+  job_data->page_bytes_out  = 0;
+  job_data->page_gray_saved = 0;
+  job_data->band_max_lines = PS_BAND_MAX_BYTES / enc->bytes_per_line;
+  if (job_data->band_max_lines < PS_BAND_GAP + 1)
+    job_data->band_max_lines = PS_BAND_GAP + 1;
+  if ((ptr = (unsigned char *)realloc(job_data->band,
+				      job_data->band_max_lines *
+				      enc->bytes_per_line)) == NULL)
+  {
+    papplLogJob(job, PAPPL_LOGLEVEL_ERROR,
+		"Unable to allocate memory for raster data");
+    return (false);
+  }
+  job_data->band = ptr;
+
+  // DSC header
+  fprintf(devout, "%%%%Page: (%d) %d\n", page, page);
+  fputs("%%BeginPageSetup\n", devout);
+  ppdEmit(job_data->ppd, devout, PPD_ORDER_PAGE);
+  fputs("%%EndPageSetup\n", devout);
+
+  // Start raster image output, the bands of non-blank lines get sent as
+  // images of their own
+  fprintf(devout, "gsave\n");
+
+  // PostScript level 1 has no color spaces, inverted gray is done with
+  // the transfer function, on level 2 the color space gets set with the
+  // first band
+  if (job_data->ppd->language_level < 2 &&
+      (options->header.cupsColorSpace == CUPS_CSPACE_K ||
+       options->header.cupsColorSpace == CUPS_CSPACE_W))
+    fputs("{1 exch sub} settransfer\n", devout);
+
+  fprintf(devout, "%d %d scale\n",
+	  options->header.PageSize[0], options->header.PageSize[1]);
+
+  return (true);
+}
+
+
+//
+// 'ps_run_qpdf()' - Run qpdf (which comes with the Snap) with the given
+//                   command line, optionally capturing its output.
+//
+
+static int				// O - Exit status, -1 on error
+ps_run_qpdf(pappl_job_t       *job,	// I - Job
+	    const char * const *args,	// I - Command line
+	    char              *buffer,	// O - Output or `NULL`
+	    size_t            bufsize)	// I - Size of output buffer
+{
+  posix_spawn_file_actions_t actions;	// File descriptors of qpdf
+  int		fds[2] = { -1, -1 },	// Pipe for the output
+		err,			// Error from posix_spawnp()
+		status;			// Exit status
+  pid_t		pid;			// Process ID
+  ssize_t	bytes;			// Bytes read
+  size_t	used = 0;		// Bytes in buffer
+  char		discard[256];		// Output not fitting into buffer
+
+
+  if (buffer && pipe2(fds, O_CLOEXEC))
+    return (-1);
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+  if (buffer)
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+  else
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+  err = posix_spawnp(&pid, args[0], &actions, NULL, (char * const *)args,
+		     environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (buffer)
+    close(fds[1]);
+
+  if (err)
+  {
+    // qpdf is optional, without it PDF files get converted as a whole
+    papplLogJob(job, err == ENOENT ? PAPPL_LOGLEVEL_DEBUG :
+		PAPPL_LOGLEVEL_ERROR, "Unable to run %s: %s", args[0],
+		strerror(err));
+    if (buffer)
+      close(fds[0]);
+    return (-1);
+  }
+
+  if (buffer)
+  {
+    while ((bytes = read(fds[0], used < bufsize - 1 ? buffer + used : discard,
+			 used < bufsize - 1 ? bufsize - 1 - used :
+			 sizeof(discard))) > 0 || (bytes < 0 && errno == EINTR))
+      if (bytes > 0 && used < bufsize - 1)
+	used += (size_t)bytes;
+    buffer[used] = '\0';
+    close(fds[0]);
+  }
+
+  while (waitpid(pid, &status, 0) < 0)
+    if (errno != EINTR)
+      return (-1);
+
+  return (WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+}
+
+
+//
+// 'ps_runlength_encode_line()' - RunLength-encode a raster line, as read by
+//                                /RunLengthDecode: Runs of 2 to 128
+//                                identical bytes as 257 - length and the
+//                                byte, other bytes as length - 1 and up to
+//                                128 literal bytes. Runs do not span lines.
+//
+
+static void
+ps_runlength_encode_line(
+    ps_encoder_t        *enc,		// I - Encoder chain
+    const unsigned char *line)		// I - Raster line
+{
+  size_t	bytes = enc->bytes_per_line,
+					// Bytes per line
+		i, j;			// Start and end of current run
+  unsigned char	*out = enc->buffer;	// Output pointer
+
+
+  for (i = 0; i < bytes; i = j)
+  {
+    // Run of identical bytes
+    for (j = i + 1; j < bytes && j - i < 128 && line[j] == line[i]; j ++);
+    if (j - i >= 2)
+    {
+      *out++ = (unsigned char)(257 - (j - i));
+      *out++ = line[i];
+      continue;
+    }
+
+    // Literal bytes up to the next run of at least 3 identical bytes
+    for (j = i + 1;
+	 j < bytes && j - i < 128 &&
+	   (j + 2 >= bytes || line[j] != line[j + 1] ||
+	    line[j] != line[j + 2]);
+	 j ++);
+    *out++ = (unsigned char)(j - i - 1);
+    memcpy(out, line + i, j - i);
+    out += j - i;
+  }
+
+  ps_transport_write(enc->transport, enc->buffer, out - enc->buffer);
+}
+
+
+//
+// 'ps_rwriteline()' - Write a line.
+//
+
+static bool				// O - `true` on success, `false` on failure
+ps_rwriteline(
+    pappl_job_t         *job,		// I - Job
+    pappl_pr_options_t  *options,	// I - Job options
+    pappl_device_t      *device,	// I - Device
+    unsigned            y,		// I - Line number
+    const unsigned char *pixels)	// I - Line
+{
+  ps_job_data_t         *job_data;      // PPD data for job
+
+  job_data = (ps_job_data_t *)papplJobGetData(job);
+
+  if (job_data->line_count < options->header.cupsHeight)
+    ps_write_image_line(job, options, job_data, pixels);
+  job_data->line_count ++;
+
+  return (true);
+}
+
+
+//
+// 'ps_setup_driver_list()' - Create a driver list of the available PPD files.
+//
+
+static void
+ps_setup_driver_list(pappl_system_t *system)      // I - System
+{
+  int              i, j, k;
+  char             *ptr1, *ptr2;
+  char             *generic_ppd, *mfg_mdl, *mdl, *dev_id;
+  ps_ppd_path_t    *ppd_path;
+  int              num_options = 0;
+  cups_option_t    *options = NULL;
+  cups_array_t     *ppds;
+  ppd_info_t       *ppd;
+  char             buf1[1024], buf2[1024];
+  int              pre_normalized;
+  pappl_pr_driver_t swap;
+
+
+  //
+  // Create the list of all available PPD files
+  //
+
+  ppds = ppdCollectionListPPDs(ppd_collections, 0,
+			       num_options, options,
+			       (filter_logfunc_t)papplLog, system);
+
+  //
+  // Create driver list from the PPD list and submit it
+  //
+  
+  if (ppds)
+  {
+    i = 0;
+    num_drivers = cupsArrayCount(ppds);
+    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	     "Found %d PPD files.", num_drivers);
+    // Search for a generic PPD to use as generic PostScript driver
+    generic_ppd = NULL;
+    for (ppd = (ppd_info_t *)cupsArrayFirst(ppds);
+	 ppd;
+	 ppd = (ppd_info_t *)cupsArrayNext(ppds))
+    {
+      if (!strcasecmp(ppd->record.make, "Generic") ||
+	  !strncasecmp(ppd->record.make_and_model, "Generic", 7) ||
+	  !strncasecmp(ppd->record.products[0], "Generic", 7))
+      {
+	generic_ppd = ppd->record.name;
+	break;
+      }
+    }
+    if (generic_ppd)
+      papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	       "Found generic PPD file: %s", generic_ppd);
+    else
+      papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	       "No generic PPD file found, "
+	       "Printer Application will only support printers "
+	       "explicitly supported by the PPD files");
+    // Create driver indices
+    if (drivers)
+      free(drivers);
+    drivers = (pappl_pr_driver_t *)calloc(num_drivers + PPD_MAX_PROD,
+					  sizeof(pappl_pr_driver_t));
+    // Create list of PPD file paths
+    if (ppd_paths)
+      cupsArrayDelete(ppd_paths);
+    ppd_paths = cupsArrayNew(ps_compare_ppd_paths, NULL);
+    if (generic_ppd)
+    {
+      drivers[i].name = strdup("generic");
+      drivers[i].description = strdup("Generic PostScript Printer");
+      drivers[i].device_id = strdup("CMD:POSTSCRIPT;");
+      drivers[i].extension = strdup(" generic");
+      i ++;
+      ppd_path = (ps_ppd_path_t *)calloc(1, sizeof(ps_ppd_path_t));
+      ppd_path->driver_name = strdup("generic");
+      ppd_path->ppd_path = strdup(generic_ppd);
+      cupsArrayAdd(ppd_paths, ppd_path);
+    }
+    for (ppd = (ppd_info_t *)cupsArrayFirst(ppds);
+	 ppd;
+	 ppd = (ppd_info_t *)cupsArrayNext(ppds))
+    {
+      if (!generic_ppd || strcmp(ppd->record.name, generic_ppd))
+      {
+	// Note: The last entry in the product list is the ModelName of the
+	// PPD not an actual Product entry. Therefore we ignore it
+	// (Hidden feature of ppdCollectionListPPDs())
+        for (j = -1; j < PPD_MAX_PROD - 1; j ++)
+	{
+	  // End of product list;
+          if (j >= 0 &&
+	      (!ppd->record.products[j][0] || !ppd->record.products[j + 1][0]))
+            break;
+	  // If there is only 1 product, ignore it, it is either the
+	  // model of the PPD itself or something weird
+	  if (j == 0 &&
+	      (!ppd->record.products[1][0] || !ppd->record.products[2][0]))
+	    break;
+	  pre_normalized = 0;
+	  dev_id = NULL;
+	  if (j < 0)
+	  {
+	    // Model of PPD itself
+	    if (ppd->record.device_id[0] &&
+		(strstr(ppd->record.device_id, "MFG:") ||
+		 strstr(ppd->record.device_id, "MANUFACTURER:")) &&
+		(strstr(ppd->record.device_id, "MDL:") ||
+		 strstr(ppd->record.device_id, "MODEL:")) &&
+		!strstr(ppd->record.device_id, "MDL:hp_") &&
+		!strstr(ppd->record.device_id, "MDL:hp-") &&
+		!strstr(ppd->record.device_id, "MDL:HP_") &&
+		!strstr(ppd->record.device_id, "MODEL:hp2") &&
+		!strstr(ppd->record.device_id, "MODEL:hp3") &&
+		!strstr(ppd->record.device_id, "MODEL:hp9") &&
+		!strstr(ppd->record.device_id, "MODEL:HP2"))
+	    {
+	      // Convert device ID to make/model string, so that we can add
+	      // the language for building final index strings
+	      mfg_mdl = ieee1284NormalizeMakeAndModel(ppd->record.device_id,
+						      NULL,
+						      IEEE1284_NORMALIZE_HUMAN,
+						      buf2, sizeof(buf2),
+						      NULL, NULL);
+	      pre_normalized = 1;
+	    }
+	    else if (ppd->record.products[0][0])
+	      mfg_mdl = ppd->record.products[0];
+	    else
+	      mfg_mdl = ppd->record.make_and_model;
+	    if (ppd->record.device_id[0])
+	      dev_id = ppd->record.device_id;
+	  }
+	  else
+	    // Extra models in list of products
+	    mfg_mdl = ppd->record.products[j];
+	  ppd_path = (ps_ppd_path_t *)calloc(1, sizeof(ps_ppd_path_t));
+	  // Base make/model/language string to generate the needed index
+	  // strings
+	  snprintf(buf1, sizeof(buf1) - 1, "%s%s (%s)",
+		   mfg_mdl,
+		   (!strncmp(ppd->record.name, extra_ppd_dir,
+			     strlen(extra_ppd_dir)) ? " - USER-ADDED" : ""),
+		   ppd->record.languages[0]);
+	  // IPP-compatible string as driver name
+	  drivers[i].name =
+	    strdup(ieee1284NormalizeMakeAndModel(buf1, ppd->record.make,
+						 IEEE1284_NORMALIZE_IPP,
+						 buf2, sizeof(buf2),
+						 NULL, NULL));
+	  ppd_path->driver_name = strdup(drivers[i].name);
+	  // Path to grab PPD from repositories
+	  ppd_path->ppd_path = strdup(ppd->record.name);
+	  cupsArrayAdd(ppd_paths, ppd_path);
+	  // Human-readable string to appear in the driver drop-down
+	  if (pre_normalized)
+	    drivers[i].description = strdup(buf1);
+	  else
+	    drivers[i].description =
+	      strdup(ieee1284NormalizeMakeAndModel(buf1, ppd->record.make,
+						   IEEE1284_NORMALIZE_HUMAN,
+						   buf2, sizeof(buf2),
+						   NULL, NULL));
+	  // We only register device IDs actually found in the PPD files,
+	  // PPDs without explicit device ID get matched by the
+	  // ieee1284NormalizeMakeAndModel() function
+	  drivers[i].device_id = (dev_id ? strdup(dev_id) : strdup(""));
+	  // List sorting index with padded numbers (typos in example intended)
+	  // "LaserJet 3P" < "laserjet 4P" < "Laserjet3000P" < "LaserJet 4000P"
+	  drivers[i].extension =
+	    strdup(ieee1284NormalizeMakeAndModel(buf1, ppd->record.make,
+					IEEE1284_NORMALIZE_COMPARE |
+					IEEE1284_NORMALIZE_LOWERCASE |
+					IEEE1284_NORMALIZE_SEPARATOR_SPACE |
+					IEEE1284_NORMALIZE_PAD_NUMBERS,
+					buf2, sizeof(buf2),
+					NULL, NULL));
+	  papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+		   "File: %s; Printer (%d): %s; --> Entry %d: Driver %s; "
+		   "Description: %s; Device ID: %s; Sorting index: %s",
+		   ppd_path->ppd_path, j, buf1, i, drivers[i].name,
+		   drivers[i].description, drivers[i].device_id,
+		   (char *)(drivers[i].extension));
+	  // Sort the new entry into the list via the extension
+	  for (k = i;
+	       k > 0 &&
+	       strcmp((char *)(drivers[k - 1].extension),
+		      (char *)(drivers[k].extension)) > 0;
+	       k --)
+	  {
+	    swap = drivers[k - 1];
+	    drivers[k - 1] = drivers[k];
+	    drivers[k] = swap;
+	  }
+	  // Check for duplicates
+	  if (k > 0 &&
+	      (strcmp(drivers[k - 1].name, drivers[k].name) == 0 ||
+	       strcasecmp(drivers[k - 1].description,
+			  drivers[k].description) == 0))
+	  {
+	    // Remove the duplicate
+	    // We do not count the freeable memory here as in the end
+	    // we adjust the allocated memory anyway
+	    memmove(&drivers[k], &drivers[k + 1],
+		    (i - k) * sizeof(pappl_pr_driver_t));
+	    i --;
+	    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+		     "DUPLICATE REMOVED!");
+	  }
+	  // Next position in the list
+	  i ++;
+	}
+	// Add memory for PPD with multiple product entries
+	num_drivers += j;
+	drivers = (pappl_pr_driver_t *)reallocarray(drivers,
+						    num_drivers +
+						    PPD_MAX_PROD,
+						    sizeof(pappl_pr_driver_t));
+      }
+      free(ppd);
+    }
+    cupsArrayDelete(ppds);
+
+    // Final adjustment of allocated memory
+    drivers = (pappl_pr_driver_t *)reallocarray(drivers, i,
+						sizeof(pappl_pr_driver_t));
+    num_drivers = i;
+    papplLog(system, PAPPL_LOGLEVEL_DEBUG,
+	     "Created %d driver entries.", num_drivers);
+  }
+  else
+    papplLog(system, PAPPL_LOGLEVEL_FATAL, "No PPD files found.");
+
+  papplSystemSetPrinterDrivers(system, num_drivers, drivers,
+			       ps_autoadd, ps_printer_extra_setup,
+			       ps_driver_setup, ppd_paths);
+}
+
+
+//
+// 'ps_setup()' - Setup PostScript driver.
+//
+
+static void
+ps_setup(pappl_system_t *system)      // I - System
+{
+  int              i;
+  char             *ptr1, *ptr2;
+  ppd_collection_t *col = NULL;
+  ps_filter_data_t *ps_filter_data,
+                   *pdf_filter_data,
+                   *jpeg_filter_data;
+
+  //
+  // Create PPD collection index data structure
+  //
+
+  ppd_paths = cupsArrayNew(ps_compare_ppd_paths, NULL);
+  ppd_collections = cupsArrayNew(NULL, NULL);
+
+  //
+  // Build PPD list from all repositories
+  //
+
+  if ((ptr1 = getenv("PPD_PATHS")) != NULL)
+  {
+    strncpy(ppd_dirs_env, ptr1, sizeof(ppd_dirs_env));
+    ptr1 = ppd_dirs_env;
+    while (ptr1 && *ptr1)
+    {
+      ptr2 = strchr(ptr1, ':');
+      if (ptr2)
+	*ptr2 = '\0';
+      col = (ppd_collection_t *)calloc(1, sizeof(ppd_collection_t));
+      col->name = NULL;
+      col->path = ptr1;
+      cupsArrayAdd(ppd_collections, col);
+      if (ptr2)
+	ptr1 = ptr2 + 1;
+      else
+	ptr1 = NULL;
+    }
+  }
+  else
+    for (i = 0; i < sizeof(col_paths)/sizeof(col_paths[0]); i ++)
+    {
+      col = (ppd_collection_t *)calloc(1, sizeof(ppd_collection_t));
+      col->name = NULL;
+      col->path = (char *)col_paths[i];
+      cupsArrayAdd(ppd_collections, col);
+    }
+
+  //
+  // Last entry in the list is the directory for the user to drop
+  // extra PPD files in via the web interface
+  //
+
+  if (col && !extra_ppd_dir[0])
+    strncpy(extra_ppd_dir, col->path, sizeof(extra_ppd_dir));
+
+  //
+  // Create the list of all available PPD files
+  //
+
+  ps_setup_driver_list(system);
+
+  //
+  // Add web admin interface page for adding PPD files
+  //
+
+  papplSystemAddResourceCallback(system, "/addppd", "text/html",
+				 (pappl_resource_cb_t)ps_system_web_add_ppd,
+				 system);
+  papplSystemAddLink(system, "Add PPD Files", "/addppd",
+		     PAPPL_LOPTIONS_OTHER | PAPPL_LOPTIONS_HTTPS_REQUIRED);
+
+  //
+  // Add web admin interface page for the conversion cache
+  //
+
+  papplSystemAddResourceCallback(system, "/cache", "text/html",
+				 (pappl_resource_cb_t)ps_system_web_cache,
+				 system);
+  papplSystemAddLink(system, "Conversion Cache", "/cache",
+		     PAPPL_LOPTIONS_OTHER | PAPPL_LOPTIONS_HTTPS_REQUIRED);
+
+  //
+  // Add filters for the different input data formats
+  //
+
+  ps_filter_data =
+    (ps_filter_data_t *)calloc(1, sizeof(ps_filter_data_t));
+  ps_filter_data->filter_function = pstops;
+  ps_filter_data->filter_parameters = "PS";
+  papplSystemAddMIMEFilter(system,
+			   "application/postscript",
+			   "application/vnd.printer-specific",
+			   ps_filter, ps_filter_data);
+
+  pdf_filter_data =
+    (ps_filter_data_t *)calloc(1, sizeof(ps_filter_data_t));
+  pdf_filter_data->filter_function = pdftops;
+  pdf_filter_data->filter_parameters = "PDF";
+  papplSystemAddMIMEFilter(system,
+			   "application/pdf",
+			   "application/vnd.printer-specific",
+			   ps_filter, pdf_filter_data);
+
+  // JPEG images are embedded in the PostScript as they are, instead of
+  // going through the raster path
+  jpeg_filter_data =
+    (ps_filter_data_t *)calloc(1, sizeof(ps_filter_data_t));
+  jpeg_filter_data->filter_function = ps_jpeg_filter_function;
+  jpeg_filter_data->filter_parameters = NULL;
+  papplSystemAddMIMEFilter(system,
+			   "image/jpeg",
+			   "application/vnd.printer-specific",
+			   ps_filter, jpeg_filter_data);
+}
+
+
+//
+// 'ps_system_web_add_ppd()' - Web interface page for adding/deleting
+//                             PPD files by the user, to add support for
+//                             printers not supported by the built-in PPD
+//                             files
+//
+
+static void
+ps_system_web_add_ppd(
+    pappl_client_t *client,		// I - Client
+    pappl_system_t *system)		// I - System
+{
+  int                 i, j;             // Looping variables
+  const char          *status = NULL;	// Status text, if any
+  const char          *uri = NULL;      // Client URI
+  pappl_version_t     version;
+  cups_array_t        *uploaded,        // List of uploaded PPDs, to delete
+                                        // them in certain error conditions
+                      *accepted_report, // Report of accepted PPDs with warnings
+                      *rejected_report; // Report of rejected PPDs with errors
+  cups_dir_t          *dir;             // User PPD file directory
+  cups_dentry_t       *dent;            // Entry in user PPD file directory
+  cups_array_t        *user_ppd_files;  // List of user-uploaded PPD files
+
+
+  if (!papplClientHTMLAuthorize(client))
+    return;
+
+  // Create arrays to log PPD file upload
+  uploaded = cupsArrayNew3(NULL, NULL, NULL, 0, NULL,
+			   (cups_afree_func_t)free);
+  accepted_report = cupsArrayNew3(NULL, NULL, NULL, 0, NULL,
+				  (cups_afree_func_t)free);
+  rejected_report = cupsArrayNew3(NULL, NULL, NULL, 0, NULL,
+				  (cups_afree_func_t)free);
+
+  // Handle POSTs to add and delete PPD files...
+  if (papplClientGetMethod(client) == HTTP_STATE_POST)
+  {
+    int			num_form = 0;	// Number of form variables
+    cups_option_t	*form = NULL;	// Form variables
+    cups_option_t	*opt;
+    const char		*action;	// Form action
+    char                strbuf[2048],
+                        destpath[2048];	// File destination path
+    const char	        *content_type;	// Content-Type header
+    const char	        *boundary;	// boundary value for multi-part
+    http_t              *http;
+    bool                error = false;
+    bool                ppd_repo_changed = false; // PPD(s) added or removed?
+    char		*ptr;		// Pointer into string
+
+
+    http = papplClientGetHTTP(client);
+    content_type = httpGetField(http, HTTP_FIELD_CONTENT_TYPE);
+    if (!strcmp(content_type, "application/x-www-form-urlencoded"))
+    {
+      // URL-encoded form data, PPD file uploads not possible in this format 
+      // Use papplClientGetForm() to do the needed decoding
+      error = true;
+      if ((num_form = papplClientGetForm(client, &form)) == 0)
+      {
+	status = "Invalid form data.";
+      }
+      else if (!papplClientIsValidForm(client, num_form, form))
+      {
+	status = "Invalid form submission.";
+      }
+      else
+	error = false;
+    }
+    else if (!strncmp(content_type, "multipart/form-data; ", 21) &&
+	     (boundary = strstr(content_type, "boundary=")) != NULL)
+    {
+      // Multi-part form data, probably we have a PPD file upload
+      // Use our own reading method to allow for submitting more than
+      // one PPD file through the single input widget and for a larger
+      // total amount of data
+      char	buf[32768],		// Message buffer
+		*bufinptr,		// Pointer end of incoming data
+		*bufreadptr,		// Pointer for reading buffer
+		*bufend;		// End of message buffer
+      size_t	body_size = 0;		// Size of message body
+      ssize_t	bytes;			// Bytes read
+      http_state_t initial_state;	// Initial HTTP state
+      char	name[1024],		// Form variable name
+		filename[1024],		// Form filename
+		bstring[256],		// Boundary string to look for
+		*bend,			// End of value (boundary)
+		*line;			// Start of line
+      size_t	blen;			// Length of boundary string
+      FILE      *fp = NULL;
+      ppd_file_t *ppd = NULL;		// PPD file data for verification
+      ppd_group_t *group;
+      ppd_option_t *option;
+      bool      codeless_option_found;
+      bool      pagesize_option_ok;
+      bool      filter_installed;
+      char      *filter_path;
+
+
+      // Read one buffer full of data, then search for \r only up to a
+      // position in the buffer so that the boundary string still fits
+      // after the \r, check for line end \r\n (in header) or boundary
+      // string (after header, file/value), then save value into
+      // "form" option list or file data into destination file, move
+      // rest of buffer content (after line break/boundary) to
+      // beginning of buffer, read rest of buffer space full,
+      // continue. If no line end found, error (too long line), if no
+      // boundary found, error in case of option value, write to
+      // destination file in case of file. Move rest of buffer content
+      // to the beginning of buffer, read buffer full, continue.
+      initial_state = httpGetState(http);
+
+      // Format the boundary string we are looking for...
+      snprintf(bstring, sizeof(bstring), "\r\n--%s", boundary + 9);
+      blen = strlen(bstring);
+      papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
+		     "Boundary string: \"%s\", %ld bytes",
+		     bstring, (long)blen);
+
+      // Parse lines in the message body...
+      name[0] = '\0';
+      filename[0] = '\0';
+
+      for (bufinptr = buf, bufend = buf + sizeof(buf);
+	   (bytes = httpRead2(http, bufinptr,
+			      (size_t)(bufend - bufinptr))) > 0 ||
+	     bufinptr > buf;)
+      {
+	body_size += (size_t)bytes;
+	papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
+		       "Bytes left over: %ld; Bytes read: %ld; Total bytes read: %ld",
+		       (long)(bufinptr - buf), (long)bytes, (long)body_size);
+	bufinptr += bytes;
+	*bufinptr = '\0';
+
+	for (bufreadptr = buf; bufreadptr < bufinptr;)
+        {
+	  if (fp == NULL)
+	  {
+	    // Split out a line...
+	    for (line = bufreadptr; bufreadptr < bufinptr - 1; bufreadptr ++)
+	    {
+	      if (!memcmp(bufreadptr, "\r\n", 2))
+	      {
+		*bufreadptr = '\0';
+		bufreadptr += 2;
+		break;
+	      }
+	    }
+
+	    if (bufreadptr >= bufinptr)
+	      break;
+	  }
+
+	  if (!*line || fp)
+          {
+	    papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
+			   "Data (value or file).");
+
+	    // End of headers, grab value...
+	    if (!name[0])
+	    {
+	      // No name value...
+	      papplLogClient(client, PAPPL_LOGLEVEL_ERROR,
+			     "Invalid multipart form data: Form field name missing.");
+	      // Stop here
+	      status = "Invalid form data.";
+	      error = true;
+	      break;
+	    }
+
+	    for (bend = bufinptr - blen - 2,
+		   ptr = memchr(bufreadptr, '\r', (size_t)(bend - bufreadptr));
+		 ptr;
+		 ptr = memchr(ptr + 1, '\r', (size_t)(bend - ptr - 1)))
+	    {
+	      // Check for boundary string...
+	      if (!memcmp(ptr, bstring, blen))
+		break;
+	    }
+
+	    if (!ptr && !filename[0])
+	    {
+	      // When reading a file, write out curremt data into destination
+	      // file, when not reading a file, error out
+	      // No boundary string, invalid data...
+	      papplLogClient(client, PAPPL_LOGLEVEL_ERROR,
+			     "Invalid multipart form data: Form field %s: File without filename or excessively long value.",
+			     name);
+	      // Stop here
+	      status = "Invalid form data.";
+	      error = true;
+	      break;
+	    }
+
+	    // Value/file data is in buffer range from ptr to bend,
+	    // Reading continues at bufreadptr
+	    if (ptr)
+	    {
+	      bend       = ptr;
+	      ptr        = bufreadptr;
+	      bufreadptr = bend + blen;
+	    }
+	    else
+	    {
+	      ptr        = bufreadptr;
+	      bufreadptr = bend;
+	    }
+
+	    if (filename[0])
+	    {
+	      // Save data of an embedded file...
+
+	      // New file
+	      if (fp == NULL) // First data portion
+	      {
+		snprintf(destpath, sizeof(destpath), "%s/%s", extra_ppd_dir,
+			 filename);
+		papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
+			       "Creating file: %s", destpath);
+		if ((fp = fopen(destpath, "w+")) == NULL)
+		{
+		  papplLogClient(client, PAPPL_LOGLEVEL_ERROR,
+				 "Unable to create file: %s",
+				 strerror(errno));
+		  // Report error
+		  snprintf(strbuf, sizeof(strbuf),
+			   "%s: Cannot create file - %s",
+			   filename, strerror(errno));
+		  cupsArrayAdd(rejected_report, strdup(strbuf));
+		  // Stop here
+		  status = "Error uploading PPD file(s), uploading stopped.";
+		  error = true;
+		  break;
+		}
+	      }
+
+	      if (fp)
+	      {
+		// Write the data
+		while (bend > ptr) // We have data to write
+		{
+		  bytes = fwrite(ptr, 1, (size_t)(bend - ptr), fp);
+		  papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
+				 "Bytes to write: %ld; %ld bytes written",
+				 (long)(bend - ptr), (long)bytes);
+		  if (errno)
+		  {
+		    papplLogClient(client, PAPPL_LOGLEVEL_ERROR,
+				   "Error writing into file %s: %s",
+				   destpath, strerror(errno));
+		    // Report error
+		    snprintf(strbuf, sizeof(strbuf),
+			     "%s: Cannot write file - %s",
+			     filename, strerror(errno));
+		    cupsArrayAdd(rejected_report, strdup(strbuf));
+		    // PPD incomplete, close and delete it.
+		    fclose(fp);
+		    fp = NULL;
+		    unlink(destpath);
+		    // Stop here
+		    status = "Error uploading PPD file(s), uploading stopped.";
+		    error = true;
+		    break;
+		  }
+		  ptr += bytes;
+		}
+
+		// Close the file and verify whether it is a usable PPD file
+		if (bufreadptr > bend) // We have read the boundary string
+		{
 		  fclose(fp);
 		  fp = NULL;
 		  // Default is PPD_CONFORM_RELAXED, uncomment if not
@@ -5223,539 +13287,1638 @@ ps_system_web_add_ppd(
 		    ppd_status_t err;		// Last error in file
 		    int		 linenum;	// Line number in file
 
-		    // Log error
-		    err = ppdLastError(&linenum);
-		    papplLogClient(client, PAPPL_LOGLEVEL_ERROR,
-				   "PPD %s: %s on line %d", destpath,
-				   ppdErrorString(err), linenum);
-		    // PPD broken (or not a PPD), delete it.
-		    unlink(destpath);
-		    // Report error
-		    snprintf(strbuf, sizeof(strbuf),
-			     "%s: Not a PPD or file corrupted", filename);
-		    cupsArrayAdd(rejected_report, strdup(strbuf));
-		  }
-		  else
-		  {
-		    // Check for cupsFilter(2) entries and for options
-		    // where the choices have no PostScript or PJL code
-		    // to insert into the job stream. This indicates that
-		    // the PPD file is possibly for a CUPS driver and not
-		    // for PostScript printing.
-		    // We do not reject these PPDs right away, as there
-		    // are some PostScript PPDs which use a filter only
-		    // to implement some non-essential options. Therefore
-		    // we issue a warning in such a case.
-		    // If the PPD mentions a filter taking PostScript as
-		    // input, we check whether it is installed and then
-		    // assume that it is used for more complex operations
-		    // In this case we do not give any warnings about
-		    // filters and codeless options as we assume that the
-		    // codeless options are handled by the installed
-		    // filter.
-		    filter_installed = false;
-		    if (ppd->num_filters)
-		    {
-		      filter_path =
-			ps_ppd_find_cups_filter
-			  ("application/vnd.cups-postscript",
-			   ppd->num_filters, ppd->filters);
-		      if (filter_path)
-		      {
-			filter_installed = true;
-			free(filter_path);
-		      }
-		      else
-		      {
-			snprintf(strbuf, sizeof(strbuf),
-				 "%s: WARNING: CUPS driver PPD, possibly non-PostScript, options which will not work:",
-				 filename);
-		      }
-		    } else
-		      snprintf(strbuf, sizeof(strbuf),
-			       "%s: WARNING: Options which will not work:",
-			       filename);
-		    codeless_option_found = false;
-		    pagesize_option_ok = false;
-		    for (i = ppd->num_groups, group = ppd->groups;
-			 i > 0;
-			 i --, group ++)
-		    {
-		      // Skip "Installable Options" they do not need code
-		      if (!strncasecmp(group->name, "Installable", 11) != 0)
-			continue;
-		      for (j = group->num_options, option = group->options;
-			   j > 0;
-			   j --, option ++)
-		      {
-			// Less than 2 choices, do not consider
-			if (option->num_choices < 2)
-			  continue;
-			// Skip "PageRegion"
-			if (!strcasecmp(option->keyword, "PageRegion"))
-			  continue;
-			// Do the choices provide code? If not, warn about
-			// this option not to work
-			// Don't worry if the filter is installed
-			if (!filter_installed &&
-			    !ps_option_has_code(system, ppd, option))
-			{
-			  codeless_option_found = true;
-			  snprintf(strbuf + strlen(strbuf),
-				   sizeof(strbuf) - strlen(strbuf) - 1,
-				   " %s,",
-				   option->text ? option->text :
-				   option->keyword);
-			} else if (!strcasecmp(option->keyword, "PageSize"))
-			  pagesize_option_ok = true;
-		      }
-		    }
-		    if (codeless_option_found)
-		      strbuf[strlen(strbuf) - 1] = '\0';
-		    else if (ppd->num_filters && !filter_installed)
-		    {
-		      // Log only the fact that PPD uses filter
-		      snprintf(strbuf, sizeof(strbuf),
-			       "%s: WARNING: CUPS driver PPD, possibly non-PostScript",
-			       filename);
-		    }
-		    else
-		    {
-		      // Log success without warning
-		      snprintf(strbuf, sizeof(strbuf), "%s: OK", filename);
-		    }
-		    ppdClose(ppd);
-		    if (pagesize_option_ok)
-		    {
-		      cupsArrayAdd(accepted_report, strdup(strbuf));
-		      // New PPD added, so driver list needs update
-		      ppd_repo_changed = true;
-		      // Log the addtion of the PPD file
-		      cupsArrayAdd(uploaded, strdup(destpath));
-		    }
-		    else
-		    {
-		      // PPD for sure not PostScript, delete it.
-		      unlink(destpath);
-		      // Report error
-		      snprintf(strbuf, sizeof(strbuf),
-			       "%s: No valid \"PageSize\" option, not a PostScript PPD file", filename);
-		      cupsArrayAdd(rejected_report, strdup(strbuf));
-		    }
-		  }
-		  //ppdSetConformance(PPD_CONFORM_RELAXED);
-		}
-	      }
-	    }
-	    else
-	    {
-	      // Save the form variable...
-	      *bend = '\0';
-	      num_form = cupsAddOption(name, ptr, num_form, &form);
-	      papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
-			     "Form variable: %s=%s", name, ptr);
+		    // Log error
+		    err = ppdLastError(&linenum);
+		    papplLogClient(client, PAPPL_LOGLEVEL_ERROR,
+				   "PPD %s: %s on line %d", destpath,
+				   ppdErrorString(err), linenum);
+		    // PPD broken (or not a PPD), delete it.
+		    unlink(destpath);
+		    // Report error
+		    snprintf(strbuf, sizeof(strbuf),
+			     "%s: Not a PPD or file corrupted", filename);
+		    cupsArrayAdd(rejected_report, strdup(strbuf));
+		  }
+		  else
+		  {
+		    // Check for cupsFilter(2) entries and for options
+		    // where the choices have no PostScript or PJL code
+		    // to insert into the job stream. This indicates that
+		    // the PPD file is possibly for a CUPS driver and not
+		    // for PostScript printing.
+		    // We do not reject these PPDs right away, as there
+		    // are some PostScript PPDs which use a filter only
+		    // to implement some non-essential options. Therefore
+		    // we issue a warning in such a case.
+		    // If the PPD mentions a filter taking PostScript as
+		    // input, we check whether it is installed and then
+		    // assume that it is used for more complex operations
+		    // In this case we do not give any warnings about
+		    // filters and codeless options as we assume that the
+		    // codeless options are handled by the installed
+		    // filter.
+		    filter_installed = false;
+		    if (ppd->num_filters)
+		    {
+		      filter_path =
+			ps_ppd_find_cups_filter
+			  ("application/vnd.cups-postscript",
+			   ppd->num_filters, ppd->filters);
+		      if (filter_path)
+		      {
+			filter_installed = true;
+			free(filter_path);
+		      }
+		      else
+		      {
+			snprintf(strbuf, sizeof(strbuf),
+				 "%s: WARNING: CUPS driver PPD, possibly non-PostScript, options which will not work:",
+				 filename);
+		      }
+		    } else
+		      snprintf(strbuf, sizeof(strbuf),
+			       "%s: WARNING: Options which will not work:",
+			       filename);
+		    codeless_option_found = false;
+		    pagesize_option_ok = false;
+		    for (i = ppd->num_groups, group = ppd->groups;
+			 i > 0;
+			 i --, group ++)
+		    {
+		      // Skip "Installable Options" they do not need code
+		      if (!strncasecmp(group->name, "Installable", 11) != 0)
+			continue;
+		      for (j = group->num_options, option = group->options;
+			   j > 0;
+			   j --, option ++)
+		      {
+			// Less than 2 choices, do not consider
+			if (option->num_choices < 2)
+			  continue;
+			// Skip "PageRegion"
+			if (!strcasecmp(option->keyword, "PageRegion"))
+			  continue;
+			// Do the choices provide code? If not, warn about
+			// this option not to work
+			// Don't worry if the filter is installed
+			if (!filter_installed &&
+			    !ps_option_has_code(system, ppd, option))
+			{
+			  codeless_option_found = true;
+			  snprintf(strbuf + strlen(strbuf),
+				   sizeof(strbuf) - strlen(strbuf) - 1,
+				   " %s,",
+				   option->text ? option->text :
+				   option->keyword);
+			} else if (!strcasecmp(option->keyword, "PageSize"))
+			  pagesize_option_ok = true;
+		      }
+		    }
+		    if (codeless_option_found)
+		      strbuf[strlen(strbuf) - 1] = '\0';
+		    else if (ppd->num_filters && !filter_installed)
+		    {
+		      // Log only the fact that PPD uses filter
+		      snprintf(strbuf, sizeof(strbuf),
+			       "%s: WARNING: CUPS driver PPD, possibly non-PostScript",
+			       filename);
+		    }
+		    else
+		    {
+		      // Log success without warning
+		      snprintf(strbuf, sizeof(strbuf), "%s: OK", filename);
+		    }
+		    ppdClose(ppd);
+		    if (pagesize_option_ok)
+		    {
+		      cupsArrayAdd(accepted_report, strdup(strbuf));
+		      // New PPD added, so driver list needs update
+		      ppd_repo_changed = true;
+		      // Log the addtion of the PPD file
+		      cupsArrayAdd(uploaded, strdup(destpath));
+		    }
+		    else
+		    {
+		      // PPD for sure not PostScript, delete it.
+		      unlink(destpath);
+		      // Report error
+		      snprintf(strbuf, sizeof(strbuf),
+			       "%s: No valid \"PageSize\" option, not a PostScript PPD file", filename);
+		      cupsArrayAdd(rejected_report, strdup(strbuf));
+		    }
+		  }
+		  //ppdSetConformance(PPD_CONFORM_RELAXED);
+		}
+	      }
+	    }
+	    else
+	    {
+	      // Save the form variable...
+	      *bend = '\0';
+	      num_form = cupsAddOption(name, ptr, num_form, &form);
+	      papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
+			     "Form variable: %s=%s", name, ptr);
+
+	      // If we have found the session ID (comes before the first PPD
+	      // file), verify it
+	      if (!strcasecmp(name, "session") &&
+		  !papplClientIsValidForm(client, num_form, form))
+	      {
+		papplLogClient(client, PAPPL_LOGLEVEL_ERROR,
+			       "Invalid session ID: %s",
+			       ptr);
+		// Remove already uploaded PPD files ...
+		while (ptr = cupsArrayFirst(uploaded))
+		{
+		  unlink(ptr);
+		  cupsArrayRemove(uploaded, ptr);
+		}
+		// ... and the reports about them
+		while (cupsArrayRemove(accepted_report,
+				       cupsArrayFirst(accepted_report)));
+		while (cupsArrayRemove(rejected_report,
+				       cupsArrayFirst(rejected_report)));
+		// Stop here
+		status = "Invalid form submission.";
+		error = true;
+		break;
+	      }
+	    }
+
+	    if (fp == NULL)
+	    {
+	      name[0]     = '\0';
+	      filename[0] = '\0';
+
+	      if (bufreadptr < (bufinptr - 1) &&
+		  bufreadptr[0] == '\r' && bufreadptr[1] == '\n')
+		bufreadptr += 2;
+	    }
+
+	    break;
+	  }
+	  else
+	  {
+	    papplLogClient(client, PAPPL_LOGLEVEL_DEBUG, "Line '%s'.", line);
+
+	    if (!strncasecmp(line, "Content-Disposition:", 20))
+            {
+	      if ((ptr = strstr(line + 20, " name=\"")) != NULL)
+	      {
+		strncpy(name, ptr + 7, sizeof(name));
+
+		if ((ptr = strchr(name, '\"')) != NULL)
+		  *ptr = '\0';
+	      }
+
+	      if ((ptr = strstr(line + 20, " filename=\"")) != NULL)
+	      {
+		strncpy(filename, ptr + 11, sizeof(filename));
+
+		if ((ptr = strchr(filename, '\"')) != NULL)
+		  *ptr = '\0';
+	      }
+	      if (filename[0])
+		papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
+			       "Found file from form field \"%s\" with file "
+			       "name \"%s\"",
+			       name, filename);
+	      else
+		papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
+			       "Found value for field \"%s\"", name);
+	    }
+
+	    break;
+	  }
+	}
+
+	if (error)
+	  break;
+
+	if (bufinptr > bufreadptr)
+	{
+	  memmove(buf, bufreadptr, (size_t)(bufinptr - bufreadptr));
+	  bufinptr = buf + (bufinptr - bufreadptr);
+	}
+	else
+	  bufinptr = buf;
+      }
+      papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
+		     "Read %ld bytes of form data (%s).",
+		     (long)body_size, content_type);
+
+      // Flush remaining data...
+      if (httpGetState(http) == initial_state)
+	httpFlush(http);
+    }
+
+    strbuf[0] = '\0';
+    for (i = num_form, opt = form; i > 0; i --, opt ++)
+      snprintf(strbuf + strlen(strbuf), sizeof(strbuf) - strlen(strbuf) - 1,
+	       "%s=%s ", opt->name, opt->value);
+    if (strbuf[0])
+      strbuf[strlen(strbuf) - 1] = '\0';
+
+    papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
+		   "Form variables: %s", strbuf);
+
+    // Check non-file form input values
+    if (!error)
+    {
+      if ((action = cupsGetOption("action", num_form, form)) == NULL)
+      {
+	status = "Missing action.";
+	error = true;
+      }
+      else if (!strcmp(action, "add-ppdfiles"))
+	status = "PPD file(s) uploaded.";
+      else if (!strcmp(action, "delete-ppdfiles"))
+      {
+	for (i = num_form, opt = form; i > 0;
+	     i --, opt ++)
+	  if (opt->name[0] == '\t')
+	  {
+	    snprintf(destpath, sizeof(destpath), "%s/%s", extra_ppd_dir,
+		     opt->name + 1);
+	    papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
+			   "Deleting file: %s", destpath);
+	    unlink(destpath);
+	    ppd_repo_changed = true;
+	  }
+	if (ppd_repo_changed)
+	  status = "PPD file(s) deleted.";
+	else
+	  status = "No PPD file selected for deletion.";
+      }
+      else if (!strcmp(action, "refresh-ppdfiles"))
+      {
+	ppd_repo_changed = true;
+	status = "Driver list refreshed.";
+      }
+      else
+      {
+	status = "Unknown action.";
+	error = true;
+      }
+      if (error)
+      {
+	// Remove already uploaded PPD files ...
+	while (ptr = cupsArrayFirst(uploaded))
+	{
+	  unlink(ptr);
+	  cupsArrayRemove(uploaded, ptr);
+	}
+	// ... and the reports about them
+	while (cupsArrayRemove(accepted_report,
+			       cupsArrayFirst(accepted_report)));
+	while (cupsArrayRemove(rejected_report,
+			       cupsArrayFirst(rejected_report)));
+      }
+    }
+
+    // Refresh driver list (if at least 1 PPD got added or removed)
+    if (ppd_repo_changed)
+      ps_setup_driver_list(system);
+
+    cupsFreeOptions(num_form, form);
+  }
+
+  if (!papplClientRespond(client, HTTP_STATUS_OK, NULL, "text/html", 0, 0))
+    goto clean_up;
+  papplClientHTMLHeader(client, "Add support for extra printers", 0);
+  if (papplSystemGetVersions(system, 1, &version) > 0)
+    papplClientHTMLPrintf(client,
+                          "    <div class=\"header2\">\n"
+                          "      <div class=\"row\">\n"
+                          "        <div class=\"col-12 nav\">\n"
+                          "          Version %s\n"
+                          "        </div>\n"
+                          "      </div>\n"
+                          "    </div>\n", version.sversion);
+  papplClientHTMLPuts(client, "    <div class=\"content\">\n");
+
+  papplClientHTMLPrintf(client,
+			"      <div class=\"row\">\n"
+			"        <div class=\"col-12\">\n"
+			"          <h1 class=\"title\">Add support for extra printer models</h1>\n");
+
+  if (status)
+    papplClientHTMLPrintf(client, "          <div class=\"banner\">%s</div>\n", status);
+
+  papplClientHTMLPuts(client,
+		      "        <h3>Add the PPD file(s) of your printer(s)</h3>\n");
+  papplClientHTMLPuts(client,
+		      "        <p>If your printer is not already supported by this Printer Application, you can add support for it by uploading your printer's PPD file here. Only add PPD files for PostScript printers, PPD files of CUPS drivers for non-PostScript printers do not work with this Printer Application!</p>\n");
+
+  uri = papplClientGetURI(client);
+
+  // Multi-part, as we want to upload a PPD file here
+  papplClientHTMLStartForm(client, uri, true);
+
+  papplClientHTMLPuts(client,
+		      "          <table class=\"form\">\n"
+		      "            <tbody>\n");
+
+  if (cupsArrayCount(rejected_report))
+  {
+    for (i = 0; i < cupsArrayCount(rejected_report); i ++)
+      papplClientHTMLPrintf(client,
+			    (i == 0 ?
+			     "              <tr><th>Upload&nbsp;failed:</th><td>%s</td></tr>\n" :
+			     "              <tr><th></th><td>%s</td></tr>\n"),
+			    (char *)cupsArrayIndex(rejected_report, i));
+    papplClientHTMLPuts(client,
+			"              <tr><th></th><td></td></tr>\n");
+  }
+  if (cupsArrayCount(accepted_report))
+  {
+    for (i = 0; i < cupsArrayCount(accepted_report); i ++)
+      papplClientHTMLPrintf(client,
+			    (i == 0 ?
+			     "              <tr><th>Uploaded:</th><td>%s</td></tr>\n" :
+			     "              <tr><th></th><td>%s</td></tr>\n"),
+			    (char *)cupsArrayIndex(accepted_report, i));
+    papplClientHTMLPuts(client,
+			"              <tr><th></th><td></td></tr>\n");
+  }
+  papplClientHTMLPuts(client,
+		      "              <tr><th><label for=\"ppdfiles\">PPD&nbsp;file(s):</label></th><td><input type=\"file\" name=\"ppdfiles\" accept=\".ppd,.PPD,.ppd.gz,.PPD.gz\" required multiple></td><td>(Only individual PPD files, no PPD-generating executables)</td></tr>\n");
+  papplClientHTMLPuts(client,
+		      "              <tr><th></th><td><button type=\"submit\" name=\"action\" value=\"add-ppdfiles\">Add PPDs</button></td><td></td></tr>\n");
+  papplClientHTMLPuts(client,
+		      "            </tbody>\n"
+		      "          </table>\n"
+		      "        </form>\n");
+
+  if ((dir = cupsDirOpen(extra_ppd_dir)) == NULL)
+  {
+    papplLog(system, PAPPL_LOGLEVEL_WARN,
+	     "Unable to read user PPD directory '%s': %s",
+	     extra_ppd_dir, strerror(errno));
+  }
+  else
+  {
+    user_ppd_files = cupsArrayNew3((cups_array_func_t)strcasecmp,
+				   NULL, NULL, 0, NULL,
+				   (cups_afree_func_t)free);
+    while ((dent = cupsDirRead(dir)) != NULL)
+      if (!S_ISDIR(dent->fileinfo.st_mode) &&
+	  dent->filename[0] && dent->filename[0] != '.' &&
+	  (!strcasecmp(dent->filename + strlen(dent->filename) - 4, ".ppd") ||
+	   !strcasecmp(dent->filename + strlen(dent->filename) - 7, ".ppd.gz")))
+	cupsArrayAdd(user_ppd_files, strdup(dent->filename));
+
+    cupsDirClose(dir);
+
+    if (cupsArrayCount(user_ppd_files))
+    {
+      papplClientHTMLPrintf(client, "          <hr>\n");
+
+      papplClientHTMLPuts(client,
+			  "          <h3>Already uploaded PPD files</h3>\n");
+
+      papplClientHTMLPuts(client,
+			  "          <p>To remove files, mark them and click the \"Delete\" button</p>\n");
+
+      papplClientHTMLStartForm(client, uri, false);
+      papplClientHTMLPuts(client,
+			  "          <table class=\"form\">\n"
+			  "            <tbody>\n");
+
+      for (i = 0; i < cupsArrayCount(user_ppd_files); i ++)
+	papplClientHTMLPrintf(client,
+			      "              <tr><th><input type=\"checkbox\" name=\"\t%s\"></th><td>%s</td></tr>\n",
+			      (char *)cupsArrayIndex(user_ppd_files, i),
+			      (char *)cupsArrayIndex(user_ppd_files, i));
+
+      papplClientHTMLPuts(client, "          <tr><th></th><td><input type=\"hidden\" name=\"action\" value=\"delete-ppdfiles\"><input type=\"submit\" value=\"Delete\"></td>\n");
+
+      papplClientHTMLPuts(client,
+			  "            </tbody>\n"
+			  "          </table>\n"
+			  "        </form>\n");
+    }
+
+    cupsArrayDelete(user_ppd_files);
+  }
+
+  papplClientHTMLPrintf(client, "          <hr>\n");
+
+  papplClientHTMLPuts(client,
+		      "          <h3>Refresh driver list</h3>\n");
+
+  papplClientHTMLPrintf(client,
+			"          <p>If you have manually loaded PPD files into the user PPD file directory (%s) or deleted PPD files from there, please click the \"Refresh\" button to update the printer model list in this Printer Application.</p>\n",
+			extra_ppd_dir);
+
+  papplClientHTMLStartForm(client, uri, false);
+  papplClientHTMLPuts(client,
+		      "          <table class=\"form\">\n"
+		      "            <tbody>\n");
+
+  papplClientHTMLPuts(client, "          <tr><th>&nbsp;&nbsp;&nbsp;&nbsp;</th><td><input type=\"hidden\" name=\"action\" value=\"refresh-ppdfiles\"><input type=\"submit\" value=\"Refresh\"></td>\n");
+
+  papplClientHTMLPuts(client,
+		      "            </tbody>\n"
+		      "          </table>\n"
+		      "        </form>\n");
+
+  papplClientHTMLPuts(client,
+                      "      </div>\n"
+                      "    </div>\n");
+  papplClientHTMLFooter(client);
+
+ clean_up:
+  // Clean up
+  cupsArrayDelete(uploaded);
+  cupsArrayDelete(accepted_report);
+  cupsArrayDelete(rejected_report);
+}
+
+
+//
+// 'ps_system_web_cache()' - Web interface page showing the state of the
+//                           conversion cache, with a button to clear it.
+//
+
+static void
+ps_system_web_cache(
+    pappl_client_t *client,		// I - Client
+    pappl_system_t *system)		// I - System
+{
+  const char		*status = NULL;	// Status text, if any
+  pappl_version_t	version;	// Version of the Printer Application
+  int			num_files = 0;	// Files in the cache
+  off_t			bytes = 0;	// Bytes in the cache
+  unsigned long		hits,		// Jobs printed from the cache
+			misses,		// Jobs not found in the cache
+			shared;		// Jobs following another job
+
+
+  if (!papplClientHTMLAuthorize(client))
+    return;
+
+  // Handle POSTs to clear the cache...
+  if (papplClientGetMethod(client) == HTTP_STATE_POST)
+  {
+    int			num_form = 0;	// Number of form variables
+    cups_option_t	*form = NULL;	// Form variables
+    const char		*action;	// Form action
+
+
+    if ((num_form = papplClientGetForm(client, &form)) == 0)
+      status = "Invalid form data.";
+    else if (!papplClientIsValidForm(client, num_form, form))
+      status = "Invalid form submission.";
+    else if ((action = cupsGetOption("action", num_form, form)) != NULL &&
+	     !strcmp(action, "clear-cache"))
+    {
+      ps_cache_trim(0, NULL, NULL);
+      papplLog(system, PAPPL_LOGLEVEL_INFO, "Conversion cache cleared");
+      status = "Conversion cache cleared.";
+    }
+    else
+      status = "Unknown action.";
+
+    cupsFreeOptions(num_form, form);
+  }
+
+  ps_cache_trim(-1, &num_files, &bytes);
+  pthread_mutex_lock(&cache_mutex);
+  hits   = cache_hits;
+  misses = cache_misses;
+  shared = cache_shared;
+  pthread_mutex_unlock(&cache_mutex);
+
+  if (!papplClientRespond(client, HTTP_STATUS_OK, NULL, "text/html", 0, 0))
+    return;
+  papplClientHTMLHeader(client, "Conversion cache", 0);
+  if (papplSystemGetVersions(system, 1, &version) > 0)
+    papplClientHTMLPrintf(client,
+                          "    <div class=\"header2\">\n"
+                          "      <div class=\"row\">\n"
+                          "        <div class=\"col-12 nav\">\n"
+                          "          Version %s\n"
+                          "        </div>\n"
+                          "      </div>\n"
+                          "    </div>\n", version.sversion);
+  papplClientHTMLPuts(client, "    <div class=\"content\">\n");
+
+  papplClientHTMLPrintf(client,
+			"      <div class=\"row\">\n"
+			"        <div class=\"col-12\">\n"
+			"          <h1 class=\"title\">Conversion cache</h1>\n");
+
+  if (status)
+    papplClientHTMLPrintf(client, "          <div class=\"banner\">%s</div>\n", status);
+
+  papplClientHTMLPuts(client,
+		      "        <p>The printer-ready data of converted PDF and PostScript jobs is kept in the conversion cache, so that reprints of the same document with the same settings on the same printer get sent without converting them again. Jobs with the same document and settings which arrive while it gets converted for another job share that conversion, for example when a document is sent to many printers of the same model at once. When the cache is full, the least recently used data gets removed. Set the size limit in MB with the CONVERSION_CACHE_SIZE environment variable, 0 turns the cache off, conversions still get shared then.</p>\n");
+
+  papplClientHTMLStartForm(client, papplClientGetURI(client), false);
+  papplClientHTMLPuts(client,
+		      "          <table class=\"form\">\n"
+		      "            <tbody>\n");
+  papplClientHTMLPrintf(client,
+			"              <tr><th>Directory:</th><td>%s</td></tr>\n",
+			cache_dir);
+  if (cache_size > 0)
+    papplClientHTMLPrintf(client,
+			  "              <tr><th>Size&nbsp;limit:</th><td>%ld&nbsp;MB</td></tr>\n",
+			  (long)(cache_size / (1024 * 1024)));
+  else
+    papplClientHTMLPuts(client,
+			"              <tr><th>Size&nbsp;limit:</th><td>Off</td></tr>\n");
+  papplClientHTMLPrintf(client,
+			"              <tr><th>Used:</th><td>%.1f&nbsp;MB in %d files</td></tr>\n",
+			bytes / (1024.0 * 1024.0), num_files);
+  papplClientHTMLPrintf(client,
+			"              <tr><th>Hits:</th><td>%lu</td></tr>\n"
+			"              <tr><th>Misses:</th><td>%lu</td></tr>\n"
+			"              <tr><th>Shared:</th><td>%lu</td></tr>\n",
+			hits, misses, shared);
+  papplClientHTMLPuts(client, "          <tr><th></th><td><input type=\"hidden\" name=\"action\" value=\"clear-cache\"><input type=\"submit\" value=\"Clear\"></td>\n");
+  papplClientHTMLPuts(client,
+		      "            </tbody>\n"
+		      "          </table>\n"
+		      "        </form>\n");
+
+  papplClientHTMLPuts(client,
+                      "      </div>\n"
+                      "    </div>\n");
+  papplClientHTMLFooter(client);
+}
+
+
+//
+// 'ps_status()' - Get printer status.
+//
+
+static bool                   // O - `true` on success, `false` on failure
+ps_status(
+    pappl_printer_t *printer) // I - Printer
+{
+  pappl_system_t         *system;              // System
+  pappl_pr_driver_data_t driver_data;
+  ps_driver_extension_t  *extension;
+
+
+  // Get system...
+  system = papplPrinterGetSystem(printer);
+
+  papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+		  "Status callback called.");
+
+  // Load the driver data
+  papplPrinterGetDriverData(printer, &driver_data);
+  extension = (ps_driver_extension_t *)driver_data.extension;
+  if (!extension->updated)
+  {
+    // Adjust the driver data according to the installed accessories
+    ps_printer_update_for_installable_options(printer, driver_data, NULL);
+    // Save new default settings (but only if system is running, to not
+    // overwrite the state file when it is still loaded during startup)
+    if (papplSystemIsRunning(system))
+      papplSystemSaveState(system, state_file);
+  }
 
-	      // If we have found the session ID (comes before the first PPD
-	      // file), verify it
-	      if (!strcasecmp(name, "session") &&
-		  !papplClientIsValidForm(client, num_form, form))
-	      {
-		papplLogClient(client, PAPPL_LOGLEVEL_ERROR,
-			       "Invalid session ID: %s",
-			       ptr);
-		// Remove already uploaded PPD files ...
-		while (ptr = cupsArrayFirst(uploaded))
-		{
-		  unlink(ptr);
-		  cupsArrayRemove(uploaded, ptr);
-		}
-		// ... and the reports about them
-		while (cupsArrayRemove(accepted_report,
-				       cupsArrayFirst(accepted_report)));
-		while (cupsArrayRemove(rejected_report,
-				       cupsArrayFirst(rejected_report)));
-		// Stop here
-		status = "Invalid form submission.";
-		error = true;
-		break;
-	      }
-	    }
+  // Use commandtops CUPS filter code to check status here (ink levels, ...)
+  // (TODO)
+
+  // Do PostScript jobs for polling only once a minute or once every five
+  // minutes, therefore save time of last call in a static variable. and
+  // only poll again if last poll is older than given time.
+
+  // Needs ink level support in PAPPL
+  // (https://github.com/michaelrsweet/pappl/issues/83)
+
+  return (true);
+}
+
+
+//
+// 'ps_testpage()' - Return a test page file to print
+//
+
+static const char *			// O - Filename or `NULL`
+ps_testpage(
+    pappl_printer_t *printer,		// I - Printer
+    char            *buffer,		// I - File Buffer
+    size_t          bufsize)		// I - Buffer Size
+{
+  const char	    *str;		// String pointer
+
+
+  // Find the right test file...
+  if ((str = getenv("TESTPAGE_DIR")) != NULL)
+    snprintf(buffer, bufsize, "%s/%s", str, TESTPAGE);
+  else if ((str = getenv("TESTPAGE")) != NULL)
+    snprintf(buffer, bufsize, "%s", str);
+  else
+    snprintf(buffer, bufsize, "%s/%s", TESTPAGEDIR, TESTPAGE);
+
+  // Does it actually exist?
+  if (access(buffer, R_OK))
+  {
+    papplLogPrinter(printer, PAPPL_LOGLEVEL_ERROR,
+		    "Test page %s not found or not readable.", buffer);
+    *buffer = '\0';
+    return (NULL);
+  }
+  else
+  {
+    papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
+		    "Using test page: %s", buffer);
+    return (buffer);
+  }
+}
+
+
+//
+// 'ps_transport_end()' - End the data of an image
+//
+
+static void
+ps_transport_end(ps_transport_t *transport)// I - Image data transport
+{
+  // Held data gets ended with ps_transport_release()
+  if (transport->hold)
+    return;
+
+  switch (transport->mode)
+  {
+    case PS_TRANSPORT_ASCII85 :
+        if (!ps_ascii85(&(transport->ascii85), transport->outputfp, NULL, 0,
+			1))
+	  transport->failed = true;
+	break;
+
+    case PS_TRANSPORT_HEX :
+        if (transport->col > 0)
+	  putc('\n', transport->outputfp);
+	transport->col = 0;
+	break;
+
+    case PS_TRANSPORT_NULL :
+        break;
+
+    default :
+        fputs(PS_BINARY_EOD, transport->outputfp);
+	break;
+  }
+}
+
+
+//
+// 'ps_transport_hold()' - Keep the data of the next image in memory
+//                         instead of sending it. ps_transport_source()
+//                         then chooses the data source knowing the data,
+//                         and ps_transport_release() sends it.
+//
+
+static void
+ps_transport_hold(ps_transport_t *transport)// I - Image data transport
+{
+  transport->hold      = true;
+  transport->held_mode = transport->mode;
+  transport->num_held  = 0;
+}
+
+
+//
+// 'ps_transport_release()' - Send the held data of an image with the
+//                            transport chosen by ps_transport_source()
+//                            and go back to the transport of the job.
+//
+
+static void
+ps_transport_release(ps_transport_t *transport)
+					// I - Image data transport
+{
+  unsigned long	bytes = transport->bytes;
+					// Bytes counted when holding
+
+
+  if (!transport->hold)
+    return;
+
+  transport->hold = false;
+  ps_transport_write(transport, transport->held, transport->num_held);
+  ps_transport_end(transport);
+  transport->bytes    = bytes;
+  transport->mode     = transport->held_mode;
+  transport->num_held = 0;
+}
 
-	    if (fp == NULL)
-	    {
-	      name[0]     = '\0';
-	      filename[0] = '\0';
 
-	      if (bufreadptr < (bufinptr - 1) &&
-		  bufreadptr[0] == '\r' && bufreadptr[1] == '\n')
-		bufreadptr += 2;
-	    }
+//
+// 'ps_transport_source()' - PostScript code for the data source of an
+//                           image, to be followed by the decoding
+//                           filters for the image data
+//                           Binary data is terminated by an end-of-data
+//                           string which also is a PostScript comment, so
+//                           that it does not matter whether the image
+//                           operator reads it or not.
+//                           For hex data (PostScript level 1) it is a
+//                           procedure reading the data into the string
+//                           "picstr" which has to be defined with the
+//                           length of an image line.
+//                           Held binary data which contains the
+//                           end-of-data string would end the image early,
+//                           it gets sent ASCII85-encoded instead.
+//
 
-	    break;
-	  }
-	  else
-	  {
-	    papplLogClient(client, PAPPL_LOGLEVEL_DEBUG, "Line '%s'.", line);
+static const char *			// O - PostScript code
+ps_transport_source(ps_transport_t *transport)// I - Image data transport
+{
+  if (transport->hold &&
+      (transport->mode == PS_TRANSPORT_BCP ||
+       transport->mode == PS_TRANSPORT_TBCP) &&
+      memmem(transport->held, transport->num_held, PS_BINARY_EOD,
+	     sizeof(PS_BINARY_EOD) - 1))
+    transport->mode = PS_TRANSPORT_ASCII85;
+
+  switch (transport->mode)
+  {
+    case PS_TRANSPORT_ASCII85 :
+        return ("currentfile /ASCII85Decode filter");
 
-	    if (!strncasecmp(line, "Content-Disposition:", 20))
-            {
-	      if ((ptr = strstr(line + 20, " name=\"")) != NULL)
-	      {
-		strncpy(name, ptr + 7, sizeof(name));
+    case PS_TRANSPORT_HEX :
+        return ("{currentfile picstr readhexstring pop}");
 
-		if ((ptr = strchr(name, '\"')) != NULL)
-		  *ptr = '\0';
-	      }
+    case PS_TRANSPORT_NULL :
+        return ("");
 
-	      if ((ptr = strstr(line + 20, " filename=\"")) != NULL)
-	      {
-		strncpy(filename, ptr + 11, sizeof(filename));
+    default :
+        return ("currentfile 0 " PS_BINARY_EOD_PS " /SubFileDecode filter");
+  }
+}
 
-		if ((ptr = strchr(filename, '\"')) != NULL)
-		  *ptr = '\0';
-	      }
-	      if (filename[0])
-		papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
-			       "Found file from form field \"%s\" with file "
-			       "name \"%s\"",
-			       name, filename);
-	      else
-		papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
-			       "Found value for field \"%s\"", name);
-	    }
 
-	    break;
-	  }
-	}
+//
+// 'ps_transport_write()' - Send image data, ASCII85- or hex-encoded or
+//                          binary with the control characters of the
+//                          printer's communication protocol quoted (BCP or
+//                          TBCP, Adobe technical note #5009).
+//
 
-	if (error)
-	  break;
+static void
+ps_transport_write(
+    ps_transport_t      *transport,	// I - Image data transport
+    const unsigned char *data,		// I - Data
+    size_t              bytes)		// I - Number of bytes
+{
+  const unsigned char	*start,		// Start of unquoted bytes
+			*ptr,		// Current byte
+			*end;		// End of data
+  unsigned		quoted;		// Bit mask of quoted characters
+  static const char	hex[] = "0123456789abcdef";
+					// Hex digits
+  char			buf[1024];	// Hex output buffer
+  size_t		bufused = 0;	// Bytes used in hex output buffer
 
-	if (bufinptr > bufreadptr)
-	{
-	  memmove(buf, bufreadptr, (size_t)(bufinptr - bufreadptr));
-	  bufinptr = buf + (bufinptr - bufreadptr);
-	}
-	else
-	  bufinptr = buf;
-      }
-      papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
-		     "Read %ld bytes of form data (%s).",
-		     (long)body_size, content_type);
 
-      // Flush remaining data...
-      if (httpGetState(http) == initial_state)
-	httpFlush(http);
-    }
+  transport->bytes += bytes;
 
-    strbuf[0] = '\0';
-    for (i = num_form, opt = form; i > 0; i --, opt ++)
-      snprintf(strbuf + strlen(strbuf), sizeof(strbuf) - strlen(strbuf) - 1,
-	       "%s=%s ", opt->name, opt->value);
-    if (strbuf[0])
-      strbuf[strlen(strbuf) - 1] = '\0';
+  if (transport->mode == PS_TRANSPORT_NULL || transport->failed)
+    return;
 
-    papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
-		   "Form variables: %s", strbuf);
+  if (transport->hold)
+  {
+    if (transport->num_held + bytes > transport->held_size)
+    {
+      size_t		size = 2 * transport->held_size + bytes;
+					// New size of the buffer
+      unsigned char	*held;		// New buffer
 
-    // Check non-file form input values
-    if (!error)
+      if ((held = (unsigned char *)realloc(transport->held, size)) == NULL)
+      {
+	transport->failed = true;
+	return;
+      }
+      transport->held      = held;
+      transport->held_size = size;
+    }
+    memcpy(transport->held + transport->num_held, data, bytes);
+    transport->num_held += bytes;
+    return;
+  }
+
+  if (transport->mode == PS_TRANSPORT_ASCII85)
+  {
+    if (!ps_ascii85(&(transport->ascii85), transport->outputfp, data,
+		    (int)bytes, 0))
+      transport->failed = true;
+    return;
+  }
+
+  if (transport->mode == PS_TRANSPORT_HEX)
+  {
+    for (ptr = data, end = data + bytes; ptr < end; ptr ++)
     {
-      if ((action = cupsGetOption("action", num_form, form)) == NULL)
+      buf[bufused ++] = hex[*ptr >> 4];
+      buf[bufused ++] = hex[*ptr & 15];
+      if ((transport->col += 2) >= 78)
       {
-	status = "Missing action.";
-	error = true;
+	buf[bufused ++] = '\n';
+	transport->col = 0;
       }
-      else if (!strcmp(action, "add-ppdfiles"))
-	status = "PPD file(s) uploaded.";
-      else if (!strcmp(action, "delete-ppdfiles"))
+      if (bufused > sizeof(buf) - 3)
       {
-	for (i = num_form, opt = form; i > 0;
-	     i --, opt ++)
-	  if (opt->name[0] == '\t')
+	fwrite(buf, 1, bufused, transport->outputfp);
+	bufused = 0;
+      }
+    }
+    if (bufused > 0)
+      fwrite(buf, 1, bufused, transport->outputfp);
+    return;
+  }
+
+  // Control characters quoted in BCP: ^A ^C ^D ^E ^Q ^S ^T ^\,
+  // TBCP also quotes ESC
+  quoted = (1 << 0x01) | (1 << 0x03) | (1 << 0x04) | (1 << 0x05) |
+	   (1 << 0x11) | (1 << 0x13) | (1 << 0x14) | (1 << 0x1c);
+  if (transport->mode == PS_TRANSPORT_TBCP)
+    quoted |= 1 << 0x1b;
+
+  for (start = ptr = data, end = data + bytes; ptr < end; ptr ++)
+    if (*ptr < 0x20 && (quoted & (1 << *ptr)))
+    {
+      if (ptr > start)
+	fwrite(start, 1, ptr - start, transport->outputfp);
+      putc(0x01, transport->outputfp);
+      putc(*ptr ^ 0x40, transport->outputfp);
+      start = ptr + 1;
+    }
+
+  if (ptr > start)
+    fwrite(start, 1, ptr - start, transport->outputfp);
+}
+
+
+#ifdef HAVE_LIBURING
+//
+// 'ps_uring_read()' - Read a batch of up to PS_URING_DEPTH buffers for
+//                     ps_uring_send(). Only the first read waits for
+//                     data, the batch takes what is there then, so that
+//                     the data streams to the device also behind a slow
+//                     filter, buffers may be partly filled.
+//
+
+static int				// O - Number of buffers or -1 on error
+ps_uring_read(int           inputfd,	// I - Input
+	      unsigned char *buffer,	// I - First buffer of the batch
+	      size_t        *size,	// O - Bytes in the buffers
+	      size_t        *done,	// O - Bytes written, set to 0
+	      bool          *eof,	// O - End of input reached?
+	      filter_data_t *data)	// I - Job and printer data
+{
+  int		num;			// Number of buffers
+  ssize_t	bytes;			// Bytes read
+  struct pollfd	pfd;			// Poll for more input
+
+
+  pfd.fd     = inputfd;
+  pfd.events = POLLIN;
+
+  for (num = 0; num < PS_URING_DEPTH && !*eof; num ++)
+  {
+    // Stop when the filter has nothing more yet
+    if (num > 0 && poll(&pfd, 1, 0) <= 0)
+      break;
+
+    size[num] = 0;
+    done[num] = 0;
+    while ((bytes = read(inputfd, buffer + num * PS_URING_BUFSIZE,
+			 PS_URING_BUFSIZE)) < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN)
+	continue;
+      if (data->logfunc)
+	data->logfunc(data->logdata, FILTER_LOGLEVEL_ERROR,
+		      "Output to device: Unable to read print data: %s\n",
+		      strerror(errno));
+      return (-1);
+    }
+    if (bytes == 0)
+    {
+      *eof = true;
+      break;
+    }
+    size[num] = (size_t)bytes;
+  }
+
+  return (num);
+}
+
+
+//
+// 'ps_uring_send()' - Send the input to the device with io_uring, keeping
+//                     up to PS_URING_DEPTH writes in flight. The writes
+//                     of a batch are linked so that they get done in
+//                     order, after the last one of the job a sync of the
+//                     device is linked. A short write cancels the rest of
+//                     the chain, which then gets submitted again from
+//                     where it stopped. The next batch gets read while
+//                     the device works on the current one.
+//
+
+static int				// O - 0 on success, 1 on error, -1 if
+					//     io_uring is not available
+ps_uring_send(int           inputfd,	// I - Input
+	      int           devfd,	// I - Device
+	      bool          flush,	// I - Sync device after last write?
+	      filter_data_t *data,	// I - Job and printer data
+	      unsigned long *bytes)	// IO - Bytes sent, added to
+{
+  struct io_uring	ring;		// io_uring instance
+  struct io_uring_probe	*probe;		// Supported operations
+  struct io_uring_sqe	*sqe;		// Submission queue entry
+  struct io_uring_cqe	*cqe;		// Completion queue entry
+  struct __kernel_timespec timeout = { 1, 0 };
+					// Check for canceled job every second
+  filter_logfunc_t	log = data->logfunc;
+					// Log function
+  void			*ld = data->logdata;
+					// Log function data
+  unsigned char		*buffer;	// Write buffers, two batches
+  size_t		size[2 * PS_URING_DEPTH],
+					// Bytes in the buffers
+			done[2 * PS_URING_DEPTH];
+					// Bytes of them written
+  int			num[2] = { 0, 0 },
+					// Buffers used in the batches
+			cur = 0,	// Batch being written
+			i,		// Looping var
+			first,		// First buffer of the batch
+			in_flight,	// Operations submitted, not completed
+			max_depth = 0,	// Most writes in flight at once
+			ret,		// Return value of io_uring call
+			status = 0;	// Exit status
+  bool			eof = false,	// End of input reached?
+			last,		// Last batch of the job?
+			next_read = false,
+					// Next batch read?
+			synced = !flush;// Device synced?
+  unsigned long		num_writes = 0,	// Writes submitted
+			num_submits = 0,// Submissions
+			num_short = 0,	// Short writes
+			depth_sum = 0;	// Sum of writes in flight at submission
+
+
+  // IORING_OP_WRITE needs Linux 5.6 or newer
+  if (io_uring_queue_init(2 * PS_URING_DEPTH + 2, &ring, 0) < 0)
+    return (-1);
+  if ((probe = io_uring_get_probe_ring(&ring)) == NULL ||
+      !io_uring_opcode_supported(probe, IORING_OP_WRITE) ||
+      !io_uring_opcode_supported(probe, IORING_OP_FSYNC) ||
+      (buffer = (unsigned char *)malloc(2 * PS_URING_DEPTH *
+					PS_URING_BUFSIZE)) == NULL)
+  {
+    if (probe)
+      io_uring_free_probe(probe);
+    io_uring_queue_exit(&ring);
+    return (-1);
+  }
+  io_uring_free_probe(probe);
+
+  if ((num[0] = ps_uring_read(inputfd, buffer, size, done, &eof,
+			      data)) < 0)
+  {
+    status = 1;
+    goto done;
+  }
+
+  while (num[cur] > 0 || !synced)
+  {
+    // Submit the rest of the current batch as a chain of writes
+    first = cur * PS_URING_DEPTH;
+    last  = eof && num[1 - cur] == 0;
+    for (i = first; i < first + num[cur] && done[i] == size[i]; i ++);
+    for (in_flight = 0; i < first + num[cur]; i ++, in_flight ++)
+    {
+      sqe = io_uring_get_sqe(&ring);
+      io_uring_prep_write(sqe, devfd, buffer + i * PS_URING_BUFSIZE + done[i],
+			  size[i] - done[i], (__u64)-1);
+      io_uring_sqe_set_data(sqe, (void *)(intptr_t)i);
+      if (i < first + num[cur] - 1 || (last && !synced))
+	sqe->flags |= IOSQE_IO_LINK;
+    }
+    num_writes += in_flight;
+    depth_sum  += in_flight;
+    if (in_flight > max_depth)
+      max_depth = in_flight;
+    if (last && !synced)
+    {
+      sqe = io_uring_get_sqe(&ring);
+      io_uring_prep_fsync(sqe, devfd, IORING_FSYNC_DATASYNC);
+      io_uring_sqe_set_data(sqe, (void *)(intptr_t)-1);
+      in_flight ++;
+    }
+    if (in_flight == 0)
+      break;
+    if ((ret = io_uring_submit(&ring)) < 0)
+    {
+      if (log)
+	log(ld, FILTER_LOGLEVEL_ERROR,
+	    "Output to device: Unable to submit writes to printer: %s\n",
+	    strerror(-ret));
+      status = 1;
+      goto done;
+    }
+    num_submits ++;
+
+    // Read the next batch while the device is busy
+    if (!next_read)
+    {
+      first = (1 - cur) * PS_URING_DEPTH;
+      if ((num[1 - cur] = ps_uring_read(inputfd, buffer +
+					first * PS_URING_BUFSIZE,
+					size + first, done + first, &eof,
+					data)) < 0)
+	status = 1;
+      first     = cur * PS_URING_DEPTH;
+      next_read = true;
+    }
+
+    // Collect the completions
+    while (in_flight > 0)
+    {
+      if ((ret = io_uring_wait_cqe_timeout(&ring, &cqe, &timeout)) == -ETIME)
+      {
+	if (data->iscanceledfunc &&
+	    (data->iscanceledfunc)(data->iscanceleddata))
+	{
+	  // Job canceled, cancel the writes, a canceled write also cancels
+	  // the rest of its chain
+	  for (i = first; i < first + num[cur]; i ++)
 	  {
-	    snprintf(destpath, sizeof(destpath), "%s/%s", extra_ppd_dir,
-		     opt->name + 1);
-	    papplLogClient(client, PAPPL_LOGLEVEL_DEBUG,
-			   "Deleting file: %s", destpath);
-	    unlink(destpath);
-	    ppd_repo_changed = true;
+	    sqe = io_uring_get_sqe(&ring);
+	    io_uring_prep_cancel(sqe, (void *)(intptr_t)i, 0);
+	    io_uring_sqe_set_data(sqe, (void *)(intptr_t)-2);
+	    in_flight ++;
 	  }
-	if (ppd_repo_changed)
-	  status = "PPD file(s) deleted.";
-	else
-	  status = "No PPD file selected for deletion.";
+	  io_uring_submit(&ring);
+	  while (in_flight > 0 && !io_uring_wait_cqe(&ring, &cqe))
+	  {
+	    io_uring_cqe_seen(&ring, cqe);
+	    in_flight --;
+	  }
+	  status = 1;
+	  goto done;
+	}
+	continue;
       }
-      else if (!strcmp(action, "refresh-ppdfiles"))
+      else if (ret < 0)
       {
-	ppd_repo_changed = true;
-	status = "Driver list refreshed.";
+	if (ret == -EINTR)
+	  continue;
+	status = 1;
+	goto done;
       }
-      else
+
+      i = (int)(intptr_t)io_uring_cqe_get_data(cqe);
+      if (i >= 0 && cqe->res >= 0)
       {
-	status = "Unknown action.";
-	error = true;
+	done[i] += cqe->res;
+	*bytes  += cqe->res;
+	if (done[i] < size[i])
+	  num_short ++;
       }
-      if (error)
+      else if (i == -1 && (cqe->res >= 0 || cqe->res == -EINVAL))
+	// Synced, or the device cannot be synced
+	synced = true;
+      else if (i != -2 && cqe->res != -ECANCELED && cqe->res != -EINTR &&
+	       cqe->res != -EAGAIN)
       {
-	// Remove already uploaded PPD files ...
-	while (ptr = cupsArrayFirst(uploaded))
-	{
-	  unlink(ptr);
-	  cupsArrayRemove(uploaded, ptr);
-	}
-	// ... and the reports about them
-	while (cupsArrayRemove(accepted_report,
-			       cupsArrayFirst(accepted_report)));
-	while (cupsArrayRemove(rejected_report,
-			       cupsArrayFirst(rejected_report)));
+	if (log)
+	  log(ld, FILTER_LOGLEVEL_ERROR,
+	      "Output to device: Unable to send data to printer: %s\n",
+	      strerror(-cqe->res));
+	status = 1;
       }
+      io_uring_cqe_seen(&ring, cqe);
+      in_flight --;
+    }
+    if (status)
+      goto done;
+
+    // Continue with the next batch when the current one is complete,
+    // otherwise submit the rest of it again
+    for (i = first; i < first + num[cur] && done[i] == size[i]; i ++);
+    if (i == first + num[cur])
+    {
+      num[cur]  = 0;
+      cur       = 1 - cur;
+      next_read = false;
+    }
+  }
+
+  if (log)
+    log(ld, FILTER_LOGLEVEL_INFO,
+	"Output to device: io_uring, %lu writes in %lu submissions, %.1f "
+	"in flight on average, at most %d, %lu short writes\n",
+	num_writes, num_submits,
+	num_submits ? (double)depth_sum / num_submits : 0.0, max_depth,
+	num_short);
+
+ done:
+  io_uring_queue_exit(&ring);
+  free(buffer);
+
+  return (status);
+}
+#endif // HAVE_LIBURING
+
+
+//
+// 'ps_vendor_compile()' - Compile the vendor options of a driver for
+//                         mapping the settings of jobs to PPD options:
+//                         PPD option, custom option and parameter, and
+//                         the choices by IPP keyword, which otherwise
+//                         each job would have to find and un-PPD-ize.
+//                         The new table replaces the old one as a whole,
+//                         jobs still reading the old one keep it until
+//                         they release it.
+//
+
+static void
+ps_vendor_compile(
+    pappl_system_t         *system,	// I - System
+    ppd_file_t             *ppd,	// I - PPD file
+    pappl_pr_driver_data_t *driver_data)// I - Driver data
+{
+  ps_driver_extension_t	*extension =
+    (ps_driver_extension_t *)driver_data->extension;
+					// Driver data extension
+  ps_vendor_table_t	*table = NULL,	// New vendor table
+			*old;		// Old vendor table
+  ps_vendor_option_t	*vopt;		// Current vendor option
+  ppd_option_t		*option;	// PPD option
+  const char		*name,		// PPD option name
+			*param;		// Custom parameter name
+  char			keyword[PPD_MAX_NAME],
+					// PPD option name of parameter
+			buf[1024];	// IPP keyword or attribute name
+  int			i, j;		// Looping vars
+
+
+  if (driver_data->num_vendor <= 0 ||
+      (table = (ps_vendor_table_t *)calloc(1,
+					   sizeof(ps_vendor_table_t))) == NULL)
+    goto publish;
+  if ((table->options =
+       (ps_vendor_option_t *)calloc(driver_data->num_vendor,
+				    sizeof(ps_vendor_option_t))) == NULL)
+  {
+    free(table);
+    table = NULL;
+    goto publish;
+  }
+  table->refcount    = 1;
+  table->num_options = driver_data->num_vendor;
+
+  for (i = 0, vopt = table->options; i < driver_data->num_vendor;
+       i ++, vopt ++)
+  {
+    snprintf(buf, sizeof(buf), "%s-default", driver_data->vendor[i]);
+    vopt->default_name = strdup(buf);
+    vopt->first_bit       = -1;
+    vopt->bool_choices[0] = -1;
+    vopt->bool_choices[1] = -1;
+
+    // Options of the Printer Application itself and the placeholder for
+    // the "Installable Options" have no PPD option
+    if ((name = extension->vendor_ppd_options[i]) == NULL)
+      continue;
+
+    // Custom parameter, "Option:Parameter"
+    if ((param = strchr(name, ':')) != NULL)
+    {
+      snprintf(keyword, sizeof(keyword), "%.*s", (int)(param - name), name);
+      vopt->option = ppdFindOption(ppd, keyword);
+      vopt->param  = param + 1;
+      continue;
     }
 
-    // Refresh driver list (if at least 1 PPD got added or removed)
-    if (ppd_repo_changed)
-      ps_setup_driver_list(system);
+    if ((option = vopt->option = ppdFindOption(ppd, name)) == NULL)
+    {
+      // Should never happen
+      papplLog(system, PAPPL_LOGLEVEL_ERROR,
+	       "PPD option \"%s\" not correctly registered (bug)", name);
+      continue;
+    }
+    if ((vopt->coption = ppdFindCustomOption(ppd, option->keyword)) != NULL)
+      vopt->num_cparams = cupsArrayCount(vopt->coption->params);
+    vopt->first_bit = ps_constraints_bit(&(extension->constraints),
+					 option->keyword, NULL);
+
+    // IPP keywords of the choices, the first two choices also for
+    // boolean IPP options
+    if (option->num_choices <= 0 ||
+	(vopt->maps = (pwg_map_t *)calloc(option->num_choices,
+					  sizeof(pwg_map_t))) == NULL)
+      continue;
+    vopt->num_maps = option->num_choices;
+    for (j = 0; j < option->num_choices; j ++)
+    {
+      ppdPwgUnppdizeName(option->choices[j].text, buf, sizeof(buf), NULL);
+      vopt->maps[j].pwg = strdup(buf);
+      vopt->maps[j].ppd = option->choices[j].choice;
+      if (j < 2 && vopt->bool_choices[0] < 0 && !strcasecmp(buf, "false"))
+	vopt->bool_choices[0] = j;
+      else if (j < 2 && vopt->bool_choices[1] < 0 &&
+	       !strcasecmp(buf, "true"))
+	vopt->bool_choices[1] = j;
+    }
+    ps_lookup_build(&(vopt->choices), vopt->maps, sizeof(pwg_map_t),
+		    vopt->num_maps);
+  }
+
+ publish:
+  // Jobs started from now on use the new table, the driver's reference
+  // to the old one gets released
+  pthread_mutex_lock(&(extension->vendor_mutex));
+  old = extension->vendor_table;
+  extension->vendor_table = table;
+  pthread_mutex_unlock(&(extension->vendor_mutex));
+  ps_vendor_release(extension, old);
+}
+
+
+//
+// 'ps_vendor_free()' - Free a table of compiled vendor options.
+//
+
+static void
+ps_vendor_free(ps_vendor_table_t *table)// I - Vendor table
+{
+  int			i, j;		// Looping vars
+  ps_vendor_option_t	*vopt;		// Current vendor option
+
+
+  for (i = 0, vopt = table->options; i < table->num_options; i ++, vopt ++)
+  {
+    free(vopt->default_name);
+    for (j = 0; j < vopt->num_maps; j ++)
+      free(vopt->maps[j].pwg);
+    free(vopt->maps);
+    ps_lookup_free(&(vopt->choices));
+  }
+  free(table->options);
+  free(table);
+}
+
+
+//
+// 'ps_vendor_get()' - Get the current compiled vendor options of a driver
+//                     for reading, to be released with ps_vendor_release().
+//
+
+static ps_vendor_table_t *		// O - Vendor table or `NULL` if none
+ps_vendor_get(ps_driver_extension_t *extension)
+					// I - Driver data extension
+{
+  ps_vendor_table_t	*table;		// Vendor table
+
+
+  pthread_mutex_lock(&(extension->vendor_mutex));
+  if ((table = extension->vendor_table) != NULL)
+    table->refcount ++;
+  pthread_mutex_unlock(&(extension->vendor_mutex));
+
+  return (table);
+}
+
 
-    cupsFreeOptions(num_form, form);
-  }
+//
+// 'ps_vendor_release()' - Release a reference to compiled vendor options,
+//                         free them with the last reference.
+//
 
-  if (!papplClientRespond(client, HTTP_STATUS_OK, NULL, "text/html", 0, 0))
-    goto clean_up;
-  papplClientHTMLHeader(client, "Add support for extra printers", 0);
-  if (papplSystemGetVersions(system, 1, &version) > 0)
-    papplClientHTMLPrintf(client,
-                          "    <div class=\"header2\">\n"
-                          "      <div class=\"row\">\n"
-                          "        <div class=\"col-12 nav\">\n"
-                          "          Version %s\n"
-                          "        </div>\n"
-                          "      </div>\n"
-                          "    </div>\n", version.sversion);
-  papplClientHTMLPuts(client, "    <div class=\"content\">\n");
+static void
+ps_vendor_release(
+    ps_driver_extension_t *extension,	// I - Driver data extension
+    ps_vendor_table_t     *table)	// I - Vendor table or `NULL`
+{
+  bool			last;		// Last reference?
 
-  papplClientHTMLPrintf(client,
-			"      <div class=\"row\">\n"
-			"        <div class=\"col-12\">\n"
-			"          <h1 class=\"title\">Add support for extra printer models</h1>\n");
 
-  if (status)
-    papplClientHTMLPrintf(client, "          <div class=\"banner\">%s</div>\n", status);
+  if (!table)
+    return;
 
-  papplClientHTMLPuts(client,
-		      "        <h3>Add the PPD file(s) of your printer(s)</h3>\n");
-  papplClientHTMLPuts(client,
-		      "        <p>If your printer is not already supported by this Printer Application, you can add support for it by uploading your printer's PPD file here. Only add PPD files for PostScript printers, PPD files of CUPS drivers for non-PostScript printers do not work with this Printer Application!</p>\n");
+  pthread_mutex_lock(&(extension->vendor_mutex));
+  last = (-- table->refcount == 0);
+  pthread_mutex_unlock(&(extension->vendor_mutex));
 
-  uri = papplClientGetURI(client);
+  if (last)
+    ps_vendor_free(table);
+}
 
-  // Multi-part, as we want to upload a PPD file here
-  papplClientHTMLStartForm(client, uri, true);
 
-  papplClientHTMLPuts(client,
-		      "          <table class=\"form\">\n"
-		      "            <tbody>\n");
+//
+// 'ps_write_image_line()' - Write a raster line of the page image. Lines
+//                           are collected in bands of non-blank lines,
+//                           blank lines outside bands are skipped. A run
+//                           of PS_BAND_GAP blank lines or a full buffer
+//                           ends a band and sends it.
+//
 
-  if (cupsArrayCount(rejected_report))
-  {
-    for (i = 0; i < cupsArrayCount(rejected_report); i ++)
-      papplClientHTMLPrintf(client,
-			    (i == 0 ?
-			     "              <tr><th>Upload&nbsp;failed:</th><td>%s</td></tr>\n" :
-			     "              <tr><th></th><td>%s</td></tr>\n"),
-			    (char *)cupsArrayIndex(rejected_report, i));
-    papplClientHTMLPuts(client,
-			"              <tr><th></th><td></td></tr>\n");
-  }
-  if (cupsArrayCount(accepted_report))
-  {
-    for (i = 0; i < cupsArrayCount(accepted_report); i ++)
-      papplClientHTMLPrintf(client,
-			    (i == 0 ?
-			     "              <tr><th>Uploaded:</th><td>%s</td></tr>\n" :
-			     "              <tr><th></th><td>%s</td></tr>\n"),
-			    (char *)cupsArrayIndex(accepted_report, i));
-    papplClientHTMLPuts(client,
-			"              <tr><th></th><td></td></tr>\n");
-  }
-  papplClientHTMLPuts(client,
-		      "              <tr><th><label for=\"ppdfiles\">PPD&nbsp;file(s):</label></th><td><input type=\"file\" name=\"ppdfiles\" accept=\".ppd,.PPD,.ppd.gz,.PPD.gz\" required multiple></td><td>(Only individual PPD files, no PPD-generating executables)</td></tr>\n");
-  papplClientHTMLPuts(client,
-		      "              <tr><th></th><td><button type=\"submit\" name=\"action\" value=\"add-ppdfiles\">Add PPDs</button></td><td></td></tr>\n");
-  papplClientHTMLPuts(client,
-		      "            </tbody>\n"
-		      "          </table>\n"
-		      "        </form>\n");
+static void
+ps_write_image_line(
+    pappl_job_t         *job,		// I - Job
+    pappl_pr_options_t  *options,	// I - Job options
+    ps_job_data_t       *job_data,	// I - Job data
+    const unsigned char *line)		// I - Raster line
+{
+  size_t	bytes = job_data->encoder.bytes_per_line;
+					// Bytes per line
 
-  if ((dir = cupsDirOpen(extra_ppd_dir)) == NULL)
+
+  if (ps_line_is_blank(line, bytes, job_data->blank))
   {
-    papplLog(system, PAPPL_LOGLEVEL_WARN,
-	     "Unable to read user PPD directory '%s': %s",
-	     extra_ppd_dir, strerror(errno));
+    if (job_data->band_lines == 0)
+      return;
+    job_data->band_blank ++;
   }
   else
   {
-    user_ppd_files = cupsArrayNew3((cups_array_func_t)strcasecmp,
-				   NULL, NULL, 0, NULL,
-				   (cups_afree_func_t)free);
-    while ((dent = cupsDirRead(dir)) != NULL)
-      if (!S_ISDIR(dent->fileinfo.st_mode) &&
-	  dent->filename[0] && dent->filename[0] != '.' &&
-	  (!strcasecmp(dent->filename + strlen(dent->filename) - 4, ".ppd") ||
-	   !strcasecmp(dent->filename + strlen(dent->filename) - 7, ".ppd.gz")))
-	cupsArrayAdd(user_ppd_files, strdup(dent->filename));
-
-    cupsDirClose(dir);
-
-    if (cupsArrayCount(user_ppd_files))
-    {
-      papplClientHTMLPrintf(client, "          <hr>\n");
+    if (job_data->band_lines == 0)
+      job_data->band_y = job_data->line_count;
+    job_data->band_blank = 0;
+  }
 
-      papplClientHTMLPuts(client,
-			  "          <h3>Already uploaded PPD files</h3>\n");
+  memcpy(job_data->band + job_data->band_lines * bytes, line, bytes);
+  job_data->band_lines ++;
 
-      papplClientHTMLPuts(client,
-			  "          <p>To remove files, mark them and click the \"Delete\" button</p>\n");
+  if (job_data->band_blank >= PS_BAND_GAP ||
+      job_data->band_lines >= job_data->band_max_lines)
+    ps_emit_band(job, options, job_data);
+}
 
-      papplClientHTMLStartForm(client, uri, false);
-      papplClientHTMLPuts(client,
-			  "          <table class=\"form\">\n"
-			  "            <tbody>\n");
 
-      for (i = 0; i < cupsArrayCount(user_ppd_files); i ++)
-	papplClientHTMLPrintf(client,
-			      "              <tr><th><input type=\"checkbox\" name=\"\t%s\"></th><td>%s</td></tr>\n",
-			      (char *)cupsArrayIndex(user_ppd_files, i),
-			      (char *)cupsArrayIndex(user_ppd_files, i));
+//
+// 'ps_writer_close()' - Close the in-process output: Send the rest of the
+//                       data, flush the device, and stop the writer
+//                       thread. Called by fclose() on the output stream.
+//
 
-      papplClientHTMLPuts(client, "          <tr><th></th><td><input type=\"hidden\" name=\"action\" value=\"delete-ppdfiles\"><input type=\"submit\" value=\"Delete\"></td>\n");
+static int				// O - 0 on success, -1 on error
+ps_writer_close(void *cookie)		// I - Writer
+{
+  ps_writer_t	*writer = (ps_writer_t *)cookie;
+					// Writer
+  int		i,			// Looping var
+		status;			// Exit status
 
-      papplClientHTMLPuts(client,
-			  "            </tbody>\n"
-			  "          </table>\n"
-			  "        </form>\n");
-    }
 
-    cupsArrayDelete(user_ppd_files);
-  }
+  ps_writer_submit(writer, true);
 
-  papplClientHTMLPrintf(client, "          <hr>\n");
+  pthread_mutex_lock(&writer->mutex);
+  writer->done = true;
+  pthread_cond_broadcast(&writer->cond);
+  pthread_mutex_unlock(&writer->mutex);
 
-  papplClientHTMLPuts(client,
-		      "          <h3>Refresh driver list</h3>\n");
+  pthread_join(writer->thread, NULL);
 
-  papplClientHTMLPrintf(client,
-			"          <p>If you have manually loaded PPD files into the user PPD file directory (%s) or deleted PPD files from there, please click the \"Refresh\" button to update the printer model list in this Printer Application.</p>\n",
-			extra_ppd_dir);
+  papplLogJob(writer->job, PAPPL_LOGLEVEL_DEBUG,
+	      "Sent %lu bytes to the device in %lu writes", writer->bytes,
+	      writer->writes);
+  status = writer->error ? -1 : 0;
 
-  papplClientHTMLStartForm(client, uri, false);
-  papplClientHTMLPuts(client,
-		      "          <table class=\"form\">\n"
-		      "            <tbody>\n");
+  pthread_cond_destroy(&writer->cond);
+  pthread_mutex_destroy(&writer->mutex);
+  for (i = 0; i < PS_WRITER_CHUNKS; i ++)
+    free(writer->chunks[i]);
+  free(writer);
 
-  papplClientHTMLPuts(client, "          <tr><th>&nbsp;&nbsp;&nbsp;&nbsp;</th><td><input type=\"hidden\" name=\"action\" value=\"refresh-ppdfiles\"><input type=\"submit\" value=\"Refresh\"></td>\n");
+  return (status);
+}
 
-  papplClientHTMLPuts(client,
-		      "            </tbody>\n"
-		      "          </table>\n"
-		      "        </form>\n");
 
-  papplClientHTMLPuts(client,
-                      "      </div>\n"
-                      "    </div>\n");
-  papplClientHTMLFooter(client);
+//
+// 'ps_writer_flush()' - Hand the data written so far to the writer thread
+//                       and let it flush the device after sending it, so
+//                       that a finished page gets printed without waiting
+//                       for the chunk to fill up.
+//
 
- clean_up:
-  // Clean up
-  cupsArrayDelete(uploaded);
-  cupsArrayDelete(accepted_report);
-  cupsArrayDelete(rejected_report);
+static bool				// O - `true` on success, `false` on error
+ps_writer_flush(ps_writer_t *writer)	// I - Writer
+{
+  return (ps_writer_submit(writer, true));
 }
 
 
 //
-// 'ps_status()' - Get printer status.
+// 'ps_writer_open()' - Open in-process output to the device. Data written
+//                      to the returned stream gets collected in large
+//                      chunks which a writer thread sends to the device,
+//                      so encoding the next data overlaps with the device
+//                      I/O.
 //
 
-static bool                   // O - `true` on success, `false` on failure
-ps_status(
-    pappl_printer_t *printer) // I - Printer
+static FILE *				// O - Output stream or `NULL` on error
+ps_writer_open(pappl_job_t    *job,	// I - Job
+	       pappl_device_t *device,	// I - Device
+	       ps_writer_t    **writer)	// O - Writer
 {
-  pappl_system_t         *system;              // System
-  pappl_pr_driver_data_t driver_data;
-  ps_driver_extension_t  *extension;
+  ps_writer_t	*w;			// Writer
+  int		i;			// Looping var
+  FILE		*fp;			// Output stream
+  cookie_io_functions_t io =		// Stream functions
+  {
+    NULL,
+    ps_writer_write,
+    NULL,
+    ps_writer_close
+  };
 
 
-  // Get system...
-  system = papplPrinterGetSystem(printer);
+  *writer = NULL;
 
-  papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-		  "Status callback called.");
+  if ((w = (ps_writer_t *)calloc(1, sizeof(ps_writer_t))) == NULL)
+    return (NULL);
 
-  // Load the driver data
-  papplPrinterGetDriverData(printer, &driver_data);
-  extension = (ps_driver_extension_t *)driver_data.extension;
-  if (!extension->updated)
+  w->job    = job;
+  w->device = device;
+  for (i = 0; i < PS_WRITER_CHUNKS; i ++)
+    if (posix_memalign((void **)&(w->chunks[i]), 4096, PS_WRITER_CHUNK))
+    {
+      w->chunks[i] = NULL;
+      goto error;
+    }
+
+  pthread_mutex_init(&w->mutex, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  if (pthread_create(&w->thread, NULL, ps_writer_run, w))
   {
-    // Adjust the driver data according to the installed accessories
-    ps_printer_update_for_installable_options(printer, driver_data, NULL);
-    // Save new default settings (but only if system is running, to not
-    // overwrite the state file when it is still loaded during startup)
-    if (papplSystemIsRunning(system))
-      papplSystemSaveState(system, state_file);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->mutex);
+    goto error;
   }
 
-  // Use commandtops CUPS filter code to check status here (ink levels, ...)
-  // (TODO)
+  if ((fp = fopencookie(w, "w", io)) == NULL)
+  {
+    // Stop the thread again
+    pthread_mutex_lock(&w->mutex);
+    w->done = true;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    pthread_join(w->thread, NULL);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->mutex);
+    goto error;
+  }
 
-  // Do PostScript jobs for polling only once a minute or once every five
-  // minutes, therefore save time of last call in a static variable. and
-  // only poll again if last poll is older than given time.
+  // The data goes directly into the chunks, no stdio buffer in between
+  setvbuf(fp, NULL, _IONBF, 0);
 
-  // Needs ink level support in PAPPL
-  // (https://github.com/michaelrsweet/pappl/issues/83)
+  *writer = w;
+  return (fp);
 
-  return (true);
+ error:
+
+  papplLogJob(job, PAPPL_LOGLEVEL_ERROR,
+	      "Unable to set up output to the device");
+  for (i = 0; i < PS_WRITER_CHUNKS; i ++)
+    free(w->chunks[i]);
+  free(w);
+
+  return (NULL);
 }
 
 
 //
-// 'ps_testpage()' - Return a test page file to print
+// 'ps_writer_run()' - Writer thread, sends the filled chunks to the device.
+//                     After an error or when the job gets canceled the
+//                     remaining data is discarded.
 //
 
-static const char *			// O - Filename or `NULL`
-ps_testpage(
-    pappl_printer_t *printer,		// I - Printer
-    char            *buffer,		// I - File Buffer
-    size_t          bufsize)		// I - Buffer Size
+static void *				// O - Thread exit status (unused)
+ps_writer_run(void *data)		// I - Writer
 {
-  const char	    *str;		// String pointer
+  ps_writer_t	*writer = (ps_writer_t *)data;
+					// Writer
+  int		chunk;			// Chunk to send
+  bool		discard;		// Discard the data?
 
 
-  // Find the right test file...
-  if ((str = getenv("TESTPAGE_DIR")) != NULL)
-    snprintf(buffer, bufsize, "%s/%s", str, TESTPAGE);
-  else if ((str = getenv("TESTPAGE")) != NULL)
-    snprintf(buffer, bufsize, "%s", str);
-  else
-    snprintf(buffer, bufsize, "%s/%s", TESTPAGEDIR, TESTPAGE);
-
-  // Does it actually exist?
-  if (access(buffer, R_OK))
+  pthread_mutex_lock(&writer->mutex);
+  for (;;)
   {
-    papplLogPrinter(printer, PAPPL_LOGLEVEL_ERROR,
-		    "Test page %s not found or not readable.", buffer);
-    *buffer = '\0';
-    return (NULL);
+    while (writer->num_pending == 0 && !writer->done)
+      pthread_cond_wait(&writer->cond, &writer->mutex);
+    if (writer->num_pending == 0)
+      break;
+
+    chunk   = writer->head;
+    discard = writer->error;
+    pthread_mutex_unlock(&writer->mutex);
+
+    // Send the chunk without holding the lock, so that the next one can
+    // get filled meanwhile
+    if (!discard && papplJobIsCanceled(writer->job))
+      discard = true;
+    if (!discard && writer->used[chunk] > 0)
+    {
+      if (papplDeviceWrite(writer->device, writer->chunks[chunk],
+			   writer->used[chunk]) < 0)
+      {
+	papplLogJob(writer->job, PAPPL_LOGLEVEL_ERROR,
+		    "Output to device: Unable to send %lu bytes to printer.",
+		    (unsigned long)writer->used[chunk]);
+	discard = true;
+      }
+      else
+      {
+	writer->bytes += writer->used[chunk];
+	writer->writes ++;
+      }
+    }
+    if (!discard && writer->flush[chunk])
+      papplDeviceFlush(writer->device);
+
+    pthread_mutex_lock(&writer->mutex);
+    if (discard && !papplJobIsCanceled(writer->job))
+      writer->error = true;
+    writer->used[chunk]  = 0;
+    writer->flush[chunk] = false;
+    writer->head         = (chunk + 1) % PS_WRITER_CHUNKS;
+    writer->num_pending --;
+    pthread_cond_broadcast(&writer->cond);
   }
-  else
+  pthread_mutex_unlock(&writer->mutex);
+
+  return (NULL);
+}
+
+
+//
+// 'ps_writer_submit()' - Hand the chunk being filled to the writer thread
+//                        and wait until the next chunk is free.
+//
+
+static bool				// O - `true` on success, `false` on error
+ps_writer_submit(ps_writer_t *writer,	// I - Writer
+		 bool        flush)	// I - Flush device after the chunk?
+{
+  bool		ret;			// Return value
+
+
+  pthread_mutex_lock(&writer->mutex);
+  writer->flush[writer->fill] = flush;
+  writer->fill = (writer->fill + 1) % PS_WRITER_CHUNKS;
+  writer->num_pending ++;
+  pthread_cond_broadcast(&writer->cond);
+  while (writer->num_pending >= PS_WRITER_CHUNKS)
+    pthread_cond_wait(&writer->cond, &writer->mutex);
+  ret = !writer->error;
+  pthread_mutex_unlock(&writer->mutex);
+
+  return (ret);
+}
+
+
+//
+// 'ps_writer_write()' - Copy data into the chunks, handing each full chunk
+//                       to the writer thread. Called by stdio for the
+//                       output stream.
+//
+
+static ssize_t				// O - Bytes written, 0 on error
+ps_writer_write(void       *cookie,	// I - Writer
+		const char *buf,	// I - Data
+		size_t     size)	// I - Number of bytes
+{
+  ps_writer_t	*writer = (ps_writer_t *)cookie;
+					// Writer
+  size_t	bytes,			// Bytes to copy into current chunk
+		left = size;		// Bytes left to copy
+
+
+  while (left > 0)
   {
-    papplLogPrinter(printer, PAPPL_LOGLEVEL_DEBUG,
-		    "Using test page: %s", buffer);
-    return (buffer);
+    // The chunk being filled is only touched by this thread
+    bytes = PS_WRITER_CHUNK - writer->used[writer->fill];
+    if (bytes > left)
+      bytes = left;
+    memcpy(writer->chunks[writer->fill] + writer->used[writer->fill], buf,
+	   bytes);
+    writer->used[writer->fill] += bytes;
+    buf  += bytes;
+    left -= bytes;
+
+    if (writer->used[writer->fill] == PS_WRITER_CHUNK &&
+	!ps_writer_submit(writer, false))
+      return (0);
   }
+
+  return ((ssize_t)size);
 }
 
 
+
 //
 // 'system_cb()' - System callback.
 //
@@ -5842,6 +15005,35 @@ system_cb(int           num_options,	// I - Number of options
   else
     snprintf(filter_dir, sizeof(filter_dir), "%s", FILTERDIR);
 
+  // Threads for converting PDF jobs in parallel, one per CPU by default
+  if ((val = getenv("PDF_CONVERSION_THREADS")) != NULL)
+    pdf_threads = atoi(val);
+  else
+    pdf_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (pdf_threads < 1)
+    pdf_threads = 1;
+  else if (pdf_threads > PS_PDF_MAX_THREADS)
+    pdf_threads = PS_PDF_MAX_THREADS;
+
+  // Conversion cache for reprints, off (0) by default
+  if ((val = getenv("CACHE_DIR")) != NULL)
+    snprintf(cache_dir, sizeof(cache_dir), "%s", val);
+  else
+    snprintf(cache_dir, sizeof(cache_dir), "%s", SYSTEM_CACHE_DIR);
+  if ((val = getenv("CONVERSION_CACHE_SIZE")) != NULL)
+    cache_size = (off_t)atoi(val) * 1024 * 1024;
+  else
+    cache_size = (off_t)PS_CACHE_SIZE * 1024 * 1024;
+  if (cache_size < 0)
+    cache_size = 0;
+  else if (cache_size > 0 && mkdir(cache_dir, 0700) && errno != EEXIST)
+  {
+    fprintf(stderr,
+	    "ps_printer_app: Unable to create cache directory '%s': %s, "
+	    "conversion cache turned off.\n", cache_dir, strerror(errno));
+    cache_size = 0;
+  }
+
   // Create the system object...
   if ((system =
        papplSystemCreate(soptions,